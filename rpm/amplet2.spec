@@ -73,6 +73,7 @@ rm -rf %{buildroot}
 %defattr(-,root,root,-)
 %doc %{_mandir}/man8/amplet2.8.gz
 %doc %{_mandir}/man8/amplet2-remote.8.gz
+%doc %{_mandir}/man8/amplet2-schedsim.8.gz
 %doc %{_mandir}/man8/amp-dns.8.gz
 %doc %{_mandir}/man8/amp-external.8.gz
 %doc %{_mandir}/man8/amp-fastping.8.gz
@@ -85,6 +86,7 @@ rm -rf %{buildroot}
 %exclude %{_mandir}/man8/amp-youtube.8.gz
 %caps(cap_net_raw=pe cap_net_admin=pe cap_net_bind_service=pe) %{_sbindir}/amplet2
 %{_bindir}/amplet2-remote
+%{_bindir}/amplet2-schedsim
 %{_bindir}/amp-dns
 %{_bindir}/amp-external
 %caps(cap_net_raw=pe) %{_bindir}/amp-fastping
@@ -108,6 +110,8 @@ rm -rf %{buildroot}
 %config(noreplace) %{_sysconfdir}/rsyslog.d/10-amplet2.conf
 %{_initrddir}/*
 %dir %{_localstatedir}/run/%{name}/
+%dir %{_localstatedir}/spool/%{name}/
+%dir %{_localstatedir}/cache/%{name}/
 %doc %{_docdir}/amplet2-client/examples/rabbitmq/*
 %license COPYING
 %{_unitdir}/amplet2-client.service
@@ -133,6 +137,14 @@ chmod 2750 %{_sysconfdir}/%{name}/keys
 # the amplet user should own everything in the config directory
 chown -R amplet: %{_sysconfdir}/%{name}/
 
+# results are spooled here while the broker is unavailable
+chown amplet: %{_localstatedir}/spool/%{name}/
+chmod 750 %{_localstatedir}/spool/%{name}/
+
+# the ASN cache is saved here so it survives restarts
+chown amplet: %{_localstatedir}/cache/%{name}/
+chmod 750 %{_localstatedir}/cache/%{name}/
+
 mkdir -p /var/log/amplet2
 
 CLIENTDIR=%{_sysconfdir}/%{name}/clients
@@ -120,8 +120,8 @@ struct ub_ctx *amp_resolver_context_init(char *servers[], int nscount,
 /*
  * Build a struct addrinfo from one set of data returned by the unbound query.
  */
-static struct addrinfo* build_addrinfo(int qtype, char *qname, char *data,
-        int datalen) {
+struct addrinfo* amp_resolve_build_addrinfo(int qtype, char *qname,
+        char *data, int datalen) {
 
         struct addrinfo *item = calloc(1, sizeof(struct addrinfo));
 
@@ -160,6 +160,41 @@ static struct addrinfo* build_addrinfo(int qtype, char *qname, char *data,
 
 
 
+/*
+ * All the queries for a name have finished, make sure there is some sort of
+ * result for it and let the caller know before freeing the data block.
+ */
+static void amp_resolve_finish(struct amp_resolve_data *data, char *qname) {
+    void (*done)(void *arg) = data->done;
+    void *done_arg = data->done_arg;
+    struct addrinfo *item;
+
+    if ( data->status != AMP_RESOLVE_OK ) {
+        Log(LOG_DEBUG, "No results for %s, creating dummy entries", qname);
+
+        if ( data->family == AF_INET || data->family == AF_UNSPEC ) {
+            item = amp_resolve_build_addrinfo(0x01, qname, NULL, 0);
+            item->ai_next = *data->addrlist;
+            *data->addrlist = item;
+        }
+
+        if ( data->family == AF_INET6 || data->family == AF_UNSPEC ) {
+            item = amp_resolve_build_addrinfo(0x1c, qname, NULL, 0);
+            item->ai_next = *data->addrlist;
+            *data->addrlist = item;
+        }
+    }
+
+    free(data);
+
+    /* this might free the address list, so data can't be used after it */
+    if ( done ) {
+        done(done_arg);
+    }
+}
+
+
+
 /*
  * Deal with a DNS response being returned - take as many addresses as we are
  * allowed and convert them into addrinfo structs for the caller to use.
@@ -199,7 +234,7 @@ static void amp_resolve_callback(void *d, int err, struct ub_result *result) {
         for ( i = 0; result->data[i] != NULL &&
                 (data->max == -1 || data->max > 0); i++ ) {
 
-            item = build_addrinfo(result->qtype, result->qname,
+            item = amp_resolve_build_addrinfo(result->qtype, result->qname,
                     result->data[i], result->len[i]);
             item->ai_next = *data->addrlist;
             *data->addrlist = item;
@@ -223,24 +258,7 @@ static void amp_resolve_callback(void *d, int err, struct ub_result *result) {
      * result and then free the data block
      */
     if ( qcount <= 0 ) {
-        if ( data->status != AMP_RESOLVE_OK ) {
-            Log(LOG_DEBUG, "No results for %s, creating dummy entries",
-                    result->qname);
-
-            if ( data->family == AF_INET || data->family == AF_UNSPEC ) {
-                item = build_addrinfo(0x01, result->qname, NULL, 0);
-                item->ai_next = *data->addrlist;
-                *data->addrlist = item;
-            }
-
-            if ( data->family == AF_INET6 || data->family == AF_UNSPEC ) {
-                item = build_addrinfo(0x1c, result->qname, NULL, 0);
-                item->ai_next = *data->addrlist;
-                *data->addrlist = item;
-            }
-        }
-
-        free(data);
+        amp_resolve_finish(data, result->qname);
     }
 
     if ( result ) {
@@ -250,15 +268,53 @@ static void amp_resolve_callback(void *d, int err, struct ub_result *result) {
 
 
 
+/*
+ * A single query for a name couldn't be started, treat it as if it had
+ * failed and finish with the name if it was the last one outstanding.
+ */
+static void amp_resolve_abandon(struct amp_resolve_data *data, char *name,
+        int err) {
+    int qcount;
+
+    Log(LOG_WARNING, "Failed to start query for %s: %s", name,
+            ub_strerror(err));
+
+    pthread_mutex_lock(data->lock);
+    qcount = --data->qcount;
+    pthread_mutex_unlock(data->lock);
+
+    if ( qcount <= 0 ) {
+        amp_resolve_finish(data, name);
+    }
+}
+
+
+
 /*
  * Add a request to the queue, querying for IPv4 and IPV6 addresses as desired.
  * TODO rename this? mostly used internally but testmain.c uses it too
  */
 void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
         pthread_mutex_t *addrlist_lock, char *name, int family, int max) {
+    amp_resolve_add_callback(ctx, res, addrlist_lock, name, family, max,
+            NULL, NULL);
+}
+
+
+
+/*
+ * Add a request to the queue, and call done(arg) once the results for the
+ * name have been added to the list. This happens before returning if the
+ * name is a numeric address, otherwise it happens in whichever thread
+ * processes the unbound answers.
+ */
+void amp_resolve_add_callback(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        void (*done)(void *arg), void *arg) {
 
     struct amp_resolve_data *data;
     struct addrinfo *addr;
+    int err;
 
     assert(ctx);
     assert(res);
@@ -293,6 +349,10 @@ void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
 
         /* free the getaddrinfo() allocated memory */
         freeaddrinfo(addr);
+
+        if ( done ) {
+            done(arg);
+        }
         return;
     }
 
@@ -302,6 +362,8 @@ void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
 
     /* keep a reference to the list of addresses we are building up */
     data->addrlist = res;
+    data->done = done;
+    data->done_arg = arg;
 
     /* create a mutex to make sure we don't mess up our addrlist */
     data->lock = addrlist_lock;
@@ -332,15 +394,19 @@ void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
     /* query for the A record */
     /* TODO only query if there is a useful IPv4 address? */
     if ( family == AF_UNSPEC || family == AF_INET ) {
-        ub_resolve_async(ctx, name, 0x01, 0x01, (void*)data,
-                amp_resolve_callback, NULL);
+        if ( (err = ub_resolve_async(ctx, name, 0x01, 0x01, (void*)data,
+                        amp_resolve_callback, NULL)) != 0 ) {
+            amp_resolve_abandon(data, name, err);
+        }
     }
 
     /* query for the AAAA record */
     /* TODO only query if there is a useful IPv6 address? */
     if ( family == AF_UNSPEC || family == AF_INET6 ) {
-        ub_resolve_async(ctx, name, 0x1c, 0x01, (void*)data,
-                amp_resolve_callback, NULL);
+        if ( (err = ub_resolve_async(ctx, name, 0x1c, 0x01, (void*)data,
+                        amp_resolve_callback, NULL)) != 0 ) {
+            amp_resolve_abandon(data, name, err);
+        }
     }
 }
 
@@ -413,6 +479,53 @@ int amp_resolver_connect(char *target) {
 
 
 
+/*
+ * Write the whole buffer to the socket, retrying short writes.
+ */
+static int send_all(int fd, void *data, size_t len) {
+    char *ptr = data;
+    ssize_t bytes;
+
+    while ( len > 0 ) {
+        if ( (bytes = send(fd, ptr, len, MSG_NOSIGNAL)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Read exactly len bytes from the socket. Returns -1 on error or if the
+ * other end closes the connection first.
+ */
+static int recv_all(int fd, void *data, size_t len) {
+    char *ptr = data;
+    ssize_t bytes;
+
+    while ( len > 0 ) {
+        if ( (bytes = recv(fd, ptr, len, MSG_WAITALL)) <= 0 ) {
+            if ( bytes < 0 && errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+
+
 /*
  * TODO rename this function so it doesn't have _new. It will generally
  * replace the existing amp_resolve_add() function. This is the one that
@@ -420,20 +533,23 @@ int amp_resolver_connect(char *target) {
  */
 int amp_resolve_add_new(int fd, resolve_dest_t *resolve) {
     struct amp_resolve_query info;
+    char buffer[sizeof(info) + MAX_DNS_NAME_LEN];
+    size_t namelen = strlen(resolve->name) + 1;
+
+    if ( namelen > MAX_DNS_NAME_LEN ) {
+        Log(LOG_WARNING, "Name too long to resolve: %s", resolve->name);
+        return -1;
+    }
 
-    info.namelen = strlen(resolve->name) + 1;
+    info.namelen = namelen;
     info.count = resolve->count;
     info.family = resolve->family;
 
-    /* send the supporting metadata about name length, family etc */
-    if ( send(fd, (void*)&info, sizeof(info), 0) < 0 ) {
-        Log(LOG_WARNING, "Failed to send resolution query info: %s",
-                strerror(errno));
-        return -1;
-    }
+    /* send the metadata about name length, family etc along with the name */
+    memcpy(buffer, &info, sizeof(info));
+    memcpy(buffer + sizeof(info), resolve->name, info.namelen);
 
-    /* send namelen bytes containing the name to resolve */
-    if ( send(fd, resolve->name, info.namelen, 0) < 0 ) {
+    if ( send_all(fd, buffer, sizeof(info) + info.namelen) < 0 ) {
         Log(LOG_WARNING, "Failed to send resolution query: %s",
                 strerror(errno));
         return -1;
@@ -467,69 +583,190 @@ int amp_resolve_flag_done(int fd) {
 
 
 /*
- * Get a list of addrinfo structs that is the result of all the queries
- * that were sent to this thread. This will block until all the queries
- * complete or time out.
+ * Serialise a list of addresses into a single buffer so that it can be sent
+ * to the test in one go. The buffer starts with a struct amp_resolve_reply
+ * followed by each address in turn.
  */
-struct addrinfo *amp_resolve_get_list(int fd) {
-    struct addrinfo *addrlist = NULL;
-    struct addrinfo item;
-    char name[MAX_DNS_NAME_LEN];
-    uint8_t more;
-    uint8_t namelen;
+static uint8_t *amp_resolve_pack_list(struct addrinfo *addrlist,
+        uint32_t *len) {
+    struct amp_resolve_reply header;
+    struct amp_resolve_entry entry;
+    struct addrinfo *item;
+    uint8_t *buffer, *ptr;
+    size_t namelen;
+
+    memset(&header, 0, sizeof(header));
+
+    /* work out how much space all the addresses need */
+    for ( item = addrlist; item != NULL; item = item->ai_next ) {
+        assert(item->ai_canonname);
+        assert(item->ai_addrlen <= UINT8_MAX);
+        namelen = strlen(item->ai_canonname);
+        assert(namelen > 0 && namelen < MAX_DNS_NAME_LEN);
+        header.len += sizeof(entry) + namelen +
+            (item->ai_addr ? item->ai_addrlen : 0);
+        header.count++;
+    }
 
-    Log(LOG_DEBUG, "Waiting for address list");
+    *len = sizeof(header) + header.len;
+    buffer = malloc(*len);
+    memcpy(buffer, &header, sizeof(header));
+    ptr = buffer + sizeof(header);
 
-    /* everything we read should be the result of a name lookup */
-    while ( 1 ) {
-        struct addrinfo *tmp;
-        if ( recv(fd, (void*)&item, sizeof(struct addrinfo), 0) <= 0 ) {
-            break;
-        }
+    for ( item = addrlist; item != NULL; item = item->ai_next ) {
+        entry.family = item->ai_family;
+        entry.socktype = item->ai_socktype;
+        entry.protocol = item->ai_protocol;
+        entry.addrlen = item->ai_addr ? item->ai_addrlen : 0;
+        entry.namelen = strlen(item->ai_canonname);
 
-        tmp = calloc(1, sizeof(struct addrinfo));
-        tmp->ai_flags = item.ai_flags;
-        tmp->ai_family = item.ai_family;
-        tmp->ai_socktype = item.ai_socktype;
-        tmp->ai_protocol = item.ai_protocol;
-        tmp->ai_addrlen = item.ai_addrlen;
+        memcpy(ptr, &entry, sizeof(entry));
+        ptr += sizeof(entry);
 
-        /* there might not be an address for this name */
-        if ( tmp->ai_addrlen > 0 ) {
-            tmp->ai_addr = calloc(1, tmp->ai_addrlen);
-            if ( recv(fd, (void*)tmp->ai_addr, tmp->ai_addrlen, 0) <= 0 ) {
-                free(tmp);
-                break;
-            }
+        if ( entry.addrlen > 0 ) {
+            memcpy(ptr, item->ai_addr, entry.addrlen);
+            ptr += entry.addrlen;
         }
 
-        if ( recv(fd, (void*)&namelen, sizeof(namelen), 0) <= 0 ) {
-            free(tmp);
-            break;
+        memcpy(ptr, item->ai_canonname, entry.namelen);
+        ptr += entry.namelen;
+    }
+
+    assert(ptr == buffer + *len);
+
+    return buffer;
+}
+
+
+
+/*
+ * Parse a buffer created by amp_resolve_pack_list() back into a list of
+ * addresses. Returns NULL if the buffer is malformed.
+ */
+static struct addrinfo *amp_resolve_unpack_list(uint8_t *buffer,
+        uint32_t len) {
+    struct amp_resolve_reply header;
+    struct amp_resolve_entry entry;
+    struct addrinfo *addrlist = NULL;
+    struct addrinfo *item;
+    uint8_t *ptr, *end;
+    uint32_t i;
+
+    if ( len < sizeof(header) ) {
+        return NULL;
+    }
+
+    memcpy(&header, buffer, sizeof(header));
+
+    if ( header.len != len - sizeof(header) ) {
+        Log(LOG_WARNING, "Resolved address batch has the wrong length");
+        return NULL;
+    }
+
+    ptr = buffer + sizeof(header);
+    end = buffer + len;
+
+    for ( i = 0; i < header.count; i++ ) {
+        if ( end - ptr < (ssize_t)sizeof(entry) ) {
+            goto malformed;
         }
 
-        assert(namelen > 1);
+        memcpy(&entry, ptr, sizeof(entry));
+        ptr += sizeof(entry);
 
-        if ( recv(fd, name, namelen, 0) <= 0 ) {
-            free(tmp);
-            break;
+        if ( entry.namelen == 0 ||
+                end - ptr < (ssize_t)entry.addrlen + entry.namelen ) {
+            goto malformed;
         }
-        tmp->ai_canonname = strdup(name);
-        assert(tmp->ai_canonname);
 
-        if ( recv(fd, (void*)&more, sizeof(more), 0) <= 0 ) {
-            free(tmp->ai_canonname);
-            free(tmp);
-            break;
+        item = calloc(1, sizeof(struct addrinfo));
+        item->ai_family = entry.family;
+        item->ai_socktype = entry.socktype;
+        item->ai_protocol = entry.protocol;
+        item->ai_addrlen = entry.addrlen;
+
+        /* there might not be an address for this name */
+        if ( entry.addrlen > 0 ) {
+            item->ai_addr = calloc(1, entry.addrlen);
+            memcpy(item->ai_addr, ptr, entry.addrlen);
+            ptr += entry.addrlen;
         }
 
+        item->ai_canonname = strndup((char*)ptr, entry.namelen);
+        ptr += entry.namelen;
+
         /* add the item to the front of the list once it is complete */
-        tmp->ai_next = addrlist;
-        addrlist = tmp;
+        item->ai_next = addrlist;
+        addrlist = item;
+    }
+
+    if ( ptr != end ) {
+        goto malformed;
+    }
+
+    return addrlist;
+
+malformed:
+    Log(LOG_WARNING, "Malformed resolved address batch");
+    amp_resolve_freeaddr(addrlist);
+    return NULL;
+}
+
+
+
+/*
+ * Send the results of all the queries made by a test back to it as a single
+ * message.
+ */
+int amp_resolve_send_list(int fd, struct addrinfo *addrlist) {
+    uint8_t *buffer;
+    uint32_t len;
+    int result;
 
-        if ( !more ) {
-            break;
+    buffer = amp_resolve_pack_list(addrlist, &len);
+
+    if ( (result = send_all(fd, buffer, len)) < 0 ) {
+        Log(LOG_WARNING, "Failed to send resolved addresses: %s",
+                strerror(errno));
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+
+
+/*
+ * Get a list of addrinfo structs that is the result of all the queries
+ * that were sent to this thread. This will block until all the queries
+ * complete or time out.
+ */
+struct addrinfo *amp_resolve_get_list(int fd) {
+    struct addrinfo *addrlist = NULL;
+    struct amp_resolve_reply header;
+    uint8_t *buffer;
+
+    Log(LOG_DEBUG, "Waiting for address list");
+
+    /* the whole batch of addresses arrives together, preceded by its length */
+    if ( recv_all(fd, &header, sizeof(header)) < 0 ) {
+        Log(LOG_WARNING, "Failed to read resolved address batch");
+    } else if ( header.len > MAX_RESOLVE_REPLY_LEN ) {
+        Log(LOG_WARNING, "Resolved address batch too large (%u bytes)",
+                header.len);
+    } else {
+        buffer = malloc(sizeof(header) + header.len);
+        memcpy(buffer, &header, sizeof(header));
+
+        if ( recv_all(fd, buffer + sizeof(header), header.len) < 0 ) {
+            Log(LOG_WARNING, "Failed to read resolved address batch");
+        } else {
+            addrlist = amp_resolve_unpack_list(buffer,
+                    sizeof(header) + header.len);
         }
+
+        free(buffer);
     }
 
     close(fd); //XXX do this here or at next level up in the test?
@@ -537,3 +774,15 @@ struct addrinfo *amp_resolve_get_list(int fd) {
     return addrlist;
 }
 
+
+
+#if UNIT_TEST
+uint8_t *amp_test_resolve_pack_list(struct addrinfo *addrlist,
+        uint32_t *len) {
+    return amp_resolve_pack_list(addrlist, len);
+}
+
+struct addrinfo *amp_test_resolve_unpack_list(uint8_t *buffer, uint32_t len) {
+    return amp_resolve_unpack_list(buffer, len);
+}
+#endif
@@ -66,6 +66,32 @@ struct amp_resolve_data {
     enum amp_resolve_status status; /* have we got a good response yet? */
     struct addrinfo **addrlist; /* list to store the results in */
     uint8_t family;             /* address family that was queried */
+    void (*done)(void *arg);    /* called once the name has been resolved */
+    void *done_arg;
+};
+
+/* largest batch of resolved addresses that will be accepted by a test */
+#define MAX_RESOLVE_REPLY_LEN (1024 * 1024)
+
+/*
+ * Header at the front of the batch of resolved addresses sent back to a test
+ * once all of its queries are complete.
+ */
+struct amp_resolve_reply {
+    uint32_t count;             /* number of addresses in the batch */
+    uint32_t len;               /* length of the packed addresses */
+};
+
+/*
+ * Header on each address in the batch, followed by addrlen bytes of sockaddr
+ * and then namelen bytes of canonical name (without the null terminator).
+ */
+struct amp_resolve_entry {
+    uint8_t family;             /* address family, even if no address */
+    uint8_t socktype;
+    uint8_t protocol;
+    uint8_t addrlen;            /* length of the sockaddr, 0 if unresolved */
+    uint8_t namelen;            /* length of the canonical name */
 };
 
 /* data block used to transfer information about a query to be performed */
@@ -92,11 +118,23 @@ struct ub_ctx *amp_resolver_context_init(char *servers[], int nscount,
         char *sourcev4, char *sourcev6);
 void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
         pthread_mutex_t *addrlist_lock, char *name, int family, int max);
+void amp_resolve_add_callback(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        void (*done)(void *arg), void *arg);
 void amp_resolve_freeaddr(struct addrinfo *addrlist);
+struct addrinfo* amp_resolve_build_addrinfo(int qtype, char *qname, char *data,
+        int datalen);
 void amp_resolver_context_delete(struct ub_ctx *ctx);
 
 struct addrinfo *amp_resolve_get_list(int fd);
+int amp_resolve_send_list(int fd, struct addrinfo *addrlist);
 int amp_resolve_add_new(int fd, resolve_dest_t *resolve);
 int amp_resolve_flag_done(int fd);
 int amp_resolver_connect(char *path);
+
+#if UNIT_TEST
+uint8_t *amp_test_resolve_pack_list(struct addrinfo *addrlist,
+        uint32_t *len);
+struct addrinfo *amp_test_resolve_unpack_list(uint8_t *buffer, uint32_t len);
+#endif
 #endif
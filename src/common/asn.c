@@ -45,6 +45,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 #if _WIN32
 #include "w32-compat.h"
@@ -59,6 +60,110 @@
 #include "iptrie.h"
 
 
+/* lock counters, updated atomically by all the resolving threads */
+static struct asn_lock_stats lock_stats;
+
+
+
+/*
+ * Record that a thread had to wait for the cache lock, and for how long.
+ */
+static void count_lock_wait(uint64_t *waits, struct timespec *start) {
+    struct timespec end;
+    int64_t delay;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    delay = (end.tv_sec - start->tv_sec) * 1000000000LL +
+        (end.tv_nsec - start->tv_nsec);
+
+    __atomic_add_fetch(waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lock_stats.wait_ns, delay, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Take a shared lock on the ASN cache. Any number of threads can look up
+ * addresses at the same time, they only wait while the cache is updated.
+ */
+void amp_asn_read_lock(struct amp_asn_info *info) {
+    struct timespec start;
+
+    __atomic_add_fetch(&lock_stats.reads, 1, __ATOMIC_RELAXED);
+
+    if ( pthread_rwlock_tryrdlock(info->lock) == 0 ) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_rdlock(info->lock);
+    count_lock_wait(&lock_stats.read_waits, &start);
+}
+
+
+
+/*
+ * Take an exclusive lock on the ASN cache, in order to modify it.
+ */
+void amp_asn_write_lock(struct amp_asn_info *info) {
+    struct timespec start;
+
+    __atomic_add_fetch(&lock_stats.writes, 1, __ATOMIC_RELAXED);
+
+    if ( pthread_rwlock_trywrlock(info->lock) == 0 ) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_wrlock(info->lock);
+    count_lock_wait(&lock_stats.write_waits, &start);
+}
+
+
+
+void amp_asn_unlock(struct amp_asn_info *info) {
+    pthread_rwlock_unlock(info->lock);
+}
+
+
+
+/*
+ * Get a copy of the current lock counters.
+ */
+void amp_asn_get_lock_stats(struct asn_lock_stats *stats) {
+    assert(stats);
+
+    stats->reads = __atomic_load_n(&lock_stats.reads, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&lock_stats.writes, __ATOMIC_RELAXED);
+    stats->read_waits = __atomic_load_n(&lock_stats.read_waits,
+            __ATOMIC_RELAXED);
+    stats->write_waits = __atomic_load_n(&lock_stats.write_waits,
+            __ATOMIC_RELAXED);
+    stats->wait_ns = __atomic_load_n(&lock_stats.wait_ns, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Add a freshly looked up ASN to the global cache, replacing any stale
+ * value already there.
+ */
+void amp_asn_cache_add(struct amp_asn_info *info, struct sockaddr *address,
+        uint8_t prefix, int64_t as) {
+    iptrie_node_t *node;
+
+    assert(info);
+
+    amp_asn_write_lock(info);
+    iptrie_add(info->trie, address, prefix, as);
+    if ( (node = iptrie_lookup(info->trie, address)) != NULL ) {
+        node->expires = time(NULL) + ASN_CACHE_TTL +
+            (rand() % ASN_CACHE_TTL_JITTER);
+    }
+    amp_asn_unlock(info);
+}
+
+
 
 /*
  * Convert a plain text ASN response into an address structure, adding it to
@@ -102,11 +207,9 @@ void add_parsed_line(struct iptrie *result, char *line,
     /* add to the result set */
     iptrie_add(result, (struct sockaddr*)&addr, prefix, as);
 
-    /* add to the global cache */
+    /* add to the global cache, replacing any stale value already there */
     if ( info != NULL ) {
-        pthread_mutex_lock(info->mutex);
-        iptrie_add(info->trie, (struct sockaddr*)&addr, prefix, as);
-        pthread_mutex_unlock(info->mutex);
+        amp_asn_cache_add(info, (struct sockaddr*)&addr, prefix, as);
     }
 }
 
@@ -347,19 +450,21 @@ static struct iptrie *amp_asn_fetch_results_direct(int whois_fd,
 
 
 /*
- * Open a TCP connection to the Team Cymru whois server and send the options
- * that will make the output look like we expect.
+ * Open a TCP connection to a whois server that speaks the Team Cymru bulk
+ * protocol, and send the options that will make the output look like we
+ * expect.
  * See http://www.team-cymru.org/Services/ip-to-asn.html for details.
  */
-int connect_to_whois_server(void) {
+int connect_to_whois_address(char *server, char *port) {
     struct addrinfo hints, *result;
     int fd;
     int flags;
     struct timeval socktimeout = {5, 0};
-    char *server = "whois.cymru.com";
-    char *port = "43";
 
-    Log(LOG_DEBUG, "Connecting to whois server");
+    assert(server);
+    assert(port);
+
+    Log(LOG_DEBUG, "Connecting to whois server %s:%s", server, port);
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -511,6 +616,15 @@ int connect_to_whois_server(void) {
 
 
 
+/*
+ * Open a TCP connection to the Team Cymru whois server.
+ */
+int connect_to_whois_server(void) {
+    return connect_to_whois_address(WHOIS_SERVER, WHOIS_PORT);
+}
+
+
+
 /*
  * Add another ASN query to the list of queries. They will be served by a local
  * cache/proxy if the main client is running, or sent directly to the server.
@@ -41,20 +41,59 @@
 #define _COMMON_ASN_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "iptrie.h"
 
 #define WHOIS_UNAVAILABLE -2
 
+/* Team Cymru whois server, which supports bulk queries of many addresses */
+#define WHOIS_SERVER "whois.cymru.com"
+#define WHOIS_PORT "43"
+
+struct asn_snapshot;
+struct asn_table;
+struct whois_client;
+
+/*
+ * Cached ASNs are valid for 24 hours + 0-60 minutes, so that entries added
+ * at the same time don't all need to be refreshed at the same time.
+ */
+#define ASN_CACHE_TTL 86400
+#define ASN_CACHE_TTL_JITTER 3600
+
+/*
+ * Counters describing how often threads had to wait for the ASN cache lock,
+ * to help diagnose contention when lots of tests are resolving at once.
+ */
+struct asn_lock_stats {
+    uint64_t reads;             /* shared locks taken for lookups */
+    uint64_t writes;            /* exclusive locks taken to update */
+    uint64_t read_waits;        /* shared locks that had to wait */
+    uint64_t write_waits;       /* exclusive locks that had to wait */
+    uint64_t wait_ns;           /* total time spent waiting for the lock */
+};
+
 /* data block given to each resolving thread */
 struct amp_asn_info {
     int fd;                     /* file descriptor to the test process */
     struct iptrie *trie;        /* shared ASN data (with the cache) */
-    pthread_mutex_t *mutex;     /* protect the shared cache */
+    pthread_rwlock_t *lock;     /* protect the shared cache */
     time_t *refresh;            /* time the cache should be refreshed */
+    struct asn_snapshot **snapshot; /* read only cache data saved on disk */
+    char *snapshot_path;        /* where the cache data is saved */
+    struct asn_table *table;    /* local prefix to ASN table, if configured */
+    struct whois_client *whois; /* connection shared by all the threads */
 };
 
+void amp_asn_read_lock(struct amp_asn_info *info);
+void amp_asn_write_lock(struct amp_asn_info *info);
+void amp_asn_unlock(struct amp_asn_info *info);
+void amp_asn_get_lock_stats(struct asn_lock_stats *stats);
+void amp_asn_cache_add(struct amp_asn_info *info, struct sockaddr *address,
+        uint8_t prefix, int64_t as);
+int connect_to_whois_address(char *server, char *port);
 int connect_to_whois_server(void);
 int amp_asn_flag_done(int fd);
 int amp_asn_add_query(iptrie_node_t *root, void *data);
@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 
 #ifndef _WIN32
 #include <arpa/inet.h>
@@ -48,56 +49,56 @@
 #endif
 
 #include "iptrie.h"
-#include "testlib.h"
 
 
 /*
- * Get the bit in the address at the given zero-based index. Expects either
- * an IPv4 or IPv6 address in network byte order.
+ * Get the 32bit block of the address at the given zero-based index, in host
+ * byte order. Expects either an IPv4 or IPv6 address in network byte order.
  */
-static int get_bit_at_index(struct sockaddr *address, int index) {
-    int offset;
+static inline uint32_t get_block(struct sockaddr *address, int index) {
+    uint8_t *bytes;
 
-    if ( address == NULL || index < 0 ) {
-        return -1;
+    if ( address->sa_family == AF_INET ) {
+        return index == 0 ?
+            ntohl(((struct sockaddr_in*)address)->sin_addr.s_addr) : 0;
     }
 
-    if ( address->sa_family == AF_INET ) {
-        if ( index > 31 ) {
-            return -1;
-        }
+    bytes = ((struct sockaddr_in6*)address)->sin6_addr.s6_addr + (index * 4);
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+        ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
 
-        /* line up the one set bit with the index we want */
-        offset = ntohl(0x80000000 >> index);
-        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
 
-    } else if ( address->sa_family == AF_INET6 ) {
-        int field;
-        if ( index > 127 ) {
-            return -1;
-        }
 
-        /* determine which 32bit block of the IPv6 address we need to check */
-        field = index / 16;
+/*
+ * Get the bit in the address at the given zero-based index. Expects either
+ * an IPv4 or IPv6 address in network byte order.
+ */
+static int get_bit_at_index(struct sockaddr *address, int index) {
+    int maxlen;
 
-        /* line up the one set bit with the index we want within the block */
-        offset = ntohs(0x8000 >> (index % 16));
-        return (((struct sockaddr_in6*)
-                address)->sin6_addr.s6_addr16[field] & offset)?1:0;
+    if ( address == NULL || index < 0 ) {
+        return -1;
+    }
 
+    maxlen = address->sa_family == AF_INET ? 32 : 128;
+    if ( index >= maxlen ) {
+        return -1;
     }
 
-    return -1;
+    return (get_block(address, index / 32) >> (31 - (index % 32))) & 1;
 }
 
 
 
 /*
  * Count the number of initial bits that match in a pair of addresses. Accepts
- * either IPv4 or IPv6 addresses, in network byte order.
+ * either IPv4 or IPv6 addresses, in network byte order. Whole 32bit blocks
+ * are compared at a time, rather than individual bits.
  */
 static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
-    int count = 0;
+    int blocks, i;
+    uint32_t diff;
 
     if ( a == NULL || b == NULL ) {
         return -1;
@@ -107,45 +108,51 @@ static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
         return -1;
     }
 
-    if ( a->sa_family == AF_INET ) {
-        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
-        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
-        int mask = 0x80000000;
-        int maxlen = 32;
+    blocks = a->sa_family == AF_INET ? 1 : 4;
 
-        /* count bits that are the same, from the left, stop when different */
-        while ( count < maxlen &&
-                (a4->sin_addr.s_addr & ntohl(mask)) ==
-                (b4->sin_addr.s_addr & ntohl(mask)) ) {
-            count++;
-            mask = (mask >> 1) | 0x80000000;
+    for ( i = 0; i < blocks; i++ ) {
+        if ( (diff = get_block(a, i) ^ get_block(b, i)) != 0 ) {
+            return (i * 32) + __builtin_clz(diff);
         }
+    }
 
-    } else if ( a->sa_family == AF_INET6 ) {
-        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
-        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
-        int mask = 0x8000;
-        int maxlen = 128;
-        int i;
-
-        for ( i = 0; i < 8; i++ ) {
-            if ( a6->sin6_addr.s6_addr16[i] == b6->sin6_addr.s6_addr16[i] ) {
-                /* skip a whole block if it's the same, don't need to count */
-                count += 16;
-            } else {
-                /* count bits that are the same, from the left */
-                while ( count < maxlen &&
-                        (a6->sin6_addr.s6_addr16[i] & ntohs(mask)) ==
-                        (b6->sin6_addr.s6_addr16[i] & ntohs(mask)) ) {
-                    count++;
-                    mask = (mask >> 1) | 0x8000;
-                }
-                break;
-            }
-        }
+    return blocks * 32;
+}
+
+
+
+/*
+ * Take a new node from the arena, allocating another block of nodes if the
+ * current one is full.
+ */
+static iptrie_node_t *iptrie_new_node(struct iptrie *root,
+        struct sockaddr *address, uint8_t prefix, int64_t as, uint8_t valid) {
+    iptrie_node_t *node;
+
+    if ( root->arena == NULL || root->arena->used >= IPTRIE_ARENA_NODES ) {
+        struct iptrie_arena *arena = malloc(sizeof(struct iptrie_arena));
+        arena->used = 0;
+        arena->next = root->arena;
+        root->arena = arena;
     }
 
-    return count;
+    node = &root->arena->nodes[root->arena->used++];
+    node->as = as;
+    node->prefix = prefix;
+    node->valid = valid;
+    node->expires = 0;
+    node->left = NULL;
+    node->right = NULL;
+    node->next = NULL;
+
+    if ( address->sa_family == AF_INET ) {
+        memcpy(&node->storage.in, address, sizeof(struct sockaddr_in));
+    } else {
+        memcpy(&node->storage.in6, address, sizeof(struct sockaddr_in6));
+    }
+    node->address = (struct sockaddr*)&node->storage;
+
+    return node;
 }
 
 
@@ -155,8 +162,9 @@ static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
  * exist then it will be added at the appropriate location, if it does exist
  * then it will be updated.
  */
-static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
-        struct sockaddr *address, uint8_t prefix, int64_t as) {
+static iptrie_node_t *iptrie_add_internal(struct iptrie *trie,
+        iptrie_node_t *root, struct sockaddr *address, uint8_t prefix,
+        int64_t as) {
 
     int cmp, len;
 
@@ -167,38 +175,45 @@ static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
 
     /* empty trie, add this address at the root */
     if ( root == NULL ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = as;
-        node->prefix = prefix;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
-        }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
-        return node;
+        return iptrie_new_node(trie, address, prefix, as, 1);
+    }
+
+    /*
+     * See how similar this node actually is. If it matches more than the
+     * node prefix, limit it... we have more nodes that we have to check
+     * below for a better match first. It can't match more than the prefix
+     * being added either.
+     */
+    if ( (len = get_matching_prefix_length(root->address, address)) >
+            root->prefix ) {
+        len = root->prefix;
+    }
+
+    if ( len > prefix ) {
+        len = prefix;
     }
 
     /* there is a prefix set and this address matches, update the ASN */
-    if ( prefix == root->prefix &&
-            compare_addresses(root->address, address, prefix) == 0 ) {
+    if ( prefix == root->prefix && len == prefix ) {
         root->as = as;
+        root->valid = 1;
         return root;
     }
 
-
     /*
-     * Prefix and address don't match, see how similar this node actually is.
-     * If it matches more than the node prefix, limit it... we have more
-     * nodes that we have to check below for a better match first.
+     * If the prefix being added covers this node then it needs to go above
+     * this node, with this node as a child on the appropriate branch.
      */
-    if ( (len = get_matching_prefix_length(root->address, address)) >
-            root->prefix ) {
-        len = root->prefix;
+    if ( len == prefix ) {
+        iptrie_node_t *node = iptrie_new_node(trie, address, prefix, as, 1);
+
+        if ( get_bit_at_index(root->address, prefix) == 0 ) {
+            node->left = root;
+        } else {
+            node->right = root;
+        }
+
+        return node;
     }
 
     /* get the first bit that didn't match */
@@ -211,28 +226,18 @@ static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
      * will become children of this new branching node.
      */
     if ( len < root->prefix ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = 0;
-        node->prefix = len;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
-        }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
+        iptrie_node_t *node = iptrie_new_node(trie, address, len, 0, 0);
 
         if ( cmp == 0 ) {
             /* the next bit is a zero, add it down the left branch */
-            node->left = iptrie_add_internal(node->left, address, prefix, as);
+            node->left = iptrie_add_internal(trie, node->left, address,
+                    prefix, as);
             /* and put the existing node on the right branch */
             node->right = root;
         } else {
             /* the next bit is a one, add it down the right branch */
-            node->right = iptrie_add_internal(node->right, address, prefix, as);
+            node->right = iptrie_add_internal(trie, node->right, address,
+                    prefix, as);
             /* and put the existing node on the left branch */
             node->left = root;
         }
@@ -246,10 +251,11 @@ static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
      */
     if ( cmp == 0 ) {
         /* the next bit is a zero, go down the left branch */
-        root->left = iptrie_add_internal(root->left, address, prefix, as);
+        root->left = iptrie_add_internal(trie, root->left, address, prefix, as);
     } else {
         /* the next bit is a one, go down the right branch */
-        root->right = iptrie_add_internal(root->right, address, prefix, as);
+        root->right = iptrie_add_internal(trie, root->right, address,
+                prefix, as);
     }
 
     return root;
@@ -266,10 +272,12 @@ void iptrie_add(struct iptrie *root, struct sockaddr *address,
 
     switch ( address->sa_family ) {
         case AF_INET:
-            root->ipv4 = iptrie_add_internal(root->ipv4, address, prefix, as);
+            root->ipv4 = iptrie_add_internal(root, root->ipv4, address,
+                    prefix, as);
             break;
         case AF_INET6:
-            root->ipv6 = iptrie_add_internal(root->ipv6, address, prefix, as);
+            root->ipv6 = iptrie_add_internal(root, root->ipv6, address,
+                    prefix, as);
             break;
     };
 }
@@ -277,81 +285,121 @@ void iptrie_add(struct iptrie *root, struct sockaddr *address,
 
 
 /*
- *
+ * Check if the first prefix bits of the key match the address of the node.
+ */
+static int node_matches(iptrie_node_t *node, uint32_t *key) {
+    int i;
+
+    for ( i = 0; i * 32 < node->prefix; i++ ) {
+        uint32_t diff = key[i] ^ get_block(node->address, i);
+        if ( diff != 0 && (i * 32) + __builtin_clz(diff) < node->prefix ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Find the longest prefix in the trie that contains the address. Follow the
+ * bit at the end of each prefix down the trie, remembering the nodes with
+ * values, then compare the whole prefix against those nodes starting with
+ * the longest. Usually the first one checked will match, rather than
+ * comparing at every node on the way down.
  */
-static int64_t iptrie_lookup_as_internal(iptrie_node_t *root,
+static iptrie_node_t *iptrie_lookup_internal(iptrie_node_t *root,
         struct sockaddr *address) {
-    int next;
 
-    /* empty trie or missing address, can't return a useful AS number */
+    iptrie_node_t *candidates[129];
+    uint32_t key[4];
+    int blocks, i, count = 0;
+
+    /* empty trie or missing address, can't find a useful node */
     if ( root == NULL || address == NULL ) {
-        return -1;
+        return NULL;
     }
 
-    /* if the address doesn't match at this prefix, it isn't present */
-    if ( compare_addresses(root->address, address, root->prefix) != 0 ) {
-        return -1;
+    /* convert the address to host byte order once, rather than every node */
+    blocks = address->sa_family == AF_INET ? 1 : 4;
+    for ( i = 0; i < blocks; i++ ) {
+        key[i] = get_block(address, i);
     }
 
-    /* if this is a leaf node, then it matches what we were looking for */
-    if ( root->left == NULL && root->right == NULL ) {
-        return root->as;
-    }
+    while ( root != NULL ) {
+        if ( root->valid ) {
+            candidates[count++] = root;
+        }
 
-    /* compare the next bit in the address to see which branch we should take */
-    next = get_bit_at_index(address, root->prefix);
+        /* compare the next bit in the address to see which branch to take */
+        if ( root->prefix >= blocks * 32 ) {
+            break;
+        } else if ( (key[root->prefix / 32] >>
+                    (31 - (root->prefix % 32))) & 1 ) {
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
 
-    /* non-leaf node, continue down the trie and try the next branch */
-    if ( next == 0 && root->left ) {
-        return iptrie_lookup_as_internal(root->left, address);
-    } else if ( next == 1 && root->right ) {
-        return iptrie_lookup_as_internal(root->right, address);
+    /* the longest prefix that actually matches the address is the answer */
+    while ( count > 0 ) {
+        if ( node_matches(candidates[--count], key) ) {
+            return candidates[count];
+        }
     }
 
-    /* no branch where expected, the ASN isn't here */
-    return -1;
+    return NULL;
 }
 
 
 
 /*
  * We keep separate tries for ipv4 and ipv6, so figure out which one we should
- * use based on the address we've been given to look up.
+ * use based on the address we've been given to look up. Returns the leaf
+ * node matching the address, or NULL if there isn't one.
  */
-int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address) {
+iptrie_node_t *iptrie_lookup(struct iptrie *root, struct sockaddr *address) {
 
     switch ( address->sa_family ) {
         case AF_INET:
-            return iptrie_lookup_as_internal(root->ipv4, address);
+            return iptrie_lookup_internal(root->ipv4, address);
         case AF_INET6:
-            return iptrie_lookup_as_internal(root->ipv6, address);
+            return iptrie_lookup_internal(root->ipv6, address);
     };
 
-    return -1;
+    return NULL;
 }
 
 
 
 /*
- * Post-order traversal, free each node after freeing all the children.
+ * Look up the AS number for an address, or -1 if it isn't present.
  */
-static void iptrie_clear_internal(iptrie_node_t *root) {
-    if ( root == NULL ) {
-        return;
-    }
+int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address) {
+    iptrie_node_t *node = iptrie_lookup(root, address);
 
-    iptrie_clear_internal(root->left);
-    iptrie_clear_internal(root->right);
+    if ( node == NULL ) {
+        return -1;
+    }
 
-    free(root->address);
-    free(root);
+    return node->as;
 }
 
 
 
+/*
+ * All the nodes live in the arena, so free all the blocks at once rather
+ * than walking the trie.
+ */
 void iptrie_clear(struct iptrie *root) {
-    iptrie_clear_internal(root->ipv4);
-    iptrie_clear_internal(root->ipv6);
+    struct iptrie_arena *arena;
+
+    while ( (arena = root->arena) != NULL ) {
+        root->arena = arena->next;
+        free(arena);
+    }
 
     root->ipv4 = NULL;
     root->ipv6 = NULL;
@@ -360,8 +408,10 @@ void iptrie_clear(struct iptrie *root) {
 
 
 /*
- * Apply the user function to each of the leaves (only the leaves contain
- * values that were added, internal nodes have been created as a by-product).
+ * Apply the user function to each node that holds a value that was added.
+ * Leaves always do, but so can internal nodes if a prefix was added that
+ * covers other prefixes. Nodes that were only created as branch points are
+ * skipped. A node is always visited before any of the nodes below it.
  */
 static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
         int (*func)(iptrie_node_t *node, void *data), void *data) {
@@ -370,15 +420,16 @@ static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
         return 0;
     }
 
-    if ( root->left == NULL && root->right == NULL ) {
-        return func(root, data);
-    } else {
-        if ( iptrie_on_all_leaves_internal(root->left, func, data) < 0 ) {
-            return -1;
-        }
-        if ( iptrie_on_all_leaves_internal(root->right, func, data) < 0 ) {
-            return -1;
-        }
+    if ( root->valid && func(root, data) < 0 ) {
+        return -1;
+    }
+
+    if ( iptrie_on_all_leaves_internal(root->left, func, data) < 0 ) {
+        return -1;
+    }
+
+    if ( iptrie_on_all_leaves_internal(root->right, func, data) < 0 ) {
+        return -1;
     }
 
     return 0;
@@ -387,8 +438,8 @@ static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
 
 
 /*
- * Apply the user function to each of the leaves (only the leaves contain
- * values that were added, internal nodes have been created as a by-product).
+ * Apply the user function to each node that holds a value that was added,
+ * including covering prefixes that have more specific prefixes below them.
  */
 int iptrie_on_all_leaves(struct iptrie *root,
         int (*func)(iptrie_node_t*, void*), void *data) {
@@ -407,7 +458,7 @@ int iptrie_on_all_leaves(struct iptrie *root,
 
 
 /*
- * Traverse the trie and join all the leaves together into a list.
+ * Add a single node to the front of the list.
  */
 static int iptrie_to_list_internal(iptrie_node_t *node, void *data) {
 
@@ -424,7 +475,7 @@ static int iptrie_to_list_internal(iptrie_node_t *node, void *data) {
 
 
 /*
- * Traverse the trie and join all the leaves together into a list.
+ * Traverse the trie and join all the nodes holding values into a list.
  */
 iplist_t *iptrie_to_list(struct iptrie *root) {
     iplist_t *list = NULL;
@@ -444,3 +495,19 @@ int iptrie_is_empty(struct iptrie *root) {
 
     return 0;
 }
+
+
+
+/*
+ * Count the number of nodes (leaves and branching nodes) in the trie.
+ */
+unsigned int iptrie_count_nodes(struct iptrie *root) {
+    struct iptrie_arena *arena;
+    unsigned int count = 0;
+
+    for ( arena = root->arena; arena != NULL; arena = arena->next ) {
+        count += arena->used;
+    }
+
+    return count;
+}
@@ -41,28 +41,55 @@
 #define _COMMON_IPTRIE_H
 
 #include <stdint.h>
+#include <time.h>
 
-#ifndef _WIN32
+#if _WIN32
+#include <ws2tcpip.h>
+#else
 #include <netinet/in.h>
 #endif
 
 
+/* number of nodes allocated at a time when the trie needs to grow */
+#define IPTRIE_ARENA_NODES 1024
+
 #define iptrie_node_t struct iptrie_node
 #define iplist_t struct iptrie_node
 struct iptrie_node {
     /* ASNs are only 32bit, but we can use the extra space as markers */
     int64_t as;
     uint8_t prefix;
+    /* set if the prefix was added, rather than created as a branch point */
+    uint8_t valid;
+    /* when a cached value should be refreshed, zero if it never expires */
+    time_t expires;
+    /* points at the copy of the address stored within the node */
     struct sockaddr *address;
 
     iptrie_node_t *left;
     iptrie_node_t *right;
     iptrie_node_t *next;
+
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } storage;
+};
+
+/*
+ * Nodes are never removed individually, so they are allocated in blocks that
+ * are all freed at once when the trie is cleared.
+ */
+struct iptrie_arena {
+    struct iptrie_arena *next;
+    unsigned int used;
+    iptrie_node_t nodes[IPTRIE_ARENA_NODES];
 };
 
 struct iptrie {
     iptrie_node_t *ipv4;
     iptrie_node_t *ipv6;
+    struct iptrie_arena *arena;
 };
 
 
@@ -70,9 +97,11 @@ struct iptrie {
 void iptrie_add(struct iptrie *root, struct sockaddr *address,
         uint8_t prefix, int64_t as);
 int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address);
+iptrie_node_t *iptrie_lookup(struct iptrie *root, struct sockaddr *address);
 void iptrie_clear(struct iptrie *root);
 int iptrie_on_all_leaves(struct iptrie *root,
         int (*func)(iptrie_node_t*, void*), void *data);
 iplist_t *iptrie_to_list(struct iptrie *root);
 int iptrie_is_empty(struct iptrie *root);
+unsigned int iptrie_count_nodes(struct iptrie *root);
 #endif
@@ -0,0 +1,514 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2022 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A common engine for tests that send a single probe packet per item and
+ * match responses back to them (icmp, dns, tcpping). Tests used to each
+ * implement the same loop: a new timer for every probe, a busy wait in
+ * delay_send_packet() to enforce the inter-packet delay, and matching
+ * responses by doing arithmetic on sequence numbers.
+ *
+ * Instead, all the probe slots are allocated up front along with a single
+ * buffer to build probes in. Probes are paced against absolute deadlines
+ * measured from the start of the test, so time spent building and sending
+ * doesn't accumulate into drift, and up to a batch worth of probes are sent
+ * with a single system call whenever they are due. Responses are read in
+ * batches and matched to waiting probes through a hash of their key.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "probe.h"
+#include "testlib.h"
+#include "debug.h"
+
+#define NS_PER_US 1000LL
+#define NS_PER_SEC 1000000000LL
+
+/* smallest number of hash buckets used for matching responses */
+#define MIN_PROBE_BUCKET_BITS 4
+
+struct probe_engine_t {
+    struct event_base *base;
+    struct socket_t sockets;
+    struct probe_opt_t options;
+    struct probe_ops_t ops;
+    void *data;
+
+    struct probe_t *probes;     /* all the probe slots, indexed by position */
+    struct probe_t **buckets;   /* waiting probes, indexed by key hash */
+    int bits;                   /* log2 of the number of buckets */
+    int next;                   /* next probe to be sent */
+    int slot;                   /* number of send slots used so far */
+    int outstanding;            /* number of probes waiting on a response */
+    int64_t start;              /* monotonic time that slot 0 was due */
+
+    char *packet;               /* buffer that probes are built in */
+    struct probe_t **queued;    /* probes in the current send batch */
+    int pending;                /* number of probes in the send batch */
+    struct send_batch_t *batch;
+    struct recv_batch_t *responses;
+
+    struct event *sendtimer;
+    struct event *losstimer;
+    struct event *socket;
+    struct event *socket6;
+};
+
+
+
+/*
+ * Hash a probe key to pick a bucket (Fibonacci hashing).
+ */
+static inline uint32_t hash_probe_key(struct probe_engine_t *engine,
+        uint32_t key) {
+    return (key * 2654435769U) >> (32 - engine->bits);
+}
+
+
+
+/*
+ * Add a probe that is now waiting on a response to the hash table.
+ */
+static void add_waiting_probe(struct probe_engine_t *engine,
+        struct probe_t *probe) {
+    uint32_t bucket = hash_probe_key(engine, probe->key);
+
+    probe->state = PROBE_WAITING;
+    probe->next = engine->buckets[bucket];
+    engine->buckets[bucket] = probe;
+    engine->outstanding++;
+}
+
+
+
+/*
+ * Stop the test if every probe has been sent and nothing is outstanding.
+ */
+static void check_probes_complete(struct probe_engine_t *engine) {
+    if ( engine->next == engine->options.count && engine->pending == 0 &&
+            engine->outstanding == 0 ) {
+        Log(LOG_DEBUG, "All expected responses received");
+        event_base_loopbreak(engine->base);
+    }
+}
+
+
+
+/*
+ * Give up waiting on any responses that haven't arrived yet.
+ */
+static void loss_timer_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+    struct probe_engine_t *engine = (struct probe_engine_t*)evdata;
+
+    Log(LOG_DEBUG, "Halting test due to timeout, %d responses outstanding",
+            engine->outstanding);
+    event_base_loopbreak(engine->base);
+}
+
+
+
+/*
+ * Wait until the next probe is due or, if they have all been sent, for
+ * the remaining responses to arrive.
+ */
+static void schedule_next_probe(struct probe_engine_t *engine, int64_t now) {
+    struct timeval timeout;
+    int64_t delay;
+
+    if ( engine->next == engine->options.count ) {
+        Log(LOG_DEBUG, "Reached final target: %d", engine->next);
+        if ( engine->outstanding == 0 ) {
+            /* avoid waiting for the loss timeout if nothing is outstanding */
+            event_base_loopbreak(engine->base);
+        } else {
+            timeout.tv_sec = engine->options.loss_timeout;
+            timeout.tv_usec = 0;
+            event_add(engine->losstimer, &timeout);
+        }
+        return;
+    }
+
+    delay = engine->start + (engine->slot *
+            (int64_t)engine->options.inter_packet_delay * NS_PER_US) - now;
+    if ( delay < 0 ) {
+        delay = 0;
+    }
+
+    timeout.tv_sec = delay / NS_PER_SEC;
+    timeout.tv_usec = (delay % NS_PER_SEC) / NS_PER_US;
+    event_add(engine->sendtimer, &timeout);
+}
+
+
+
+/*
+ * Build and send every probe that is due. A whole batch is sent at once if
+ * it would fit within the time that batch is allowed, so the average rate is
+ * still respected. If the test falls more than a batch behind (e.g. the host
+ * was busy) then the schedule restarts from now rather than trying to catch
+ * up with a burst of probes. If the rate budget shared with other tests
+ * doesn't have room for the batch yet then it is held until there is.
+ */
+static void send_probes_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+
+    struct probe_engine_t *engine = (struct probe_engine_t*)evdata;
+    struct probe_opt_t *options = &engine->options;
+    struct probe_t *probe;
+    struct timeval timeout;
+    int64_t now, gap, horizon;
+    int length, delay, i;
+
+    now = monotonic_ns();
+    gap = (int64_t)options->inter_packet_delay * NS_PER_US;
+
+    /* a batch held back by the rate budget has to be sent before any more */
+    if ( engine->pending == 0 ) {
+        if ( now - (engine->start + (engine->slot * gap)) >
+                gap * options->batch ) {
+            engine->start = now - (engine->slot * gap);
+        }
+
+        /* anything due before the end of this batch can be sent now */
+        horizon = now + (gap * (options->batch - 1));
+
+        while ( engine->next < options->count &&
+                engine->pending < options->batch ) {
+
+            if ( engine->pending > 0 && engine->start +
+                    ((engine->slot + engine->pending) * gap) > horizon ) {
+                break;
+            }
+
+            probe = &engine->probes[engine->next++];
+
+            if ( (length = engine->ops.build(engine->data, probe,
+                            engine->packet, options->packet_size)) < 0 ) {
+                probe->state = PROBE_SKIPPED;
+                continue;
+            }
+
+            assert(probe->dest);
+            assert(probe->sent);
+
+            if ( queue_send_packet(engine->batch, engine->packet, length,
+                        probe->dest, probe->ttl, probe->sent) < 0 ) {
+                probe->state = PROBE_SKIPPED;
+                continue;
+            }
+
+            engine->queued[engine->pending++] = probe;
+        }
+    }
+
+    if ( engine->pending > 0 ) {
+        /*
+         * Pacing is done here so the batch is sent immediately, unless the
+         * rate budget is full, in which case try again when there is room.
+         */
+        if ( (delay = flush_send_batch(engine->batch)) > 0 ) {
+            timeout.tv_sec = delay / 1000000;
+            timeout.tv_usec = delay % 1000000;
+            event_add(engine->sendtimer, &timeout);
+            return;
+        }
+
+        /* any probe without a sent time failed to send, don't wait for it */
+        for ( i = 0; i < engine->pending; i++ ) {
+            probe = engine->queued[i];
+            if ( probe->sent->tv_sec == 0 && probe->sent->tv_nsec == 0 ) {
+                probe->state = PROBE_SKIPPED;
+            } else {
+                add_waiting_probe(engine, probe);
+            }
+        }
+
+        engine->slot += engine->pending;
+        engine->pending = 0;
+    }
+
+    schedule_next_probe(engine, now);
+}
+
+
+
+/*
+ * Read every response that is currently waiting on the socket and match
+ * them to the probes they belong to.
+ */
+static void receive_probes_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct probe_engine_t *engine = (struct probe_engine_t*)evdata;
+    struct recv_packet_t *packet;
+    struct socket_t sockets;
+    struct probe_t *probe;
+    uint32_t key;
+    int wait = 0;
+    int i;
+
+    /* the socket used here doesn't matter as the family isn't used anywhere */
+    sockets.socket = evsock;
+    sockets.socket6 = -1;
+
+    get_packets(&sockets, engine->responses, &wait);
+
+    for ( i = 0; i < engine->responses->count; i++ ) {
+        packet = &engine->responses->packets[i];
+
+        if ( engine->ops.match(engine->data, packet, &key) < 0 ) {
+            continue;
+        }
+
+        if ( (probe = find_probe(engine, key)) == NULL ) {
+            Log(LOG_DEBUG, "Response doesn't match any waiting probe");
+            continue;
+        }
+
+        if ( engine->ops.report(engine->data, probe, packet) > 0 ) {
+            finish_probe(engine, probe);
+        }
+    }
+}
+
+
+
+/*
+ * Create a new probe engine that sends probes on the given sockets. All the
+ * memory required to build, send and receive probes is allocated here, so
+ * the only allocations while the test runs are those made by the hooks.
+ */
+struct probe_engine_t *new_probe_engine(struct event_base *base,
+        struct socket_t *sockets, struct probe_opt_t *options,
+        struct probe_ops_t *ops, void *data) {
+
+    struct probe_engine_t *engine;
+    int i;
+
+    assert(base);
+    assert(sockets);
+    assert(options);
+    assert(options->count >= 0);
+    assert(options->packet_size > 0);
+    assert(ops);
+    assert(ops->build);
+    assert(options->response_size == 0 || (ops->match && ops->report));
+
+    engine = calloc(1, sizeof(struct probe_engine_t));
+    engine->base = base;
+    engine->sockets = *sockets;
+    engine->options = *options;
+    engine->ops = *ops;
+    engine->data = data;
+
+    if ( engine->options.batch < 1 ) {
+        engine->options.batch = 1;
+    } else if ( engine->options.batch > MAX_SEND_BATCH ) {
+        engine->options.batch = MAX_SEND_BATCH;
+    }
+
+    engine->probes = calloc(options->count > 0 ? options->count : 1,
+            sizeof(struct probe_t));
+    for ( i = 0; i < options->count; i++ ) {
+        engine->probes[i].index = i;
+    }
+
+    /* keep the hash table no more than half full */
+    for ( engine->bits = MIN_PROBE_BUCKET_BITS;
+            (1 << engine->bits) < options->count * 2 && engine->bits < 24;
+            engine->bits++ ) {
+        /* nothing */
+    }
+    engine->buckets = calloc(1 << engine->bits, sizeof(struct probe_t*));
+
+    engine->packet = malloc(options->packet_size);
+    engine->queued = calloc(engine->options.batch, sizeof(struct probe_t*));
+    engine->batch = new_send_batch(sockets, engine->options.batch,
+            options->packet_size, 0);
+
+    engine->sendtimer = event_new(base, -1, 0, send_probes_callback, engine);
+    engine->losstimer = event_new(base, -1, 0, loss_timer_callback, engine);
+
+    if ( options->response_size > 0 ) {
+        engine->responses = new_recv_batch(MAX_RECV_BATCH,
+                options->response_size);
+
+        if ( sockets->socket >= 0 ) {
+            engine->socket = event_new(base, sockets->socket,
+                    EV_READ|EV_PERSIST, receive_probes_callback, engine);
+            event_add(engine->socket, NULL);
+        }
+
+        if ( sockets->socket6 >= 0 ) {
+            engine->socket6 = event_new(base, sockets->socket6,
+                    EV_READ|EV_PERSIST, receive_probes_callback, engine);
+            event_add(engine->socket6, NULL);
+        }
+    }
+
+    return engine;
+}
+
+
+
+/*
+ * Free a probe engine. The sockets belong to the caller and are left open.
+ */
+void free_probe_engine(struct probe_engine_t *engine) {
+    if ( engine == NULL ) {
+        return;
+    }
+
+    event_free(engine->sendtimer);
+    event_free(engine->losstimer);
+
+    if ( engine->socket ) {
+        event_free(engine->socket);
+    }
+
+    if ( engine->socket6 ) {
+        event_free(engine->socket6);
+    }
+
+    free_send_batch(engine->batch);
+    free_recv_batch(engine->responses);
+    free(engine->queued);
+    free(engine->packet);
+    free(engine->buckets);
+    free(engine->probes);
+    free(engine);
+}
+
+
+
+/*
+ * Send the first probe as soon as the event loop is run. The event loop will
+ * be stopped once every probe has been answered or the loss timeout expires.
+ */
+void start_probe_engine(struct probe_engine_t *engine) {
+    assert(engine);
+
+    engine->start = monotonic_ns();
+    event_active(engine->sendtimer, 0, 0);
+}
+
+
+
+/*
+ * Get the probe at the given position within the test.
+ */
+struct probe_t *get_probe(struct probe_engine_t *engine, int index) {
+    assert(engine);
+    assert(index >= 0 && index < engine->options.count);
+
+    return &engine->probes[index];
+}
+
+
+
+/*
+ * Find the probe that is waiting on a response with the given key, or NULL
+ * if there isn't one.
+ */
+struct probe_t *find_probe(struct probe_engine_t *engine, uint32_t key) {
+    struct probe_t *probe;
+
+    assert(engine);
+
+    for ( probe = engine->buckets[hash_probe_key(engine, key)];
+            probe != NULL; probe = probe->next ) {
+        if ( probe->key == key ) {
+            return probe;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Mark a probe as having received its response, so it no longer matches any
+ * more packets. Stops the test if it was the last one being waited on.
+ */
+void finish_probe(struct probe_engine_t *engine, struct probe_t *probe) {
+    struct probe_t **prev;
+
+    assert(engine);
+    assert(probe);
+
+    if ( probe->state != PROBE_WAITING ) {
+        return;
+    }
+
+    for ( prev = &engine->buckets[hash_probe_key(engine, probe->key)];
+            *prev != NULL; prev = &(*prev)->next ) {
+        if ( *prev == probe ) {
+            *prev = probe->next;
+            break;
+        }
+    }
+
+    probe->next = NULL;
+    probe->state = PROBE_DONE;
+    engine->outstanding--;
+
+    check_probes_complete(engine);
+}
+
+
+
+/*
+ * Get the number of probes that have been sent but not yet answered.
+ */
+int probe_engine_outstanding(struct probe_engine_t *engine) {
+    assert(engine);
+
+    return engine->outstanding;
+}
@@ -0,0 +1,130 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _COMMON_PROBE_H
+#define _COMMON_PROBE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "testlib.h"
+
+/* state of each probe slot */
+#define PROBE_IDLE 0            /* not sent yet */
+#define PROBE_WAITING 1         /* sent, waiting on a response */
+#define PROBE_DONE 2            /* response has been received */
+#define PROBE_SKIPPED 3         /* not sent, by choice or due to an error */
+
+/*
+ * A single probe, preallocated when the engine is created. The build hook
+ * fills in where the probe is going, the key that responses to it can be
+ * matched by, and where to record the time it was sent.
+ */
+struct probe_t {
+    int index;                  /* position of the probe within the test */
+    int state;                  /* PROBE_IDLE, PROBE_WAITING, etc */
+    int ttl;                    /* TTL/hop limit to send with, or 0 */
+    uint32_t key;               /* value identifying responses to the probe */
+    struct addrinfo *dest;      /* where the probe is sent */
+    struct timespec *sent;      /* where to record when it was sent */
+    struct probe_t *next;       /* next waiting probe with the same hash */
+};
+
+/*
+ * Build the probe packet into the given buffer, filling in the probe dest,
+ * key and sent fields. Returns the length of the packet, or -1 if the probe
+ * should be skipped.
+ */
+typedef int (*probe_build_cb)(void *data, struct probe_t *probe,
+        char *packet, int size);
+
+/*
+ * Check if a received packet looks like a response to one of our probes and
+ * if so store the key of that probe. Returns 0 on success, or -1 if the
+ * packet should be ignored.
+ */
+typedef int (*probe_match_cb)(void *data, struct recv_packet_t *packet,
+        uint32_t *key);
+
+/*
+ * Record the response to a waiting probe. Returns 1 if the probe is now
+ * complete, 0 if it should keep waiting for another response, or -1 if the
+ * packet turned out not to be a response after all.
+ */
+typedef int (*probe_report_cb)(void *data, struct probe_t *probe,
+        struct recv_packet_t *packet);
+
+/*
+ * The test specific parts of sending probes and processing their responses.
+ * Tests that capture responses some other way can leave match and report
+ * NULL, and use find_probe() and finish_probe() themselves.
+ */
+struct probe_ops_t {
+    probe_build_cb build;
+    probe_match_cb match;
+    probe_report_cb report;
+};
+
+/*
+ * Options that control how many probes are sent and how quickly.
+ */
+struct probe_opt_t {
+    int count;                  /* number of probes to send */
+    int batch;                  /* maximum number of probes to send at once */
+    int packet_size;            /* size of the largest probe (bytes) */
+    int response_size;          /* size of the largest response, 0 if the
+                                   engine shouldn't read from the sockets */
+    uint32_t inter_packet_delay;/* gap between sending probes (usec) */
+    int loss_timeout;           /* time to wait after the last probe (sec) */
+};
+
+/*
+ * Opaque engine that sends probes and matches responses to them.
+ */
+struct probe_engine_t;
+
+struct probe_engine_t *new_probe_engine(struct event_base *base,
+        struct socket_t *sockets, struct probe_opt_t *options,
+        struct probe_ops_t *ops, void *data);
+void free_probe_engine(struct probe_engine_t *engine);
+void start_probe_engine(struct probe_engine_t *engine);
+struct probe_t *get_probe(struct probe_engine_t *engine, int index);
+struct probe_t *find_probe(struct probe_engine_t *engine, uint32_t key);
+void finish_probe(struct probe_engine_t *engine, struct probe_t *probe);
+int probe_engine_outstanding(struct probe_engine_t *engine);
+#endif
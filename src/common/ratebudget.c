@@ -0,0 +1,454 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A budget for the total rate of test traffic sent by all of the tests that
+ * are running, so that lots of overlapping tests can't add up to enough
+ * traffic to trigger rate limiting somewhere upstream and skew the results.
+ * Each test only enforces its own inter-packet delay, which on its own does
+ * nothing to limit the aggregate rate.
+ *
+ * The budget is kept in memory shared between measured and every test
+ * process. There is a global packets per second and bits per second limit,
+ * and each test is also limited to an equal share of them, so that one busy
+ * test can't starve the others. Tests that haven't sent anything recently
+ * don't count towards the share.
+ *
+ * Each limit is a token bucket, tracked as the time at which the bucket
+ * will next be empty (as in GCRA) so that it can be updated with a single
+ * compare and swap. Senders reserve their packets up front and are told
+ * when they may send them, so a sender that has to wait can't then lose
+ * its place to another that arrives later.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "ratebudget.h"
+#include "debug.h"
+#include "waitset.h"
+
+#define NS_PER_MS INT64_C(1000000)
+#define NS_PER_SEC INT64_C(1000000000)
+
+/*
+ * A single test process using the budget.
+ */
+struct rate_client {
+    int32_t pid;                    /* process running the test */
+    int32_t used;                   /* set while the slot is claimed */
+    int64_t last_active;            /* monotonic time of the last send (ns) */
+    int64_t packet_tat;             /* fair share packet bucket */
+    int64_t bit_tat;                /* fair share bit bucket */
+    char name[RATE_BUDGET_NAME_LEN];
+    struct rate_budget_stats stats;
+};
+
+/*
+ * The budget shared by every test process.
+ */
+struct rate_budget {
+    uint64_t pps;                   /* global packet limit, 0 if unlimited */
+    uint64_t bps;                   /* global bit limit, 0 if unlimited */
+    int64_t burst;                  /* length of burst allowed (ns) */
+    int64_t packet_tat;             /* global packet bucket */
+    int64_t bit_tat;                /* global bit bucket */
+    struct rate_budget_stats stats; /* totals for all tests */
+    struct rate_client clients[MAX_RATE_BUDGET_CLIENTS];
+};
+
+/* the budget shared with all the test processes, if there is one */
+static struct rate_budget *budget = NULL;
+
+/* the slot this process is sending as, if any */
+static struct rate_client *client = NULL;
+
+/* number of tests sharing the budget, as of the last count */
+static int64_t active_counted = 0;
+static int active_clients = 1;
+
+
+
+/*
+ * Reserve the cost of some packets from a bucket, returning the time that
+ * they are allowed to be sent. The bucket is tracked as the time that it
+ * would next be empty - this can be up to the burst length in the future
+ * before anything has to wait.
+ */
+static int64_t reserve_bucket(int64_t *tat, int64_t now, int64_t cost,
+        int64_t burst) {
+    int64_t old, start, next;
+
+    old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+
+    do {
+        start = (old - burst > now) ? old - burst : now;
+        next = ((old > now) ? old : now) + cost;
+    } while ( !__atomic_compare_exchange_n(tat, &old, next, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+
+    return start;
+}
+
+
+
+/*
+ * Count the tests that have sent something recently, which the budget is
+ * shared equally between. This process is always counted.
+ */
+static int count_active_clients(int64_t now) {
+    int count = 1;
+    int i;
+
+    for ( i = 0; i < MAX_RATE_BUDGET_CLIENTS; i++ ) {
+        struct rate_client *other = &budget->clients[i];
+
+        if ( other == client ||
+                !__atomic_load_n(&other->used, __ATOMIC_ACQUIRE) ) {
+            continue;
+        }
+
+        if ( now - __atomic_load_n(&other->last_active, __ATOMIC_RELAXED) <
+                RATE_BUDGET_ACTIVE_TIMEOUT ) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Add a reservation to the statistics, both for this test and the total.
+ */
+static void record_send(struct rate_budget_stats *stats, int packets,
+        int bytes, int64_t throttled) {
+    uint64_t max;
+
+    __atomic_add_fetch(&stats->packets, packets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->sends, 1, __ATOMIC_RELAXED);
+
+    if ( throttled <= 0 ) {
+        return;
+    }
+
+    __atomic_add_fetch(&stats->throttled, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->throttled_ns, throttled, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&stats->max_throttled_ns, __ATOMIC_RELAXED);
+    while ( (uint64_t)throttled > max &&
+            !__atomic_compare_exchange_n(&stats->max_throttled_ns, &max,
+                throttled, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+        /* nothing */
+    }
+}
+
+
+
+/*
+ * Give up the slot held by this process as it exits. Test processes may
+ * have children of their own that inherit this handler, so only the process
+ * that attached releases the slot.
+ */
+static void release_client(void) {
+    if ( budget == NULL || client == NULL ||
+            __atomic_load_n(&client->pid, __ATOMIC_RELAXED) != getpid() ) {
+        return;
+    }
+
+    if ( client->stats.throttled > 0 ) {
+        Log(LOG_DEBUG, "%s test was throttled %" PRIu64 " times for %.3fms "
+                "total, sending %" PRIu64 " packets", client->name,
+                client->stats.throttled, client->stats.throttled_ns / 1000000.0,
+                client->stats.packets);
+    }
+
+    __atomic_store_n(&client->pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->used, 0, __ATOMIC_RELEASE);
+    client = NULL;
+}
+
+
+
+/*
+ * Create the budget shared with test processes. This must be done before
+ * the worker pool is started, so that the workers share it too.
+ */
+int start_rate_budget(rate_budget_config_t *config) {
+    stop_rate_budget();
+
+    /* don't bother with the budget at all if nothing is limited */
+    if ( config == NULL || (config->pps == 0 && config->bps == 0) ) {
+        return 0;
+    }
+
+    budget = mmap(NULL, sizeof(struct rate_budget), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if ( budget == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to create packet rate budget: %s",
+                strerror(errno));
+        budget = NULL;
+        return -1;
+    }
+
+    budget->pps = config->pps;
+    budget->bps = config->bps;
+    budget->burst = (config->burst > 0 ? config->burst : 0) * NS_PER_MS;
+
+    Log(LOG_DEBUG, "Limiting test traffic to %" PRIu64 "pps, %" PRIu64
+            "bps with %dms bursts", budget->pps, budget->bps,
+            config->burst);
+
+    return 0;
+}
+
+
+
+/*
+ * Remove the limits on test traffic.
+ */
+void stop_rate_budget(void) {
+    if ( budget != NULL ) {
+        munmap(budget, sizeof(struct rate_budget));
+        budget = NULL;
+    }
+
+    client = NULL;
+}
+
+
+
+/*
+ * Called by the test process as the test starts, to claim a slot that the
+ * fair share of the budget is tracked in. The slot is released when the
+ * process exits. Returns 0 if the test can share the budget (or there is no
+ * budget), or -1 if there are no free slots and only the global limit will
+ * apply.
+ */
+int rate_budget_attach(char *name) {
+    int32_t used, pid;
+    int i;
+
+    if ( budget == NULL || client != NULL ) {
+        return 0;
+    }
+
+    for ( i = 0; i < MAX_RATE_BUDGET_CLIENTS; i++ ) {
+        struct rate_client *slot = &budget->clients[i];
+
+        used = __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+        pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+
+        if ( used ) {
+            /*
+             * Reuse slots belonging to tests that died without releasing
+             * them. The pid is only zero while a slot is being claimed.
+             */
+            if ( pid == 0 || kill(pid, 0) == 0 || errno != ESRCH ||
+                    !__atomic_compare_exchange_n(&slot->pid, &pid, getpid(),
+                        0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+                continue;
+            }
+        } else if ( !__atomic_compare_exchange_n(&slot->used, &used, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+            continue;
+        }
+
+        memset(&slot->stats, 0, sizeof(slot->stats));
+        slot->packet_tat = 0;
+        slot->bit_tat = 0;
+        slot->last_active = 0;
+        snprintf(slot->name, sizeof(slot->name), "%s", name);
+        __atomic_store_n(&slot->pid, getpid(), __ATOMIC_RELAXED);
+        client = slot;
+
+        if ( atexit(release_client) != 0 ) {
+            Log(LOG_WARNING, "Failed to register rate budget release");
+        }
+
+        return 0;
+    }
+
+    Log(LOG_WARNING, "No free rate budget slots, %s test only has the "
+            "global limit", name);
+    return -1;
+}
+
+
+
+/*
+ * Reserve the budget to send some packets, returning the monotonic time (ns)
+ * after which they may be sent. Returns 0 if there is no budget and they can
+ * always be sent immediately.
+ */
+int64_t rate_budget_reserve(int packets, int bytes) {
+    int64_t now, send_at, start, cost;
+
+    if ( budget == NULL || packets <= 0 ) {
+        return 0;
+    }
+
+    send_at = now = monotonic_ns();
+
+    if ( client ) {
+        __atomic_store_n(&client->last_active, now, __ATOMIC_RELAXED);
+        if ( now - active_counted > RATE_BUDGET_RECOUNT ) {
+            active_clients = count_active_clients(now);
+            active_counted = now;
+        }
+    }
+
+    if ( budget->pps > 0 ) {
+        cost = packets * NS_PER_SEC / budget->pps;
+        start = reserve_bucket(&budget->packet_tat, now, cost, budget->burst);
+        send_at = (start > send_at) ? start : send_at;
+
+        if ( client ) {
+            start = reserve_bucket(&client->packet_tat, now,
+                    cost * active_clients, budget->burst);
+            send_at = (start > send_at) ? start : send_at;
+        }
+    }
+
+    if ( budget->bps > 0 ) {
+        cost = (int64_t)bytes * 8 * NS_PER_SEC / budget->bps;
+        start = reserve_bucket(&budget->bit_tat, now, cost, budget->burst);
+        send_at = (start > send_at) ? start : send_at;
+
+        if ( client ) {
+            start = reserve_bucket(&client->bit_tat, now,
+                    cost * active_clients, budget->burst);
+            send_at = (start > send_at) ? start : send_at;
+        }
+    }
+
+    record_send(&budget->stats, packets, bytes, send_at - now);
+    if ( client ) {
+        record_send(&client->stats, packets, bytes, send_at - now);
+    }
+
+    return send_at;
+}
+
+
+
+/*
+ * Reserve the budget to send some packets, and sleep until they may be sent.
+ * For tests that send their own packets without any other work to do while
+ * they are waiting.
+ */
+void rate_budget_wait(int packets, int bytes) {
+    struct timespec until;
+    int64_t send_at;
+
+    if ( (send_at = rate_budget_reserve(packets, bytes)) <= monotonic_ns() ) {
+        return;
+    }
+
+    until.tv_sec = send_at / NS_PER_SEC;
+    until.tv_nsec = send_at % NS_PER_SEC;
+
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                NULL) == EINTR ) {
+        /* nothing */
+    }
+}
+
+
+
+/*
+ * Get the totals across every test that has used the budget.
+ */
+void rate_budget_get_stats(struct rate_budget_stats *stats) {
+    if ( budget == NULL ) {
+        memset(stats, 0, sizeof(struct rate_budget_stats));
+        return;
+    }
+
+    memcpy(stats, &budget->stats, sizeof(struct rate_budget_stats));
+}
+
+
+
+/*
+ * Write the budget statistics, and those of every running test, to the
+ * debug dump.
+ */
+void dump_rate_budget_stats(FILE *out) {
+    struct rate_budget_stats *stats;
+    int i;
+
+    if ( budget == NULL ) {
+        fprintf(out, "Rate budget: unlimited\n");
+        return;
+    }
+
+    stats = &budget->stats;
+    fprintf(out, "Rate budget: %" PRIu64 "pps %" PRIu64 "bps, %" PRIu64
+            " packets %" PRIu64 " bytes, %" PRIu64 "/%" PRIu64
+            " sends throttled for %.3fms total, %.3fms max\n",
+            budget->pps, budget->bps, stats->packets, stats->bytes,
+            stats->throttled, stats->sends, stats->throttled_ns / 1000000.0,
+            stats->max_throttled_ns / 1000000.0);
+
+    for ( i = 0; i < MAX_RATE_BUDGET_CLIENTS; i++ ) {
+        struct rate_client *slot = &budget->clients[i];
+
+        if ( !__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE) ) {
+            continue;
+        }
+
+        stats = &slot->stats;
+        fprintf(out, "  %s (pid %d): %" PRIu64 " packets, %" PRIu64
+                "/%" PRIu64 " sends throttled for %.3fms\n", slot->name,
+                slot->pid, stats->packets, stats->throttled, stats->sends,
+                stats->throttled_ns / 1000000.0);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_RATEBUDGET_H
+#define _COMMON_RATEBUDGET_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* maximum number of test processes that can share the budget at once */
+#define MAX_RATE_BUDGET_CLIENTS 1024
+
+/* default amount of traffic that can be sent in a burst (ms) */
+#define DEFAULT_RATE_BUDGET_BURST 10
+
+/* a test stops counting towards the fair share if idle this long (ns) */
+#define RATE_BUDGET_ACTIVE_TIMEOUT (1000 * INT64_C(1000000))
+
+/* how often a test recounts the tests sharing the budget (ns) */
+#define RATE_BUDGET_RECOUNT (10 * INT64_C(1000000))
+
+/* longest test name recorded against a client, for debugging */
+#define RATE_BUDGET_NAME_LEN 32
+
+/*
+ * Limits on the total rate of test traffic from all tests, from the client
+ * config file. A zero rate is unlimited.
+ */
+typedef struct rate_budget_config {
+    uint64_t pps;                   /* packets per second */
+    uint64_t bps;                   /* bits per second */
+    int burst;                      /* traffic that can be sent at once (ms) */
+} rate_budget_config_t;
+
+/*
+ * Time spent waiting on the budget, either for a single test process or
+ * totalled across all of them.
+ */
+struct rate_budget_stats {
+    uint64_t packets;               /* packets sent through the budget */
+    uint64_t bytes;                 /* bytes sent through the budget */
+    uint64_t sends;                 /* number of reservations made */
+    uint64_t throttled;             /* reservations that had to wait */
+    uint64_t throttled_ns;          /* total time spent waiting */
+    uint64_t max_throttled_ns;      /* longest single wait */
+};
+
+int start_rate_budget(rate_budget_config_t *config);
+void stop_rate_budget(void);
+int rate_budget_attach(char *name);
+int64_t rate_budget_reserve(int packets, int bytes);
+void rate_budget_wait(int packets, int bytes);
+void rate_budget_get_stats(struct rate_budget_stats *stats);
+void dump_rate_budget_stats(FILE *out);
+#endif
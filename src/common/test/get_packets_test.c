@@ -0,0 +1,132 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_PACKETS 1000
+#define BATCH_SIZE 16
+#define MAX_PACKET_LEN 512
+
+/*
+ * Check that get_packets() drains multiple waiting packets in a single call,
+ * never reads more than the batch size, receives them in the order they were
+ * sent with the correct length and data, and times out when nothing is
+ * waiting. Tests both the ipv4 and ipv6 code paths.
+ */
+int main(void) {
+    int sockets[2];
+    struct socket_t amp_sockets;
+    struct recv_batch_t *batch;
+    char out_packet[MAX_PACKET_LEN];
+    int maxwait, length, count, sent, received, i;
+    int out;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * The code under test doesn't actually care about the address family
+     * and will assume that "socket" is ipv4 and "socket6" is ipv6.
+     */
+    amp_sockets.socket = sockets[0];
+    amp_sockets.socket6 = sockets[1];
+
+    batch = new_recv_batch(BATCH_SIZE, MAX_PACKET_LEN);
+    assert(batch);
+    assert(batch->size == BATCH_SIZE);
+
+    /* nothing has been written yet, so it should timeout */
+    maxwait = 1;
+    assert(get_packets(&amp_sockets, batch, &maxwait) == 0);
+    assert(batch->count == 0);
+
+    for ( sent = 0, received = 0; sent < TEST_PACKETS; ) {
+        /* write a varying number of packets, sometimes more than the batch */
+        count = (sent % (BATCH_SIZE * 2)) + 1;
+        out = (sent / 10) % 2 ? amp_sockets.socket : amp_sockets.socket6;
+
+        for ( i = 0; i < count && sent < TEST_PACKETS; i++, sent++ ) {
+            length = (sent % (MAX_PACKET_LEN - 1)) + 1;
+            memset(out_packet, sent % 255, length);
+            assert(send(out, out_packet, length, 0) == length);
+        }
+
+        /* read them all back, checking they arrive in the same order */
+        while ( received < sent ) {
+            maxwait = 1;
+            count = get_packets(&amp_sockets, batch, &maxwait);
+
+            assert(count > 0);
+            assert(count <= BATCH_SIZE);
+            assert(count == batch->count);
+
+            for ( i = 0; i < count; i++, received++ ) {
+                length = (received % (MAX_PACKET_LEN - 1)) + 1;
+                memset(out_packet, received % 255, length);
+                assert(batch->packets[i].bytes == length);
+                assert(memcmp(batch->packets[i].data, out_packet,
+                            length) == 0);
+                assert(batch->packets[i].time.tv_sec != 0);
+            }
+        }
+
+        assert(received == sent);
+    }
+
+    free_recv_batch(batch);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Compare the arena allocated iptrie against the original implementation
+ * that allocated every node (and every address) separately. This isn't run
+ * as part of the tests, run it by hand to see the difference:
+ *
+ *   ./iptrie.bench [prefixes] [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iptrie.h"
+#include "testlib.h"
+
+#define DEFAULT_PREFIXES 200000
+#define DEFAULT_LOOKUPS 2000000
+
+/* the original trie node, with separately allocated node and address */
+#define baseline_node_t struct baseline_node
+struct baseline_node {
+    int64_t as;
+    uint8_t prefix;
+    struct sockaddr *address;
+
+    baseline_node_t *left;
+    baseline_node_t *right;
+    baseline_node_t *next;
+};
+
+
+
+/*
+ * The original implementation of the trie, as it was before nodes were
+ * allocated from an arena.
+ */
+static int baseline_get_bit(struct sockaddr *address, int index) {
+    int offset;
+
+    if ( address == NULL || index < 0 ) {
+        return -1;
+    }
+
+    if ( address->sa_family == AF_INET ) {
+        if ( index > 31 ) {
+            return -1;
+        }
+
+        /* line up the one set bit with the index we want */
+        offset = ntohl(0x80000000 >> index);
+        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
+
+    } else if ( address->sa_family == AF_INET6 ) {
+        int field;
+        if ( index > 127 ) {
+            return -1;
+        }
+
+        /* determine which 32bit block of the IPv6 address we need to check */
+        field = index / 16;
+
+        /* line up the one set bit with the index we want within the block */
+        offset = ntohs(0x8000 >> (index % 16));
+        return (((struct sockaddr_in6*)
+                address)->sin6_addr.s6_addr16[field] & offset)?1:0;
+
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Count the number of initial bits that match in a pair of addresses. Accepts
+ * either IPv4 or IPv6 addresses, in network byte order.
+ */
+static int baseline_matching_length(struct sockaddr *a,
+        struct sockaddr *b) {
+    int count = 0;
+
+    if ( a == NULL || b == NULL ) {
+        return -1;
+    }
+
+    if ( a->sa_family != b->sa_family ) {
+        return -1;
+    }
+
+    if ( a->sa_family == AF_INET ) {
+        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
+        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
+        int mask = 0x80000000;
+        int maxlen = 32;
+
+        /* count bits that are the same, from the left, stop when different */
+        while ( count < maxlen &&
+                (a4->sin_addr.s_addr & ntohl(mask)) ==
+                (b4->sin_addr.s_addr & ntohl(mask)) ) {
+            count++;
+            mask = (mask >> 1) | 0x80000000;
+        }
+
+    } else if ( a->sa_family == AF_INET6 ) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
+        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
+        int mask = 0x8000;
+        int maxlen = 128;
+        int i;
+
+        for ( i = 0; i < 8; i++ ) {
+            if ( a6->sin6_addr.s6_addr16[i] == b6->sin6_addr.s6_addr16[i] ) {
+                /* skip a whole block if it's the same, don't need to count */
+                count += 16;
+            } else {
+                /* count bits that are the same, from the left */
+                while ( count < maxlen &&
+                        (a6->sin6_addr.s6_addr16[i] & ntohs(mask)) ==
+                        (b6->sin6_addr.s6_addr16[i] & ntohs(mask)) ) {
+                    count++;
+                    mask = (mask >> 1) | 0x8000;
+                }
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Add or update an address with ASN in the trie. If the address does not
+ * exist then it will be added at the appropriate location, if it does exist
+ * then it will be updated.
+ */
+static baseline_node_t *baseline_add(baseline_node_t *root,
+        struct sockaddr *address, uint8_t prefix, int64_t as) {
+
+    int cmp, len;
+
+    /* missing address, return the trie unchanged */
+    if ( address == NULL ) {
+        return root;
+    }
+
+    /* empty trie, add this address at the root */
+    if ( root == NULL ) {
+        baseline_node_t *node = malloc(sizeof(baseline_node_t));
+        node->as = as;
+        node->prefix = prefix;
+        if ( address->sa_family == AF_INET ) {
+            node->address = malloc(sizeof(struct sockaddr_in));
+            memcpy(node->address, address, sizeof(struct sockaddr_in));
+        } else {
+            node->address = malloc(sizeof(struct sockaddr_in6));
+            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+        }
+        node->left = NULL;
+        node->right = NULL;
+        node->next = NULL;
+        return node;
+    }
+
+    /* there is a prefix set and this address matches, update the ASN */
+    if ( prefix == root->prefix &&
+            compare_addresses(root->address, address, prefix) == 0 ) {
+        root->as = as;
+        return root;
+    }
+
+
+    /*
+     * Prefix and address don't match, see how similar this node actually is.
+     * If it matches more than the node prefix, limit it... we have more
+     * nodes that we have to check below for a better match first.
+     */
+    if ( (len = baseline_matching_length(root->address, address)) >
+            root->prefix ) {
+        len = root->prefix;
+    }
+
+    /* get the first bit that didn't match */
+    cmp = baseline_get_bit(address, len);
+
+    /*
+     * If the matching prefix length is shorter than the prefix length already
+     * at this node, then we need to insert a new branching node at this
+     * location. The address we are trying to add and the node currently here
+     * will become children of this new branching node.
+     */
+    if ( len < root->prefix ) {
+        baseline_node_t *node = malloc(sizeof(baseline_node_t));
+        node->as = 0;
+        node->prefix = len;
+        if ( address->sa_family == AF_INET ) {
+            node->address = malloc(sizeof(struct sockaddr_in));
+            memcpy(node->address, address, sizeof(struct sockaddr_in));
+        } else {
+            node->address = malloc(sizeof(struct sockaddr_in6));
+            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+        }
+        node->left = NULL;
+        node->right = NULL;
+        node->next = NULL;
+
+        if ( cmp == 0 ) {
+            /* the next bit is a zero, add it down the left branch */
+            node->left = baseline_add(node->left, address, prefix, as);
+            /* and put the existing node on the right branch */
+            node->right = root;
+        } else {
+            /* the next bit is a one, add it down the right branch */
+            node->right = baseline_add(node->right, address, prefix, as);
+            /* and put the existing node on the left branch */
+            node->left = root;
+        }
+
+        return node;
+    }
+
+    /*
+     * otherwise, we match the address here so far but it isn't the end,
+     * keep looking down the appropriate branch for where we should insert.
+     */
+    if ( cmp == 0 ) {
+        /* the next bit is a zero, go down the left branch */
+        root->left = baseline_add(root->left, address, prefix, as);
+    } else {
+        /* the next bit is a one, go down the right branch */
+        root->right = baseline_add(root->right, address, prefix, as);
+    }
+
+    return root;
+}
+
+
+
+/*
+ * Recursive lookup, comparing the address against the prefix at each node.
+ */
+static int64_t baseline_lookup(baseline_node_t *root,
+        struct sockaddr *address) {
+    int next;
+
+    /* empty trie or missing address, can't return a useful AS number */
+    if ( root == NULL || address == NULL ) {
+        return -1;
+    }
+
+    /* if the address doesn't match at this prefix, it isn't present */
+    if ( compare_addresses(root->address, address, root->prefix) != 0 ) {
+        return -1;
+    }
+
+    /* if this is a leaf node, then it matches what we were looking for */
+    if ( root->left == NULL && root->right == NULL ) {
+        return root->as;
+    }
+
+    /* compare the next bit in the address to see which branch we should take */
+    next = baseline_get_bit(address, root->prefix);
+
+    /* non-leaf node, continue down the trie and try the next branch */
+    if ( next == 0 && root->left ) {
+        return baseline_lookup(root->left, address);
+    } else if ( next == 1 && root->right ) {
+        return baseline_lookup(root->right, address);
+    }
+
+    /* no branch where expected, the ASN isn't here */
+    return -1;
+}
+
+
+
+/*
+ * We keep separate tries for ipv4 and ipv6, so figure out which one we should
+ * use based on the address we've been given to look up.
+ */
+
+
+
+static void baseline_clear(baseline_node_t *root) {
+    if ( root == NULL ) {
+        return;
+    }
+
+    baseline_clear(root->left);
+    baseline_clear(root->right);
+
+    free(root->address);
+    free(root);
+}
+
+
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+        ((now.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+
+
+/*
+ * Make a random IPv4 or IPv6 prefix, similar to those returned by whois.
+ */
+static void random_prefix(struct sockaddr_storage *addr, uint8_t *prefix) {
+    memset(addr, 0, sizeof(*addr));
+
+    if ( rand() % 4 ) {
+        struct sockaddr_in *in = (struct sockaddr_in*)addr;
+        in->sin_family = AF_INET;
+        *prefix = 16 + (rand() % 9);
+        in->sin_addr.s_addr = htonl((((uint32_t)rand() << 16) ^ rand()) &
+                (0xffffffff << (32 - *prefix)));
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+        int i;
+        in6->sin6_family = AF_INET6;
+        *prefix = 32 + (rand() % 17);
+        for ( i = 0; i < *prefix / 8; i++ ) {
+            in6->sin6_addr.s6_addr[i] = rand() & 0xff;
+        }
+        if ( i == 2 ) {
+            in6->sin6_addr.s6_addr[0] = 0x20;
+        }
+    }
+}
+
+
+
+/*
+ * Turn a prefix into an address within that prefix.
+ */
+static void random_address(struct sockaddr_storage *addr, uint8_t prefix) {
+    if ( addr->ss_family == AF_INET ) {
+        struct sockaddr_in *in = (struct sockaddr_in*)addr;
+        in->sin_addr.s_addr |= htonl(rand() & (0xffffffff >> prefix));
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+        in6->sin6_addr.s6_addr[15] = rand() & 0xff;
+    }
+}
+
+
+
+int main(int argc, char *argv[]) {
+    struct iptrie trie = { NULL, NULL, NULL };
+    baseline_node_t *base4 = NULL, *base6 = NULL;
+    struct sockaddr_storage *addrs;
+    uint8_t *prefixes;
+    struct timespec start;
+    double baseline_time, trie_time;
+    int64_t expected, found;
+    int count, lookups, extra;
+    int i;
+
+    count = argc > 1 ? atoi(argv[1]) : DEFAULT_PREFIXES;
+    lookups = argc > 2 ? atoi(argv[2]) : DEFAULT_LOOKUPS;
+    assert(count > 0 && lookups > 0);
+
+    addrs = calloc(count, sizeof(struct sockaddr_storage));
+    prefixes = calloc(count, sizeof(uint8_t));
+
+    srand(1);
+    for ( i = 0; i < count; i++ ) {
+        random_prefix(&addrs[i], &prefixes[i]);
+    }
+
+    /* insert the same prefixes into both tries */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < count; i++ ) {
+        if ( addrs[i].ss_family == AF_INET ) {
+            base4 = baseline_add(base4, (struct sockaddr*)&addrs[i],
+                    prefixes[i], i);
+        } else {
+            base6 = baseline_add(base6, (struct sockaddr*)&addrs[i],
+                    prefixes[i], i);
+        }
+    }
+    baseline_time = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < count; i++ ) {
+        iptrie_add(&trie, (struct sockaddr*)&addrs[i], prefixes[i], i);
+    }
+    trie_time = elapsed(&start);
+
+    printf("insert %d prefixes: baseline %.3fs, arena %.3fs (%u nodes)\n",
+            count, baseline_time, trie_time, iptrie_count_nodes(&trie));
+
+    /* look up addresses within the prefixes, and make sure both agree */
+    for ( i = 0; i < count; i++ ) {
+        random_address(&addrs[i], prefixes[i]);
+    }
+
+    /*
+     * The baseline doesn't do longest prefix matching, and gives up on
+     * addresses covered by a short prefix that was added after longer ones,
+     * so it can miss some that the new trie finds. Anything it does find
+     * should also be found by the new trie.
+     */
+    for ( i = 0, extra = 0; i < count; i++ ) {
+        expected = baseline_lookup(addrs[i].ss_family == AF_INET ? base4:base6,
+                (struct sockaddr*)&addrs[i]);
+        found = iptrie_lookup_as(&trie, (struct sockaddr*)&addrs[i]);
+        assert(found != -1 || expected == -1);
+        if ( found != expected ) {
+            extra++;
+        }
+    }
+
+    printf("lookups answered differently by arena and baseline: %d\n", extra);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < lookups; i++ ) {
+        struct sockaddr_storage *addr = &addrs[i % count];
+        baseline_lookup(addr->ss_family == AF_INET ? base4 : base6,
+                (struct sockaddr*)addr);
+    }
+    baseline_time = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < lookups; i++ ) {
+        iptrie_lookup_as(&trie, (struct sockaddr*)&addrs[i % count]);
+    }
+    trie_time = elapsed(&start);
+
+    printf("%d lookups: baseline %.1fns, arena %.1fns per lookup\n", lookups,
+            baseline_time * 1000000000 / lookups,
+            trie_time * 1000000000 / lookups);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    baseline_clear(base4);
+    baseline_clear(base6);
+    baseline_time = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    iptrie_clear(&trie);
+    trie_time = elapsed(&start);
+
+    printf("clear: baseline %.3fs, arena %.3fs\n", baseline_time, trie_time);
+
+    free(addrs);
+    free(prefixes);
+
+    return 0;
+}
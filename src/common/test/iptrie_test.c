@@ -0,0 +1,274 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iptrie.h"
+
+#define RANDOM_PREFIXES 5000
+
+
+
+/*
+ * Build an address structure from a string.
+ */
+static struct sockaddr *make_address(struct sockaddr_storage *storage,
+        char *str) {
+    memset(storage, 0, sizeof(*storage));
+
+    if ( inet_pton(AF_INET, str,
+                &((struct sockaddr_in*)storage)->sin_addr) == 1 ) {
+        storage->ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, str,
+                    &((struct sockaddr_in6*)storage)->sin6_addr) == 1);
+        storage->ss_family = AF_INET6;
+    }
+
+    return (struct sockaddr*)storage;
+}
+
+
+
+static void add(struct iptrie *trie, char *str, uint8_t prefix, int64_t as) {
+    struct sockaddr_storage storage;
+    iptrie_add(trie, make_address(&storage, str), prefix, as);
+}
+
+
+
+static int64_t lookup(struct iptrie *trie, char *str) {
+    struct sockaddr_storage storage;
+    return iptrie_lookup_as(trie, make_address(&storage, str));
+}
+
+
+
+static int count_leaves(iptrie_node_t *node, void *data) {
+    assert(node->address == (struct sockaddr*)&node->storage);
+    (*(int*)data)++;
+    return 0;
+}
+
+
+
+/*
+ * Add a lot of unrelated /24 prefixes, enough to need several blocks of
+ * nodes, and make sure they can all be found again.
+ */
+static void check_random_prefixes(struct iptrie *trie) {
+    struct sockaddr_in addr;
+    uint32_t prefixes[RANDOM_PREFIXES];
+    int i, leaves = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    srand(1);
+
+    for ( i = 0; i < RANDOM_PREFIXES; i++ ) {
+        prefixes[i] = (((uint32_t)rand() << 8) ^ (uint32_t)rand()) & 0xffffff00;
+        addr.sin_addr.s_addr = htonl(prefixes[i]);
+        iptrie_add(trie, (struct sockaddr*)&addr, 24, prefixes[i] >> 8);
+    }
+
+    assert(iptrie_count_nodes(trie) > IPTRIE_ARENA_NODES);
+
+    for ( i = 0; i < RANDOM_PREFIXES; i++ ) {
+        addr.sin_addr.s_addr = htonl(prefixes[i] | (i & 0xff));
+        assert(iptrie_lookup_as(trie, (struct sockaddr*)&addr) ==
+                prefixes[i] >> 8);
+    }
+
+    iptrie_on_all_leaves(trie, count_leaves, &leaves);
+    assert(leaves <= RANDOM_PREFIXES);
+    assert(leaves > RANDOM_PREFIXES * 0.99);
+}
+
+
+
+/*
+ * Make sure every prefix that was added is visited exactly once, including
+ * those covering other prefixes, and that covering prefixes come first.
+ */
+static int check_visited(iptrie_node_t *node, void *data) {
+    int64_t *visited = (int64_t*)data;
+
+    assert(node->valid);
+    assert(node->as > 0 && node->as < 64);
+    assert(!(visited[0] & (INT64_C(1) << node->as)));
+
+    /* ASNs in the nested test are numbered from least specific */
+    if ( node->as == 2 || node->as == 4 ) {
+        assert(visited[0] & (INT64_C(1) << 1));
+    }
+    if ( node->as == 3 ) {
+        assert(visited[0] & (INT64_C(1) << 2));
+    }
+
+    visited[0] |= INT64_C(1) << node->as;
+    visited[1]++;
+
+    return 0;
+}
+
+
+
+/*
+ * Prefixes that overlap should find the longest matching prefix, whatever
+ * order they were added in.
+ */
+static void check_nested_prefixes(struct iptrie *trie) {
+    int64_t visited[2] = { 0, 0 };
+    iplist_t *list;
+    int count;
+
+    /* a covering prefix added after a more specific one is still visited */
+    add(trie, "10.1.0.0", 16, 2);
+    add(trie, "10.0.0.0", 8, 1);
+    iptrie_on_all_leaves(trie, check_visited, visited);
+    assert(visited[1] == 2);
+    iptrie_clear(trie);
+    memset(visited, 0, sizeof(visited));
+
+    add(trie, "10.1.2.0", 24, 3);
+    add(trie, "10.0.0.0", 8, 1);
+    add(trie, "10.1.0.0", 16, 2);
+    add(trie, "10.128.0.0", 9, 4);
+    add(trie, "0.0.0.0", 0, 5);
+    add(trie, "2001:db8:1::", 48, 7);
+    add(trie, "2001:db8::", 32, 6);
+
+    assert(lookup(trie, "10.1.2.3") == 3);
+    assert(lookup(trie, "10.1.3.1") == 2);
+    assert(lookup(trie, "10.2.0.1") == 1);
+    assert(lookup(trie, "10.200.0.1") == 4);
+    assert(lookup(trie, "11.0.0.1") == 5);
+    assert(lookup(trie, "2001:db8:1::1") == 7);
+    assert(lookup(trie, "2001:db8:2::1") == 6);
+    assert(lookup(trie, "2001:db9::1") == -1);
+
+    /* branch points created along the way don't have values of their own */
+    add(trie, "10.1.2.128", 25, 8);
+    add(trie, "10.1.2.0", 25, 9);
+    assert(lookup(trie, "10.1.2.129") == 8);
+    assert(lookup(trie, "10.1.2.1") == 9);
+    assert(lookup(trie, "10.1.4.1") == 2);
+
+    /* every prefix is visited once, but none of the branch points */
+    iptrie_on_all_leaves(trie, check_visited, visited);
+    assert(visited[1] == 9);
+
+    for ( count = 0, list = iptrie_to_list(trie); list != NULL;
+            list = list->next ) {
+        count++;
+    }
+    assert(count == 9);
+}
+
+
+
+/*
+ * Check that prefixes can be added, updated and found, and that clearing
+ * the trie frees all the nodes.
+ */
+int main(void) {
+    struct iptrie trie = { NULL, NULL, NULL };
+    iplist_t *list;
+    int leaves = 0;
+
+    assert(iptrie_is_empty(&trie));
+    assert(lookup(&trie, "10.0.0.1") == -1);
+
+    add(&trie, "10.0.0.0", 8, 1);
+    add(&trie, "192.168.0.0", 16, 2);
+    add(&trie, "192.169.1.0", 24, 3);
+    add(&trie, "2001:db8::", 32, 4);
+    add(&trie, "2001:db9:1::", 48, 5);
+    add(&trie, "2001:db9:2::", 48, 6);
+
+    assert(!iptrie_is_empty(&trie));
+
+    assert(lookup(&trie, "10.0.0.1") == 1);
+    assert(lookup(&trie, "10.255.255.255") == 1);
+    assert(lookup(&trie, "192.168.3.4") == 2);
+    assert(lookup(&trie, "192.169.1.255") == 3);
+    assert(lookup(&trie, "192.169.2.1") == -1);
+    assert(lookup(&trie, "11.0.0.1") == -1);
+    assert(lookup(&trie, "2001:db8:ffff::1") == 4);
+    assert(lookup(&trie, "2001:db9:1::1") == 5);
+    assert(lookup(&trie, "2001:db9:2:3::4") == 6);
+    assert(lookup(&trie, "2001:db9:3::1") == -1);
+    assert(lookup(&trie, "::1") == -1);
+
+    /* adding an existing prefix again updates the ASN */
+    add(&trie, "192.168.0.0", 16, 7);
+    assert(lookup(&trie, "192.168.0.1") == 7);
+
+    /* only the prefixes that were added are visited */
+    iptrie_on_all_leaves(&trie, count_leaves, &leaves);
+    assert(leaves == 6);
+
+    for ( leaves = 0, list = iptrie_to_list(&trie); list != NULL;
+            list = list->next ) {
+        leaves++;
+    }
+    assert(leaves == 6);
+
+    iptrie_clear(&trie);
+    assert(iptrie_is_empty(&trie));
+    assert(iptrie_count_nodes(&trie) == 0);
+    assert(lookup(&trie, "10.0.0.1") == -1);
+
+    check_nested_prefixes(&trie);
+    iptrie_clear(&trie);
+
+    /* the trie can be used again after being cleared */
+    check_random_prefixes(&trie);
+    iptrie_clear(&trie);
+    assert(trie.arena == NULL);
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <event2/event.h>
+
+#include "testlib.h"
+#include "probe.h"
+#include "waitset.h"
+
+#define TEST_PROBES 500
+#define BATCH_SIZE 4
+#define MAX_PACKET_LEN 64
+#define INTER_PACKET_DELAY 200
+#define KEY_OFFSET 100000
+
+/* probes that are never sent, and probes that never get a response */
+#define SKIPPED(i) ((i) % 13 == 5)
+#define DROPPED(i) ((i) % 10 == 3)
+
+struct probe_test {
+    struct addrinfo dest;
+    struct timespec sent[TEST_PROBES];
+    int responses[TEST_PROBES];
+    int responder;
+};
+
+
+
+static int build(void *data, struct probe_t *probe, char *packet, int size) {
+    struct probe_test *test = (struct probe_test*)data;
+
+    assert(size == MAX_PACKET_LEN);
+
+    if ( SKIPPED(probe->index) ) {
+        return -1;
+    }
+
+    /* keys don't need to be related to the index */
+    probe->key = (probe->index * 7919) + KEY_OFFSET;
+    probe->dest = &test->dest;
+    probe->sent = &test->sent[probe->index];
+    memcpy(packet, &probe->key, sizeof(probe->key));
+
+    return sizeof(probe->key);
+}
+
+
+
+static int match(__attribute__((unused))void *data,
+        struct recv_packet_t *packet, uint32_t *key) {
+
+    if ( packet->bytes != sizeof(uint32_t) ) {
+        return -1;
+    }
+
+    memcpy(key, packet->data, sizeof(uint32_t));
+
+    return 0;
+}
+
+
+
+static int report(void *data, struct probe_t *probe,
+        struct recv_packet_t *packet) {
+    struct probe_test *test = (struct probe_test*)data;
+
+    assert(probe->state == PROBE_WAITING);
+    assert(memcmp(packet->data, &probe->key, sizeof(probe->key)) == 0);
+    test->responses[probe->index]++;
+
+    return 1;
+}
+
+
+
+/*
+ * Echo each probe back to the engine (twice, to make sure the duplicate is
+ * ignored), except for those that should be lost.
+ */
+static void respond(evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+    uint32_t key;
+
+    while ( recv(evsock, &key, sizeof(key), MSG_DONTWAIT) == sizeof(key) ) {
+        if ( DROPPED((key - KEY_OFFSET) / 7919) ) {
+            continue;
+        }
+        assert(send(evsock, &key, sizeof(key), 0) == sizeof(key));
+        assert(send(evsock, &key, sizeof(key), 0) == sizeof(key));
+    }
+}
+
+
+
+/*
+ * Check that the probe engine sends every probe that isn't skipped, paced
+ * at the inter packet delay, matches each response to the right probe
+ * exactly once, and gives up on lost probes after the loss timeout.
+ */
+int main(void) {
+    int sockets[2];
+    struct socket_t amp_sockets;
+    struct probe_test test;
+    struct probe_opt_t options;
+    struct probe_ops_t ops = { build, match, report };
+    struct probe_engine_t *engine;
+    struct event_base *base;
+    struct event *responder;
+    struct probe_t *probe;
+    int64_t start, duration;
+    int i, sent = 0, lost = 0;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the engine picks a socket based on family, so treat it as ipv4 */
+    amp_sockets.socket = sockets[0];
+    amp_sockets.socket6 = -1;
+
+    /* we don't need a real address for testing, our socket pair is connected */
+    memset(&test, 0, sizeof(test));
+    test.dest.ai_family = AF_INET;
+    test.dest.ai_addr = NULL;
+    test.dest.ai_addrlen = 0;
+
+    options.count = TEST_PROBES;
+    options.batch = BATCH_SIZE;
+    options.packet_size = MAX_PACKET_LEN;
+    options.response_size = MAX_PACKET_LEN;
+    options.inter_packet_delay = INTER_PACKET_DELAY;
+    options.loss_timeout = 1;
+
+    base = event_base_new();
+    responder = event_new(base, sockets[1], EV_READ|EV_PERSIST, respond, NULL);
+    event_add(responder, NULL);
+
+    engine = new_probe_engine(base, &amp_sockets, &options, &ops, &test);
+
+    start = monotonic_ns();
+    start_probe_engine(engine);
+    event_base_dispatch(base);
+    duration = (monotonic_ns() - start) / 1000;
+
+    for ( i = 0; i < TEST_PROBES; i++ ) {
+        probe = get_probe(engine, i);
+        assert(probe->index == i);
+
+        if ( SKIPPED(i) ) {
+            assert(probe->state == PROBE_SKIPPED);
+            assert(test.responses[i] == 0);
+            continue;
+        }
+
+        sent++;
+        assert(test.sent[i].tv_sec != 0);
+
+        if ( DROPPED(i) ) {
+            /* lost probes are still waiting, and can still be found */
+            assert(probe->state == PROBE_WAITING);
+            assert(find_probe(engine, probe->key) == probe);
+            assert(test.responses[i] == 0);
+            lost++;
+        } else {
+            assert(probe->state == PROBE_DONE);
+            assert(find_probe(engine, probe->key) == NULL);
+            assert(test.responses[i] == 1);
+        }
+    }
+
+    assert(probe_engine_outstanding(engine) == lost);
+
+    /*
+     * check that we took longer than the minimum possible time, allowing a
+     * batch to be sent at once, and waited for the lost probes
+     */
+    assert(duration > ((sent - BATCH_SIZE) * INTER_PACKET_DELAY) + 1000000);
+
+    free_probe_engine(engine);
+    event_free(responder);
+    event_base_free(base);
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
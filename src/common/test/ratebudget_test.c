@@ -0,0 +1,222 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "ratebudget.h"
+#include "waitset.h"
+
+#define NS_PER_MS 1000000
+
+#define CHILDREN 4
+#define CHILD_RUN_MS 500
+
+
+
+static void set_budget(uint64_t pps, uint64_t bps, int burst) {
+    rate_budget_config_t config;
+
+    config.pps = pps;
+    config.bps = bps;
+    config.burst = burst;
+
+    assert(start_rate_budget(&config) == 0);
+}
+
+
+
+/*
+ * Reserve count packets of the given size one after another, which should
+ * be allowed to be sent exactly interval nanoseconds apart.
+ */
+static void check_spacing(int count, int bytes, int64_t interval) {
+    int64_t first, last;
+    int i;
+
+    first = rate_budget_reserve(1, bytes);
+    last = first;
+
+    for ( i = 1; i < count; i++ ) {
+        int64_t next = rate_budget_reserve(1, bytes);
+        assert(next - last == interval);
+        last = next;
+    }
+
+    assert(last - first == interval * (count - 1));
+}
+
+
+
+/*
+ * Send as fast as the budget allows for a while and report how many packets
+ * were sent.
+ */
+static int run_child(int fd) {
+    int64_t end;
+    int count = 0;
+
+    assert(rate_budget_attach("test") == 0);
+
+    end = monotonic_ns() + (CHILD_RUN_MS * NS_PER_MS);
+    while ( monotonic_ns() < end ) {
+        rate_budget_wait(1, 100);
+        count++;
+    }
+
+    assert(write(fd, &count, sizeof(count)) == sizeof(count));
+    close(fd);
+
+    return count;
+}
+
+
+
+/*
+ * Check that the budget limits the total packet and bit rates, allows
+ * bursts, is shared fairly between processes and records how long they
+ * were throttled for.
+ */
+int main(void) {
+    struct rate_budget_stats stats;
+    int fds[2];
+    int counts[CHILDREN];
+    int64_t now;
+    int total, immediate, status, i;
+    char line[1024];
+    FILE *out;
+
+    /* without a budget everything can be sent immediately */
+    assert(rate_budget_reserve(1, 1500) == 0);
+    set_budget(0, 0, 0);
+    assert(rate_budget_reserve(100, 150000) == 0);
+    assert(rate_budget_attach("test") == 0);
+
+    /* 10,000 packets per second means 100us between each packet */
+    set_budget(10000, 0, 0);
+    check_spacing(1000, 1500, 100000);
+
+    /* 8Mbps means 1ms between each 1000 byte packet */
+    set_budget(0, 8000000, 0);
+    check_spacing(100, 1000, 1000000);
+
+    /* the slower of the two limits applies */
+    set_budget(10000, 8000000, 0);
+    check_spacing(100, 1000, 1000000);
+    set_budget(10000, 8000000, 0);
+    check_spacing(100, 10, 100000);
+
+    /* batches are reserved all at once, and take as long as all packets */
+    set_budget(1000, 0, 0);
+    now = rate_budget_reserve(10, 1000);
+    assert(rate_budget_reserve(1, 100) - now == 10 * NS_PER_MS);
+
+    /* 10ms of burst at 1000pps should let about 10 packets go immediately */
+    set_budget(1000, 0, 10);
+    for ( immediate = 0; immediate < 100; immediate++ ) {
+        if ( rate_budget_reserve(1, 100) > monotonic_ns() ) {
+            break;
+        }
+    }
+    assert(immediate >= 10 && immediate <= 12);
+
+    rate_budget_get_stats(&stats);
+    assert(stats.packets == (uint64_t)immediate + 1);
+    assert(stats.sends == (uint64_t)immediate + 1);
+
+    /* processes sending at the same time should each get an equal share */
+    set_budget(1000, 0, 0);
+    assert(pipe(fds) == 0);
+
+    for ( i = 0; i < CHILDREN; i++ ) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if ( pid == 0 ) {
+            close(fds[0]);
+            exit(run_child(fds[1]) > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    close(fds[1]);
+    for ( i = 0, total = 0; i < CHILDREN; i++ ) {
+        assert(read(fds[0], &counts[i], sizeof(int)) == sizeof(int));
+        total += counts[i];
+    }
+    close(fds[0]);
+
+    for ( i = 0; i < CHILDREN; i++ ) {
+        assert(wait(&status) > 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* nobody gets more than the global limit, or much more than their share */
+    assert(total <= CHILD_RUN_MS + 20);
+    assert(total >= CHILD_RUN_MS / 2);
+    for ( i = 0; i < CHILDREN; i++ ) {
+        assert(counts[i] >= CHILD_RUN_MS / CHILDREN / 2);
+        assert(counts[i] <= CHILD_RUN_MS / CHILDREN * 2);
+    }
+
+    /* the time spent waiting is recorded, but not against this process */
+    rate_budget_get_stats(&stats);
+    assert(stats.packets == (uint64_t)total);
+    assert(stats.throttled > 0);
+    assert(stats.throttled_ns > 0);
+    assert(stats.max_throttled_ns >= stats.throttled_ns / stats.throttled);
+
+    /* the children all released their slots as they exited */
+    out = tmpfile();
+    dump_rate_budget_stats(out);
+    rewind(out);
+    for ( i = 0; fgets(line, sizeof(line), out) != NULL; i++ ) {
+        assert(strncmp(line, "Rate budget: ", 13) == 0);
+    }
+    assert(i == 1);
+    fclose(out);
+
+    stop_rate_budget();
+    assert(rate_budget_reserve(1, 1500) == 0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,223 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ampresolv.h"
+
+/* enough names to need many reads from the socket */
+#define MANY_NAMES 500
+
+
+
+/*
+ * Build a single address with the given name, like the resolver does.
+ */
+static struct addrinfo *build_address(char *name, char *address,
+        struct addrinfo *next) {
+    struct addrinfo hints, *result, *item;
+
+    item = calloc(1, sizeof(struct addrinfo));
+    item->ai_canonname = strdup(name);
+    item->ai_next = next;
+
+    if ( address == NULL ) {
+        /* name that didn't resolve */
+        item->ai_family = AF_INET6;
+        return item;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_socktype = SOCK_DGRAM;
+    assert(getaddrinfo(address, NULL, &hints, &result) == 0);
+
+    item->ai_family = result->ai_family;
+    item->ai_socktype = result->ai_socktype;
+    item->ai_protocol = result->ai_protocol;
+    item->ai_addrlen = result->ai_addrlen;
+    item->ai_addr = calloc(1, item->ai_addrlen);
+    memcpy(item->ai_addr, result->ai_addr, item->ai_addrlen);
+    freeaddrinfo(result);
+
+    return item;
+}
+
+
+
+/*
+ * Check that a list of addresses matches the original list, which will be
+ * in the opposite order.
+ */
+static void check_list(struct addrinfo *original, struct addrinfo *result) {
+    struct addrinfo *item;
+    int count = 0, i;
+
+    for ( item = original; item != NULL; item = item->ai_next ) {
+        count++;
+    }
+
+    for ( i = count - 1; i >= 0; i-- ) {
+        int j;
+
+        assert(result);
+
+        for ( item = original, j = 0; j < i; j++ ) {
+            item = item->ai_next;
+        }
+
+        assert(strcmp(result->ai_canonname, item->ai_canonname) == 0);
+        assert(result->ai_family == item->ai_family);
+        assert(result->ai_socktype == item->ai_socktype);
+        assert(result->ai_protocol == item->ai_protocol);
+        assert(result->ai_addrlen == item->ai_addrlen);
+        if ( item->ai_addr ) {
+            assert(result->ai_addr);
+            assert(memcmp(result->ai_addr, item->ai_addr,
+                        item->ai_addrlen) == 0);
+        } else {
+            assert(result->ai_addr == NULL);
+        }
+
+        result = result->ai_next;
+    }
+
+    assert(result == NULL);
+}
+
+
+
+/*
+ * Send the list of addresses across a socket and make sure the same list
+ * is read out the other end.
+ */
+static void check_send_list(struct addrinfo *addrlist) {
+    struct addrinfo *result;
+    int sv[2];
+    pid_t pid;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    /* large batches won't fit in the socket buffer, so send from a child */
+    if ( (pid = fork()) == 0 ) {
+        close(sv[0]);
+        exit(amp_resolve_send_list(sv[1], addrlist) == 0 ? 0 : 1);
+    }
+
+    assert(pid > 0);
+    close(sv[1]);
+
+    /* amp_resolve_get_list() closes the socket */
+    result = amp_resolve_get_list(sv[0]);
+    check_list(addrlist, result);
+    amp_resolve_freeaddr(result);
+}
+
+
+
+/*
+ * Test that lists of resolved addresses survive being packed into a single
+ * batch and sent to the test.
+ */
+int main(void) {
+    struct addrinfo *addrlist = NULL, *result;
+    struct amp_resolve_reply header;
+    char name[MAX_DNS_NAME_LEN];
+    uint8_t *buffer;
+    uint32_t len;
+    int sv[2];
+    int i;
+
+    /* an empty list is an empty batch */
+    buffer = amp_test_resolve_pack_list(NULL, &len);
+    assert(len == sizeof(struct amp_resolve_reply));
+    assert(amp_test_resolve_unpack_list(buffer, len) == NULL);
+    free(buffer);
+
+    /* mix of address families, including names that didn't resolve */
+    addrlist = build_address("www.example.com", "192.0.2.1", addrlist);
+    addrlist = build_address("www.example.com", "2001:db8::1", addrlist);
+    addrlist = build_address("missing.example.com", NULL, addrlist);
+    addrlist = build_address("192.0.2.200", "192.0.2.200", addrlist);
+
+    buffer = amp_test_resolve_pack_list(addrlist, &len);
+    result = amp_test_resolve_unpack_list(buffer, len);
+    check_list(addrlist, result);
+    amp_resolve_freeaddr(result);
+
+    /* truncated or extended batches are rejected */
+    assert(amp_test_resolve_unpack_list(buffer, len - 1) == NULL);
+    assert(amp_test_resolve_unpack_list(buffer, 3) == NULL);
+
+    /* batch that claims more entries than it contains is rejected */
+    memcpy(&header, buffer, sizeof(header));
+    header.count++;
+    memcpy(buffer, &header, sizeof(header));
+    assert(amp_test_resolve_unpack_list(buffer, len) == NULL);
+    free(buffer);
+
+    check_send_list(addrlist);
+
+    /* lots of names, as might be used by a large traceroute or icmp test */
+    for ( i = 0; i < MANY_NAMES; i++ ) {
+        snprintf(name, sizeof(name), "target%d.example.com", i);
+        addrlist = build_address(name, (i % 2) ? "192.0.2.3" : "2001:db8::3",
+                addrlist);
+    }
+
+    check_send_list(addrlist);
+
+    /* connection closing without a batch gives an empty list */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    close(sv[1]);
+    assert(amp_resolve_get_list(sv[0]) == NULL);
+
+    amp_resolve_freeaddr(addrlist);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_PACKETS 10000
+#define BATCH_SIZE 16
+#define MAX_PACKET_LEN 512
+
+
+/*
+ * Check that batches of packets are being sent correctly, in the order they
+ * were queued, and that the average delay between sending them is being
+ * enforced properly. A packet that can't be sent should fail on its own
+ * without stopping the rest of the batch.
+ */
+int main(void) {
+    struct addrinfo dest, baddest;
+    struct sockaddr_un badaddr;
+    struct socket_t amp_sockets;
+    struct send_batch_t *batch;
+    struct timespec sent[BATCH_SIZE];
+    int sockets[2];
+    char out_packet[BATCH_SIZE][MAX_PACKET_LEN];
+    char in_packet[MAX_PACKET_LEN];
+    int delay, length, i, j;
+    struct timeval start, end;
+    int64_t duration;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the batch picks a socket based on family, so treat it as ipv4 */
+    amp_sockets.socket = sockets[0];
+    amp_sockets.socket6 = -1;
+
+    /* we don't need a real address for testing, our socket pair is connected */
+    memset(&dest, 0, sizeof(dest));
+    dest.ai_family = AF_INET;
+    dest.ai_addr = NULL;
+    dest.ai_addrlen = 0;
+
+    batch = new_send_batch(&amp_sockets, BATCH_SIZE, MAX_PACKET_LEN,
+            MIN_INTER_PACKET_DELAY);
+
+    gettimeofday(&start, NULL);
+
+    for ( i = 0; i < TEST_PACKETS; i += BATCH_SIZE ) {
+        /* fill the packets with some data we can check later */
+        for ( j = 0; j < BATCH_SIZE; j++ ) {
+            length = (i + j) % MAX_PACKET_LEN;
+            out_packet[j][length++] = (i + j) % 255;
+            assert(queue_send_packet(batch, out_packet[j], length, &dest, 0,
+                        &sent[j]) == j + 1);
+            assert(sent[j].tv_sec == 0);
+        }
+
+        /* a full batch should refuse any more packets */
+        assert(queue_send_packet(batch, out_packet[0], 1, &dest, 0,
+                    NULL) < 0);
+
+        /* loop until all the packets are allowed to be sent or errors */
+        while ( (delay = flush_send_batch(batch)) > 0 ) {
+            assert(delay <= MIN_INTER_PACKET_DELAY);
+            usleep(delay);
+        }
+
+        if ( delay < 0 ) {
+            fprintf(stderr, "Failed to send packet: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* try to read the packets that we just sent, in order */
+        for ( j = 0; j < BATCH_SIZE; j++ ) {
+            length = ((i + j) % MAX_PACKET_LEN) + 1;
+            if ( recv(sockets[1], in_packet, MAX_PACKET_LEN, 0) != length ) {
+                fprintf(stderr, "Failed to receive packet: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+
+            /* confirm that it matches what we sent, and has a timestamp */
+            assert(memcmp(out_packet[j], in_packet, length) == 0);
+            assert(sent[j].tv_sec != 0);
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    /*
+     * check that we took longer than the minimum possible time, allowing
+     * the very first batch to be sent immediately
+     */
+    duration = DIFF_TV_US(end, start);
+    assert(duration > ((i - BATCH_SIZE) * MIN_INTER_PACKET_DELAY));
+
+    /* a destination that doesn't exist, so sending to it will fail */
+    memset(&badaddr, 0, sizeof(badaddr));
+    badaddr.sun_family = AF_UNIX;
+    strncpy(badaddr.sun_path, "/nonexistent/amplet2-send-batch-test",
+            sizeof(badaddr.sun_path) - 1);
+    baddest = dest;
+    baddest.ai_addr = (struct sockaddr*)&badaddr;
+    baddest.ai_addrlen = sizeof(badaddr);
+
+    /* put the bad destination in the middle of the batch */
+    for ( j = 0; j < BATCH_SIZE; j++ ) {
+        out_packet[j][0] = j;
+        assert(queue_send_packet(batch, out_packet[j], j + 1,
+                    j == BATCH_SIZE / 2 ? &baddest : &dest, 0,
+                    &sent[j]) == j + 1);
+    }
+
+    while ( (delay = flush_send_batch(batch)) > 0 ) {
+        usleep(delay);
+    }
+
+    /* the failure should be reported once the batch is empty */
+    assert(delay < 0);
+
+    /* every other packet, including those after the bad one, was sent */
+    for ( j = 0; j < BATCH_SIZE; j++ ) {
+        if ( j == BATCH_SIZE / 2 ) {
+            assert(sent[j].tv_sec == 0 && sent[j].tv_nsec == 0);
+            continue;
+        }
+
+        assert(recv(sockets[1], in_packet, MAX_PACKET_LEN, MSG_DONTWAIT) ==
+                j + 1);
+        assert(memcmp(out_packet[j], in_packet, j + 1) == 0);
+        assert(sent[j].tv_sec != 0);
+    }
+
+    /* nothing else should have been sent */
+    assert(recv(sockets[1], in_packet, MAX_PACKET_LEN, MSG_DONTWAIT) < 0);
+
+    /* the batch should be empty and usable again */
+    assert(flush_send_batch(batch) == 0);
+
+    free_send_batch(batch);
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "config.h"
+#include "testlib.h"
+
+#define TEST_PACKETS 2000
+#define TEST_PACKET_LEN 64
+#define BURST_SIZE 100
+/* use a high descriptor to check there is no limit on descriptor values */
+#define TEST_SOCKET_FD 500
+/* automake treats this exit status as a skipped test */
+#define SKIP_TEST 77
+
+/*
+ * Check that every packet sent on a socket with SO_TIMESTAMPING enabled gets
+ * a kernel transmit timestamp once the error queue is harvested, even when
+ * a burst of packets is sent before any timestamps are collected and the
+ * socket uses a high numbered file descriptor. Uses UDP over the loopback
+ * interface as unix sockets don't generate transmit timestamps.
+ */
+int main(void) {
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    struct addrinfo dest;
+    struct socket_t sockets;
+    struct timespec sent[TEST_PACKETS];
+    char packet[TEST_PACKET_LEN];
+    int receiver, sender;
+    int harvested, i, attempts;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ( (receiver = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            bind(receiver, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            getsockname(receiver, (struct sockaddr*)&addr, &addrlen) < 0 ) {
+        fprintf(stderr, "Loopback unavailable: %s\n", strerror(errno));
+        return SKIP_TEST;
+    }
+
+    if ( (sender = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            dup2(sender, TEST_SOCKET_FD) < 0 ) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    close(sender);
+
+    sockets.socket = TEST_SOCKET_FD;
+    sockets.socket6 = -1;
+    set_default_socket_options(&sockets);
+
+    memset(&dest, 0, sizeof(dest));
+    dest.ai_family = AF_INET;
+    dest.ai_addr = (struct sockaddr*)&addr;
+    dest.ai_addrlen = addrlen;
+
+    memset(packet, 0, sizeof(packet));
+    memset(sent, 0, sizeof(sent));
+
+    /*
+     * Send bursts of packets without collecting any timestamps, then collect
+     * them all at once, allowing a little time for them to arrive.
+     */
+    for ( i = 0, harvested = 0; i < TEST_PACKETS; ) {
+        int burst = i + BURST_SIZE;
+
+        for ( ; i < burst; i++ ) {
+            assert(delay_send_packet(TEST_SOCKET_FD, packet, sizeof(packet),
+                        &dest, 0, &sent[i]) == 0);
+            assert(sent[i].tv_sec != 0);
+        }
+
+        for ( attempts = 0; harvested < i && attempts < 100; attempts++ ) {
+            harvested += harvest_tx_timestamps();
+            if ( harvested < i ) {
+                usleep(1000);
+            }
+        }
+
+        /* the loopback interface should always provide software timestamps */
+        if ( harvested == 0 ) {
+            fprintf(stderr, "No transmit timestamps available\n");
+            return SKIP_TEST;
+        }
+
+        /* every packet sent should have had a timestamp collected */
+        assert(harvested == i);
+
+        /* drain the receiver so it doesn't start dropping packets */
+        while ( recv(receiver, packet, sizeof(packet), MSG_DONTWAIT) > 0 );
+    }
+
+    /* nothing more should be waiting, so the socket is no longer checked */
+    assert(harvest_tx_timestamps() == 0);
+    assert(amp_test_tx_timestamp_active() == 0);
+
+    /* sending makes it active again until the timestamp is collected */
+    assert(delay_send_packet(TEST_SOCKET_FD, packet, sizeof(packet),
+                &dest, 0, &sent[0]) == 0);
+    assert(amp_test_tx_timestamp_active() == 1);
+
+    /* closing it releases the context even with a packet outstanding */
+    assert(close_socket(TEST_SOCKET_FD) == 0);
+    assert(amp_test_tx_timestamp_active() == 0);
+    assert(harvest_tx_timestamps() == 0);
+
+    close(receiver);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+#include "waitset.h"
+
+#define TEST_PAIRS 128
+#define TEST_ROUNDS 1000
+#define TIMEOUT_NS 1000000
+
+/*
+ * Check that a wait set correctly reports which of many sockets have data
+ * available, that it times out and updates the remaining time when nothing
+ * is ready, reports sockets ready for writing, and stops reporting sockets
+ * once they have been removed.
+ */
+int main(void) {
+    int sockets[TEST_PAIRS][2];
+    struct wait_set_t *set;
+    struct wait_event_t ready[MAX_WAIT_EVENTS];
+    int64_t timeout, start;
+    char buf[16];
+    int i, j, count;
+
+    set = new_wait_set();
+    assert(set);
+
+    /*
+     * use pairs of unix sockets to test without relying on the network
+     * being present/sane/etc. Only wait for data on one end of each pair.
+     */
+    for ( i = 0; i < TEST_PAIRS; i++ ) {
+        if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets[i]) < 0 ) {
+            fprintf(stderr, "Failed to create socket pair: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        assert(wait_set_add(set, sockets[i][1], WAIT_READ) == 0);
+    }
+
+    /* no data has been written, it should timeout and use all the time */
+    timeout = TIMEOUT_NS;
+    start = monotonic_ns();
+    assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == 0);
+    assert(timeout == 0);
+    assert(monotonic_ns() - start >= TIMEOUT_NS);
+
+    for ( i = 0; i < TEST_ROUNDS; i++ ) {
+        /* write to a varying number of sockets, spread across the set */
+        count = (i % 3) + 1;
+        for ( j = 0; j < count; j++ ) {
+            buf[0] = (i + j * 7) % TEST_PAIRS;
+            assert(send(sockets[(int)buf[0]][0], buf, 1, 0) == 1);
+        }
+
+        timeout = TIMEOUT_NS;
+        assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == count);
+        assert(timeout >= 0 && timeout <= TIMEOUT_NS);
+
+        /* every ready socket should be one we wrote to, so read it out */
+        for ( j = 0; j < count; j++ ) {
+            assert(ready[j].events == WAIT_READ);
+            assert(recv(ready[j].fd, buf, sizeof(buf), 0) == 1);
+            assert(ready[j].fd == sockets[(int)buf[0]][1]);
+        }
+    }
+
+    /* removed sockets should no longer be reported, even with data waiting */
+    assert(send(sockets[0][0], buf, 1, 0) == 1);
+    assert(wait_set_remove(set, sockets[0][1]) == 0);
+    timeout = TIMEOUT_NS;
+    assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == 0);
+
+    /* an idle socket should be immediately ready for writing */
+    assert(wait_set_add(set, sockets[1][0], WAIT_WRITE) == 0);
+    timeout = TIMEOUT_NS;
+    assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == 1);
+    assert(ready[0].fd == sockets[1][0]);
+    assert(ready[0].events == WAIT_WRITE);
+    assert(wait_set_remove(set, sockets[1][0]) == 0);
+
+    /* the millisecond fallback for older kernels should behave the same */
+    amp_test_disable_epoll_pwait2();
+    timeout = TIMEOUT_NS;
+    start = monotonic_ns();
+    assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == 0);
+    assert(timeout == 0);
+    assert(monotonic_ns() - start >= TIMEOUT_NS);
+
+    assert(send(sockets[2][0], buf, 1, 0) == 1);
+    timeout = TIMEOUT_NS;
+    assert(wait_set_wait(set, &timeout, ready, MAX_WAIT_EVENTS) == 1);
+    assert(ready[0].fd == sockets[2][1]);
+    assert(ready[0].events == WAIT_READ);
+    assert(recv(ready[0].fd, buf, sizeof(buf), 0) == 1);
+
+    free_wait_set(set);
+
+    for ( i = 0; i < TEST_PAIRS; i++ ) {
+        close(sockets[i][0]);
+        close(sockets[i][1]);
+    }
+
+    return 0;
+}
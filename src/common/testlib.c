@@ -62,12 +62,15 @@
 #include <sys/ioctl.h>
 #include <linux/net_tstamp.h>
 #include <linux/errqueue.h>
+#include <poll.h>
 #endif
 
 #include "config.h"
 #include "testlib.h"
 #include "debug.h"
 #include "global.h"
+#include "waitset.h"
+#include "ratebudget.h"
 
 
 
@@ -229,11 +232,11 @@ int unblock_signals(void) {
 
 
 /*
- * Specific logic for checking, retriving and converting SO_TIMESTAMPING
- * timestamp value
+ * Specific logic for checking and retriving SO_TIMESTAMPING timestamp value
  */
 #ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
-inline static int retrieve_timestamping(struct cmsghdr *c, struct timeval *now){
+inline static int retrieve_timestamping(struct cmsghdr *c,
+        struct timespec *now) {
     struct timestamping_t *ts;
 
     assert(c);
@@ -245,12 +248,9 @@ inline static int retrieve_timestamping(struct cmsghdr *c, struct timeval *now){
         ts = ((struct timestamping_t*)CMSG_DATA(c));
 
         if ( ts->hardware.tv_sec != 0 ) {
-            now->tv_sec = ts->hardware.tv_sec;
-            now->tv_usec = (ts->hardware.tv_nsec / 1000);
-            /* NOTE, converting timespec to timeval here */
+            *now = ts->hardware;
         } else {
-            now->tv_sec = ts->software.tv_sec;
-            now->tv_usec = (ts->software.tv_nsec / 1000);
+            *now = ts->software;
         }
         return 1;
     }
@@ -261,17 +261,15 @@ inline static int retrieve_timestamping(struct cmsghdr *c, struct timeval *now){
 
 
 /*
- * Specific logic for checking and retriving SO_TIMESTAMP timestamp value
+ * Specific logic for checking and retriving SO_TIMESTAMPNS timestamp value
  */
-#ifdef SO_TIMESTAMP
-inline static int retrieve_timestamp(struct cmsghdr *c, struct timeval *now) {
-    struct timeval *tv;
-    if ( c->cmsg_type == SO_TIMESTAMP &&
-            c->cmsg_len >= CMSG_LEN(sizeof(struct timeval)) ) {
-
-        tv = ((struct timeval*)CMSG_DATA(c));
-        now->tv_sec = tv->tv_sec;
-        now->tv_usec = tv->tv_usec;
+#ifdef SO_TIMESTAMPNS
+inline static int retrieve_timestampns(struct cmsghdr *c,
+        struct timespec *now) {
+    if ( c->cmsg_type == SO_TIMESTAMPNS &&
+            c->cmsg_len >= CMSG_LEN(sizeof(struct timespec)) ) {
+
+        memcpy(now, CMSG_DATA(c), sizeof(struct timespec));
         return 1;
     }
     return 0;
@@ -280,20 +278,74 @@ inline static int retrieve_timestamp(struct cmsghdr *c, struct timeval *now) {
 
 
 
+/*
+ * Get the current (wall clock) time with nanosecond precision, if the
+ * platform supports it. This is the same clock used to timestamp packets.
+ */
+void get_realtime(struct timespec *now) {
+#if _WIN32
+    struct timeval tv;
+
+    /*
+     * XXX mingw appears to use GetSystemTimeAsFileTime(), which has a
+     * lower resolution than GetSystemTimePreciseAsFileTime(). Should I
+     * write my own code to use the better timer?
+     */
+    gettimeofday(&tv, NULL);
+    now->tv_sec = tv.tv_sec;
+    now->tv_nsec = tv.tv_usec * 1000;
+#else
+    clock_gettime(CLOCK_REALTIME, now);
+#endif
+}
+
+
+
+/*
+ * Get the current time in nanoseconds according to the monotonic clock. This
+ * isn't related to wall clock time, but won't jump if the clock is adjusted
+ * so is suitable for measuring how long things take.
+ */
+int64_t monotonic_ns(void) {
+#if _WIN32
+    LARGE_INTEGER count;
+    static LARGE_INTEGER frequency;
+
+    if ( frequency.QuadPart == 0 ) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&count);
+
+    return ((count.QuadPart / frequency.QuadPart) * 1000000000LL) +
+        ((count.QuadPart % frequency.QuadPart) * 1000000000LL /
+         frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t)now.tv_sec * 1000000000LL) + now.tv_nsec;
+#endif
+}
+
+
+
 /*
  * Try to get the best timestamp that is available to us,
  * in order of preference:
- * SO_TIMESTAMPING (HW then SW), SO_TIMESTAMP, SIOCGSTAMP and gettimeofday().
+ * SO_TIMESTAMPING (HW then SW), SO_TIMESTAMPNS, SIOCGSTAMPNS and
+ * clock_gettime().
  */
 #ifndef _WIN32
-static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
+static void get_timestamp(int sock, struct msghdr *msg, struct timespec *now) {
     struct cmsghdr *c;
 
     assert(msg);
     assert(now);
 
     /*
-     * Only one of SO_TIMESTAMPING or SO_TIMESTAMP will be enabled
+     * Only one of SO_TIMESTAMPING or SO_TIMESTAMPNS will be enabled
      * so it is safe to just return the first we find
     */
     for ( c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c) ) {
@@ -303,21 +355,21 @@ static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
                 return;
             }
 #endif
-#ifdef SO_TIMESTAMP
-            if ( retrieve_timestamp(c, now) ) {
+#ifdef SO_TIMESTAMPNS
+            if ( retrieve_timestampns(c, now) ) {
                 return;
             }
 #endif
         }
     }
 
-    /* next try using SIOCGSTAMP to get a timestamp */
-#ifdef SIOCGSTAMP
-    if ( ioctl(sock, SIOCGSTAMP, now) < 0 ) {
+    /* next try using SIOCGSTAMPNS to get a timestamp */
+#ifdef SIOCGSTAMPNS
+    if ( ioctl(sock, SIOCGSTAMPNS, now) < 0 ) {
 #endif
-        /* failing that, call gettimeofday() which we know will work */
-        gettimeofday(now, NULL);
-#ifdef SIOCGSTAMP
+        /* failing that, call clock_gettime() which we know will work */
+        get_realtime(now);
+#ifdef SIOCGSTAMPNS
     }
 #endif
 }
@@ -327,379 +379,1266 @@ static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
 
 #ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
 /*
- * Tx SO_TIMESTAMPING values are read in the from MSG_ERRQUEUE of the
- * sending socket, if value exists it is copied into 'sent'
+ * A packet that has been sent and is waiting on a transmit timestamp. The
+ * id is the one the kernel will report alongside the timestamp, and sent
+ * is where the timestamp should be stored when it arrives.
+ */
+struct tx_pending_t {
+    uint32_t id;
+    struct timespec *sent;
+};
+
+/*
+ * Per-socket transmit timestamp context. SOF_TIMESTAMPING_OPT_ID numbers
+ * each packet sent on a socket sequentially from zero, so the next id to be
+ * used is tracked here and each outstanding packet is stored in a ring
+ * indexed by its id. If the ring wraps before a timestamp arrives then the
+ * older packet keeps the estimated send time it was given when sent.
+ */
+struct tx_timestamp_t {
+    int sock;
+    ino_t inode;
+    uint32_t next_id;
+    uint32_t outstanding;
+    int active;
+    struct tx_pending_t pending[TX_TIMESTAMP_RING_SIZE];
+};
+
+/*
+ * Timestamp contexts for every socket with SO_TIMESTAMPING enabled, indexed
+ * by file descriptor. This grows as required so there is no limit on the
+ * value of descriptors that can be used.
+ */
+static struct tx_timestamp_t **tx_contexts = NULL;
+static int tx_contexts_size = 0;
+
+/*
+ * Contexts that have packets still waiting on a timestamp, so that only
+ * these need their error queues checked. Each context stores its own index
+ * in this list (or -1) so it can be removed without searching.
+ */
+static struct tx_timestamp_t **tx_active = NULL;
+static int tx_active_count = 0;
+static int tx_active_size = 0;
+
+
+
+/*
+ * Add a context to the list of those waiting on timestamps.
+ */
+static void activate_tx_timestamp(struct tx_timestamp_t *ctx) {
+    if ( ctx->active >= 0 ) {
+        return;
+    }
+
+    if ( tx_active_count == tx_active_size ) {
+        tx_active_size = tx_active_size ? tx_active_size * 2 : 16;
+        tx_active = realloc(tx_active,
+                sizeof(struct tx_timestamp_t *) * tx_active_size);
+    }
+
+    ctx->active = tx_active_count;
+    tx_active[tx_active_count++] = ctx;
+}
+
+
+
+/*
+ * Remove a context from the list of those waiting on timestamps. Order
+ * doesn't matter, so the last context is moved into the gap.
+ */
+static void deactivate_tx_timestamp(struct tx_timestamp_t *ctx) {
+    if ( ctx->active < 0 ) {
+        return;
+    }
+
+    tx_active[ctx->active] = tx_active[--tx_active_count];
+    tx_active[ctx->active]->active = ctx->active;
+    ctx->active = -1;
+}
+
+
+
+/*
+ * Release the transmit timestamp context for a socket, if it has one. Any
+ * packets still waiting keep the estimated send time they were given.
  */
-static void get_tx_timestamping(int sock, uint32_t packet_id,
-        struct timeval *sent) {
+static void free_tx_timestamp(int sock) {
+    struct tx_timestamp_t *ctx;
 
+    if ( sock < 0 || sock >= tx_contexts_size ||
+            (ctx = tx_contexts[sock]) == NULL ) {
+        return;
+    }
+
+    deactivate_tx_timestamp(ctx);
+    tx_contexts[sock] = NULL;
+    free(ctx);
+}
+
+
+
+/*
+ * Create (or reset) the transmit timestamp context for a socket that has
+ * just had SOF_TIMESTAMPING_OPT_ID enabled. The kernel only restarts packet
+ * ids when the option is first enabled, so an existing context for the same
+ * socket is left alone.
+ */
+static void new_tx_timestamp(int sock) {
+    struct tx_timestamp_t *ctx;
+    struct stat statbuf;
+
+    assert(sock >= 0);
+
+    if ( fstat(sock, &statbuf) < 0 ) {
+        return;
+    }
+
+    if ( sock >= tx_contexts_size ) {
+        int size = tx_contexts_size ? tx_contexts_size : 16;
+
+        while ( size <= sock ) {
+            size *= 2;
+        }
+
+        tx_contexts = realloc(tx_contexts,
+                sizeof(struct tx_timestamp_t *) * size);
+        memset(tx_contexts + tx_contexts_size, 0,
+                sizeof(struct tx_timestamp_t *) * (size - tx_contexts_size));
+        tx_contexts_size = size;
+    }
+
+    if ( (ctx = tx_contexts[sock]) != NULL && ctx->inode == statbuf.st_ino ) {
+        return;
+    }
+
+    /* the descriptor has been reused without being closed by close_socket() */
+    free_tx_timestamp(sock);
+
+    ctx = tx_contexts[sock] = calloc(1, sizeof(struct tx_timestamp_t));
+    ctx->sock = sock;
+    ctx->inode = statbuf.st_ino;
+    ctx->active = -1;
+}
+
+
+
+/*
+ * Record that a packet has just been sent on the socket, so that the
+ * transmit timestamp can be stored in sent when it later arrives on the
+ * error queue. This doesn't wait for the timestamp.
+ */
+static void record_tx_packet(int sock, struct timespec *sent) {
+    struct tx_timestamp_t *ctx;
+    struct tx_pending_t *pending;
+
+    if ( sock >= tx_contexts_size || (ctx = tx_contexts[sock]) == NULL ) {
+        return;
+    }
+
+    pending = &ctx->pending[ctx->next_id & (TX_TIMESTAMP_RING_SIZE - 1)];
+
+    /* a packet overwritten in the ring is no longer waiting on a timestamp */
+    if ( pending->sent ) {
+        ctx->outstanding--;
+    }
+
+    /* the id is always used, but there is nothing to wait for without sent */
+    pending->id = ctx->next_id++;
+    pending->sent = sent;
+
+    if ( sent ) {
+        ctx->outstanding++;
+        activate_tx_timestamp(ctx);
+    }
+}
+
+
+
+/*
+ * Read all the transmit timestamps currently waiting on the error queue of
+ * a socket, and store each in the packet it belongs to. Returns the number
+ * of timestamps that were stored.
+ */
+static int harvest_tx_context(struct tx_timestamp_t *ctx) {
     struct msghdr msg;
     struct cmsghdr *c;
     char ancillary[CMSG_SPACE(sizeof(struct timespec) * 10)];
-    int rc;
-    int check;
-
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_control = ancillary;
-    msg.msg_controllen = sizeof(ancillary);
+    int count = 0;
 
-    memset(ancillary, 0, sizeof(ancillary));
+    while ( 1 ) {
+        struct cmsghdr *tsmsg = NULL;
+        struct sock_extended_err *serr = NULL;
 
-    check = 0;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = ancillary;
+        msg.msg_controllen = sizeof(ancillary);
 
-    /*
-     * Even if the timestamp isn't being stored, try to empty the error
-     * queue so there is room for future timestamp mesages. Any messages
-     * seen here should be either directly related to the packet we've
-     * just sent, or are old messages that were too slow arriving and had
-     * been given up on.
-     */
-    do {
-        rc = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if ( recvmsg(ctx->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+            /* error queue is empty */
+            break;
+        }
 
-        /* no need to process it if there is nowhere to store the result */
-        if ( rc >= 0 && sent != NULL ) {
-            struct cmsghdr *tsmsg = NULL;
-            struct sock_extended_err *serr = NULL;
+        /* we are only expecting to get error queue messages */
+        if ( !(msg.msg_flags & MSG_ERRQUEUE) ) {
+            continue;
+        }
 
-            /* we are only expecting to get error queue messages */
-            if ( msg.msg_flags != MSG_ERRQUEUE ) {
-                break;
+        for ( c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c) ) {
+            if ( c->cmsg_level == SOL_SOCKET &&
+                    c->cmsg_type == SO_TIMESTAMPING ) {
+                tsmsg = c;
+            } else if ( (c->cmsg_level == SOL_IP &&
+                        c->cmsg_type == IP_RECVERR) ||
+                        (c->cmsg_level == SOL_IPV6 &&
+                        c->cmsg_type == IPV6_RECVERR) ) {
+                /* check for timestamp packet id, and store it if so */
+                serr = (void *)CMSG_DATA(c);
+                if ( serr->ee_errno != ENOMSG ||
+                        serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+                    serr = NULL;
+                }
+            } else {
+                Log(LOG_DEBUG, "Unknown message on error queue %d/%d",
+                        c->cmsg_level, c->cmsg_type);
             }
+        }
 
-            for ( c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c) ) {
-                if ( c->cmsg_level == SOL_SOCKET &&
-                        c->cmsg_type == SO_TIMESTAMPING ) {
-                    /* timestamp message, store it for now in case it's ours */
-                    tsmsg = c;
-                } else if ( (c->cmsg_level == SOL_IP &&
-                            c->cmsg_type == IP_RECVERR) ||
-                            (c->cmsg_level == SOL_IPV6 &&
-                            c->cmsg_type == IPV6_RECVERR)/* ||
-                            (c->cmsg_level == SOL_PACKET &&
-                            c->cmsg_type == PACKET_TX_TIMESTAMP)*/ ) {
-                    /* check for timestamp packet id, and store it if so */
-                    serr = (void *)CMSG_DATA(c);
-                    if ( serr->ee_errno != ENOMSG ||
-                            serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
-                        serr = NULL;
-                    }
-                } else {
-                    Log(LOG_DEBUG, "Unknown message on error queue %d/%d",
-                            c->cmsg_level, c->cmsg_type);
-                }
+        /* if there is both an id and a timestamp, find the matching packet */
+        if ( serr && tsmsg ) {
+            struct tx_pending_t *pending = &ctx->pending[
+                serr->ee_data & (TX_TIMESTAMP_RING_SIZE - 1)];
 
-                /* if there is both an id and a timestamp, see if it's ours */
-                if ( serr && tsmsg && serr->ee_data == packet_id ) {
-                    /* yes it's our packet id, use the timestamp value */
-                    retrieve_timestamping(tsmsg, sent);
-                    return;
-                }
+            if ( pending->id == serr->ee_data && pending->sent ) {
+                retrieve_timestamping(tsmsg, pending->sent);
+                pending->sent = NULL;
+                ctx->outstanding--;
+                count++;
             }
         }
-    } while ( check++ < 100 &&
-            (rc >= 0 || errno == EAGAIN || errno == EWOULDBLOCK) );
-    /* keep consuming messages, or check for messages up to 100 times max */
+    }
+
+    return count;
+}
+#endif
+
+
+
+/*
+ * Collect any transmit timestamps waiting on the error queues of the sockets
+ * that still have packets outstanding, updating the sent time of the packets
+ * they belong to. Receive functions call this before reading packets so that
+ * send times are accurate before responses are processed, but tests that
+ * receive responses by other means (e.g. pcap) should call it themselves.
+ * Returns the number of timestamps collected.
+ */
+int harvest_tx_timestamps(void) {
+    int count = 0;
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    int i;
+
+    for ( i = 0; i < tx_active_count; ) {
+        struct tx_timestamp_t *ctx = tx_active[i];
+
+        count += harvest_tx_context(ctx);
+
+        /* the last context is moved into this slot when one is removed */
+        if ( ctx->outstanding == 0 ) {
+            deactivate_tx_timestamp(ctx);
+        } else {
+            i++;
+        }
+    }
+#endif
+
+    return count;
+}
+
+
+
+/*
+ * Close a test socket, releasing any transmit timestamp state that was being
+ * kept for it. Sockets that had set_default_socket_options() applied should
+ * be closed with this rather than close().
+ */
+int close_socket(int sock) {
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    free_tx_timestamp(sock);
+#endif
+
+    return close(sock);
+}
+
+
+
+#ifdef HAVE_PPOLL
+/*
+ * Given a pair of sockets (ipv4 and ipv6), wait for data to arrive on either
+ * of them, up to maxwait microseconds. If data arrives before the timeout
+ * then return which socket received the data, otherwise -1.
+ *
+ * Uses ppoll() so that there is no limit on descriptor numbers and the
+ * timeout has nanosecond resolution, with the elapsed time measured using
+ * the monotonic clock. Tests that wait on many sockets or wait repeatedly
+ * should use a persistent struct wait_set_t instead.
+ */
+int wait_for_data(struct socket_t *sockets, int *maxwait) {
+    struct pollfd fds[2];
+    struct timespec timeout;
+    int64_t start_time;
+    int64_t delay;
+    int64_t wait;
+    int nfds;
+    int ready;
+    int i;
+
+    assert(sockets);
+    assert(sockets->socket || sockets->socket6);
+
+    nfds = 0;
+
+    if ( sockets->socket > 0 ) {
+        fds[nfds].fd = sockets->socket;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    if ( sockets->socket6 > 0 ) {
+        fds[nfds].fd = sockets->socket6;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    wait = (int64_t)*maxwait * 1000;
+    start_time = monotonic_ns();
+    delay = 0;
+
+    do {
+        /*
+         * if there has been an error then update timeout by how long we have
+         * already taken so we can carry on where we left off
+         */
+        if ( delay > wait ) {
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = 0;
+        } else {
+            timeout.tv_sec = (wait - delay) / 1000000000;
+            timeout.tv_nsec = (wait - delay) % 1000000000;
+        }
+
+        ready = ppoll(fds, nfds, &timeout, NULL);
+        delay = monotonic_ns() - start_time;
+
+        /* continue until there is data to read or we get a non EINTR error */
+    } while ( ready < 0 && errno == EINTR );
+
+    /* remove the time waited so far from maxwait */
+    *maxwait -= delay / 1000;
+    if ( *maxwait < 0 ) {
+        *maxwait = 0;
+    }
+
+    /* if there was a non-EINTR error then report it */
+    if ( ready < 0 ) {
+        Log(LOG_WARNING, "ppoll() failed");
+        return -1;
+    }
+
+    /* return the appropriate socket that has data waiting */
+    for ( i = 0; i < nfds && ready > 0; i++ ) {
+        if ( fds[i].revents ) {
+            return (fds[i].fd == sockets->socket) ? AF_INET : AF_INET6;
+        }
+    }
+
+    return -1;
+}
+#else
+/*
+ * Given a pair of sockets (ipv4 and ipv6), wait for data to arrive on either
+ * of them, up to maxwait microseconds. If data arrives before the timeout
+ * then return which socket received the data, otherwise -1.
+ */
+int wait_for_data(struct socket_t *sockets, int *maxwait) {
+    struct timeval start_time, end_time;
+    struct timeval timeout;
+    int delay;
+    int max_fd;
+    int ready;
+    fd_set readset;
+
+    assert(sockets);
+    assert(sockets->socket || sockets->socket6);
+
+    gettimeofday(&start_time, NULL);
+
+    max_fd = -1;
+    delay = 0;
+
+    do {
+	/*
+	 * if there has been an error then update timeout by how long we have
+	 * already taken so we can carry on where we left off
+	 */
+	if ( delay > *maxwait ) {
+	    timeout.tv_sec = 0;
+	    timeout.tv_usec = 0;
+	} else {
+	    timeout.tv_sec = S_FROM_US(*maxwait - delay);
+	    timeout.tv_usec = US_FROM_US(*maxwait - delay);
+	}
+
+	/* fd sets are undefined after an error, so set them every time too */
+	FD_ZERO(&readset);
+	if ( sockets->socket > 0 ) {
+	    FD_SET(sockets->socket, &readset);
+	    max_fd = sockets->socket;
+	}
+
+	if ( sockets->socket6 > 0 ) {
+	    FD_SET(sockets->socket6, &readset);
+	    if ( sockets->socket6 > max_fd ) {
+		max_fd = sockets->socket6;
+	    }
+	}
+
+	ready = select(max_fd+1, &readset, NULL, NULL, &timeout);
+
+	/*
+	 * we can't always trust the value of timeout after select returns, so
+	 * check for ourselves how much time has elapsed
+	 */
+	gettimeofday(&end_time, NULL);
+	delay = DIFF_TV_US(end_time, start_time);
+
+	/* if delay is less than zero then maybe the clock was adjusted */
+	if ( delay < 0 ) {
+	    delay = 0;
+	}
+
+	/* continue until there is data to read or we get a non EINTR error */
+    } while ( ready < 0 && errno == EINTR );
+
+    /* remove the time waited so far from maxwait */
+    *maxwait -= delay;
+    if ( *maxwait < 0 ) {
+	*maxwait = 0;
+    }
+
+    /* if there was a non-EINTR error then report it */
+    if ( ready < 0 ) {
+	Log(LOG_WARNING, "select() failed");
+	return -1;
+    }
+
+    /* return the appropriate socket that has data waiting */
+    if ( sockets->socket > 0 && FD_ISSET(sockets->socket, &readset) ) {
+	return AF_INET;
+    }
+
+    if ( sockets->socket6 > 0 && FD_ISSET(sockets->socket6, &readset) ) {
+	return AF_INET6;
+    }
+
+    return -1;
+}
+#endif
+
+
+
+/*
+ * Read a single packet that is already waiting on the socket and return the
+ * number of bytes read. If valid pointers with storage for an address (of
+ * addrlen bytes) or timespec are given then they will be populated with the
+ * source address and time the packet was received. This doesn't wait for
+ * the socket to become readable, so should only be used once the caller
+ * knows that data is available (e.g. using a struct wait_set_t). Returns -1
+ * if there was no packet waiting after all, which can happen if the socket
+ * was only woken by transmit timestamps arriving on the error queue.
+ */
+int read_packet(int sock, char *buf, int buflen, struct sockaddr *saddr,
+        socklen_t addrlen, struct timespec *now) {
+
+    int bytes;
+    char ans_data[4096];
+#if _WIN32
+    WSABUF iov;
+    WSAMSG msg;
+#else
+    struct iovec iov;
+    struct msghdr msg;
+#endif
+
+    assert(sock >= 0);
+    assert(buf);
+
+    /* set up the message structure, including the user supplied packet */
+    memset(&msg, 0, sizeof(msg));
+
+#if _WIN32
+    iov.buf = buf;
+    iov.len = buflen;
+    msg.name = (struct sockaddr *) saddr;
+    msg.namelen = saddr ? addrlen : 0;
+    msg.lpBuffers = &iov;
+    msg.dwBufferCount = 1;
+    msg.Control.buf = (char *) ans_data;
+    msg.Control.len = sizeof(ans_data);
+
+    LPFN_WSARECVMSG WSARecvMsg = NULL;
+
+    /*
+     * TODO if we don't actually use the returned message, perhaps we don't
+     * need to use recvmsg under windows?
+     */
+    /* load the WSARecvMsg function, because it isn't available by default */
+    GUID g = WSAID_WSARECVMSG;
+    DWORD dwBytesReturned = 0;
+    if ( WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &g, sizeof(g),
+                &WSARecvMsg, sizeof(WSARecvMsg),
+                &dwBytesReturned, NULL, NULL) != 0 ) {
+        Log(LOG_ERR, "Failed to load recvmsg()");
+        exit(EXIT_FAILURE);
+    }
+
+    /* receive the packet that we know is ready on one of our sockets */
+    if ( WSARecvMsg(sock, &msg, &bytes, NULL, NULL) < 0 ) {
+        Log(LOG_ERR, "Failed to recvmsg()");
+        exit(EXIT_FAILURE);
+    }
+#else
+    iov.iov_base = buf;
+    iov.iov_len = buflen;
+    msg.msg_name = saddr;
+    msg.msg_namelen = saddr ? addrlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ans_data;
+    msg.msg_controllen = sizeof(ans_data);
+
+    /* collect transmit timestamps first, they may be why we were woken */
+    harvest_tx_timestamps();
+
+    /* receive the packet that should be ready on one of our sockets */
+    if ( (bytes = recvmsg(sock, &msg, MSG_DONTWAIT)) < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+            return -1;
+        }
+        Log(LOG_ERR, "Failed to recvmsg()");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    /* populate the timestamp argument with the receive time of packet */
+    if ( now ) {
+#if _WIN32
+        get_realtime(now);
+#else
+        get_timestamp(sock, &msg, now);
+#endif
+    }
+
+    return bytes;
+}
+
+
+
+/*
+ * Wait for up to timeout microseconds to receive a packet on the given
+ * sockets and return the number of bytes read. If valid pointers with
+ * storage for an address or timespec are given then they will be populated
+ * with the source address and time the packet was received.
+ *
+ * TODO can this take a single socket so that I don't need to create a whole
+ * struct socket_t when I only want to listen on one socket? Almost every use
+ * of this is for only one socket, except wait_for_data() which can use both.
+ */
+int get_packet(struct socket_t *sockets, char *buf, int buflen,
+        struct sockaddr *saddr, int *timeout, struct timespec *now) {
+
+    int sock;
+    int family;
+    int bytes;
+    socklen_t addrlen;
+
+    assert(sockets);
+    assert(sockets->socket || sockets->socket6);
+    assert(timeout);
+
+    do {
+        /* wait for data to be ready, up to timeout (wait will update it) */
+        if ( (family = wait_for_data(sockets, timeout)) <= 0 ) {
+            return 0;
+        }
+
+        /* determine which socket we have received data on and read from it */
+        switch ( family ) {
+            case AF_INET: sock = sockets->socket;
+                          addrlen = sizeof(struct sockaddr_in);
+                          break;
+            case AF_INET6: sock = sockets->socket6;
+                           addrlen = sizeof(struct sockaddr_in6);
+                           break;
+            default: return 0;
+        };
+
+        bytes = read_packet(sock, buf, buflen, saddr, addrlen, now);
+
+        /* keep waiting if there was nothing but transmit timestamps */
+    } while ( bytes < 0 && *timeout > 0 );
+
+    return bytes < 0 ? 0 : bytes;
+}
+
+
+
+/*
+ * Create storage for a batch of up to size packets, each up to buflen bytes
+ * long, to be filled by get_packets(). The same batch should be reused for
+ * every call to avoid reallocating buffers for each packet.
+ */
+struct recv_batch_t *new_recv_batch(int size, int buflen) {
+    struct recv_batch_t *batch;
+    int i;
+
+    assert(size > 0);
+    assert(buflen > 0);
+
+    if ( size > MAX_RECV_BATCH ) {
+        Log(LOG_DEBUG, "Limiting receive batch size %d to %d", size,
+                MAX_RECV_BATCH);
+        size = MAX_RECV_BATCH;
+    }
+
+    batch = calloc(1, sizeof(struct recv_batch_t));
+    batch->size = size;
+    batch->buflen = buflen;
+    batch->count = 0;
+    batch->packets = calloc(size, sizeof(struct recv_packet_t));
+    batch->control = calloc(size, RECV_CONTROL_LEN);
+
+    for ( i = 0; i < size; i++ ) {
+        batch->packets[i].data = calloc(1, buflen);
+    }
+
+    return batch;
+}
+
+
+
+/*
+ * Free a batch of received packets, including all the packet buffers.
+ */
+void free_recv_batch(struct recv_batch_t *batch) {
+    int i;
+
+    if ( batch == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < batch->size; i++ ) {
+        free(batch->packets[i].data);
+    }
+
+    free(batch->packets);
+    free(batch->control);
+    free(batch);
+}
+
+
+
+/*
+ * Wait for up to timeout microseconds for packets to arrive on the given
+ * sockets, then read as many as are available on the ready socket (up to the
+ * size of the batch) using a single call to recvmmsg() if possible. Returns
+ * the number of packets read, which is also stored in the batch. Each packet
+ * is stored with the number of bytes read, the source address and the time
+ * it was received.
+ */
+int get_packets(struct socket_t *sockets, struct recv_batch_t *batch,
+        int *timeout) {
+
+    int family;
+    int sock;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[MAX_RECV_BATCH];
+    struct iovec iov[MAX_RECV_BATCH];
+    int count;
+    int i;
+#endif
+
+    assert(sockets);
+    assert(sockets->socket || sockets->socket6);
+    assert(batch);
+    assert(timeout);
+
+    batch->count = 0;
+
+    /* wait for data to be ready, up to timeout (wait will update it) */
+    if ( (family = wait_for_data(sockets, timeout)) <= 0 ) {
+        return 0;
+    }
+
+    /* determine which socket we have received data on and read from it */
+    switch ( family ) {
+        case AF_INET: sock = sockets->socket; break;
+        case AF_INET6: sock = sockets->socket6; break;
+        default: return 0;
+    };
+
+#ifdef HAVE_RECVMMSG
+    /* collect transmit timestamps first, they may be why we were woken */
+    harvest_tx_timestamps();
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for ( i = 0; i < batch->size; i++ ) {
+        iov[i].iov_base = batch->packets[i].data;
+        iov[i].iov_len = batch->buflen;
+        msgs[i].msg_hdr.msg_name = &batch->packets[i].from;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = batch->control + (i * RECV_CONTROL_LEN);
+        msgs[i].msg_hdr.msg_controllen = RECV_CONTROL_LEN;
+    }
+
+    /* read everything that is waiting, without blocking for more to arrive */
+    if ( (count = recvmmsg(sock, msgs, batch->size, MSG_DONTWAIT,
+                    NULL)) < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+            return 0;
+        }
+        Log(LOG_ERR, "Failed to recvmmsg()");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        batch->packets[i].bytes = msgs[i].msg_len;
+        get_timestamp(sock, &msgs[i].msg_hdr, &batch->packets[i].time);
+    }
+
+    batch->count = count;
+#else
+    {
+        struct socket_t ready;
+        int wait = 0;
+        int bytes;
+
+        /* only read from the socket that was ready, without waiting again */
+        ready.socket = (family == AF_INET) ? sock : -1;
+        ready.socket6 = (family == AF_INET6) ? sock : -1;
+
+        while ( batch->count < batch->size ) {
+            struct recv_packet_t *packet = &batch->packets[batch->count];
+            if ( (bytes = get_packet(&ready, packet->data, batch->buflen,
+                            (struct sockaddr*)&packet->from, &wait,
+                            &packet->time)) <= 0 ) {
+                break;
+            }
+            packet->bytes = bytes;
+            batch->count++;
+        }
+    }
+#endif
+
+    return batch->count;
+}
+
+
+
+/*
+ * Time that the most recent test packet was sent, shared between the single
+ * and batched send functions so that the inter-packet delay applies to all
+ * test traffic regardless of which was used. This is measured using the
+ * monotonic clock so that wall clock adjustments don't disturb the pacing.
+ */
+static int64_t last_sent = 0;
+
+/*
+ * Time that a packet already reserved from the global rate budget may be
+ * sent, if delay_send_packet() is waiting on the budget. The caller will try
+ * to send the same packet again after waiting, so it shouldn't be reserved
+ * a second time.
+ */
+static int64_t budget_ready = 0;
+
+/*
+ * Enforce a minimum inter-packet delay for test traffic, and the rate budget
+ * shared with all other tests. Try to send a packet but if it is too soon
+ * for the test to be sending again then return a delay time to wait (in
+ * microseconds).
+ */
+int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
+        uint32_t inter_packet_delay, struct timespec *sent) {
+
+    int bytes_sent;
+    int64_t now;
+    int delay, diff;
+
+    assert(sock > 0);
+    assert(size > 0);
+    assert(packet);
+    assert(dest);
+
+    now = monotonic_ns();
+    diff = (now - last_sent) / 1000;
+
+    /* determine how much time is left to wait until the minimum delay */
+    if ( last_sent != 0 && diff < (int)inter_packet_delay ) {
+        delay = inter_packet_delay - diff;
+    } else {
+        /* then make sure there is room for it in the shared budget */
+#ifndef _WIN32
+        if ( budget_ready == 0 ) {
+            budget_ready = rate_budget_reserve(1, size);
+        }
+#endif
+
+        if ( budget_ready > now ) {
+            delay = (budget_ready - now + 999) / 1000;
+        } else {
+            delay = 0;
+            budget_ready = 0;
+            last_sent = now;
+
+            /* populate sent timestamp (may be overwritten by a better one) */
+            if ( sent ) {
+                get_realtime(sent);
+            }
+        }
+    }
+
+    /*
+     * if there is still time to wait before the next packet then return
+     * control to the caller, in case they want to do more work while waiting
+     */
+    if ( delay != 0 ) {
+        return delay;
+    }
+
+    bytes_sent = sendto(sock, packet, size, 0, dest->ai_addr, dest->ai_addrlen);
+
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    /* the transmit timestamp will be collected later, when it is available */
+    if ( bytes_sent > 0 ) {
+        record_tx_packet(sock, sent);
+    }
+#endif
+
+    /* TODO determine error and/or send any unsent bytes */
+    if ( bytes_sent != size ) {
+        Log(LOG_DEBUG, "Only sent %d of %d bytes", bytes_sent, size);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * A single probe packet that has been queued to be sent as part of a batch.
+ */
+struct batch_packet_t {
+    int sock;                   /* socket to send the packet on */
+    int size;                   /* length of the packet data */
+    int ttl;                    /* TTL/hop limit to set, or 0 for default */
+    struct addrinfo *dest;      /* where to send the packet */
+    struct timespec *sent;      /* where to store the time it was sent */
+    char *packet;               /* copy of the packet data */
+};
+
+/*
+ * A queue of probe packets to be sent together, using sendmmsg() if it is
+ * available so that a whole batch only costs a single system call.
+ */
+struct send_batch_t {
+    struct socket_t sockets;    /* ipv4 and ipv6 sockets to send on */
+    uint32_t inter_packet_delay;/* minimum average gap between packets */
+    int max_packet_size;        /* largest packet that can be queued */
+    int size;                   /* maximum number of packets in a batch */
+    int count;                  /* number of packets currently queued */
+    int reserved;               /* queued packets reserved from the budget */
+    int64_t budget_ready;       /* when the reserved packets may be sent */
+    int failed;                 /* packets that failed since last empty */
+    struct batch_packet_t *packets;
+};
+
+
+
+/*
+ * Create a new batch that can queue up to size packets of at most
+ * max_packet_size bytes each, to be sent on the given sockets. Packets are
+ * sent on the ipv4 or ipv6 socket depending on the family of the destination.
+ */
+struct send_batch_t *new_send_batch(struct socket_t *sockets, int size,
+        int max_packet_size, uint32_t inter_packet_delay) {
+
+    struct send_batch_t *batch;
+    int i;
+
+    assert(sockets);
+    assert(size > 0);
+    assert(max_packet_size > 0);
 
-    if ( sent ) {
-        Log(LOG_DEBUG,
-                "Failed to get transmit timestamp for packet, using estimate");
+    if ( size > MAX_SEND_BATCH ) {
+        Log(LOG_DEBUG, "Limiting send batch size %d to %d", size,
+                MAX_SEND_BATCH);
+        size = MAX_SEND_BATCH;
+    }
+
+    batch = calloc(1, sizeof(struct send_batch_t));
+    batch->sockets.socket = sockets->socket;
+    batch->sockets.socket6 = sockets->socket6;
+    batch->inter_packet_delay = inter_packet_delay;
+    batch->max_packet_size = max_packet_size;
+    batch->size = size;
+    batch->count = 0;
+    batch->reserved = 0;
+    batch->budget_ready = 0;
+    batch->failed = 0;
+    batch->packets = calloc(size, sizeof(struct batch_packet_t));
+
+    for ( i = 0; i < size; i++ ) {
+        batch->packets[i].packet = malloc(max_packet_size);
     }
+
+    return batch;
 }
-#endif
 
 
 
 /*
- * Given a pair of sockets (ipv4 and ipv6), wait for data to arrive on either
- * of them, up to maxwait microseconds. If data arrives before the timeout
- * then return which socket received the data, otherwise -1.
+ * Free a batch, including any packets that are still queued without having
+ * been sent.
  */
-int wait_for_data(struct socket_t *sockets, int *maxwait) {
-    struct timeval start_time, end_time;
-    struct timeval timeout;
-    int delay;
-    int max_fd;
-    int ready;
-    fd_set readset;
-
-    assert(sockets);
-    assert(sockets->socket || sockets->socket6);
-
-    gettimeofday(&start_time, NULL);
+void free_send_batch(struct send_batch_t *batch) {
+    int i;
 
-    max_fd = -1;
-    delay = 0;
+    if ( batch == NULL ) {
+        return;
+    }
 
-    do {
-	/*
-	 * if there has been an error then update timeout by how long we have
-	 * already taken so we can carry on where we left off
-	 */
-	if ( delay > *maxwait ) {
-	    timeout.tv_sec = 0;
-	    timeout.tv_usec = 0;
-	} else {
-	    timeout.tv_sec = S_FROM_US(*maxwait - delay);
-	    timeout.tv_usec = US_FROM_US(*maxwait - delay);
-	}
+    for ( i = 0; i < batch->size; i++ ) {
+        free(batch->packets[i].packet);
+    }
 
-	/* fd sets are undefined after an error, so set them every time too */
-	FD_ZERO(&readset);
-	if ( sockets->socket > 0 ) {
-	    FD_SET(sockets->socket, &readset);
-	    max_fd = sockets->socket;
-	}
+    free(batch->packets);
+    free(batch);
+}
 
-	if ( sockets->socket6 > 0 ) {
-	    FD_SET(sockets->socket6, &readset);
-	    if ( sockets->socket6 > max_fd ) {
-		max_fd = sockets->socket6;
-	    }
-	}
 
-	ready = select(max_fd+1, &readset, NULL, NULL, &timeout);
 
-	/*
-	 * we can't always trust the value of timeout after select returns, so
-	 * check for ourselves how much time has elapsed
-	 */
-	gettimeofday(&end_time, NULL);
-	delay = DIFF_TV_US(end_time, start_time);
+/*
+ * Add a copy of a packet to the batch to be sent the next time the batch is
+ * flushed. If ttl is non-zero then it will be set as the TTL (or hop limit)
+ * for this packet only. The sent timestamp is cleared until the packet has
+ * been successfully sent. Returns the number of packets now queued, or -1 if
+ * the packet could not be queued.
+ */
+int queue_send_packet(struct send_batch_t *batch, char *packet, int size,
+        struct addrinfo *dest, int ttl, struct timespec *sent) {
 
-	/* if delay is less than zero then maybe the clock was adjusted */
-	if ( delay < 0 ) {
-	    delay = 0;
-	}
+    struct batch_packet_t *item;
+    int sock;
 
-	/* continue until there is data to read or we get a non EINTR error */
-    } while ( ready < 0 && errno == EINTR );
+    assert(batch);
+    assert(packet);
+    assert(size > 0);
+    assert(dest);
 
-    /* remove the time waited so far from maxwait */
-    *maxwait -= delay;
-    if ( *maxwait < 0 ) {
-	*maxwait = 0;
+    if ( batch->count >= batch->size ) {
+        Log(LOG_WARNING, "Send batch is full, can't queue packet");
+        return -1;
     }
 
-    /* if there was a non-EINTR error then report it */
-    if ( ready < 0 ) {
-	Log(LOG_WARNING, "select() failed");
-	return -1;
+    if ( size > batch->max_packet_size ) {
+        Log(LOG_WARNING, "Packet too large to queue (%d > %d bytes)",
+                size, batch->max_packet_size);
+        return -1;
     }
 
-    /* return the appropriate socket that has data waiting */
-    if ( sockets->socket > 0 && FD_ISSET(sockets->socket, &readset) ) {
-	return AF_INET;
+    switch ( dest->ai_family ) {
+        case AF_INET: sock = batch->sockets.socket; break;
+        case AF_INET6: sock = batch->sockets.socket6; break;
+        default: Log(LOG_WARNING, "Unknown address family: %d",
+                         dest->ai_family);
+                 return -1;
+    };
+
+    if ( sock < 0 ) {
+        Log(LOG_WARNING, "No socket to send to %s, can't queue packet",
+                dest->ai_canonname);
+        return -1;
     }
 
-    if ( sockets->socket6 > 0 && FD_ISSET(sockets->socket6, &readset) ) {
-	return AF_INET6;
+    item = &batch->packets[batch->count];
+    item->sock = sock;
+    item->size = size;
+    item->ttl = ttl;
+    item->dest = dest;
+    item->sent = sent;
+    memcpy(item->packet, packet, size);
+
+    if ( sent ) {
+        memset(sent, 0, sizeof(struct timespec));
     }
 
-    return -1;
+    return ++batch->count;
 }
 
 
 
 /*
- * Wait for up to timeout microseconds to receive a packet on the given
- * sockets and return the number of bytes read. If valid pointers with
- * storage for an address or timeval are given then they will be populated
- * with the source address and time the packet was received.
- *
- * TODO can this take a single socket so that I don't need to create a whole
- * struct socket_t when I only want to listen on one socket? Almost every use
- * of this is for only one socket, except wait_for_data() which can use both.
+ * Record the outcome of sending a single packet from a batch. Packets that
+ * were sent are tracked so their transmit timestamps can be collected, while
+ * packets that failed have their sent time cleared so the caller knows not
+ * to wait for a response.
  */
-int get_packet(struct socket_t *sockets, char *buf, int buflen,
-        struct sockaddr *saddr, int *timeout, struct timeval *now) {
+static void finish_batch_packet(struct batch_packet_t *packet, int ok) {
+    if ( !ok ) {
+        if ( packet->sent ) {
+            memset(packet->sent, 0, sizeof(struct timespec));
+        }
+        return;
+    }
 
-    int bytes;
-    int sock;
-    int family;
-    socklen_t addrlen;
-    char ans_data[4096];
-#if _WIN32
-    WSABUF iov;
-    WSAMSG msg;
-#else
-    struct iovec iov;
-    struct msghdr msg;
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    record_tx_packet(packet->sock, packet->sent);
 #endif
+}
 
-    assert(sockets);
-    assert(sockets->socket || sockets->socket6);
-    assert(timeout);
 
-    /* wait for data to be ready, up to timeout (wait will update it) */
-    if ( (family = wait_for_data(sockets, timeout)) <= 0 ) {
-        return 0;
-    }
 
-    /* determine which socket we have received data on and read from it */
-    switch ( family ) {
-        case AF_INET: sock = sockets->socket;
-                      addrlen = sizeof(struct sockaddr_in);
-                      break;
-        case AF_INET6: sock = sockets->socket6;
-                       addrlen = sizeof(struct sockaddr_in6);
-                       break;
-        default: return 0;
-    };
+/*
+ * Send count packets from the front of the batch that all share the same
+ * socket. A packet that fails to send doesn't stop the rest from being sent.
+ * Returns the number of packets that failed.
+ */
+#ifndef _WIN32
+static int send_batch_run(struct batch_packet_t *packets, int count) {
+    struct iovec iov[MAX_SEND_BATCH];
+    char control[MAX_SEND_BATCH][CMSG_SPACE(sizeof(int))];
+    int sock = packets[0].sock;
+    int done;
+    int failed = 0;
+    int i;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[MAX_SEND_BATCH];
+#else
+    struct msghdr msgs[MAX_SEND_BATCH];
+#endif
 
-    /* set up the message structure, including the user supplied packet */
-    memset(&msg, 0, sizeof(msg));
+    assert(count > 0 && count <= MAX_SEND_BATCH);
 
-#if _WIN32
-    iov.buf = buf;
-    iov.len = buflen;
-    msg.name = (struct sockaddr *) saddr;
-    msg.namelen = saddr ? addrlen : 0;
-    msg.lpBuffers = &iov;
-    msg.dwBufferCount = 1;
-    msg.Control.buf = (char *) ans_data;
-    msg.Control.len = sizeof(ans_data);
+    memset(msgs, 0, sizeof(msgs));
 
-    LPFN_WSARECVMSG WSARecvMsg = NULL;
+    for ( i = 0; i < count; i++ ) {
+        struct msghdr *msg;
+
+#ifdef HAVE_SENDMMSG
+        msg = &msgs[i].msg_hdr;
+#else
+        msg = &msgs[i];
+#endif
+
+        iov[i].iov_base = packets[i].packet;
+        iov[i].iov_len = packets[i].size;
+        msg->msg_name = packets[i].dest->ai_addr;
+        msg->msg_namelen = packets[i].dest->ai_addrlen;
+        msg->msg_iov = &iov[i];
+        msg->msg_iovlen = 1;
+
+        /* set the TTL for this packet alone using ancillary data */
+        if ( packets[i].ttl > 0 ) {
+            struct cmsghdr *c;
+
+            memset(control[i], 0, sizeof(control[i]));
+            msg->msg_control = control[i];
+            msg->msg_controllen = sizeof(control[i]);
+            c = CMSG_FIRSTHDR(msg);
+            c->cmsg_len = CMSG_LEN(sizeof(int));
+            if ( packets[i].dest->ai_family == AF_INET6 ) {
+                c->cmsg_level = IPPROTO_IPV6;
+                c->cmsg_type = IPV6_HOPLIMIT;
+            } else {
+                c->cmsg_level = IPPROTO_IP;
+                c->cmsg_type = IP_TTL;
+            }
+            memcpy(CMSG_DATA(c), &packets[i].ttl, sizeof(int));
+        }
+    }
 
+#ifdef HAVE_SENDMMSG
     /*
-     * TODO if we don't actually use the returned message, perhaps we don't
-     * need to use recvmsg under windows?
+     * sendmmsg() stops at the first message that fails, reporting the error
+     * only if it was the first in the call. Skip over the failed message and
+     * carry on with the rest until every message has been tried.
      */
-    /* load the WSARecvMsg function, because it isn't available by default */
-    GUID g = WSAID_WSARECVMSG;
-    DWORD dwBytesReturned = 0;
-    if ( WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &g, sizeof(g),
-                &WSARecvMsg, sizeof(WSARecvMsg),
-                &dwBytesReturned, NULL, NULL) != 0 ) {
-        Log(LOG_ERR, "Failed to load recvmsg()");
-        exit(EXIT_FAILURE);
-    }
+    done = 0;
+    while ( done < count ) {
+        int result = sendmmsg(sock, msgs + done, count - done, 0);
+        if ( result < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_DEBUG, "Failed to sendmmsg(): %s", strerror(errno));
+            finish_batch_packet(&packets[done++], 0);
+            failed++;
+            continue;
+        }
 
-    /* receive the packet that we know is ready on one of our sockets */
-    if ( WSARecvMsg(sock, &msg, &bytes, NULL, NULL) < 0 ) {
-        Log(LOG_ERR, "Failed to recvmsg()");
-        exit(EXIT_FAILURE);
+        for ( i = done; i < done + result; i++ ) {
+            if ( msgs[i].msg_len != (unsigned int)packets[i].size ) {
+                Log(LOG_DEBUG, "Only sent %d of %d bytes", msgs[i].msg_len,
+                        packets[i].size);
+                finish_batch_packet(&packets[i], 0);
+                failed++;
+            } else {
+                finish_batch_packet(&packets[i], 1);
+            }
+        }
+
+        done += result;
     }
 #else
-    iov.iov_base = buf;
-    iov.iov_len = buflen;
-    msg.msg_name = saddr;
-    msg.msg_namelen = saddr ? addrlen : 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = ans_data;
-    msg.msg_controllen = sizeof(ans_data);
-
-    /* receive the packet that we know is ready on one of our sockets */
-    if ( (bytes = recvmsg(sock, &msg, 0)) < 0 ) {
-        Log(LOG_ERR, "Failed to recvmsg()");
-        exit(EXIT_FAILURE);
+    for ( done = 0; done < count; done++ ) {
+        int result = sendmsg(sock, &msgs[done], 0);
+        if ( result != packets[done].size ) {
+            Log(LOG_DEBUG, "Only sent %d of %d bytes", result,
+                    packets[done].size);
+            finish_batch_packet(&packets[done], 0);
+            failed++;
+        } else {
+            finish_batch_packet(&packets[done], 1);
+        }
     }
 #endif
 
-    /* populate the timestamp argument with the receive time of packet */
-    if ( now ) {
-#if _WIN32
-        /*
-         * XXX mingw appears to use GetSystemTimeAsFileTime(), which has a
-         * lower resolution than GetSystemTimePreciseAsFileTime(). Should I
-         * write my own code to use the better timer?
-         */
-        gettimeofday(now, NULL);
+    return failed;
+}
 #else
-        get_timestamp(sock, &msg, now);
-#endif
+static int send_batch_run(struct batch_packet_t *packets, int count) {
+    int failed = 0;
+    int i;
+
+    /* no per-packet ancillary data available, so just send them one by one */
+    for ( i = 0; i < count; i++ ) {
+        int ok = sendto(packets[i].sock, packets[i].packet,
+                packets[i].size, 0, packets[i].dest->ai_addr,
+                packets[i].dest->ai_addrlen) == packets[i].size;
+        finish_batch_packet(&packets[i], ok);
+        if ( !ok ) {
+            failed++;
+        }
     }
 
-    return bytes;
+    return failed;
 }
+#endif
 
 
 
 /*
- * Enforce a minimum inter-packet delay for test traffic. Try to send a packet
- * but if it is too soon for the test to be sending again then return a delay
- * time to wait (in microseconds).
+ * Send as many of the queued packets as the inter-packet delay currently
+ * allows. The delay is enforced as an average across the batch - if enough
+ * time has elapsed since the last packet for N packets to have been sent
+ * then up to N packets are sent at once, if the rate budget shared with all
+ * other tests has room for them. Returns a delay time to wait (in
+ * microseconds) if there are still packets waiting to be sent, otherwise 0
+ * once the batch is empty or -1 if any of its packets failed to send. A
+ * packet that fails is removed from the batch with its sent timestamp left
+ * cleared, but doesn't affect any of the others.
  */
-int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
-        uint32_t inter_packet_delay, struct timeval *sent) {
-
-    static struct timeval last = {0, 0};
-#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
-    /*
-     * This could be associated more closely with each individual socket, but
-     * for now lets store the id of the packets we send here so that calling
-     * functions don't need to do any extra work. We make the assumption that
-     * tests will generally use file descriptors with lower numbers, so we can
-     * use a small array indexed by file descriptor to store the packet count
-     * for the values of descriptor that we expect to see, which are then used
-     * to match the correct timestamp message. We also make the assumption that
-     * the same file descriptor always refers to the same socket, and they
-     * aren't being reused.
-     * TODO attach packet count information to the socket and pass it around.
-     */
-    static uint32_t packet_id[MAX_TX_TIMESTAMP_FD] = {0};
-#endif
-    int bytes_sent;
-    struct timeval now;
-    int delay, diff;
-
-    assert(sock > 0);
-    assert(size > 0);
-    assert(packet);
-    assert(dest);
+int flush_send_batch(struct send_batch_t *batch) {
+    struct timespec sent_time;
+    int64_t now;
+    int allowed, diff, bytes;
+    int start, i;
+    int result = 0;
 
-    gettimeofday(&now, NULL);
+    assert(batch);
 
-    /* if time has gone backwards then cap it at the last time */
-    if ( (diff = DIFF_TV_US(now, last)) < 0 ) {
-        diff = 0;
+    if ( batch->count == 0 ) {
+        return 0;
     }
 
-    /* determine how much time is left to wait until the minimum delay */
-    if ( last.tv_sec != 0 && diff < (int)inter_packet_delay ) {
-        delay = inter_packet_delay - diff;
+    now = monotonic_ns();
+    diff = (now - last_sent) / 1000;
+
+    /* determine how many packets we are allowed to send right now */
+    if ( last_sent == 0 || batch->inter_packet_delay == 0 ) {
+        allowed = batch->count;
+    } else if ( diff < (int)batch->inter_packet_delay ) {
+        return batch->inter_packet_delay - diff;
     } else {
-        delay = 0;
-        last.tv_sec = now.tv_sec;
-        last.tv_usec = now.tv_usec;
-
-        /* populate sent timestamp (might get overwritten by a better one) */
-        if ( sent ) {
-            sent->tv_sec = now.tv_sec;
-            sent->tv_usec = now.tv_usec;
+        allowed = diff / batch->inter_packet_delay;
+        if ( allowed > batch->count ) {
+            allowed = batch->count;
         }
     }
 
     /*
-     * if there is still time to wait before the next packet then return
-     * control to the caller, in case they want to do more work while waiting
+     * Reserve the packets from the shared budget once, and send exactly
+     * those packets when the budget says they may be sent.
      */
-    if ( delay != 0 ) {
-        return delay;
+    if ( batch->reserved == 0 ) {
+        for ( i = 0, bytes = 0; i < allowed; i++ ) {
+            bytes += batch->packets[i].size;
+        }
+#ifndef _WIN32
+        batch->budget_ready = rate_budget_reserve(allowed, bytes);
+#endif
+        batch->reserved = allowed;
     }
 
-    bytes_sent = sendto(sock, packet, size, 0, dest->ai_addr, dest->ai_addrlen);
+    if ( batch->budget_ready > now ) {
+        return (batch->budget_ready - now + 999) / 1000;
+    }
 
-#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
-    /* get timestamp if TIMESTAMPING is available and we know the packet id */
-    if ( sock < MAX_TX_TIMESTAMP_FD ) {
-        get_tx_timestamping(sock, packet_id[sock]++, sent);
-    } else {
-        Log(LOG_WARNING,
-                "Transmit timestamps only supported for file descriptors < %d",
-                MAX_TX_TIMESTAMP_FD);
+    allowed = batch->reserved;
+    batch->reserved = 0;
+    last_sent = now;
+
+    /* send each run of consecutive packets that share a socket together */
+    for ( start = 0; start < allowed; ) {
+        int end;
+
+        for ( end = start + 1; end < allowed &&
+                batch->packets[end].sock == batch->packets[start].sock;
+                end++ ) {
+            /* nothing */
+        }
+
+        /* populate sent timestamps (might get overwritten by a better one) */
+        get_realtime(&sent_time);
+        for ( i = start; i < end; i++ ) {
+            if ( batch->packets[i].sent ) {
+                *batch->packets[i].sent = sent_time;
+            }
+        }
+
+        batch->failed += send_batch_run(&batch->packets[start], end - start);
+        start = end;
     }
-#endif
 
-    /* TODO determine error and/or send any unsent bytes */
-    if ( bytes_sent != size ) {
-        Log(LOG_DEBUG, "Only sent %d of %d bytes", bytes_sent, size);
-        return -1;
+    /* shuffle any packets that weren't allowed to be sent to the front */
+    for ( i = allowed; i < batch->count; i++ ) {
+        struct batch_packet_t tmp = batch->packets[i - allowed];
+        batch->packets[i - allowed] = batch->packets[i];
+        batch->packets[i] = tmp;
     }
+    batch->count -= allowed;
 
-    return 0;
+    if ( batch->count > 0 ) {
+        result = batch->inter_packet_delay;
+    } else if ( batch->failed > 0 ) {
+        batch->failed = 0;
+        result = -1;
+    }
+
+    return result;
 }
 
 
@@ -962,26 +1901,27 @@ static void set_timestamp_socket_option(int sock) {
         if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &optval,
                     sizeof(optval)) >= 0 ) {
             Log(LOG_DEBUG, "Using SOF_TIMESTAMPING_SOFTWARE");
+            new_tx_timestamp(sock);
             return;
         }
     }
 #endif
 
-    Log(LOG_DEBUG, "No SO_TIMESTAMPING support, trying SO_TIMESTAMP");
+    Log(LOG_DEBUG, "No SO_TIMESTAMPING support, trying SO_TIMESTAMPNS");
 
-#ifdef SO_TIMESTAMP
+#ifdef SO_TIMESTAMPNS
     {
         int one = 1;
-        /* try to enable socket timestamping using SO_TIMESTAMP */
-        if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &one,
+        /* try to enable nanosecond socket timestamping using SO_TIMESTAMPNS */
+        if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one,
                     sizeof(one)) >= 0 ) {
-            Log(LOG_DEBUG, "Using SO_TIMESTAMP");
+            Log(LOG_DEBUG, "Using SO_TIMESTAMPNS");
             return;
         }
     }
 #endif
 
-    Log(LOG_DEBUG, "No SO_TIMESTAMP support, using SIOCGSTAMP");
+    Log(LOG_DEBUG, "No SO_TIMESTAMPNS support, using SIOCGSTAMPNS");
 }
 
 
@@ -1326,3 +2266,18 @@ void do_socket_setup(int sock, int family, struct sockopt_t *options) {
         }
     }
 }
+
+
+
+#if UNIT_TEST
+/*
+ * Number of sockets that still have packets waiting on a transmit timestamp.
+ */
+int amp_test_tx_timestamp_active(void) {
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    return tx_active_count;
+#else
+    return 0;
+#endif
+}
+#endif
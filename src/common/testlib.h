@@ -75,9 +75,25 @@
         (int64_t) ( (((tva).tv_sec - (tvb).tv_sec) * 1000000) + \
             ((tva).tv_usec - (tvb).tv_usec) ) \
         )
+#define NS_FROM_TS(ts) ( \
+        ((int64_t)(ts).tv_sec * 1000000000) + (ts).tv_nsec \
+        )
+#define DIFF_TS_NS(tsa, tsb) ( NS_FROM_TS(tsa) - NS_FROM_TS(tsb) )
+
+/*
+ * number of packets per socket that can be waiting on a TX timestamp, must be
+ * a power of two
+ */
+#define TX_TIMESTAMP_RING_SIZE 1024
+
+/* maximum number of packets that can be queued to send in a single batch */
+#define MAX_SEND_BATCH 64
 
-/* maximum value of fd that will track packet sent counts (for TX timestamps) */
-#define MAX_TX_TIMESTAMP_FD 64
+/* maximum number of packets that can be read from a socket in a single batch */
+#define MAX_RECV_BATCH 64
+
+/* space for ancillary data (i.e. timestamps) for each packet in a batch */
+#define RECV_CONTROL_LEN 512
 
 /*
  * Structure combining the ipv4 and ipv6 network sockets so that they can be
@@ -88,6 +104,33 @@ struct socket_t {
     int socket6;                /* ipv6 socket, if available */
 };
 
+/*
+ * Opaque queue of probe packets that are sent together in a single batch.
+ */
+struct send_batch_t;
+
+/*
+ * A single packet received as part of a batch by get_packets().
+ */
+struct recv_packet_t {
+    char *data;                 /* packet data */
+    int bytes;                  /* number of bytes of packet data */
+    struct sockaddr_storage from; /* address the packet was received from */
+    struct timespec time;       /* time the packet was received */
+};
+
+/*
+ * Storage for a batch of packets read from a socket by get_packets(). Buffers
+ * are allocated once when the batch is created and reused for every call.
+ */
+struct recv_batch_t {
+    int size;                   /* maximum number of packets in a batch */
+    int buflen;                 /* maximum length of each packet */
+    int count;                  /* number of packets currently in the batch */
+    struct recv_packet_t *packets;
+    char *control;              /* ancillary data space for each packet */
+};
+
 struct sockopt_t {
     struct addrinfo *sourcev4;
     struct addrinfo *sourcev6;
@@ -113,11 +156,27 @@ struct timestamping_t {
 void set_proc_name(char *testname);
 void free_duped_environ(void);
 int unblock_signals(void);
+void get_realtime(struct timespec *now);
+int64_t monotonic_ns(void);
 int wait_for_data(struct socket_t *sockets, int *maxwait);
+int read_packet(int sock, char *buf, int buflen, struct sockaddr *saddr,
+        socklen_t addrlen, struct timespec *now);
 int get_packet(struct socket_t *sockets, char *buf, int buflen,
-	struct sockaddr *saddr, int *timeout, struct timeval *now);
+	struct sockaddr *saddr, int *timeout, struct timespec *now);
+struct recv_batch_t *new_recv_batch(int size, int buflen);
+void free_recv_batch(struct recv_batch_t *batch);
+int get_packets(struct socket_t *sockets, struct recv_batch_t *batch,
+        int *timeout);
+int harvest_tx_timestamps(void);
+int close_socket(int sock);
 int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
-        uint32_t inter_packet_delay, struct timeval *sent);
+        uint32_t inter_packet_delay, struct timespec *sent);
+struct send_batch_t *new_send_batch(struct socket_t *sockets, int size,
+        int max_packet_size, uint32_t inter_packet_delay);
+void free_send_batch(struct send_batch_t *batch);
+int queue_send_packet(struct send_batch_t *batch, char *packet, int size,
+        struct addrinfo *dest, int ttl, struct timespec *sent);
+int flush_send_batch(struct send_batch_t *batch);
 char *address_to_name(struct addrinfo *address);
 int compare_addresses(const struct sockaddr *a,
         const struct sockaddr *b, uint8_t len);
@@ -136,4 +195,8 @@ char *parse_optional_argument(char *argv[]);
 int set_and_verify_sockopt(int sock, int value, int proto, int opt,
         const char *optname);
 void do_socket_setup(int sock, int family, struct sockopt_t *options);
+
+#if UNIT_TEST
+int amp_test_tx_timestamp_active(void);
+#endif
 #endif
@@ -70,6 +70,7 @@ typedef struct amp_test_result {
     uint64_t timestamp;
     size_t len;
     void *data;
+    int64_t start_delay;    /* us after the scheduled time the test started */
 } amp_test_result_t;
 
 typedef struct test {
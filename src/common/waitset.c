@@ -0,0 +1,394 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2022 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <poll.h>
+
+#include "config.h"
+
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+#include "waitset.h"
+#include "debug.h"
+
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_MS 1000000LL
+
+#ifdef HAVE_EPOLL_PWAIT2
+/*
+ * Set once epoll_pwait2() has failed with ENOSYS. The C library can provide
+ * the wrapper even when the running kernel (older than 5.11) doesn't have the
+ * system call, so remember that and fall back to millisecond timeouts.
+ */
+static int epoll_pwait2_missing = 0;
+#endif
+
+/*
+ * The epoll backend only needs to track the number of descriptors, but the
+ * ppoll backend needs to keep the full array of descriptors to pass in.
+ */
+struct wait_set_t {
+#ifdef HAVE_EPOLL_CREATE1
+    int epfd;
+#else
+    struct pollfd *fds;
+    int size;
+#endif
+    int count;
+};
+
+
+
+/*
+ * Create a new, empty set of file descriptors to wait on.
+ */
+struct wait_set_t *new_wait_set(void) {
+    struct wait_set_t *set = calloc(1, sizeof(struct wait_set_t));
+
+#ifdef HAVE_EPOLL_CREATE1
+    if ( (set->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create epoll instance: %s",
+                strerror(errno));
+        free(set);
+        return NULL;
+    }
+#endif
+
+    return set;
+}
+
+
+
+/*
+ * Free a set of file descriptors. The descriptors themselves are not closed.
+ */
+void free_wait_set(struct wait_set_t *set) {
+    if ( set == NULL ) {
+        return;
+    }
+
+#ifdef HAVE_EPOLL_CREATE1
+    close(set->epfd);
+#else
+    free(set->fds);
+#endif
+    free(set);
+}
+
+
+
+/*
+ * Add a file descriptor to the set, to be waited on for the given events
+ * (WAIT_READ and/or WAIT_WRITE). Returns 0 on success, -1 on failure.
+ */
+int wait_set_add(struct wait_set_t *set, int fd, int events) {
+    assert(set);
+    assert(events & (WAIT_READ | WAIT_WRITE));
+
+    if ( fd < 0 ) {
+        return -1;
+    }
+
+#ifdef HAVE_EPOLL_CREATE1
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = ((events & WAIT_READ) ? EPOLLIN : 0) |
+            ((events & WAIT_WRITE) ? EPOLLOUT : 0);
+        event.data.fd = fd;
+
+        if ( epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &event) < 0 ) {
+            Log(LOG_WARNING, "Failed to add descriptor %d to epoll: %s", fd,
+                    strerror(errno));
+            return -1;
+        }
+    }
+#else
+    if ( set->count == set->size ) {
+        set->size = set->size ? set->size * 2 : 4;
+        set->fds = realloc(set->fds, sizeof(struct pollfd) * set->size);
+    }
+
+    set->fds[set->count].fd = fd;
+    set->fds[set->count].events = ((events & WAIT_READ) ? POLLIN : 0) |
+        ((events & WAIT_WRITE) ? POLLOUT : 0);
+    set->fds[set->count].revents = 0;
+#endif
+
+    set->count++;
+
+    return 0;
+}
+
+
+
+/*
+ * Add all the valid sockets in a struct socket_t to the set, waiting for
+ * them to become readable. Returns 0 on success, -1 on failure.
+ */
+int wait_set_add_sockets(struct wait_set_t *set, struct socket_t *sockets) {
+    assert(set);
+    assert(sockets);
+
+    if ( sockets->socket > 0 &&
+            wait_set_add(set, sockets->socket, WAIT_READ) < 0 ) {
+        return -1;
+    }
+
+    if ( sockets->socket6 > 0 &&
+            wait_set_add(set, sockets->socket6, WAIT_READ) < 0 ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Remove a file descriptor from the set. Returns 0 on success, -1 if the
+ * descriptor wasn't in the set.
+ */
+int wait_set_remove(struct wait_set_t *set, int fd) {
+    assert(set);
+
+#ifdef HAVE_EPOLL_CREATE1
+    if ( epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 ) {
+        return -1;
+    }
+#else
+    {
+        int i;
+
+        for ( i = 0; i < set->count; i++ ) {
+            if ( set->fds[i].fd == fd ) {
+                break;
+            }
+        }
+
+        if ( i == set->count ) {
+            return -1;
+        }
+
+        /* order doesn't matter, so move the last descriptor into the gap */
+        set->fds[i] = set->fds[set->count - 1];
+    }
+#endif
+
+    set->count--;
+
+    return 0;
+}
+
+
+
+#ifdef HAVE_EPOLL_CREATE1
+/*
+ * Wait on an epoll descriptor for at most timeout nanoseconds (or forever if
+ * negative). Uses epoll_pwait2() for the full precision when the kernel has
+ * it, otherwise the timeout is rounded to milliseconds for epoll_pwait().
+ */
+static int epoll_wait_ns(int epfd, struct epoll_event *events, int maxready,
+        int64_t timeout) {
+#ifdef HAVE_EPOLL_PWAIT2
+    if ( !__atomic_load_n(&epoll_pwait2_missing, __ATOMIC_RELAXED) ) {
+        struct timespec ts;
+        int count;
+
+        ts.tv_sec = timeout / NS_PER_SEC;
+        ts.tv_nsec = timeout % NS_PER_SEC;
+        count = epoll_pwait2(epfd, events, maxready,
+                timeout < 0 ? NULL : &ts, NULL);
+
+        if ( count >= 0 || errno != ENOSYS ) {
+            return count;
+        }
+
+        Log(LOG_DEBUG, "epoll_pwait2() unavailable, using epoll_pwait()");
+        __atomic_store_n(&epoll_pwait2_missing, 1, __ATOMIC_RELAXED);
+    }
+#endif
+
+    /* round up so that we never wake early and spin waiting for the rest */
+    return epoll_pwait(epfd, events, maxready,
+            timeout < 0 ? -1 : (int)((timeout + NS_PER_MS - 1) / NS_PER_MS),
+            NULL);
+}
+#endif
+
+
+
+/*
+ * Perform a single wait on the set using whichever backend is available,
+ * waiting at most timeout nanoseconds (or forever if negative).
+ */
+static int wait_set_poll(struct wait_set_t *set, int64_t timeout,
+        struct wait_event_t *ready, int maxready) {
+    int count;
+    int i;
+
+#ifdef HAVE_EPOLL_CREATE1
+    struct epoll_event events[MAX_WAIT_EVENTS];
+
+    if ( maxready > MAX_WAIT_EVENTS ) {
+        maxready = MAX_WAIT_EVENTS;
+    }
+
+    count = epoll_wait_ns(set->epfd, events, maxready, timeout);
+
+    for ( i = 0; i < count; i++ ) {
+        ready[i].fd = events[i].data.fd;
+        if ( events[i].events & (EPOLLERR | EPOLLHUP) ) {
+            ready[i].events = WAIT_READ | WAIT_WRITE;
+        } else {
+            ready[i].events = ((events[i].events & EPOLLIN) ? WAIT_READ : 0) |
+                ((events[i].events & EPOLLOUT) ? WAIT_WRITE : 0);
+        }
+    }
+#else
+    struct timespec ts;
+    int found;
+
+    ts.tv_sec = timeout / NS_PER_SEC;
+    ts.tv_nsec = timeout % NS_PER_SEC;
+
+    if ( (count = ppoll(set->fds, set->count, timeout < 0 ? NULL : &ts,
+                    NULL)) <= 0 ) {
+        return count;
+    }
+
+    for ( i = 0, found = 0; i < set->count && found < maxready; i++ ) {
+        short revents = set->fds[i].revents;
+
+        if ( revents == 0 ) {
+            continue;
+        }
+
+        ready[found].fd = set->fds[i].fd;
+        if ( revents & (POLLERR | POLLHUP | POLLNVAL) ) {
+            ready[found].events = WAIT_READ | WAIT_WRITE;
+        } else {
+            ready[found].events = ((revents & POLLIN) ? WAIT_READ : 0) |
+                ((revents & POLLOUT) ? WAIT_WRITE : 0);
+        }
+        found++;
+    }
+
+    count = found;
+#endif
+
+    return count;
+}
+
+
+
+/*
+ * Wait for up to timeout nanoseconds (or forever if timeout is NULL or
+ * WAIT_FOREVER) for any descriptor in the set to become ready. Up to
+ * maxready ready descriptors are stored in the ready array. The time spent
+ * waiting is measured with the monotonic clock and removed from the timeout
+ * so that it can be used again to carry on waiting. Returns the number of
+ * ready descriptors, 0 if the timeout expired, or -1 on error.
+ */
+int wait_set_wait(struct wait_set_t *set, int64_t *timeout_ns,
+        struct wait_event_t *ready, int maxready) {
+    int64_t start;
+    int64_t elapsed;
+    int64_t remaining;
+    int count;
+
+    assert(set);
+    assert(ready);
+    assert(maxready > 0);
+
+    start = monotonic_ns();
+    elapsed = 0;
+
+    do {
+        /* carry on where we left off if interrupted by a signal */
+        if ( timeout_ns == NULL || *timeout_ns < 0 ) {
+            remaining = WAIT_FOREVER;
+        } else if ( elapsed > *timeout_ns ) {
+            remaining = 0;
+        } else {
+            remaining = *timeout_ns - elapsed;
+        }
+
+        count = wait_set_poll(set, remaining, ready, maxready);
+        elapsed = monotonic_ns() - start;
+    } while ( count < 0 && errno == EINTR );
+
+    /* remove the time waited so far from the timeout */
+    if ( timeout_ns && *timeout_ns >= 0 ) {
+        *timeout_ns -= elapsed;
+        if ( *timeout_ns < 0 ) {
+            *timeout_ns = 0;
+        }
+    }
+
+    if ( count < 0 ) {
+        Log(LOG_WARNING, "Failed to wait for descriptors: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return count;
+}
+
+
+
+#if UNIT_TEST
+/*
+ * Behave as if the kernel doesn't support epoll_pwait2(), so the fallback
+ * can be tested on machines that do.
+ */
+void amp_test_disable_epoll_pwait2(void) {
+#ifdef HAVE_EPOLL_PWAIT2
+    __atomic_store_n(&epoll_pwait2_missing, 1, __ATOMIC_RELAXED);
+#endif
+}
+#endif
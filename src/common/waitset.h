@@ -0,0 +1,83 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _COMMON_WAITSET_H
+#define _COMMON_WAITSET_H
+
+#include <stdint.h>
+
+#include "testlib.h"
+
+/* events that can be waited for on a file descriptor */
+#define WAIT_READ 0x01
+#define WAIT_WRITE 0x02
+
+/* wait with no timeout, until a descriptor becomes ready */
+#define WAIT_FOREVER -1
+
+/* maximum number of ready descriptors returned by a single wait */
+#define MAX_WAIT_EVENTS 64
+
+/*
+ * A ready file descriptor returned by wait_set_wait(), along with the events
+ * that it is ready for. Errors and hangups are reported as being ready for
+ * both reading and writing, so that the following call reports the error.
+ */
+struct wait_event_t {
+    int fd;
+    int events;
+};
+
+/*
+ * Persistent set of file descriptors that can be waited on repeatedly without
+ * having to rebuild it each time. Uses epoll where available, otherwise ppoll.
+ */
+struct wait_set_t;
+
+struct wait_set_t *new_wait_set(void);
+void free_wait_set(struct wait_set_t *set);
+int wait_set_add(struct wait_set_t *set, int fd, int events);
+int wait_set_add_sockets(struct wait_set_t *set, struct socket_t *sockets);
+int wait_set_remove(struct wait_set_t *set, int fd);
+int wait_set_wait(struct wait_set_t *set, int64_t *timeout_ns,
+        struct wait_event_t *ready, int maxready);
+
+#if UNIT_TEST
+void amp_test_disable_epoll_pwait2(void);
+#endif
+#endif
@@ -0,0 +1,441 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Limit the number of scheduled tests of each type that can be running at
+ * the same time, as well as the total number of tests running. Tests that are scheduled at the same time (which is very
+ * common, as they are aligned to period boundaries) can otherwise all start
+ * in the same second and compete for CPU and the network, which shows up in
+ * their measurements.
+ *
+ * A table of slots is kept in memory shared with every test process. The
+ * main process claims a slot before starting a test, and the test process
+ * records its pid in the slot when it starts and releases it as it exits.
+ * If the test dies without releasing the slot then the main process will
+ * reclaim it when it finds the process no longer exists.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "admission.h"
+#include "debug.h"
+#include "waitset.h"
+
+/* table of slots shared with the test processes */
+static struct admission_slot *slots = NULL;
+
+/* running limits for each test type, copied from the configuration */
+static int default_max_running = 0;
+static int max_total = 0;
+static int max_delay = DEFAULT_ADMISSION_MAX_DELAY;
+static admission_limit_t *limits = NULL;
+
+/* the slot this process is running a test in, if any */
+static int current_slot = ADMISSION_UNLIMITED;
+
+static struct admission_stats stats;
+
+
+
+/*
+ * Find the maximum number of tests of this type that may run at once.
+ */
+static int get_max_running(test_t *test) {
+    admission_limit_t *limit;
+
+    for ( limit = limits; limit != NULL; limit = limit->next ) {
+        if ( strcmp(limit->name, test->name) == 0 ) {
+            return limit->max_running;
+        }
+    }
+
+    return default_max_running;
+}
+
+
+
+/*
+ * Free a slot whose test has gone away without releasing it. Uses a compare
+ * and swap in case the test process is changing the slot at the same time.
+ */
+static int reclaim_slot(struct admission_slot *slot, int32_t state) {
+    if ( __atomic_compare_exchange_n(&slot->state, &state,
+                ADMISSION_SLOT_FREE, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+        stats.reclaimed++;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Count the running tests, both of the given type and in total. If check is
+ * set then make sure that each one really is still running, reclaiming the
+ * slots of any that aren't.
+ */
+static void count_running(uint64_t test_id, int check, int64_t now,
+        int *count, int *total) {
+    int i;
+
+    *count = 0;
+    *total = 0;
+
+    for ( i = 0; i < MAX_ADMISSION_SLOTS; i++ ) {
+        struct admission_slot *slot = &slots[i];
+        int32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if ( state == ADMISSION_SLOT_FREE ) {
+            continue;
+        }
+
+        if ( check ) {
+            if ( state == ADMISSION_SLOT_STARTING &&
+                    now - slot->claimed > ADMISSION_START_TIMEOUT &&
+                    reclaim_slot(slot, state) ) {
+                Log(LOG_DEBUG, "Reclaimed admission slot %d, never started",
+                        i + 1);
+                continue;
+            }
+
+            if ( state == ADMISSION_SLOT_RUNNING &&
+                    kill(__atomic_load_n(&slot->pid, __ATOMIC_RELAXED),
+                        0) < 0 && errno == ESRCH &&
+                    reclaim_slot(slot, state) ) {
+                Log(LOG_DEBUG, "Reclaimed admission slot %d, test exited",
+                        i + 1);
+                continue;
+            }
+        }
+
+        if ( slot->test_id == test_id ) {
+            (*count)++;
+        }
+        (*total)++;
+    }
+}
+
+
+
+/*
+ * Check if starting another test of this type would go over either the
+ * limit for the type or the limit on all tests.
+ */
+static int is_full(int max_running, int count, int total) {
+    return (max_running > 0 && count >= max_running) ||
+        (max_total > 0 && total >= max_total);
+}
+
+
+
+/*
+ * Record the delay between the time a test was scheduled and the time it
+ * actually started.
+ */
+static void record_start(int64_t delay) {
+    if ( delay < 0 ) {
+        delay = 0;
+    }
+
+    stats.started++;
+    stats.total_delay += delay;
+    if ( (uint64_t)delay > stats.max_delay ) {
+        stats.max_delay = delay;
+    }
+}
+
+
+
+/*
+ * Release the slot held by this process as it exits, however it exits.
+ * Test processes may have children of their own that inherit this handler,
+ * so only the process that started the test releases the slot.
+ */
+static void release_current_slot(void) {
+    struct admission_slot *slot;
+    int32_t state = ADMISSION_SLOT_RUNNING;
+
+    if ( slots == NULL || current_slot <= ADMISSION_UNLIMITED ) {
+        return;
+    }
+
+    slot = &slots[current_slot - 1];
+
+    if ( __atomic_load_n(&slot->pid, __ATOMIC_RELAXED) != getpid() ) {
+        return;
+    }
+
+    __atomic_compare_exchange_n(&slot->state, &state, ADMISSION_SLOT_FREE, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    current_slot = ADMISSION_UNLIMITED;
+}
+
+
+
+/*
+ * Create the table of slots shared with test processes. This must be done
+ * before the worker pool is started, so that the workers share it too.
+ */
+int start_admission_control(admission_config_t *config) {
+    admission_limit_t *limit;
+
+    if ( config == NULL ) {
+        return 0;
+    }
+
+    stop_admission_control();
+
+    default_max_running = config->max_running;
+    max_total = config->max_total;
+    max_delay = config->max_delay;
+
+    /* keep a private copy of the limits, the config will be freed */
+    for ( limit = config->limits; limit != NULL; limit = limit->next ) {
+        admission_limit_t *copy = calloc(1, sizeof(admission_limit_t));
+        copy->name = strdup(limit->name);
+        copy->max_running = limit->max_running;
+        copy->next = limits;
+        limits = copy;
+    }
+
+    /* don't bother with the table at all if nothing is limited */
+    if ( default_max_running <= 0 && max_total <= 0 ) {
+        for ( limit = limits; limit != NULL; limit = limit->next ) {
+            if ( limit->max_running > 0 ) {
+                break;
+            }
+        }
+
+        if ( limit == NULL ) {
+            return 0;
+        }
+    }
+
+    slots = mmap(NULL, sizeof(struct admission_slot) * MAX_ADMISSION_SLOTS,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if ( slots == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to create admission table: %s",
+                strerror(errno));
+        slots = NULL;
+        return -1;
+    }
+
+    Log(LOG_DEBUG, "Limiting running tests to %d per test type and %d in "
+            "total, waiting at most %dms", default_max_running, max_total,
+            max_delay);
+
+    return 0;
+}
+
+
+
+/*
+ * Remove all limits on running tests.
+ */
+void stop_admission_control(void) {
+    admission_limit_t *limit;
+
+    while ( limits != NULL ) {
+        limit = limits;
+        limits = limits->next;
+        free(limit->name);
+        free(limit);
+    }
+
+    if ( slots != NULL ) {
+        munmap(slots, sizeof(struct admission_slot) * MAX_ADMISSION_SLOTS);
+        slots = NULL;
+    }
+
+    default_max_running = 0;
+    max_total = 0;
+    max_delay = DEFAULT_ADMISSION_MAX_DELAY;
+}
+
+
+
+/*
+ * Try to claim a slot for a test that is about to start, which was due to
+ * start delay microseconds ago. Returns the slot number if one was claimed,
+ * ADMISSION_UNLIMITED if tests aren't being limited, ADMISSION_FULL if the
+ * test should try again shortly, or ADMISSION_SKIP if it has waited too long
+ * and this run should be skipped.
+ */
+int admission_acquire(test_t *test, int64_t delay) {
+    int max_running;
+    int count, total;
+    int64_t now;
+    int i;
+
+    if ( slots == NULL ) {
+        record_start(delay);
+        return ADMISSION_UNLIMITED;
+    }
+
+    /* tests are still counted if only the total is limited */
+    max_running = get_max_running(test);
+    if ( max_running <= 0 && max_total <= 0 ) {
+        record_start(delay);
+        return ADMISSION_UNLIMITED;
+    }
+
+    now = monotonic_ns();
+
+    /* only check that tests are still alive if they appear to be full */
+    count_running(test->id, 0, now, &count, &total);
+    if ( is_full(max_running, count, total) ) {
+        count_running(test->id, 1, now, &count, &total);
+    }
+
+    if ( is_full(max_running, count, total) ) {
+        if ( delay > (int64_t)max_delay * 1000 ) {
+            Log(LOG_WARNING, "Skipping %s test, waited %" PRId64 "ms with %d "
+                    "%s tests and %d tests in total running", test->name,
+                    delay / 1000, count, test->name, total);
+            stats.skipped++;
+            return ADMISSION_SKIP;
+        }
+
+        stats.deferred++;
+        return ADMISSION_FULL;
+    }
+
+    /* only the main process claims slots, so a free one stays free */
+    for ( i = 0; i < MAX_ADMISSION_SLOTS; i++ ) {
+        if ( __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE) ==
+                ADMISSION_SLOT_FREE ) {
+            slots[i].test_id = test->id;
+            slots[i].claimed = now;
+            slots[i].pid = 0;
+            __atomic_store_n(&slots[i].state, ADMISSION_SLOT_STARTING,
+                    __ATOMIC_RELEASE);
+            stats.admitted++;
+            record_start(delay);
+            return i + 1;
+        }
+    }
+
+    /* every slot is in use, run the test but without accounting for it */
+    Log(LOG_WARNING, "No free admission slots, starting %s test anyway",
+            test->name);
+    record_start(delay);
+    return ADMISSION_UNLIMITED;
+}
+
+
+
+/*
+ * Give back a slot that was claimed for a test that then failed to start.
+ * A slot that the test has already marked as running is left alone, it is
+ * released when the test process exits.
+ */
+void admission_cancel(int slot) {
+    int32_t state = ADMISSION_SLOT_STARTING;
+
+    if ( slots == NULL || slot <= ADMISSION_UNLIMITED ||
+            slot > MAX_ADMISSION_SLOTS ) {
+        return;
+    }
+
+    __atomic_compare_exchange_n(&slots[slot - 1].state, &state,
+            ADMISSION_SLOT_FREE, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Called by the test process as the test starts, to mark the slot as being
+ * used by this process. The slot is released when the process exits.
+ */
+void admission_started(int slot) {
+    int32_t state = ADMISSION_SLOT_STARTING;
+
+    if ( slots == NULL || slot <= ADMISSION_UNLIMITED ||
+            slot > MAX_ADMISSION_SLOTS ) {
+        return;
+    }
+
+    __atomic_store_n(&slots[slot - 1].pid, getpid(), __ATOMIC_RELAXED);
+
+    /* the slot may have been reclaimed if this took far too long to start */
+    if ( !__atomic_compare_exchange_n(&slots[slot - 1].state, &state,
+                ADMISSION_SLOT_RUNNING, 0, __ATOMIC_ACQ_REL,
+                __ATOMIC_RELAXED) ) {
+        return;
+    }
+
+    current_slot = slot;
+
+    if ( atexit(release_current_slot) != 0 ) {
+        Log(LOG_WARNING, "Failed to register admission slot release");
+    }
+}
+
+
+
+void admission_get_stats(struct admission_stats *out) {
+    memcpy(out, &stats, sizeof(struct admission_stats));
+}
+
+
+
+/*
+ * Write the admission statistics to the debug dump.
+ */
+void dump_admission_stats(FILE *out) {
+    fprintf(out, "Admission: %" PRIu64 " started, %" PRIu64 " admitted, %"
+            PRIu64 " deferred, %" PRIu64 " skipped, %" PRIu64 " reclaimed\n",
+            stats.started, stats.admitted, stats.deferred, stats.skipped,
+            stats.reclaimed);
+    fprintf(out, "Admission start delay: %.3fms average, %.3fms max\n",
+            stats.started ? stats.total_delay / 1000.0 / stats.started : 0.0,
+            stats.max_delay / 1000.0);
+}
@@ -0,0 +1,124 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_ADMISSION_H
+#define _MEASURED_ADMISSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tests.h"
+
+/* maximum number of scheduled tests that can be tracked as running at once */
+#define MAX_ADMISSION_SLOTS 1024
+
+/* default time a test can wait for a free slot before it is skipped (ms) */
+#define DEFAULT_ADMISSION_MAX_DELAY 5000
+
+/* how often a test waiting for a free slot tries again (ms) */
+#define ADMISSION_RETRY_MS 100
+
+/* slots handed to a worker that never starts the test are reclaimed (ns) */
+#define ADMISSION_START_TIMEOUT (60 * INT64_C(1000000000))
+
+/* results of trying to admit a test that didn't get a slot */
+#define ADMISSION_UNLIMITED 0
+#define ADMISSION_FULL -1
+#define ADMISSION_SKIP -2
+
+/* state of a single slot in the shared table */
+enum admission_state {
+    ADMISSION_SLOT_FREE = 0,        /* available to be claimed */
+    ADMISSION_SLOT_STARTING,        /* claimed by measured, not yet started */
+    ADMISSION_SLOT_RUNNING,         /* test process is running */
+};
+
+/*
+ * One entry in the table of running tests. The table is shared between
+ * measured and every test process, so that tests run by the worker pool
+ * are accounted for the same as tests forked directly.
+ */
+struct admission_slot {
+    uint64_t test_id;               /* class the running test belongs to */
+    int64_t claimed;                /* monotonic time slot was claimed (ns) */
+    int32_t pid;                    /* process running the test */
+    int32_t state;                  /* enum admission_state */
+};
+
+/*
+ * Limit on the number of concurrently running tests for one test type,
+ * overriding the default limit.
+ */
+typedef struct admission_limit {
+    char *name;                     /* name of the test type */
+    int max_running;                /* maximum running, 0 for unlimited */
+    struct admission_limit *next;
+} admission_limit_t;
+
+/*
+ * Scheduler configuration from the client config file.
+ */
+typedef struct admission_config {
+    int max_running;                /* default per test type, 0 unlimited */
+    int max_total;                  /* all test types together, 0 unlimited */
+    int jitter;                     /* budget to spread test starts (ms) */
+    int max_delay;                  /* longest a test can wait for a slot */
+    admission_limit_t *limits;      /* per test type overrides */
+} admission_config_t;
+
+struct admission_stats {
+    uint64_t admitted;              /* tests given a slot and started */
+    uint64_t deferred;              /* attempts that found no free slot */
+    uint64_t skipped;               /* runs skipped after waiting too long */
+    uint64_t reclaimed;             /* slots freed after a test died */
+    uint64_t started;               /* tests started, limited or not */
+    uint64_t total_delay;           /* sum of all start delays (us) */
+    uint64_t max_delay;             /* largest start delay (us) */
+};
+
+int start_admission_control(admission_config_t *config);
+void stop_admission_control(void);
+int admission_acquire(test_t *test, int64_t delay);
+void admission_cancel(int slot);
+void admission_started(int slot);
+void admission_get_stats(struct admission_stats *stats);
+void dump_admission_stats(FILE *out);
+
+#endif
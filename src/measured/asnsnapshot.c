@@ -0,0 +1,472 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Saves the ASN cache to disk so that it doesn't start out empty every time
+ * measured restarts. The snapshot is a single file of fixed size entries
+ * sorted by network, which is mapped read only and searched in place - there
+ * is nothing to parse or allocate when loading it. Entries learnt since the
+ * snapshot was taken are kept in the in-memory trie, which is checked first,
+ * and are merged into a new snapshot each time it is written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#if _WIN32
+#include <io.h>
+#include "w32-compat.h"
+#define fsync(fd) _commit(fd)
+#else
+#define O_BINARY 0
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#endif
+
+#include "asnsnapshot.h"
+#include "debug.h"
+
+
+/* entries being collected to write a new snapshot */
+struct snapshot_builder {
+    struct asn_snapshot_entry *entries[2];
+    uint32_t count[2];
+    uint32_t size[2];
+};
+
+
+
+/*
+ * Get the first 64 bits of the address in host byte order, masked to the
+ * prefix length. IPv4 addresses are stored in the upper 32 bits.
+ */
+static uint64_t get_network(struct sockaddr *address, uint8_t prefix) {
+    uint64_t network = 0;
+    int i;
+
+    if ( address->sa_family == AF_INET ) {
+        network = (uint64_t)ntohl(
+                ((struct sockaddr_in*)address)->sin_addr.s_addr) << 32;
+    } else {
+        uint8_t *bytes = ((struct sockaddr_in6*)address)->sin6_addr.s6_addr;
+        for ( i = 0; i < 8; i++ ) {
+            network = (network << 8) | bytes[i];
+        }
+    }
+
+    if ( prefix == 0 ) {
+        return 0;
+    }
+
+    if ( prefix >= 64 ) {
+        return network;
+    }
+
+    return network & (~(uint64_t)0 << (64 - prefix));
+}
+
+
+
+/*
+ * Sort entries by network, with the newest entry for a network first so
+ * that it is the one that is kept when duplicates are removed.
+ */
+static int compare_entries(const void *a, const void *b) {
+    const struct asn_snapshot_entry *x = a, *y = b;
+
+    if ( x->network != y->network ) {
+        return x->network < y->network ? -1 : 1;
+    }
+
+    if ( x->prefix != y->prefix ) {
+        return x->prefix < y->prefix ? -1 : 1;
+    }
+
+    if ( x->expires != y->expires ) {
+        return x->expires > y->expires ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+
+static void add_entry(struct snapshot_builder *builder, int family,
+        uint64_t network, uint8_t prefix, uint32_t asn, int64_t expires) {
+    struct asn_snapshot_entry *entry;
+    int index = family == AF_INET ? 0 : 1;
+
+    if ( builder->count[index] == builder->size[index] ) {
+        builder->size[index] = builder->size[index] ?
+            builder->size[index] * 2 : 1024;
+        builder->entries[index] = realloc(builder->entries[index],
+                builder->size[index] * sizeof(struct asn_snapshot_entry));
+    }
+
+    entry = &builder->entries[index][builder->count[index]++];
+    memset(entry, 0, sizeof(*entry));
+    entry->network = network;
+    entry->prefix = prefix;
+    entry->asn = asn;
+    entry->expires = expires;
+}
+
+
+
+/*
+ * Collect all the entries from the in-memory trie.
+ */
+static int add_trie_entry(iptrie_node_t *node, void *data) {
+    struct snapshot_builder *builder = (struct snapshot_builder*)data;
+
+    /* the network won't fit, and the cache shouldn't have added it anyway */
+    if ( node->prefix > 64 || node->as < 0 ) {
+        return 0;
+    }
+
+    add_entry(builder, node->address->sa_family,
+            get_network(node->address, node->prefix), node->prefix,
+            (uint32_t)node->as, node->expires);
+
+    return 0;
+}
+
+
+
+/*
+ * Sort the entries and remove duplicates (keeping the newest).
+ */
+static uint32_t sort_entries(struct asn_snapshot_entry *entries,
+        uint32_t count) {
+    uint32_t i, unique = 0;
+
+    if ( count == 0 ) {
+        return 0;
+    }
+
+    qsort(entries, count, sizeof(struct asn_snapshot_entry), compare_entries);
+
+    for ( i = 1; i < count; i++ ) {
+        if ( entries[i].network != entries[unique].network ||
+                entries[i].prefix != entries[unique].prefix ) {
+            entries[++unique] = entries[i];
+        }
+    }
+
+    return unique + 1;
+}
+
+
+
+/*
+ * Release the memory holding a snapshot, however it was loaded.
+ */
+static void unmap_snapshot(void *map, __attribute__((unused))size_t size) {
+#if _WIN32
+    free(map);
+#else
+    munmap(map, size);
+#endif
+}
+
+
+
+/*
+ * Map a snapshot file into memory. Returns NULL if there is no snapshot or
+ * it isn't valid, in which case the cache will just start out empty.
+ */
+struct asn_snapshot *open_asn_snapshot(char *path) {
+    struct asn_snapshot *snapshot;
+    struct asn_snapshot_header *header;
+    struct stat statbuf;
+    void *map;
+    int fd;
+
+    assert(path);
+
+    if ( (fd = open(path, O_RDONLY | O_BINARY)) < 0 ) {
+        if ( errno != ENOENT ) {
+            Log(LOG_WARNING, "Failed to open ASN snapshot %s: %s", path,
+                    strerror(errno));
+        }
+        return NULL;
+    }
+
+    if ( fstat(fd, &statbuf) < 0 ||
+            (size_t)statbuf.st_size < sizeof(struct asn_snapshot_header) ) {
+        Log(LOG_WARNING, "Ignoring invalid ASN snapshot %s", path);
+        close(fd);
+        return NULL;
+    }
+
+#if _WIN32
+    /* no mmap(), so read the whole file into memory instead */
+    if ( (map = malloc(statbuf.st_size)) == NULL ||
+            read(fd, map, statbuf.st_size) != statbuf.st_size ) {
+        Log(LOG_WARNING, "Failed to read ASN snapshot %s: %s", path,
+                strerror(errno));
+        free(map);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+#else
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( map == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map ASN snapshot %s: %s", path,
+                strerror(errno));
+        return NULL;
+    }
+#endif
+
+    header = (struct asn_snapshot_header*)map;
+
+    /* the magic number also catches files written with another byte order */
+    if ( header->magic != ASN_SNAPSHOT_MAGIC ||
+            header->version != ASN_SNAPSHOT_VERSION ||
+            (size_t)statbuf.st_size != sizeof(struct asn_snapshot_header) +
+            (((size_t)header->ipv4_count + header->ipv6_count) *
+             sizeof(struct asn_snapshot_entry)) ) {
+        Log(LOG_WARNING, "Ignoring invalid ASN snapshot %s", path);
+        unmap_snapshot(map, statbuf.st_size);
+        return NULL;
+    }
+
+    snapshot = calloc(1, sizeof(struct asn_snapshot));
+    snapshot->map = map;
+    snapshot->size = statbuf.st_size;
+    snapshot->header = header;
+    snapshot->ipv4 = (struct asn_snapshot_entry*)(header + 1);
+    snapshot->ipv6 = snapshot->ipv4 + header->ipv4_count;
+
+    Log(LOG_DEBUG, "Loaded %u IPv4 and %u IPv6 ASN entries from %s",
+            header->ipv4_count, header->ipv6_count, path);
+
+    return snapshot;
+}
+
+
+
+void close_asn_snapshot(struct asn_snapshot *snapshot) {
+    if ( snapshot == NULL ) {
+        return;
+    }
+
+    unmap_snapshot(snapshot->map, snapshot->size);
+    free(snapshot);
+}
+
+
+
+/*
+ * Find the entry covering the address, or NULL if there isn't one. Entries
+ * don't overlap, so the only candidate is the entry with the largest network
+ * that isn't greater than the address.
+ */
+struct asn_snapshot_entry *asn_snapshot_lookup(struct asn_snapshot *snapshot,
+        struct sockaddr *address) {
+    struct asn_snapshot_entry *entries;
+    uint32_t low, high, mid;
+    uint64_t key;
+
+    if ( snapshot == NULL || address == NULL ) {
+        return NULL;
+    }
+
+    switch ( address->sa_family ) {
+        case AF_INET:
+            entries = snapshot->ipv4;
+            high = snapshot->header->ipv4_count;
+            break;
+        case AF_INET6:
+            entries = snapshot->ipv6;
+            high = snapshot->header->ipv6_count;
+            break;
+        default:
+            return NULL;
+    };
+
+    key = get_network(address, 64);
+    low = 0;
+
+    /* find the first entry with a network greater than the address */
+    while ( low < high ) {
+        mid = low + ((high - low) / 2);
+        if ( entries[mid].network <= key ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if ( low == 0 ) {
+        return NULL;
+    }
+
+    if ( get_network(address, entries[low - 1].prefix) !=
+            entries[low - 1].network ) {
+        return NULL;
+    }
+
+    return &entries[low - 1];
+}
+
+
+
+/*
+ * Write a new snapshot containing everything in the trie and everything in
+ * the old snapshot that hasn't been replaced, skipping any entries that
+ * expired before the oldest time. The new file is written alongside the
+ * old one and renamed over it, so anyone with the old file mapped can keep
+ * using it.
+ */
+int write_asn_snapshot(char *path, struct iptrie *trie,
+        struct asn_snapshot *old, time_t oldest) {
+    struct snapshot_builder builder;
+    struct asn_snapshot_header header;
+    struct asn_snapshot_entry *entry;
+    char *tmp;
+    FILE *out;
+    uint32_t i;
+    int fd;
+
+    assert(path);
+    assert(trie);
+
+    memset(&builder, 0, sizeof(builder));
+
+    iptrie_on_all_leaves(trie, add_trie_entry, &builder);
+
+    if ( old ) {
+        for ( i = 0; i < old->header->ipv4_count; i++ ) {
+            entry = &old->ipv4[i];
+            add_entry(&builder, AF_INET, entry->network, entry->prefix,
+                    entry->asn, entry->expires);
+        }
+        for ( i = 0; i < old->header->ipv6_count; i++ ) {
+            entry = &old->ipv6[i];
+            add_entry(&builder, AF_INET6, entry->network, entry->prefix,
+                    entry->asn, entry->expires);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = ASN_SNAPSHOT_MAGIC;
+    header.version = ASN_SNAPSHOT_VERSION;
+    header.created = time(NULL);
+
+    for ( i = 0; i < 2; i++ ) {
+        uint32_t j, kept = 0;
+        uint32_t count = sort_entries(builder.entries[i], builder.count[i]);
+
+        /* drop entries that haven't been used (or refreshed) for a while */
+        for ( j = 0; j < count; j++ ) {
+            if ( builder.entries[i][j].expires == 0 ||
+                    builder.entries[i][j].expires >= oldest ) {
+                builder.entries[i][kept++] = builder.entries[i][j];
+            }
+        }
+        builder.count[i] = kept;
+    }
+
+    header.ipv4_count = builder.count[0];
+    header.ipv6_count = builder.count[1];
+
+    if ( asprintf(&tmp, "%s.tmp", path) < 0 ) {
+        Log(LOG_WARNING, "Failed to build temporary ASN snapshot path");
+        free(builder.entries[0]);
+        free(builder.entries[1]);
+        return -1;
+    }
+
+    if ( (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                    0640)) < 0 || (out = fdopen(fd, "wb")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open ASN snapshot %s: %s", tmp,
+                strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        free(builder.entries[0]);
+        free(builder.entries[1]);
+        free(tmp);
+        return -1;
+    }
+
+    if ( fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fwrite(builder.entries[0], sizeof(struct asn_snapshot_entry),
+                builder.count[0], out) != builder.count[0] ||
+            fwrite(builder.entries[1], sizeof(struct asn_snapshot_entry),
+                builder.count[1], out) != builder.count[1] ||
+            fflush(out) != 0 || fsync(fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to write ASN snapshot %s: %s", tmp,
+                strerror(errno));
+        fclose(out);
+        unlink(tmp);
+        free(builder.entries[0]);
+        free(builder.entries[1]);
+        free(tmp);
+        return -1;
+    }
+
+    fclose(out);
+    free(builder.entries[0]);
+    free(builder.entries[1]);
+
+    if ( rename(tmp, path) < 0 ) {
+        Log(LOG_WARNING, "Failed to replace ASN snapshot %s: %s", path,
+                strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+
+    Log(LOG_DEBUG, "Saved %u IPv4 and %u IPv6 ASN entries to %s",
+            header.ipv4_count, header.ipv6_count, path);
+
+    return 0;
+}
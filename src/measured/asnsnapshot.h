@@ -0,0 +1,102 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_ASNSNAPSHOT_H
+#define _MEASURED_ASNSNAPSHOT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "iptrie.h"
+
+/* how often the ASN cache is written to disk, if it has changed (seconds) */
+#define ASN_SNAPSHOT_INTERVAL 3600
+
+/* identifies a file as an amplet2 ASN cache snapshot */
+#define ASN_SNAPSHOT_MAGIC 0x414d5041
+#define ASN_SNAPSHOT_VERSION 1
+
+/*
+ * Header at the start of the snapshot file. It is followed by all the IPv4
+ * entries and then all the IPv6 entries, each sorted by network. Everything
+ * is in host byte order and there are no pointers, so the file can be mapped
+ * into memory and used directly.
+ */
+struct asn_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ipv4_count;
+    uint32_t ipv6_count;
+    int64_t created;
+};
+
+/*
+ * A single cached prefix. The network holds the first 64 bits of the address
+ * (IPv4 addresses are in the upper 32 bits), so prefixes longer than /64
+ * can't be stored. The ASN cache only uses /24 and /64 prefixes.
+ */
+struct asn_snapshot_entry {
+    uint64_t network;
+    int64_t expires;
+    uint32_t asn;
+    uint8_t prefix;
+    uint8_t unused[3];
+};
+
+/*
+ * A snapshot file that has been mapped into memory, read only.
+ */
+struct asn_snapshot {
+    void *map;
+    size_t size;
+    struct asn_snapshot_header *header;
+    struct asn_snapshot_entry *ipv4;
+    struct asn_snapshot_entry *ipv6;
+};
+
+struct asn_snapshot *open_asn_snapshot(char *path);
+void close_asn_snapshot(struct asn_snapshot *snapshot);
+struct asn_snapshot_entry *asn_snapshot_lookup(struct asn_snapshot *snapshot,
+        struct sockaddr *address);
+int write_asn_snapshot(char *path, struct iptrie *trie,
+        struct asn_snapshot *old, time_t oldest);
+
+#endif
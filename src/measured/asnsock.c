@@ -43,7 +43,11 @@
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <inttypes.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #if _WIN32
 #include "w32-compat.h"
@@ -55,10 +59,22 @@
 
 #include "asn.h"
 #include "asnsock.h"
+#include "asnsnapshot.h"
+#include "asntable.h"
+#include "whois.h"
 #include "ampresolv.h"
 #include "debug.h"
 
 
+/* state used while removing unused entries from the cache */
+struct asn_purge {
+    struct iptrie trie;
+    struct iptrie *saved;
+    time_t oldest;
+    unsigned int removed;
+};
+
+
 
 /*
  * Send back all the results of ASN resolution
@@ -102,76 +118,63 @@ static int return_asn_list(iptrie_node_t *root, void *data) {
 
 
 /*
- * Write an IP address in plain text to the socket connected to the whois
- * server, asking it to look up the AS number.
+ * Add a copy of a cache entry to another trie, keeping when it expires.
  */
-static int write_asn_request(int fd, struct sockaddr *address) {
-    char addrstr[INET6_ADDRSTRLEN + 1];
-    unsigned int sent, left;
-    int bytes;
-    void *addrptr;
-
-    Log(LOG_DEBUG, "Sending whois request");
+static void copy_entry(struct iptrie *trie, iptrie_node_t *node) {
+    iptrie_node_t *copy;
 
-    /* convert IP address into a string for the query */
-    switch ( address->sa_family ) {
-        case AF_INET: addrptr = &((struct sockaddr_in*)address)->sin_addr;
-                      break;
-        case AF_INET6: addrptr = &((struct sockaddr_in6*)address)->sin6_addr;
-                       break;
-        default: Log(LOG_WARNING, "Invalid address family"); return -1;
-    };
+    iptrie_add(trie, node->address, node->prefix, node->as);
+    if ( (copy = iptrie_lookup(trie, node->address)) != NULL ) {
+        copy->expires = node->expires;
+    }
+}
 
-    inet_ntop(address->sa_family, addrptr, addrstr, INET6_ADDRSTRLEN);
 
-    /* need a newline between addresses, null terminate too */
-    addrstr[strlen(addrstr) + 1] = '\0';
-    addrstr[strlen(addrstr)] = '\n';
 
-    sent = 0;
-    left = strlen(addrstr);
+/*
+ * Copy a cache entry into the new cache unless it has been stale for so long
+ * that it clearly isn't being used any more.
+ */
+static int keep_recent_entry(iptrie_node_t *node, void *data) {
+    struct asn_purge *purge = (struct asn_purge*)data;
 
-    /* deal with annoying partial sends, make sure the whole buffer goes */
-    while ( sent < strlen(addrstr) ) {
-        if ( (bytes = send(fd, addrstr + sent, left, 0)) < 0 ) {
-            Log(LOG_WARNING, "Error writing to whois socket: %s",
-                    strerror(errno));
-            return -1;
-        }
-        sent += bytes;
-        left -= bytes;
+    if ( node->expires != 0 && node->expires < purge->oldest ) {
+        purge->removed++;
+        return 0;
     }
 
+    copy_entry(&purge->trie, node);
+
+    return 0;
+}
+
+
+
+static int copy_all_entries(iptrie_node_t *node, void *data) {
+    copy_entry((struct iptrie*)data, node);
     return 0;
 }
 
 
 
 /*
- * Read the available ASN data (up to one less than the available
- * space, so we have room to null terminate the buffer).
+ * Keep a cache entry unless it is exactly the same as the one that was just
+ * written to the snapshot. Anything added or refreshed while the snapshot
+ * was being written needs to stay in the trie.
  */
-static int read_asn_request(int fd, char *buffer, int buflen, int *offset) {
-    int bytes;
+static int keep_unsaved_entry(iptrie_node_t *node, void *data) {
+    struct asn_purge *purge = (struct asn_purge*)data;
+    iptrie_node_t *saved;
 
-    if ( (bytes = recv(fd, buffer + *offset, buflen - *offset - 1, 0)) < 1 ) {
-        /* error or end of file */
-        if ( bytes == 0 ) {
-            Log(LOG_DEBUG, "Finished receiving data from whois server");
-        } else {
-            Log(LOG_WARNING, "Error receiving data from whois server: %s",
-                    strerror(errno));
-        }
-        return -1;
+    saved = iptrie_lookup(purge->saved, node->address);
+
+    if ( saved && saved->prefix == node->prefix && saved->as == node->as &&
+            saved->expires == node->expires ) {
+        purge->removed++;
+        return 0;
     }
 
-    *offset += bytes;
-
-    /*
-     * We use string functions looking for newlines in the buffer,
-     * so null terminate it in case we end up travelling off the end.
-     */
-    buffer[*offset] = '\0';
+    copy_entry(&purge->trie, node);
 
     return 0;
 }
@@ -179,61 +182,145 @@ static int read_asn_request(int fd, char *buffer, int buflen, int *offset) {
 
 
 /*
- *
+ * Periodically remove entries that haven't been used (and so haven't been
+ * refreshed) for a long time. Entries that are still in use are refreshed
+ * individually as they expire, so the cache is never emptied all at once.
  */
-static int check_whois_connection(int *whois_fd) {
-    /* if we haven't already tried, connect to the whois server */
-    if ( *whois_fd == -1 ) {
-        *whois_fd = connect_to_whois_server();
+static void purge_asn_cache(struct amp_asn_info *info) {
+    struct asn_purge purge;
+    struct iptrie old;
+    time_t now = time(NULL);
+
+    /* every thread checks this, so avoid taking the lock most of the time */
+    if ( now <= __atomic_load_n(info->refresh, __ATOMIC_RELAXED) ) {
+        return;
     }
 
-    /* we've tried and failed to connect, don't bother any more */
-    if ( *whois_fd < 0 ) {
-        Log(LOG_DEBUG, "whois connection unavailable, ignoring");
-        return -1;
+    amp_asn_write_lock(info);
+
+    if ( now <= *info->refresh ) {
+        amp_asn_unlock(info);
+        return;
     }
 
-    return 0;
-}
+    memset(&purge, 0, sizeof(purge));
+    purge.oldest = now - MAX_ASN_CACHE_STALE;
 
+    iptrie_on_all_leaves(info->trie, keep_recent_entry, &purge);
 
+    /* swap in the new cache and free all the old entries at once */
+    old = *info->trie;
+    *info->trie = purge.trie;
+    iptrie_clear(&old);
 
-/*
- * TODO be smarter about this, we don't need to dump the whole thing
- */
-static void check_refresh_cache(struct amp_asn_info *info) {
-    pthread_mutex_lock(info->mutex);
-    if ( time(NULL) > *info->refresh ) {
-        Log(LOG_DEBUG, "Clearing ASN cache");
-        iptrie_clear(info->trie);
-        *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
-            (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
-        Log(LOG_DEBUG, "Next refresh at %d", *info->refresh);
-    }
-    pthread_mutex_unlock(info->mutex);
+    __atomic_store_n(info->refresh, now + MIN_ASN_CACHE_REFRESH +
+            (rand() % MAX_ASN_CACHE_REFRESH_OFFSET), __ATOMIC_RELAXED);
+
+    amp_asn_unlock(info);
+
+    Log(LOG_DEBUG, "Removed %u unused entries from ASN cache", purge.removed);
+    Log(LOG_DEBUG, "Next purge at %d", *info->refresh);
 }
 
 
 
 /*
- * Try to look up the ASN for an address in the local cache.
+ * Try to look up the ASN for an address in the local cache. Stale entries
+ * are still used so the test doesn't have to wait, but are also added to
+ * the stale trie so that they can be refreshed once the test has its data.
  */
 static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
-        struct sockaddr *address) {
+        struct iptrie *stale, struct sockaddr *address) {
+    iptrie_node_t *node;
+    struct asn_snapshot_entry *entry;
+    int refresh = 0;
     int asn;
     int prefix;
+    time_t expires;
+    time_t now = time(NULL);
 
     Log(LOG_DEBUG, "Checking ASN cache for address");
 
-    pthread_mutex_lock(info->mutex);
-    if ( (asn = iptrie_lookup_as(info->trie, address)) < 0 ) {
-        pthread_mutex_unlock(info->mutex);
+    if ( address->sa_family == AF_INET ) {
+        prefix = 24;
+    } else {
+        prefix = 64;
+    }
+
+    amp_asn_read_lock(info);
+
+    /* entries learnt since the snapshot was saved override the snapshot */
+    if ( (node = iptrie_lookup(info->trie, address)) != NULL ) {
+        asn = node->as;
+        expires = __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+    } else if ( (entry = asn_snapshot_lookup(*info->snapshot,
+                    address)) != NULL ) {
+        asn = entry->asn;
+        expires = entry->expires;
+        prefix = entry->prefix;
+    } else {
+        amp_asn_unlock(info);
         Log(LOG_DEBUG, "Address not found in ASN cache");
         return -1;
     }
-    pthread_mutex_unlock(info->mutex);
 
-    Log(LOG_DEBUG, "Address found in ASN cache");
+    /*
+     * Only the first thread to see a stale entry will refresh it, the entry
+     * is treated as fresh by everyone else until it's time to try again.
+     * Lookups only hold a shared lock, so the entry is claimed atomically.
+     */
+    if ( expires != 0 && expires <= now && node != NULL ) {
+        refresh = __atomic_compare_exchange_n(&node->expires, &expires,
+                now + ASN_CACHE_RETRY, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    amp_asn_unlock(info);
+
+    /*
+     * The snapshot is read only, so stale entries from there are copied
+     * into the trie first. Another thread might have done so while the lock
+     * wasn't held, in which case it is the one doing the refresh.
+     */
+    if ( expires != 0 && expires <= now && node == NULL ) {
+        amp_asn_write_lock(info);
+        if ( iptrie_lookup(info->trie, address) == NULL ) {
+            iptrie_add(info->trie, address, prefix, asn);
+            if ( (node = iptrie_lookup(info->trie, address)) != NULL ) {
+                node->expires = now + ASN_CACHE_RETRY;
+            }
+            refresh = 1;
+        }
+        amp_asn_unlock(info);
+    }
+
+    Log(LOG_DEBUG, "Address found in ASN cache%s", refresh ? " (stale)" : "");
+
+    /* add the values to our result trie */
+    iptrie_add(result, address, prefix, asn);
+
+    if ( refresh ) {
+        iptrie_add(stale, address, prefix, 0);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Look up the ASN for an address in the local prefix to ASN table, if one
+ * is loaded. The table is authoritative, so addresses that aren't in it are
+ * given AS 0 rather than being sent to the whois server. Results are still
+ * returned as /24 or /64 networks, the same as the whois lookups.
+ */
+static int check_asn_table(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address) {
+    iptrie_node_t *node;
+    int64_t asn;
+    int prefix;
+
+    if ( info->table == NULL ) {
+        return -1;
+    }
 
     if ( address->sa_family == AF_INET ) {
         prefix = 24;
@@ -241,8 +328,23 @@ static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
         prefix = 64;
     }
 
-    /* add the values to our result trie */
+    amp_asn_read_lock(info);
+
+    if ( info->table->trie == NULL ) {
+        amp_asn_unlock(info);
+        return -1;
+    }
+
+    if ( (node = iptrie_lookup(info->table->trie, address)) != NULL ) {
+        asn = node->as;
+    } else {
+        asn = 0;
+    }
+
+    amp_asn_unlock(info);
+
     iptrie_add(result, address, prefix, asn);
+
     return 0;
 }
 
@@ -333,137 +435,118 @@ static int fill_request_trie(int fd, struct iptrie *requests) {
 
 
 
-static void *amp_asn_worker_thread(void *thread_data) {
-    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
-    struct iptrie result = { NULL, NULL };
-    struct iptrie requests = { NULL, NULL };
-
-    fd_set readset, writeset;
-    int whois_fd = -1;
-    int ready;
-    int offset = 0;
-    int buflen = 1024;//XXX define? and bigger
-    char *buffer = calloc(1, buflen);
-    int outstanding = 0;
-    struct timeval timeout;
-    iplist_t *list;
+/*
+ * Look up the ASNs for all the addresses in the list. If the stale trie is
+ * given then the cache is checked first and the whois server is only asked
+ * about addresses that aren't cached. If it is NULL then every address is
+ * sent to the whois server, which is used to refresh stale cache entries.
+ */
+static void lookup_asn_list(struct amp_asn_info *info, iplist_t *list,
+        struct iptrie *result, struct iptrie *stale) {
 
-    Log(LOG_DEBUG, "Starting new asn resolution thread");
+    struct sockaddr **addresses;
+    int64_t *asns;
+    iplist_t *item;
+    int count = 0;
+    int i;
 
-    /* periodically clear out the cache */
-    check_refresh_cache(info);
+    for ( item = list; item != NULL; item = item->next ) {
+        count++;
+    }
 
-    /* read all the addresses from the socket and build a trie from them */
-    if ( fill_request_trie(info->fd, &requests) < 0 ) {
-        Log(LOG_WARNING, "asn resolution thread failed to create request trie");
-        goto end;
+    if ( count == 0 ) {
+        return;
     }
 
-    /* look up all the addresses in the cache or the whois server */
-    for ( list = iptrie_to_list(&requests), outstanding = 0;
-            list != NULL || outstanding > 0; /* no increment statement*/ ) {
+    addresses = calloc(count, sizeof(struct sockaddr*));
+    asns = calloc(count, sizeof(int64_t));
+    count = 0;
 
-        if ( list ) {
-            /* first try to find address in cache */
-            if ( check_asn_cache(info, &result, list->address) == 0 ) {
-                list = list->next;
+    /* collect all the addresses that aren't known locally */
+    for ( item = list; item != NULL; item = item->next ) {
+        if ( stale ) {
+            /* a local ASN table (if there is one) answers everything */
+            if ( check_asn_table(info, result, item->address) == 0 ) {
                 continue;
             }
 
-            /* if not in cache, check if can connect to the whois server */
-            if ( check_whois_connection(&whois_fd) < 0 ) {
-                list = list->next;
+            /* otherwise try to find address in cache */
+            if ( check_asn_cache(info, result, stale, item->address) == 0 ) {
                 continue;
             }
         }
 
-        /* we have a connection, try looking up the ASN for the address */
-        do {
-            FD_ZERO(&readset);
-            FD_ZERO(&writeset);
+        addresses[count++] = item->address;
+    }
 
-            if ( outstanding > 0 ) {
-                FD_SET(whois_fd, &readset);
-            }
+    /* ask the whois server about the rest, all at once */
+    if ( count > 0 && info->whois != NULL &&
+            whois_client_lookup(info->whois, addresses, count, asns,
+                WHOIS_QUERY_TIMEOUT) > 0 ) {
+        for ( i = 0; i < count; i++ ) {
+            uint8_t prefix;
 
-            if ( list ) {
-                FD_SET(whois_fd, &writeset);
+            if ( asns[i] < 0 ) {
+                continue;
             }
 
-            /* it should never take 30s and we don't want to wait forever */
-            timeout.tv_sec = 30;
-            timeout.tv_usec = 0;
-            ready = select(whois_fd + 1, &readset, &writeset, NULL, &timeout);
-
-        } while ( ready < 0 && errno == EINTR );
-
-        /* error, close the whois connection and just use the cache */
-        if ( ready <= 0 ) {
-            if ( ready < 0 ) {
-                Log(LOG_WARNING,
-                        "Error while waiting for ASN data (r:%d w:%d): %s",
-                        outstanding, list ? 1 : 0, strerror(errno));
-            } else {
-                Log(LOG_WARNING,
-                        "Timeout while waiting for ASN data (r:%d w:%d)",
-                        outstanding, list ? 1 : 0);
-            }
-            close(whois_fd);
-            whois_fd = WHOIS_UNAVAILABLE;
-            if ( list ) list = list->next;
-            outstanding = 0;
-            continue;
+            prefix = (addresses[i]->sa_family == AF_INET) ? 24 : 64;
+            iptrie_add(result, addresses[i], prefix, asns[i]);
+            amp_asn_cache_add(info, addresses[i], prefix, asns[i]);
         }
+    }
 
-        /* we can write a new request, do so */
-        if ( FD_ISSET(whois_fd, &writeset) ) {
+    free(addresses);
+    free(asns);
+}
 
-            /* send the asn request to the whois server */
-            if ( write_asn_request(whois_fd, list->address) < 0 ) {
-                close(whois_fd);
-                whois_fd = WHOIS_UNAVAILABLE;
-                list = list->next;
-                outstanding = 0;
-                continue;
-            }
 
-            /* successfully sent, we expect to get a reply for it */
-            outstanding++;
-            list = list->next;
-        }
 
-        /* here is a result we previously asked for, read it */
-        if ( FD_ISSET(whois_fd, &readset) ) {
+static void *amp_asn_worker_thread(void *thread_data) {
+    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
+    struct iptrie result = { NULL, NULL, NULL };
+    struct iptrie requests = { NULL, NULL, NULL };
+    struct iptrie stale = { NULL, NULL, NULL };
+    struct iptrie refreshed = { NULL, NULL, NULL };
 
-            /* Read the available ASN data */
-            if ( read_asn_request(whois_fd, buffer, buflen, &offset) < 0 ) {
-                close(whois_fd);
-                whois_fd = WHOIS_UNAVAILABLE;
-                if ( list ) list = list->next;
-                outstanding = 0;
-                continue;
-            }
+    Log(LOG_DEBUG, "Starting new asn resolution thread");
 
-            /* try to read any completed ASN results from the buffer */
-            process_buffer(&result, buffer, buflen, &offset, info,&outstanding);
-        }
-    }
+    /* periodically remove unused entries from the cache */
+    purge_asn_cache(info);
 
-    if ( whois_fd != -1 ) {
-        close(whois_fd);
+    /* read all the addresses from the socket and build a trie from them */
+    if ( fill_request_trie(info->fd, &requests) < 0 ) {
+        Log(LOG_WARNING, "asn resolution thread failed to create request trie");
+        goto end;
     }
+
+    lookup_asn_list(info, iptrie_to_list(&requests), &result, &stale);
+
     Log(LOG_DEBUG, "Got all responses, sending them back");
 
     iptrie_on_all_leaves(&result, return_asn_list, &info->fd);
 
+    /* the test has everything it needs, refresh any stale entries it used */
+    close(info->fd);
+    info->fd = -1;
+
+    if ( !iptrie_is_empty(&stale) ) {
+        Log(LOG_DEBUG, "Refreshing stale ASN cache entries");
+        lookup_asn_list(info, iptrie_to_list(&stale), &refreshed, NULL);
+    }
+
 end:
     Log(LOG_DEBUG, "Tidying up after asn resolution thread");
 
-    close(info->fd);
+    if ( info->fd >= 0 ) {
+        close(info->fd);
+    }
+
     iptrie_clear(&requests);
     iptrie_clear(&result);
+    iptrie_clear(&stale);
+    iptrie_clear(&refreshed);
     free(thread_data);
-    free(buffer);
 
     Log(LOG_DEBUG, "asn resolution thread completed, exiting");
 
@@ -495,8 +578,12 @@ void asn_socket_event_callback(evutil_socket_t evsock,
 
     info = calloc(1, sizeof(struct amp_asn_info));
     info->trie = ((struct amp_asn_info*)evdata)->trie;
-    info->mutex = ((struct amp_asn_info*)evdata)->mutex;
+    info->lock = ((struct amp_asn_info*)evdata)->lock;
     info->refresh = ((struct amp_asn_info*)evdata)->refresh;
+    info->snapshot = ((struct amp_asn_info*)evdata)->snapshot;
+    info->snapshot_path = ((struct amp_asn_info*)evdata)->snapshot_path;
+    info->table = ((struct amp_asn_info*)evdata)->table;
+    info->whois = ((struct amp_asn_info*)evdata)->whois;
     info->fd = fd;
 
     /* create the thread and detach, we don't need to look after it */
@@ -507,9 +594,190 @@ void asn_socket_event_callback(evutil_socket_t evsock,
 
 
 /*
- *
+ * Write everything learnt since the last snapshot to a new snapshot file,
+ * and start using that instead. The trie only needs to hold entries that
+ * aren't in the snapshot, so anything that was saved can be removed from it
+ * afterwards. Writing the file can take a while, so it is done from a copy
+ * of the trie without holding the lock. Only this function replaces the
+ * snapshot, so the current one can't go away while the new one is written.
  */
-struct amp_asn_info* initialise_asn_info(void) {
+int save_asn_snapshot(struct amp_asn_info *info) {
+    struct asn_snapshot *snapshot, *old;
+    struct asn_purge purge;
+    struct iptrie saved;
+    struct iptrie trie;
+
+    if ( info->snapshot_path == NULL ) {
+        return 0;
+    }
+
+    memset(&saved, 0, sizeof(saved));
+
+    amp_asn_read_lock(info);
+
+    /* nothing new has been added to the cache since the last snapshot */
+    if ( iptrie_is_empty(info->trie) ) {
+        amp_asn_unlock(info);
+        return 0;
+    }
+
+    iptrie_on_all_leaves(info->trie, copy_all_entries, &saved);
+    old = *info->snapshot;
+
+    amp_asn_unlock(info);
+
+    if ( write_asn_snapshot(info->snapshot_path, &saved, old,
+                time(NULL) - MAX_ASN_CACHE_STALE) < 0 ) {
+        iptrie_clear(&saved);
+        return -1;
+    }
+
+    if ( (snapshot = open_asn_snapshot(info->snapshot_path)) == NULL ) {
+        iptrie_clear(&saved);
+        return 0;
+    }
+
+    memset(&purge, 0, sizeof(purge));
+    purge.saved = &saved;
+
+    amp_asn_write_lock(info);
+
+    *info->snapshot = snapshot;
+    iptrie_on_all_leaves(info->trie, keep_unsaved_entry, &purge);
+    trie = *info->trie;
+    *info->trie = purge.trie;
+
+    amp_asn_unlock(info);
+
+    close_asn_snapshot(old);
+    iptrie_clear(&trie);
+    iptrie_clear(&saved);
+
+    return 0;
+}
+
+
+
+/*
+ * Periodically save the ASN cache so it isn't lost when measured restarts.
+ */
+void asn_snapshot_timer_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    save_asn_snapshot((struct amp_asn_info*)evdata);
+}
+
+
+
+/*
+ * Load a new copy of the ASN table and swap it in place of the old one.
+ * This runs in its own thread so that large tables don't hold up the
+ * main event loop while they are parsed.
+ */
+static void *reload_asn_table_thread(void *thread_data) {
+    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
+    struct iptrie *table, *old = NULL;
+    struct stat statbuf;
+    time_t mtime = 0;
+
+    if ( stat(info->table->path, &statbuf) == 0 ) {
+        mtime = statbuf.st_mtime;
+    }
+
+    /* if the new table is broken then keep using the old one */
+    table = load_asn_table(info->table->path);
+
+    amp_asn_write_lock(info);
+    if ( table ) {
+        old = info->table->trie;
+        info->table->trie = table;
+    }
+    info->table->mtime = mtime;
+    info->table->loading = 0;
+    amp_asn_unlock(info);
+
+    free_asn_table(old);
+
+    return NULL;
+}
+
+
+
+/*
+ * Periodically check if the ASN table file has changed, and reload it if
+ * it has.
+ */
+void asn_table_timer_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_asn_info *info = (struct amp_asn_info*)evdata;
+    struct stat statbuf;
+    pthread_t thread;
+
+    if ( info->table == NULL ) {
+        return;
+    }
+
+    if ( stat(info->table->path, &statbuf) < 0 ) {
+        Log(LOG_DEBUG, "Failed to stat ASN table %s: %s", info->table->path,
+                strerror(errno));
+        return;
+    }
+
+    amp_asn_write_lock(info);
+    if ( info->table->loading || statbuf.st_mtime == info->table->mtime ) {
+        amp_asn_unlock(info);
+        return;
+    }
+    info->table->loading = 1;
+    amp_asn_unlock(info);
+
+    Log(LOG_INFO, "ASN table %s has changed, reloading", info->table->path);
+
+    if ( pthread_create(&thread, NULL, reload_asn_table_thread, info) != 0 ) {
+        Log(LOG_WARNING, "Failed to create thread to reload ASN table");
+        amp_asn_write_lock(info);
+        info->table->loading = 0;
+        amp_asn_unlock(info);
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+
+
+/*
+ * Write the ASN cache lock counters to a file for debugging.
+ */
+void dump_asn_stats(FILE *out) {
+    struct asn_lock_stats stats;
+
+    assert(out);
+
+    amp_asn_get_lock_stats(&stats);
+
+    fprintf(out, "===== ASN CACHE LOCK =====\n");
+    fprintf(out, "reads %" PRIu64 " (%" PRIu64 " waited) writes %" PRIu64
+            " (%" PRIu64 " waited) wait time %" PRIu64 "us\n\n",
+            stats.reads, stats.read_waits, stats.writes, stats.write_waits,
+            stats.wait_ns / 1000);
+}
+
+
+
+/*
+ * Create the shared ASN cache, starting with the contents of the snapshot
+ * file if there is one. A NULL path means the cache is never saved. If a
+ * table path is given then ASNs are looked up in that file rather than
+ * asking the whois server.
+ */
+struct amp_asn_info* initialise_asn_info(char *snapshot_path,
+        char *table_path) {
+    struct stat statbuf;
+
     struct amp_asn_info *info;
 
     info = (struct amp_asn_info *) malloc(sizeof(struct amp_asn_info));
@@ -520,14 +788,42 @@ struct amp_asn_info* initialise_asn_info(void) {
     *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
         (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
 
-    Log(LOG_DEBUG, "ASN cache will be refreshed at %d", *info->refresh);
+    Log(LOG_DEBUG, "ASN cache will be purged at %d", *info->refresh);
 
     info->trie = malloc(sizeof(struct iptrie));
     info->trie->ipv4 = NULL;
     info->trie->ipv6 = NULL;
+    info->trie->arena = NULL;
+
+    info->lock = malloc(sizeof(pthread_rwlock_t));
+    pthread_rwlock_init(info->lock, NULL);
+
+    info->snapshot = malloc(sizeof(struct asn_snapshot*));
+    *info->snapshot = NULL;
+    info->snapshot_path = NULL;
 
-    info->mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(info->mutex, NULL);
+    if ( snapshot_path ) {
+        info->snapshot_path = strdup(snapshot_path);
+        *info->snapshot = open_asn_snapshot(snapshot_path);
+    }
+
+    info->table = NULL;
+
+    /* the whois connection is only made once there is something to ask */
+    info->whois = whois_client_create(WHOIS_SERVER, WHOIS_PORT);
+
+    if ( table_path ) {
+        info->table = calloc(1, sizeof(struct asn_table));
+        info->table->path = strdup(table_path);
+        if ( stat(table_path, &statbuf) == 0 ) {
+            info->table->mtime = statbuf.st_mtime;
+        }
+        info->table->trie = load_asn_table(table_path);
+        if ( info->table->trie == NULL ) {
+            Log(LOG_WARNING, "Using whois for ASN lookups until %s is valid",
+                    table_path);
+        }
+    }
 
     return info;
 }
@@ -535,21 +831,52 @@ struct amp_asn_info* initialise_asn_info(void) {
 
 
 /*
- *
+ * Save and free the shared ASN cache.
  */
 void amp_asn_info_delete(struct amp_asn_info *info) {
     if ( info == NULL ) {
         return;
     }
 
-    pthread_mutex_lock(info->mutex);
+    save_asn_snapshot(info);
+
+    whois_client_destroy(info->whois);
+
+    amp_asn_write_lock(info);
     iptrie_clear(info->trie);
-    pthread_mutex_unlock(info->mutex);
-    pthread_mutex_destroy(info->mutex);
+    close_asn_snapshot(*info->snapshot);
+    amp_asn_unlock(info);
+    pthread_rwlock_destroy(info->lock);
 
-    if ( info->mutex ) free(info->mutex);
+    if ( info->lock ) free(info->lock);
     if ( info->refresh ) free(info->refresh);
     if ( info->trie ) free(info->trie);
+    if ( info->snapshot ) free(info->snapshot);
+    if ( info->snapshot_path ) free(info->snapshot_path);
+
+    if ( info->table ) {
+        free_asn_table(info->table->trie);
+        free(info->table->path);
+        free(info->table);
+    }
 
     free(info);
 }
+
+
+
+#if UNIT_TEST
+int amp_test_check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
+        struct iptrie *stale, struct sockaddr *address) {
+    return check_asn_cache(info, result, stale, address);
+}
+
+void amp_test_purge_asn_cache(struct amp_asn_info *info) {
+    purge_asn_cache(info);
+}
+
+int amp_test_check_asn_table(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address) {
+    return check_asn_table(info, result, address);
+}
+#endif
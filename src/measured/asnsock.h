@@ -40,22 +40,45 @@
 #ifndef _MEASURED_ASNSOCK_H
 #define _MEASURED_ASNSOCK_H
 
+#include <stdio.h>
 #include <event2/event.h>
 
 #include "iptrie.h"
 #include "asn.h"
 
 /*
- * Ideally the cache could refresh individual items and expunge those
- * that haven't been used for a while. In the meantime, lets just empty
- * the whole cache and start again every 24 hours + 0-60 minutes.
+ * Individual cache entries are refreshed as they are used after expiring
+ * (see ASN_CACHE_TTL). Every 24 hours + 0-60 minutes the cache is checked
+ * for entries that have been stale for MAX_ASN_CACHE_STALE seconds without
+ * being used, and they are removed.
  */
 #define MIN_ASN_CACHE_REFRESH 86400
 #define MAX_ASN_CACHE_REFRESH_OFFSET 3600
+#define MAX_ASN_CACHE_STALE 86400
+
+/* how long to keep using a stale entry before trying to refresh it again */
+#define ASN_CACHE_RETRY 300
 
 void asn_socket_event_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata);
 
-struct amp_asn_info* initialise_asn_info(void);
+void asn_snapshot_timer_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata);
+
+void asn_table_timer_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata);
+
+struct amp_asn_info* initialise_asn_info(char *snapshot_path,
+        char *table_path);
+int save_asn_snapshot(struct amp_asn_info *info);
+void dump_asn_stats(FILE *out);
 void amp_asn_info_delete(struct amp_asn_info *info);
+
+#if UNIT_TEST
+int amp_test_check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
+        struct iptrie *stale, struct sockaddr *address);
+void amp_test_purge_asn_cache(struct amp_asn_info *info);
+int amp_test_check_asn_table(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address);
+#endif
 #endif
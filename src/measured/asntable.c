@@ -0,0 +1,228 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Load a local prefix to origin AS table, so that ASN queries can be
+ * answered without asking a whois server. Two formats are understood,
+ * one prefix per line:
+ *
+ *   192.0.2.0<tab>24<tab>64496         (CAIDA Routeviews prefix2as)
+ *   192.0.2.0/24,64496                 (CSV, or whitespace separated)
+ *
+ * Lines starting with '#' are ignored. Prefixes with multiple origins
+ * (e.g. "64496_64497" or "64496,64497") use the first origin listed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <ctype.h>
+
+#if _WIN32
+#include <ws2tcpip.h>
+#include "w32-compat.h"
+#else
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#endif
+
+#include "asntable.h"
+#include "debug.h"
+
+
+
+/*
+ * Parse a single line of the table. Returns 1 if an entry was found, 0 if
+ * the line is empty or a comment, or -1 if the line isn't valid.
+ */
+static int parse_asn_table_line(char *line, struct sockaddr_storage *addr,
+        uint8_t *prefix, int64_t *asn) {
+    char *saveptr = NULL;
+    char *addrstr, *lenstr, *asnstr, *end;
+    unsigned long value;
+    int maxlen;
+
+    /* skip leading whitespace, blank lines and comments */
+    while ( isspace((unsigned char)*line) ) {
+        line++;
+    }
+
+    if ( *line == '\0' || *line == '#' ) {
+        return 0;
+    }
+
+    if ( (addrstr = strtok_r(line, " \t,\r\n", &saveptr)) == NULL ) {
+        return -1;
+    }
+
+    /* the prefix length is either after a slash or in the next field */
+    if ( (lenstr = strchr(addrstr, '/')) != NULL ) {
+        *lenstr++ = '\0';
+    } else if ( (lenstr = strtok_r(NULL, " \t,\r\n", &saveptr)) == NULL ) {
+        return -1;
+    }
+
+    if ( (asnstr = strtok_r(NULL, " \t,\r\n", &saveptr)) == NULL ) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+
+    if ( inet_pton(AF_INET, addrstr,
+                &((struct sockaddr_in*)addr)->sin_addr) == 1 ) {
+        addr->ss_family = AF_INET;
+        maxlen = 32;
+    } else if ( inet_pton(AF_INET6, addrstr,
+                &((struct sockaddr_in6*)addr)->sin6_addr) == 1 ) {
+        addr->ss_family = AF_INET6;
+        maxlen = 128;
+    } else {
+        return -1;
+    }
+
+    errno = 0;
+    value = strtoul(lenstr, &end, 10);
+    if ( errno != 0 || end == lenstr || *end != '\0' ||
+            value > (unsigned long)maxlen ) {
+        return -1;
+    }
+    *prefix = value;
+
+    /* allow an "AS" in front of the number, and ignore any extra origins */
+    if ( strncasecmp(asnstr, "AS", 2) == 0 ) {
+        asnstr += 2;
+    }
+
+    errno = 0;
+    value = strtoul(asnstr, &end, 10);
+    if ( errno != 0 || end == asnstr || value > UINT32_MAX ||
+            (*end != '\0' && *end != '_') ) {
+        return -1;
+    }
+    *asn = value;
+
+    return 1;
+}
+
+
+
+/*
+ * Load the whole table into a new trie. Returns NULL if the file can't be
+ * read or doesn't contain any valid entries.
+ */
+struct iptrie *load_asn_table(char *path) {
+    struct iptrie *table;
+    struct sockaddr_storage addr;
+    char line[MAX_ASN_TABLE_LINE];
+    unsigned int count = 0, invalid = 0;
+    uint8_t prefix;
+    int64_t asn;
+    FILE *in;
+
+    assert(path);
+
+    if ( (in = fopen(path, "r")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open ASN table %s: %s", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    table = calloc(1, sizeof(struct iptrie));
+
+    while ( fgets(line, sizeof(line), in) != NULL ) {
+        switch ( parse_asn_table_line(line, &addr, &prefix, &asn) ) {
+            case 1:
+                iptrie_add(table, (struct sockaddr*)&addr, prefix, asn);
+                count++;
+                break;
+            case -1:
+                invalid++;
+                break;
+            default:
+                break;
+        };
+    }
+
+    if ( ferror(in) ) {
+        Log(LOG_WARNING, "Failed to read ASN table %s", path);
+        fclose(in);
+        free_asn_table(table);
+        return NULL;
+    }
+
+    fclose(in);
+
+    if ( invalid > 0 ) {
+        Log(LOG_WARNING, "Ignored %u invalid lines in ASN table %s", invalid,
+                path);
+    }
+
+    if ( count == 0 ) {
+        Log(LOG_WARNING, "No prefixes found in ASN table %s", path);
+        free_asn_table(table);
+        return NULL;
+    }
+
+    Log(LOG_INFO, "Loaded %u prefixes from ASN table %s", count, path);
+
+    return table;
+}
+
+
+
+void free_asn_table(struct iptrie *table) {
+    if ( table == NULL ) {
+        return;
+    }
+
+    iptrie_clear(table);
+    free(table);
+}
+
+
+
+#if UNIT_TEST
+int amp_test_parse_asn_table_line(char *line, struct sockaddr_storage *addr,
+        uint8_t *prefix, int64_t *asn) {
+    return parse_asn_table_line(line, addr, prefix, asn);
+}
+#endif
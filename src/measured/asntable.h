@@ -0,0 +1,72 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_ASNTABLE_H
+#define _MEASURED_ASNTABLE_H
+
+#include <time.h>
+
+#include "iptrie.h"
+
+/* how often to check if the prefix to ASN table has changed (seconds) */
+#define ASN_TABLE_CHECK_INTERVAL 60
+
+/* longest line expected in a prefix to ASN table */
+#define MAX_ASN_TABLE_LINE 1024
+
+/*
+ * A prefix to ASN table loaded from a local file, shared between all the
+ * ASN resolving threads and protected by the ASN cache lock.
+ */
+struct asn_table {
+    struct iptrie *trie;        /* prefixes loaded from the file */
+    char *path;                 /* file the table is loaded from */
+    time_t mtime;               /* modification time of the loaded file */
+    int loading;                /* set while a new table is being loaded */
+};
+
+struct iptrie *load_asn_table(char *path);
+void free_asn_table(struct iptrie *table);
+
+#if UNIT_TEST
+int amp_test_parse_asn_table_line(char *line, struct sockaddr_storage *addr,
+        uint8_t *prefix, int64_t *asn);
+#endif
+#endif
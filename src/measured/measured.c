@@ -72,11 +72,19 @@
 #include "rabbitcfg.h"
 #include "nssock.h"
 #include "asnsock.h"
+#include "asnsnapshot.h"
+#include "asntable.h"
+#include "whois.h"
 #include "localsock.h"
 #include "certs.h"
 #include "parseconfig.h"
 #include "users.h"
 #include "clock.h"
+#include "workerpool.h"
+#include "admission.h"
+#include "ratebudget.h"
+#include "messaging.h"
+#include "prefetch.h"
 
 #define AMP_CLIENT_CONFIG_DIR AMP_CONFIG_DIR "/clients"
 
@@ -232,13 +240,22 @@ static void reload(
         void *evdata) {
     char schedule[PATH_MAX];
     amp_test_meta_t *meta = (amp_test_meta_t*)evdata;
+    struct saved_schedule *saved = NULL;
 
     /* signal > 0 is a real signal meaning "reload", signal == 0 is "load" */
     if ( evsock > 0 ) {
         Log(LOG_INFO, "Received signal %d, reloading all configuration",evsock);
 
-        /* cancel all scheduled tests (let running ones finish) */
-        clear_test_schedule(meta->base, 0);
+        /*
+         * Take the scheduled tests out of the event loop (let running ones
+         * finish), any that are unchanged will be put back afterwards.
+         */
+        saved = detach_test_schedule(meta->base);
+
+#ifndef _WIN32
+        /* idle workers have the old test modules loaded, replace them */
+        stop_worker_pool();
+#endif
 
         /* unload all the test modules */
         unregister_tests();
@@ -250,10 +267,24 @@ static void reload(
 	exit(EXIT_FAILURE);
     }
 
+#ifndef _WIN32
+    /*
+     * Start the worker pool after loading the test modules so the workers
+     * have them, but before reading the schedule so the pool has very little
+     * to tear down.
+     */
+    if ( start_worker_pool(meta->base) < 0 ) {
+        Log(LOG_WARNING, "Failed to start worker pool, tests will be forked");
+    }
+#endif
+
     /* re-read schedule files from the global and client specific dirs */
     read_schedule_dir(meta->base, SCHEDULE_DIR, meta);
     snprintf((char*)&schedule, PATH_MAX, "%s/%s", SCHEDULE_DIR, meta->ampname);
     read_schedule_dir(meta->base, schedule, meta);
+
+    /* keep the existing timers for tests that haven't changed */
+    restore_test_schedule(meta->base, saved);
 }
 
 
@@ -297,6 +328,11 @@ static void debug_dump(evutil_socket_t evsock,
     }
 
     dump_schedule(base, out);
+    dump_prefetch_stats(out);
+    dump_asn_stats(out);
+    dump_whois_stats(out);
+    dump_admission_stats(out);
+    dump_rate_budget_stats(out);
 
     fclose(out);
     free(filename);
@@ -380,6 +416,10 @@ int main(int argc, char *argv[]) {
     char *pidfile = NULL;
     int fetch_remote = 1;
     struct amp_asn_info *asn_info;
+    char *asn_cache;
+    char *asn_table;
+    admission_config_t *admission;
+    rate_budget_config_t *budget;
     amp_test_meta_t meta;
     amp_control_t *control;
     fetch_schedule_item_t *fetch;
@@ -392,9 +432,12 @@ int main(int argc, char *argv[]) {
     struct event *signal_chld = NULL;
     struct event *resolver_socket_event = NULL;
     struct event *asn_socket_event = NULL;
+    struct event *asn_snapshot_event = NULL;
+    struct event *asn_table_event = NULL;
     struct event *signal_hup = NULL;
     struct event *signal_tmax = NULL;
     struct ub_ctx *dns_ctx;
+    struct ub_ctx *prefetch_ctx = NULL;
     char nametable[PATH_MAX];
 
 #if _WIN32
@@ -683,6 +726,17 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+#ifndef _WIN32
+    /*
+     * Start the reporter before anything else is forked so that every test
+     * can hand its results to the single persistent broker connection.
+     * Results are spooled to disk while the broker is unavailable.
+     */
+    if ( start_reporter(get_spool_config(cfg)) < 0 ) {
+        Log(LOG_WARNING, "Failed to start reporter, tests will report directly");
+    }
+#endif
+
     /* set up event handlers */
     meta.base = event_base_new();
     assert(meta.base);
@@ -752,6 +806,11 @@ int main(int argc, char *argv[]) {
         cfg_free(cfg);
         exit(EXIT_FAILURE);
     }
+    if ( start_resolver(meta.base, dns_ctx) < 0 ) {
+        Log(LOG_ALERT, "Failed to start local resolver, aborting");
+        cfg_free(cfg);
+        exit(EXIT_FAILURE);
+    }
     resolver_socket_event = event_new(meta.base, vars.nssock_fd,
             EV_READ|EV_PERSIST, resolver_socket_event_callback, dns_ctx);
     event_add(resolver_socket_event, NULL);
@@ -764,12 +823,32 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    asn_info = initialise_asn_info();
+    /* start with whatever ASN data was saved when measured last ran */
+    asn_cache = get_asn_cache_config(cfg);
+    asn_table = get_asn_table_config(cfg);
+    asn_info = initialise_asn_info(asn_cache, asn_table);
     //XXX can we move this and socket creation off into the function too?
     asn_socket_event = event_new(meta.base, vars.asnsock_fd,
             EV_READ|EV_PERSIST, asn_socket_event_callback, asn_info);
     event_add(asn_socket_event, NULL);
 
+    if ( asn_cache ) {
+        struct timeval interval = { ASN_SNAPSHOT_INTERVAL, 0 };
+        asn_snapshot_event = event_new(meta.base, -1, EV_PERSIST,
+                asn_snapshot_timer_callback, asn_info);
+        event_add(asn_snapshot_event, &interval);
+        free(asn_cache);
+    }
+
+    /* reload the local ASN table whenever the file changes */
+    if ( asn_table ) {
+        struct timeval interval = { ASN_TABLE_CHECK_INTERVAL, 0 };
+        asn_table_event = event_new(meta.base, -1, EV_PERSIST,
+                asn_table_timer_callback, asn_info);
+        event_add(asn_table_event, &interval);
+        free(asn_table);
+    }
+
     /* save the port, tests need to know where to connect */
     control = get_control_config(cfg, &meta);
 
@@ -790,6 +869,52 @@ int main(int argc, char *argv[]) {
     snprintf((char*)&nametable, PATH_MAX, "%s/%s", NAMETABLE_DIR, meta.ampname);
     read_nametable_dir(dns_ctx, nametable);
 
+    /*
+     * Names are prefetched using a separate resolver context so that the
+     * main loop never waits on queries being made on behalf of tests.
+     */
+    if ( should_prefetch_names(cfg) ) {
+        if ( (prefetch_ctx = get_dns_context_config(cfg, &meta)) == NULL ) {
+            Log(LOG_WARNING, "Failed to configure prefetch resolver");
+        } else {
+            load_nametable_hosts(prefetch_ctx, NAMETABLE_DIR);
+            load_nametable_hosts(prefetch_ctx, nametable);
+            if ( start_prefetcher(meta.base, prefetch_ctx) < 0 ) {
+                Log(LOG_WARNING, "Failed to start prefetching names");
+            }
+        }
+    }
+
+#ifndef _WIN32
+    set_worker_pool_size(get_worker_pool_config(cfg));
+#endif
+
+    /*
+     * Limit how many tests of each type run at once, and how tests scheduled
+     * at the same time are spread out. The shared admission table needs to
+     * exist before the worker pool is started so the workers can use it.
+     */
+    admission = get_admission_config(cfg);
+    set_schedule_jitter(admission->jitter);
+#ifndef _WIN32
+    if ( start_admission_control(admission) < 0 ) {
+        Log(LOG_WARNING, "Failed to limit running tests, starting all tests");
+    }
+#endif
+    free_admission_config(admission);
+
+    /*
+     * Limit the total rate of test traffic. Like the admission table, the
+     * shared budget needs to exist before the worker pool is started.
+     */
+    budget = get_rate_budget_config(cfg);
+#ifndef _WIN32
+    if ( start_rate_budget(budget) < 0 ) {
+        Log(LOG_WARNING, "Failed to limit test traffic, sending unlimited");
+    }
+#endif
+    free(budget);
+
     /* register all test modules, load schedules */
     load_tests_and_schedules(&meta);
 
@@ -834,6 +959,21 @@ int main(int argc, char *argv[]) {
     Log(LOG_DEBUG, "Clearing test schedules");
     clear_test_schedule(meta.base, 1);
 
+#ifndef _WIN32
+    stop_worker_pool();
+    stop_admission_control();
+    stop_rate_budget();
+
+    Log(LOG_DEBUG, "Stopping reporter");
+    stop_reporter();
+#endif
+
+    Log(LOG_DEBUG, "Stopping DNS prefetching");
+    stop_prefetcher();
+
+    Log(LOG_DEBUG, "Stopping local resolver");
+    stop_resolver();
+
     Log(LOG_DEBUG, "Clearing name table");
     clear_nametable();
 
@@ -848,6 +988,8 @@ int main(int argc, char *argv[]) {
     if ( signal_chld ) event_free(signal_chld);
     if ( resolver_socket_event ) event_free(resolver_socket_event);
     if ( asn_socket_event ) event_free(asn_socket_event);
+    if ( asn_snapshot_event ) event_free(asn_snapshot_event);
+    if ( asn_table_event ) event_free(asn_table_event);
     if ( signal_hup ) event_free(signal_hup);
     if ( signal_usr1 ) event_free(signal_usr1);
     if ( signal_tmax ) event_free(signal_tmax);
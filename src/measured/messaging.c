@@ -39,24 +39,43 @@
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <amqp_ssl_socket.h>
 #include <amqp_tcp_socket.h>
 
+#if _WIN32
+#include "w32-compat.h"
+#else
+#include <sys/socket.h>
+#include <poll.h>
+#endif
+
 #include "messaging.h"
 #include "debug.h"
 #include "modules.h"
 #include "global.h"
+#include "testlib.h"
+
+
+#ifndef _WIN32
+/* socket used by test processes to hand results to the reporter */
+static int reporter_fd = -1;
+
+/* spool used when results can't be delivered to the broker */
+static spool_config_t *spool_config = NULL;
+#endif
 
 
 
 /*
  * Create a connection to the broker (local or remote) that measured can use
- * to report data from tests. Each test *should* use a different channel within
- * this connection but they currently all create their own individual
- * connections as sharing connections/channels becomes tricky when multiple
- * processes are involved.
- * TODO create a connection that persists for the lifetime of the main process
- * that allocates channels within it for each test process.
+ * to report data from tests. The reporter process holds one of these open
+ * for its whole lifetime, tests only create their own individual connections
+ * if they can't hand their results to the reporter.
  */
 static amqp_connection_state_t connect_to_broker(void) {
     amqp_socket_t *sock;
@@ -151,57 +170,36 @@ static void close_broker_connection(amqp_connection_state_t conn) {
 
 
 /*
- * Report results for a single test to the broker.
+ * Publish a single result on an open channel.
  *
  * example amqp_table_t stuff:
  * https://groups.google.com/forum/?fromgroups=#!topic/rabbitmq-discuss/M_8I12gWxbQ
  * rabbitmq-c/tests/test_tables.c
  */
-int report_to_broker(test_t *test, amp_test_result_t *result) {
+static int publish_result(amqp_connection_state_t conn, amqp_channel_t channel,
+        char *name, uint64_t timestamp, int64_t start_delay, void *bytes,
+        uint32_t len) {
 
     amqp_basic_properties_t props;
     amqp_bytes_t data;
     amqp_table_t headers;
-    amqp_table_entry_t table_entries;
+    amqp_table_entry_t table_entries[2];
     char *exchange = vars.vialocal ? AMQP_LOCAL_EXCHANGE : vars.exchange;
     char *routingkey = vars.vialocal ? AMQP_LOCAL_ROUTING_KEY : vars.routingkey;
-    amqp_connection_state_t conn;
-
-    /*
-     * Ideally this would only happen once and the same connection would be
-     * reused for all tests, but with their own channel. A connection can't
-     * be shared by multiple processes/threads however, so they can't just
-     * create themselves a new channel using the single connection object -
-     * they need to make their own connection, or the master parent process
-     * needs to create the channel and somehow tell the child which channel
-     * to use.
-     * TODO how to make this work with a single connection, multiple channels.
-     */
-    if ( (conn = connect_to_broker()) == NULL ) {
-        return -1;
-    }
-
-    /*
-     * open a new channel for every reporting process, there may be multiple
-     * of these going on at once so they need individual channels
-     */
-    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
-    amqp_channel_open(conn, getpid());
-
-    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
-	Log(LOG_ERR, "Failed to open channel");
-	close_broker_connection(conn);
-	return -1;
-    }
 
     /* The name of the test data is being reported for */
-    table_entries.key = amqp_cstring_bytes("x-amp-test-type");
-    table_entries.value.kind = AMQP_FIELD_KIND_UTF8;
-    table_entries.value.value.bytes = amqp_cstring_bytes(test->name);
+    table_entries[0].key = amqp_cstring_bytes("x-amp-test-type");
+    table_entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+    table_entries[0].value.value.bytes = amqp_cstring_bytes(name);
+
+    /* How long after its scheduled time the test started (us), if known */
+    table_entries[1].key = amqp_cstring_bytes("x-amp-start-delay");
+    table_entries[1].value.kind = AMQP_FIELD_KIND_I64;
+    table_entries[1].value.value.i64 = start_delay;
 
-    /* Add all the individual headers to the header table - only test type */
-    headers.num_entries = 1;
-    headers.entries = &table_entries;
+    /* Add all the individual headers to the header table */
+    headers.num_entries = start_delay >= 0 ? 2 : 1;
+    headers.entries = table_entries;
 
     /* Mark the flags that will be present */
     props._flags =
@@ -214,7 +212,7 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     props.content_type = amqp_cstring_bytes("application/octet-stream");
     props.delivery_mode = 2; /* persistent delivery mode */
     props.headers = headers;
-    props.timestamp = result->timestamp;
+    props.timestamp = timestamp;
     /*
      * If the userid is set, it must match the authenticated username or the
      * message will be rejected by the rabbitmq broker. If it is not set then
@@ -223,15 +221,15 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     props.user_id = amqp_cstring_bytes(vars.ampname);
 
     /* Add the binary blob, the other end will know how to unpack it */
-    data.len = result->len;
-    data.bytes = result->data;
+    data.len = len;
+    data.bytes = bytes;
 
     /* publish the message */
     Log(LOG_DEBUG, "Publishing message to exchange '%s', routingkey '%s'\n",
             exchange, routingkey);
 
     if ( amqp_basic_publish(conn,
-	    getpid(),				    /* channel, our pid */
+	    channel,				    /* channel */
 	    amqp_cstring_bytes(exchange),           /* exchange name */
 	    amqp_cstring_bytes(routingkey),         /* routing key */
 	    0,					    /* mandatory */
@@ -240,9 +238,138 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
 	    data) < 0 ) {			    /* body */
 
 	Log(LOG_ERR, "Failed to publish message");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+#ifndef _WIN32
+/*
+ * Hand a result over to the reporter process, which will publish it using
+ * its persistent connection to the broker. Returns -1 if the reporter isn't
+ * available or can't take the result right now.
+ */
+static int hand_off_result(test_t *test, amp_test_result_t *result) {
+    struct report_message_header header;
+    struct iovec iov[3];
+    struct msghdr msg;
+
+    if ( reporter_fd < 0 ) {
+        return -1;
+    }
+
+    header.timestamp = result->timestamp;
+    header.start_delay = result->start_delay;
+    header.len = result->len;
+    header.namelen = strlen(test->name) + 1;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = test->name;
+    iov[1].iov_len = header.namelen;
+    iov[2].iov_base = result->data;
+    iov[2].iov_len = result->len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    if ( sendmsg(reporter_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+        Log(LOG_DEBUG, "Failed to hand result to reporter: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+
+
+#if _WIN32
+/*
+ * There is no spool on Windows, results that can't be reported are lost.
+ */
+static int spool_result(__attribute__((unused))test_t *test,
+        __attribute__((unused))amp_test_result_t *result) {
+    return -1;
+}
+#else
+/*
+ * Write a result straight to the spool, for when neither the reporter nor
+ * the broker can take it. The reporter will replay it later.
+ */
+static int spool_result(test_t *test, amp_test_result_t *result) {
+    spool_t *spool;
+    int status;
+
+    if ( spool_config == NULL ) {
+        return -1;
+    }
+
+    if ( (spool = open_spool(spool_config->path,
+                    spool_config->max_size)) == NULL ) {
+        return -1;
+    }
+
+    status = spool_append(spool, test->name, result->timestamp,
+            result->start_delay, result->data, result->len);
+    close_spool(spool);
+
+    if ( status == 0 ) {
+        Log(LOG_DEBUG, "Spooled %s result for later delivery", test->name);
+    }
+
+    return status;
+}
+#endif
+
+
+
+/*
+ * Report results for a single test to the broker. If the reporter process
+ * is running then the result is handed to it, otherwise a new connection is
+ * made to the broker just for this result. If that fails too then the
+ * result is written to the spool (if enabled).
+ */
+int report_to_broker(test_t *test, amp_test_result_t *result) {
+    amqp_connection_state_t conn;
+
+#ifndef _WIN32
+    if ( hand_off_result(test, result) == 0 ) {
+        return 0;
+    }
+#endif
+
+    /*
+     * A connection can't be shared by multiple processes/threads, so if the
+     * reporter isn't available then make a connection of our own.
+     */
+    if ( (conn = connect_to_broker()) == NULL ) {
+        return spool_result(test, result);
+    }
+
+    /*
+     * open a new channel for every reporting process, there may be multiple
+     * of these going on at once so they need individual channels
+     */
+    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
+    amqp_channel_open(conn, getpid());
+
+    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+	Log(LOG_ERR, "Failed to open channel");
+	close_broker_connection(conn);
+	return spool_result(test, result);
+    }
+
+    if ( publish_result(conn, getpid(), test->name, result->timestamp,
+                result->start_delay, result->data, result->len) < 0 ) {
 	amqp_channel_close(conn, getpid(), AMQP_REPLY_SUCCESS);
 	close_broker_connection(conn);
-	return -1;
+	return spool_result(test, result);
     }
 
     Log(LOG_DEBUG, "Closing channel %d\n", getpid());
@@ -251,3 +378,691 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     close_broker_connection(conn);
     return 0;
 }
+
+
+
+#ifndef _WIN32
+/*
+ * Add a result item to the end of a queue.
+ */
+static void queue_append(struct report_queue *queue, struct report_item *item) {
+    item->next = NULL;
+    if ( queue->tail ) {
+        queue->tail->next = item;
+    } else {
+        queue->head = item;
+    }
+    queue->tail = item;
+    queue->count++;
+}
+
+
+
+/*
+ * Remove and return the result item at the front of a queue.
+ */
+static struct report_item *queue_pop(struct report_queue *queue) {
+    struct report_item *item = queue->head;
+
+    if ( item ) {
+        queue->head = item->next;
+        if ( queue->head == NULL ) {
+            queue->tail = NULL;
+        }
+        queue->count--;
+        item->next = NULL;
+    }
+
+    return item;
+}
+
+
+
+/*
+ * Move every item in the source queue to the front of the destination queue,
+ * keeping them in the same order. Used to republish unconfirmed results.
+ */
+static void queue_prepend_all(struct report_queue *dst,
+        struct report_queue *src) {
+    if ( src->head == NULL ) {
+        return;
+    }
+
+    src->tail->next = dst->head;
+    if ( dst->tail == NULL ) {
+        dst->tail = src->tail;
+    }
+    dst->head = src->head;
+    dst->count += src->count;
+
+    src->head = src->tail = NULL;
+    src->count = 0;
+}
+
+
+
+static void free_report_item(struct report_item *item) {
+    free(item->name);
+    free(item->data);
+    free(item);
+}
+
+
+
+/*
+ * Parse a result message sent by hand_off_result().
+ */
+static struct report_item *parse_report_message(char *buffer, ssize_t bytes) {
+    struct report_message_header header;
+    struct report_item *item;
+
+    if ( bytes < (ssize_t)sizeof(header) ) {
+        return NULL;
+    }
+
+    memcpy(&header, buffer, sizeof(header));
+
+    if ( header.namelen == 0 ||
+            (ssize_t)(sizeof(header) + header.namelen + header.len) != bytes ||
+            buffer[sizeof(header) + header.namelen - 1] != '\0' ) {
+        return NULL;
+    }
+
+    if ( (item = calloc(1, sizeof(struct report_item))) == NULL ) {
+        return NULL;
+    }
+
+    if ( (item->name = strdup(buffer + sizeof(header))) == NULL ||
+            (item->data = malloc(header.len > 0 ? header.len : 1)) == NULL ) {
+        free_report_item(item);
+        return NULL;
+    }
+
+    item->timestamp = header.timestamp;
+    item->start_delay = header.start_delay;
+    item->len = header.len;
+    memcpy(item->data, buffer + sizeof(header) + header.namelen, header.len);
+
+    return item;
+}
+
+
+
+/*
+ * Connect to the broker and open a channel in confirm mode, so that the
+ * broker will acknowledge each message once it has taken responsibility
+ * for it.
+ */
+static amqp_connection_state_t open_reporter_connection(void) {
+    amqp_connection_state_t conn;
+
+    if ( (conn = connect_to_broker()) == NULL ) {
+        return NULL;
+    }
+
+    amqp_channel_open(conn, REPORTER_CHANNEL);
+
+    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+	Log(LOG_ERR, "Failed to open reporter channel");
+	amqp_destroy_connection(conn);
+	return NULL;
+    }
+
+    amqp_confirm_select(conn, REPORTER_CHANNEL);
+
+    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+	Log(LOG_ERR, "Failed to enable publisher confirms");
+	amqp_destroy_connection(conn);
+	return NULL;
+    }
+
+    return conn;
+}
+
+
+
+/*
+ * Write a result item to the spool so that it can be replayed once the
+ * broker is available again. Items that were themselves replayed from the
+ * spool and are still past the confirmed offset don't need to be written
+ * again, they will be read again after the spool is rewound. The item is
+ * freed on success, returns -1 if it couldn't be spooled.
+ */
+static int spool_report_item(struct reporter *reporter,
+        struct report_item *item) {
+
+    if ( reporter->spool == NULL ) {
+        return -1;
+    }
+
+    if ( item->spool_end > 0 ) {
+        uint64_t end = item->spool_end;
+
+        reporter->spooled--;
+        item->spool_end = 0;
+
+        if ( end > reporter->spool->done ) {
+            free_report_item(item);
+            return 0;
+        }
+    }
+
+    if ( spool_append(reporter->spool, item->name, item->timestamp,
+                item->start_delay, item->data, item->len) < 0 ) {
+        return -1;
+    }
+
+    free_report_item(item);
+    return 0;
+}
+
+
+
+/*
+ * Move every result waiting to be published out of memory and into the
+ * spool, keeping anything that couldn't be spooled. The spool is rewound so
+ * that replayed results that weren't confirmed are read again.
+ */
+static void spool_pending(struct reporter *reporter) {
+    struct report_queue kept;
+    struct report_item *item;
+
+    if ( reporter->spool == NULL ) {
+        return;
+    }
+
+    memset(&kept, 0, sizeof(kept));
+
+    while ( (item = queue_pop(&reporter->pending)) != NULL ) {
+        if ( spool_report_item(reporter, item) < 0 ) {
+            queue_append(&kept, item);
+        }
+    }
+
+    queue_prepend_all(&reporter->pending, &kept);
+    spool_rewind(reporter->spool);
+    spool_sync(reporter->spool, 1);
+}
+
+
+
+/*
+ * Drop the connection to the broker after an error. Anything that hasn't
+ * been confirmed yet will be published again on the next connection, via
+ * the spool if it is enabled.
+ */
+static void drop_reporter_connection(amqp_connection_state_t conn,
+        struct reporter *reporter) {
+
+    Log(LOG_WARNING, "Lost connection to broker, %d results unconfirmed",
+            reporter->unconfirmed.count);
+
+    amqp_destroy_connection(conn);
+    queue_prepend_all(&reporter->pending, &reporter->unconfirmed);
+    spool_pending(reporter);
+}
+
+
+
+/*
+ * Deal with a publisher confirm (ack or nack) from the broker. Items are
+ * published in order, so the unconfirmed queue is sorted by delivery tag.
+ */
+static void process_confirm(uint64_t tag, int multiple, int ack,
+        struct reporter *reporter) {
+    struct report_queue waiting;
+    struct report_item *item;
+
+    memset(&waiting, 0, sizeof(waiting));
+
+    while ( reporter->unconfirmed.head != NULL &&
+            reporter->unconfirmed.head->tag <= tag ) {
+        item = queue_pop(&reporter->unconfirmed);
+
+        if ( !multiple && item->tag != tag ) {
+            /* not covered by this confirm, keep waiting for it */
+            queue_append(&waiting, item);
+            continue;
+        }
+
+        if ( ack ) {
+            if ( item->spool_end > 0 ) {
+                spool_mark_done(reporter->spool, item->spool_end);
+                reporter->spooled--;
+            }
+            free_report_item(item);
+        } else {
+            Log(LOG_WARNING, "Broker rejected %s result, will retry",
+                    item->name);
+            /* move past a replayed result so it gets written again */
+            if ( item->spool_end > 0 ) {
+                spool_mark_done(reporter->spool, item->spool_end);
+            }
+            if ( spool_report_item(reporter, item) < 0 ) {
+                queue_append(&reporter->pending, item);
+            }
+        }
+    }
+
+    /* anything skipped over is still waiting for confirmation */
+    queue_prepend_all(&reporter->unconfirmed, &waiting);
+
+    /* empty the spool once everything in it has been delivered */
+    if ( reporter->spool && reporter->spooled == 0 ) {
+        spool_compact(reporter->spool);
+    }
+}
+
+
+
+/*
+ * Read and act on all the frames the broker has sent us. Returns -1 if the
+ * connection has failed and needs to be reestablished.
+ */
+static int process_broker_frames(amqp_connection_state_t conn,
+        struct reporter *reporter) {
+    struct timeval timeout = {0, 0};
+    amqp_frame_t frame;
+    int status;
+
+    while ( (status = amqp_simple_wait_frame_noblock(conn, &frame,
+                    &timeout)) == AMQP_STATUS_OK ) {
+        if ( frame.frame_type != AMQP_FRAME_METHOD ) {
+            continue;
+        }
+
+        switch ( frame.payload.method.id ) {
+            case AMQP_BASIC_ACK_METHOD: {
+                amqp_basic_ack_t *ack = frame.payload.method.decoded;
+                process_confirm(ack->delivery_tag, ack->multiple, 1, reporter);
+                break;
+            }
+
+            case AMQP_BASIC_NACK_METHOD: {
+                amqp_basic_nack_t *nack = frame.payload.method.decoded;
+                process_confirm(nack->delivery_tag, nack->multiple, 0,
+                        reporter);
+                break;
+            }
+
+            case AMQP_CHANNEL_CLOSE_METHOD:
+            case AMQP_CONNECTION_CLOSE_METHOD:
+                Log(LOG_WARNING, "Broker closed reporter connection");
+                return -1;
+
+            default:
+                break;
+        };
+    }
+
+    amqp_maybe_release_buffers(conn);
+
+    return status == AMQP_STATUS_TIMEOUT ? 0 : -1;
+}
+
+
+
+/*
+ * Read results back out of the spool to be published, limited by the replay
+ * rate so that a long outage doesn't flood the broker when it comes back.
+ * Only as many results are read as will fit in the window of unconfirmed
+ * messages, newer results that arrive in the meantime take priority.
+ */
+static void replay_spool(struct reporter *reporter, double *tokens,
+        uint64_t *last_refill, uint32_t rate) {
+    spool_record_t record;
+    struct report_item *item;
+    uint64_t now = monotonic_ns();
+    int status;
+
+    *tokens += (double)(now - *last_refill) * rate / 1000000000.0;
+    *last_refill = now;
+
+    /* allow at most a second worth of results in a single burst */
+    if ( *tokens > rate ) {
+        *tokens = rate;
+    }
+
+    while ( *tokens >= 1 && reporter->pending.count +
+            reporter->unconfirmed.count < MAX_REPORTER_UNCONFIRMED ) {
+        /* allocate first so a record is never read and then lost */
+        if ( (item = calloc(1, sizeof(struct report_item))) == NULL ) {
+            break;
+        }
+
+        if ( (status = spool_read_next(reporter->spool, &record)) == 0 ) {
+            free(item);
+            break;
+        }
+
+        if ( status < 0 ) {
+            /* bad record, it will never be confirmed so skip past it */
+            if ( reporter->spooled == 0 ) {
+                spool_mark_done(reporter->spool, reporter->spool->read);
+                spool_compact(reporter->spool);
+            }
+            free(item);
+            continue;
+        }
+
+        item->name = record.name;
+        item->timestamp = record.timestamp;
+        item->start_delay = record.start_delay;
+        item->data = record.data;
+        item->len = record.len;
+        item->spool_end = record.end;
+
+        queue_append(&reporter->pending, item);
+        reporter->spooled++;
+        *tokens -= 1;
+    }
+}
+
+
+
+/*
+ * Main loop of the reporter process. Results arrive from test processes on
+ * the local socket and are published on a single long lived connection.
+ * Publishes are pipelined (up to MAX_REPORTER_UNCONFIRMED at a time) and
+ * only forgotten once the broker confirms them, so a result that is lost in
+ * a connection failure will be published again once reconnected. While the
+ * broker is unavailable results are written to the spool (if enabled), and
+ * replayed from there at a limited rate once the broker is back.
+ */
+static void run_reporter(int fd, spool_config_t *config) {
+    struct reporter reporter;
+    amqp_connection_state_t conn = NULL;
+    time_t next_connect = 0;
+    time_t deadline = 0;
+    uint64_t next_tag = 0;
+    uint64_t last_refill = monotonic_ns();
+    double tokens = 0;
+    int closing = 0;
+    int unsent;
+    char *buffer;
+
+    memset(&reporter, 0, sizeof(reporter));
+
+    if ( (buffer = malloc(MAX_REPORT_MESSAGE_LEN)) == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate reporter buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( config ) {
+        if ( (reporter.spool = open_spool(config->path,
+                        config->max_size)) == NULL ) {
+            Log(LOG_WARNING, "Spool unavailable, results will only be "
+                    "held in memory while the broker is unavailable");
+        }
+    }
+
+    while ( 1 ) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        int timeout = REPORTER_POLL_MS;
+        int backlog = reporter.spool && spool_has_backlog(reporter.spool);
+        time_t now = time(NULL);
+
+        /* try to (re)connect if there is anything to publish */
+        if ( conn == NULL && (reporter.pending.count > 0 || backlog) &&
+                now >= next_connect ) {
+            if ( (conn = open_reporter_connection()) == NULL ) {
+                next_connect = now + REPORTER_RECONNECT_DELAY;
+                spool_pending(&reporter);
+            } else {
+                next_tag = 1;
+            }
+        }
+
+        /* catch up on anything spooled while the broker was unavailable */
+        if ( conn != NULL && backlog && !closing ) {
+            replay_spool(&reporter, &tokens, &last_refill,
+                    config->replay_rate);
+            timeout = 1000 / config->replay_rate;
+            if ( timeout == 0 ) {
+                timeout = 1;
+            }
+        }
+
+        /* publish everything we can without waiting for confirms */
+        while ( conn != NULL && reporter.pending.count > 0 &&
+                reporter.unconfirmed.count < MAX_REPORTER_UNCONFIRMED ) {
+            struct report_item *item = queue_pop(&reporter.pending);
+
+            queue_append(&reporter.unconfirmed, item);
+
+            if ( publish_result(conn, REPORTER_CHANNEL, item->name,
+                        item->timestamp, item->start_delay, item->data,
+                        item->len) < 0 ) {
+                drop_reporter_connection(conn, &reporter);
+                conn = NULL;
+                next_connect = now + REPORTER_RECONNECT_DELAY;
+                break;
+            }
+
+            item->tag = next_tag++;
+        }
+
+        if ( reporter.spool ) {
+            spool_sync(reporter.spool, 0);
+        }
+
+        if ( closing ) {
+            if ( reporter.pending.count == 0 &&
+                    reporter.unconfirmed.count == 0 ) {
+                break;
+            }
+
+            /* no point waiting for the broker if results can be spooled */
+            if ( now >= deadline || (reporter.spool && conn == NULL) ) {
+                break;
+            }
+        } else {
+            fds[nfds].fd = fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if ( conn != NULL ) {
+            /* frames might already be buffered, don't wait for the socket */
+            if ( amqp_frames_enqueued(conn) || amqp_data_in_buffer(conn) ) {
+                if ( process_broker_frames(conn, &reporter) < 0 ) {
+                    drop_reporter_connection(conn, &reporter);
+                    conn = NULL;
+                    next_connect = now + REPORTER_RECONNECT_DELAY;
+                }
+                continue;
+            }
+
+            fds[nfds].fd = amqp_get_sockfd(conn);
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if ( poll(fds, nfds, timeout) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Reporter poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if ( !closing && fds[0].revents ) {
+            ssize_t bytes = recv(fd, buffer, MAX_REPORT_MESSAGE_LEN, 0);
+
+            if ( bytes > 0 ) {
+                struct report_item *item;
+
+                if ( (item = parse_report_message(buffer, bytes)) == NULL ) {
+                    Log(LOG_WARNING, "Reporter received malformed result");
+                } else if ( (conn == NULL && now < next_connect) ||
+                        reporter.pending.count + reporter.unconfirmed.count >=
+                        MAX_REPORTER_BACKLOG ) {
+                    /* broker is unavailable or we're too far behind */
+                    if ( spool_report_item(&reporter, item) < 0 ) {
+                        /* don't let a broker outage use unbounded memory */
+                        if ( reporter.pending.count +
+                                reporter.unconfirmed.count >=
+                                MAX_REPORTER_BACKLOG ) {
+                            struct report_item *old =
+                                queue_pop(&reporter.pending);
+                            if ( old ) {
+                                Log(LOG_WARNING, "Reporter backlog full, "
+                                        "dropping %s result", old->name);
+                                free_report_item(old);
+                            }
+                        }
+                        queue_append(&reporter.pending, item);
+                    }
+                } else {
+                    queue_append(&reporter.pending, item);
+                }
+            } else if ( bytes == 0 || (errno != EINTR && errno != EAGAIN) ) {
+                /* measured has closed the socket, finish up and exit */
+                Log(LOG_DEBUG, "Reporter socket closed, flushing %d results",
+                        reporter.pending.count + reporter.unconfirmed.count);
+                closing = 1;
+                deadline = now + REPORTER_FLUSH_TIMEOUT;
+            }
+        }
+
+        if ( conn != NULL && fds[nfds - 1].revents ) {
+            if ( process_broker_frames(conn, &reporter) < 0 ) {
+                drop_reporter_connection(conn, &reporter);
+                conn = NULL;
+                next_connect = now + REPORTER_RECONNECT_DELAY;
+            }
+        }
+    }
+
+    if ( conn ) {
+        amqp_channel_close(conn, REPORTER_CHANNEL, AMQP_REPLY_SUCCESS);
+        close_broker_connection(conn);
+    }
+
+    /* keep anything that wasn't confirmed to send next time */
+    queue_prepend_all(&reporter.pending, &reporter.unconfirmed);
+    spool_pending(&reporter);
+
+    if ( (unsent = reporter.pending.count) > 0 ) {
+        Log(LOG_WARNING, "Reporter exiting with %d results unsent", unsent);
+    }
+
+    close_spool(reporter.spool);
+    free(buffer);
+    exit(EXIT_SUCCESS);
+}
+
+
+
+/*
+ * Start the reporter process that holds the persistent connection to the
+ * broker. Test processes forked after this will hand their results to it
+ * rather than connecting to the broker themselves. If a spool is configured
+ * then results are kept there while the broker is unavailable.
+ */
+int start_reporter(spool_config_t *spool) {
+    int sv[2];
+    int size = MAX_REPORT_MESSAGE_LEN;
+    pid_t pid;
+
+    /* tests can still use the spool even if the reporter fails */
+    spool_config = spool;
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 ) {
+        Log(LOG_WARNING, "Failed to create reporter socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    /* make sure large results fit in a single message if possible */
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    if ( (pid = fork()) < 0 ) {
+        Log(LOG_WARNING, "Failed to fork reporter: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if ( pid == 0 ) {
+        close(sv[0]);
+
+        /*
+         * Shutdown is signalled by measured closing the socket, so don't let
+         * signals sent to the whole process group throw away results.
+         */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+
+        set_proc_name("reporter");
+
+        run_reporter(sv[1], spool);
+        /* not reached */
+        exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    reporter_fd = sv[0];
+
+    Log(LOG_DEBUG, "Started reporter process %d", pid);
+
+    return 0;
+}
+
+
+
+/*
+ * Close the socket to the reporter, which will publish anything that is
+ * outstanding and then exit.
+ */
+void stop_reporter(void) {
+    if ( reporter_fd < 0 ) {
+        return;
+    }
+
+    /* tests forked from measured may still hold a copy of the descriptor */
+    shutdown(reporter_fd, SHUT_RDWR);
+    close(reporter_fd);
+    reporter_fd = -1;
+}
+
+
+
+#if UNIT_TEST
+struct report_item *amp_test_parse_report_message(char *buffer,
+        ssize_t bytes) {
+    return parse_report_message(buffer, bytes);
+}
+
+void amp_test_free_report_item(struct report_item *item) {
+    free_report_item(item);
+}
+
+void amp_test_queue_append(struct report_queue *queue,
+        struct report_item *item) {
+    queue_append(queue, item);
+}
+
+struct report_item *amp_test_queue_pop(struct report_queue *queue) {
+    return queue_pop(queue);
+}
+
+void amp_test_queue_prepend_all(struct report_queue *dst,
+        struct report_queue *src) {
+    queue_prepend_all(dst, src);
+}
+
+void amp_test_process_confirm(uint64_t tag, int multiple, int ack,
+        struct reporter *reporter) {
+    process_confirm(tag, multiple, ack, reporter);
+}
+
+void amp_test_replay_spool(struct reporter *reporter, double *tokens,
+        uint64_t *last_refill, uint32_t rate) {
+    replay_spool(reporter, tokens, last_refill, rate);
+}
+#endif
+#endif
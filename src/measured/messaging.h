@@ -40,8 +40,11 @@
 #ifndef _MEASURED_MESSAGING_H
 #define _MEASURED_MESSAGING_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <amqp.h>
 #include "tests.h"
+#include "spool.h"
 
 
 /* local broker will persist it for us and send to master server later */
@@ -60,6 +63,90 @@
 #define AMQP_LOCAL_EXCHANGE ""
 #define AMQP_LOCAL_ROUTING_KEY "report"
 
+/* channel used by the reporter on its persistent connection */
+#define REPORTER_CHANNEL 1
+
+/* largest result that can be handed to the reporter */
+#define MAX_REPORT_MESSAGE_LEN (256 * 1024)
+
+/* maximum number of published results waiting on broker confirms */
+#define MAX_REPORTER_UNCONFIRMED 256
+
+/* maximum number of results held in memory while the broker is unavailable */
+#define MAX_REPORTER_BACKLOG 4096
+
+/* seconds to wait between attempts to reconnect to the broker */
+#define REPORTER_RECONNECT_DELAY 10
+
+/* seconds to spend publishing outstanding results when shutting down */
+#define REPORTER_FLUSH_TIMEOUT 10
+
+/* how often the reporter wakes up to check timers (ms) */
+#define REPORTER_POLL_MS 1000
+
+/*
+ * Header on the front of every result sent to the reporter, followed by the
+ * null terminated test name and then the result data.
+ */
+struct report_message_header {
+    uint64_t timestamp;         /* timestamp of the result */
+    int64_t start_delay;        /* how late the test started (us) */
+    uint32_t len;               /* length of the result data */
+    uint8_t namelen;            /* length of the test name, including null */
+};
+
+#ifndef _WIN32
+/*
+ * A single result waiting to be published (or confirmed) by the reporter.
+ */
+struct report_item {
+    char *name;                 /* name of the test that produced the data */
+    uint64_t timestamp;         /* timestamp of the result */
+    int64_t start_delay;        /* how late the test started, -1 unknown */
+    void *data;                 /* serialised result data */
+    uint32_t len;               /* length of the result data */
+    uint64_t tag;               /* delivery tag once published */
+    uint64_t spool_end;         /* end of the spool record, if replayed */
+    struct report_item *next;
+};
+
+/* simple FIFO of result items */
+struct report_queue {
+    struct report_item *head;
+    struct report_item *tail;
+    uint32_t count;
+};
+
+/*
+ * State of the reporter process.
+ */
+struct reporter {
+    struct report_queue pending;        /* results waiting to be published */
+    struct report_queue unconfirmed;    /* results waiting on confirms */
+    spool_t *spool;                     /* on-disk spool, if enabled */
+    uint32_t spooled;                   /* results replayed but unconfirmed */
+};
+#endif
+
 int report_to_broker(test_t *test, amp_test_result_t *result);
+#ifndef _WIN32
+int start_reporter(spool_config_t *spool);
+void stop_reporter(void);
+#endif
+
+#if UNIT_TEST && !_WIN32
+struct report_item *amp_test_parse_report_message(char *buffer,
+        ssize_t bytes);
+void amp_test_free_report_item(struct report_item *item);
+void amp_test_queue_append(struct report_queue *queue,
+        struct report_item *item);
+struct report_item *amp_test_queue_pop(struct report_queue *queue);
+void amp_test_queue_prepend_all(struct report_queue *dst,
+        struct report_queue *src);
+void amp_test_process_confirm(uint64_t tag, int multiple, int ack,
+        struct reporter *reporter);
+void amp_test_replay_spool(struct reporter *reporter, double *tokens,
+        uint64_t *last_refill, uint32_t rate);
+#endif
 
 #endif
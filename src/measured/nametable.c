@@ -60,6 +60,80 @@
 
 nametable_t *name_table = NULL;
 
+/*
+ * Every item in the name_table list is also indexed by a hash of its name so
+ * that lookups don't need to walk the whole list. Schedules can refer to tens
+ * of thousands of names, and every insert also needs a lookup.
+ */
+static nametable_t **name_buckets = NULL;
+static uint32_t bucket_count = 0;
+static uint32_t name_count = 0;
+
+/* set once loading is complete, the table won't change until it's cleared */
+static int nametable_frozen = 0;
+
+
+
+/*
+ * FNV-1a hash of the name.
+ */
+static uint32_t hash_name(char *name) {
+    uint32_t hash = 2166136261U;
+
+    for ( ; *name != '\0'; name++ ) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Rebuild the hash index with the given number of buckets, which must be a
+ * power of two.
+ */
+static void resize_name_buckets(uint32_t size) {
+    nametable_t *item;
+
+    assert(size > 0 && (size & (size - 1)) == 0);
+
+    free(name_buckets);
+    name_buckets = (nametable_t **)calloc(size, sizeof(nametable_t *));
+    bucket_count = size;
+
+    for ( item = name_table; item != NULL; item = item->next ) {
+        item->hash_next = name_buckets[item->hash & (bucket_count - 1)];
+        name_buckets[item->hash & (bucket_count - 1)] = item;
+    }
+}
+
+
+
+/*
+ * Find the item with the given name and hash.
+ */
+static nametable_t *lookup_name(char *name, uint32_t hash) {
+    nametable_t *item;
+
+    if ( name_buckets == NULL ) {
+        return NULL;
+    }
+
+    for ( item = name_buckets[hash & (bucket_count - 1)]; item != NULL;
+            item = item->hash_next ) {
+        assert(item->addr);
+        assert(item->addr->ai_canonname);
+        if ( item->hash == hash &&
+                strcmp(name, item->addr->ai_canonname) == 0 ) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
 
 
 /*
@@ -68,19 +142,34 @@ nametable_t *name_table = NULL;
  */
 static void insert_nametable_entry(char *name, struct addrinfo *info) {
     nametable_t *item;
+    uint32_t hash;
+
     assert(name);
     assert(info);
     assert(info->ai_next == NULL);
+    assert(!nametable_frozen);
 
     info->ai_canonname = strdup(name);
+    hash = hash_name(name);
 
-    if ( (item = name_to_address(name)) == NULL ) {
+    if ( (item = lookup_name(name, hash)) == NULL ) {
         /* if it doesn't exist, create it with the single struct addrinfo */
         item = (nametable_t *)malloc(sizeof(nametable_t));
         item->addr = info;
         item->next = name_table;
+        item->hash = hash;
         item->count = 1;
         name_table = item;
+        name_count++;
+
+        /* keep the average chain length below one while loading */
+        if ( name_count > bucket_count ) {
+            resize_name_buckets(bucket_count ? bucket_count * 2 :
+                    NAMETABLE_INITIAL_BUCKETS);
+        } else {
+            item->hash_next = name_buckets[hash & (bucket_count - 1)];
+            name_buckets[hash & (bucket_count - 1)] = item;
+        }
     } else {
         /* if it does exist, add this struct addrinfo to the list */
         info->ai_next = item->addr;
@@ -91,6 +180,27 @@ static void insert_nametable_entry(char *name, struct addrinfo *info) {
 
 
 
+/*
+ * Mark the nametable as complete once all the files have been loaded. The
+ * index is trimmed to fit the number of names so it stays compact, and
+ * nothing should modify the table after this until it is cleared.
+ */
+static void freeze_nametable(void) {
+    uint32_t size = NAMETABLE_INITIAL_BUCKETS;
+
+    while ( size < name_count ) {
+        size *= 2;
+    }
+
+    if ( name_table != NULL && size != bucket_count ) {
+        resize_name_buckets(size);
+    }
+
+    nametable_frozen = 1;
+}
+
+
+
 /*
  * Dump the entire contents of the nametable for debugging.
  */
@@ -153,32 +263,27 @@ void clear_nametable() {
         }
 	name_table = NULL;
     }
+
+    free(name_buckets);
+    name_buckets = NULL;
+    bucket_count = 0;
+    name_count = 0;
+    nametable_frozen = 0;
 }
 
 
 
 /*
- * Traverse the list and return the first address structure that has the
- * given name.
+ * Return the nametable item that has the given name.
  */
 nametable_t *name_to_address(char *name) {
-    nametable_t *item;
-
     assert(name);
 
     if ( name_table == NULL ) {
 	return NULL;
     }
 
-    for ( item=name_table; item != NULL; item=item->next ) {
-        assert(item->addr);
-        assert(item->addr->ai_canonname);
-        if ( strcmp(name, item->addr->ai_canonname) == 0 ) {
-            return item;
-        }
-    }
-
-    return NULL;
+    return lookup_name(name, hash_name(name));
 }
 
 
@@ -241,11 +346,9 @@ static void read_nametable_file(char *filename) {
 
 
 /*
- *
+ * Find all the nametable files in a directory.
  */
-void read_nametable_dir(struct ub_ctx *ctx, char *directory) {
-    glob_t glob_buf;
-    unsigned int i;
+static void glob_nametable_dir(char *directory, glob_t *glob_buf) {
     char full_loc[MAX_PATH_LENGTH];
 
     assert(directory);
@@ -258,11 +361,26 @@ void read_nametable_dir(struct ub_ctx *ctx, char *directory) {
      */
     strcpy(full_loc, directory);
     strcat(full_loc, "/*.name");
-    glob(full_loc, 0, NULL, &glob_buf);
+    glob(full_loc, 0, NULL, glob_buf);
+}
+
+
+
+/*
+ *
+ */
+void read_nametable_dir(struct ub_ctx *ctx, char *directory) {
+    glob_t glob_buf;
+    unsigned int i;
+
+    glob_nametable_dir(directory, &glob_buf);
 
     Log(LOG_INFO, "Loading nametable from %s (found %zd candidates)",
 	    directory, glob_buf.gl_pathc);
 
+    /* entries can be added to by every directory that gets loaded */
+    nametable_frozen = 0;
+
     for ( i = 0; i < glob_buf.gl_pathc; i++ ) {
         Log(LOG_INFO, "Loading nametable from %s", glob_buf.gl_pathv[i]);
         /* try loading using libunbound, if the format is wrong fallback */
@@ -271,6 +389,7 @@ void read_nametable_dir(struct ub_ctx *ctx, char *directory) {
         }
     }
 
+    freeze_nametable();
     dump_nametable();
 
     globfree(&glob_buf);
@@ -279,8 +398,35 @@ void read_nametable_dir(struct ub_ctx *ctx, char *directory) {
 
 
 
+/*
+ * Load only the hosts format nametable files from a directory into another
+ * unbound context, so it will give the same answers as the main context.
+ */
+void load_nametable_hosts(struct ub_ctx *ctx, char *directory) {
+    glob_t glob_buf;
+    unsigned int i;
+
+    glob_nametable_dir(directory, &glob_buf);
+
+    for ( i = 0; i < glob_buf.gl_pathc; i++ ) {
+        ub_ctx_hosts(ctx, glob_buf.gl_pathv[i]);
+    }
+
+    globfree(&glob_buf);
+}
+
+
+
 #if UNIT_TEST
 void nametable_test_insert_nametable_entry(char *name, struct addrinfo *info) {
     insert_nametable_entry(name, info);
 }
+
+void nametable_test_freeze_nametable(void) {
+    freeze_nametable();
+}
+
+uint32_t nametable_test_get_bucket_count(void) {
+    return bucket_count;
+}
 #endif
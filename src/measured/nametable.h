@@ -50,19 +50,27 @@
 
 #define MAX_NAMETABLE_HOSTS 1024
 
+/* initial number of hash buckets, must be a power of two */
+#define NAMETABLE_INITIAL_BUCKETS 256
+
 struct nametable_item {
     struct addrinfo *addr;
-    struct nametable_item *next;
+    struct nametable_item *next;        /* next item in the list of all names */
+    struct nametable_item *hash_next;   /* next item in the same hash bucket */
+    uint32_t hash;
     uint8_t count;
 };
 typedef struct nametable_item nametable_t;
 
 void read_nametable_dir(struct ub_ctx *ctx, char *directory);
+void load_nametable_hosts(struct ub_ctx *ctx, char *directory);
 void setup_nametable_refresh(struct event_base *base);
 nametable_t *name_to_address(char *name);
 void clear_nametable(void);
 #if UNIT_TEST
 void nametable_test_insert_nametable_entry(char *name, struct addrinfo *info);
+void nametable_test_freeze_nametable(void);
+uint32_t nametable_test_get_bucket_count(void);
 #endif
 
 #endif
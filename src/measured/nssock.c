@@ -54,114 +54,241 @@
 
 #include "nssock.h"
 #include "ampresolv.h"
+#include "prefetch.h"
 #include "debug.h"
 
 
 
+/* event loop that test connections and unbound answers are dealt with on */
+static struct event_base *resolver_base = NULL;
+static struct event *resolver_fd_event = NULL;
+static struct ub_ctx *resolver_ctx = NULL;
+static struct timeval resolve_timeout = { NSSOCK_RESOLVE_TIMEOUT, 0 };
+
+
+
 /*
- * Receive all the queries from the local socket and wait for them to resolve
- * before sending them back to the test process.
+ * Free a connection once it has been closed and nothing else is going to
+ * add results to its address list.
  */
-static void *amp_resolver_worker_thread(void *thread_data) {
-    struct amp_resolve_info *data = (struct amp_resolve_info *)thread_data;
-    struct addrinfo *addrlist = NULL, *item;
-    char name[MAX_DNS_NAME_LEN];
-    struct amp_resolve_query info;
-    uint8_t more;
-    uint8_t namelen;
-    int bytes;
-    pthread_mutex_t addrlist_lock;
+static void free_resolve_info(struct amp_resolve_info *info) {
+    amp_resolve_freeaddr(info->addrlist);
+    pthread_mutex_destroy(&info->addrlist_lock);
+    free(info);
+}
 
-    Log(LOG_DEBUG, "Starting new name resolution thread");
 
-    pthread_mutex_init(&addrlist_lock, NULL);
 
-    /* everything we read should be a name to lookup */
-    while ( 1 ) {
+/*
+ * Send the test all the results that have been collected so far as a single
+ * batch (unless the connection failed), then close it. Names that are still
+ * being resolved keep the connection data alive until they finish.
+ */
+static void close_resolve_connection(struct amp_resolve_info *info,
+        int send_results) {
+
+    if ( send_results ) {
+        Log(LOG_DEBUG, "Sending resolved addresses back to test");
+        pthread_mutex_lock(&info->addrlist_lock);
+        amp_resolve_send_list(info->fd, info->addrlist);
+        pthread_mutex_unlock(&info->addrlist_lock);
+    }
 
-        /* read name length, address count, family etc */
-        if ( recv(data->fd, (void*)&info, sizeof(info), 0) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name info, aborting");
-            break;
-        }
+    if ( info->read_event ) {
+        event_free(info->read_event);
+        info->read_event = NULL;
+    }
 
-        /* zero here is a marker - no more names need to be resolved */
-        if ( info.namelen == 0 ) {
-            break;
-        }
+    if ( info->timeout ) {
+        event_free(info->timeout);
+        info->timeout = NULL;
+    }
 
-        if ( (bytes = recv(data->fd, (void*)name, info.namelen, 0)) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name, aborting");
-            break;
+    close(info->fd);
+    info->fd = -1;
+    info->replied = 1;
+
+    if ( info->pending == 0 ) {
+        free_resolve_info(info);
+    }
+}
+
+
+
+/*
+ * Called when all the answers for a single name have been added to the
+ * address list. Once the test has sent all its queries and every one has
+ * been answered, the results are sent back.
+ */
+static void resolve_name_done(void *arg) {
+    struct amp_resolve_info *info = (struct amp_resolve_info*)arg;
+
+    info->pending--;
+
+    if ( info->replied ) {
+        /* the test has already been sent what was available, tidy up */
+        if ( info->pending == 0 ) {
+            free_resolve_info(info);
         }
+        return;
+    }
+
+    if ( info->finished && info->pending == 0 ) {
+        Log(LOG_DEBUG, "Got all responses, sending them back");
+        close_resolve_connection(info, 1);
+    }
+}
+
+
+
+/*
+ * Start resolving a single name, using a prefetched answer if there is one.
+ */
+static void resolve_name(struct amp_resolve_info *info,
+        struct amp_resolve_query *query, char *name) {
 
-        Log(LOG_DEBUG, "Read %d bytes for name '%s'", bytes, name);
+    Log(LOG_DEBUG, "Read %d bytes for name '%s'", query->namelen, name);
 
-        /* add it to the list of names to resolve and go back for more */
-        amp_resolve_add(data->ctx, &addrlist, &addrlist_lock, name,
-                info.family, info.count);
+    if ( prefetch_lookup(name, query->family, query->count, &info->addrlist,
+                &info->addrlist_lock) == 0 ) {
+        return;
     }
 
-    Log(LOG_DEBUG, "Got all requests, waiting for responses");
+    info->pending++;
+    amp_resolve_add_callback(info->ctx, &info->addrlist, &info->addrlist_lock,
+            name, query->family, query->count, resolve_name_done, info);
+}
+
 
-    /* when the remote end has finished sending names, wait for resolution */
-    ub_wait(data->ctx);
 
-    /* once we have all the responses then we don't need the addrlist lock */
-    pthread_mutex_lock(&addrlist_lock);
+/*
+ * Read queries from a test process. Each one is a struct amp_resolve_query
+ * followed by the name, and a query with a zero length name marks the end.
+ */
+static void resolve_read_callback(evutil_socket_t fd,
+        __attribute__((unused))short flags, void *evdata) {
 
-    Log(LOG_DEBUG, "Got all responses, sending them back");
+    struct amp_resolve_info *info = (struct amp_resolve_info*)evdata;
+    struct amp_resolve_query query;
+    char name[MAX_DNS_NAME_LEN];
+    int bytes, used = 0;
 
-    /* send back all the results of name resolution */
-    for ( item = addrlist; item != NULL; item = item->ai_next) {
-        if ( send(data->fd, (void*)item, sizeof(*item), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved address info: %s",
-                    strerror(errno));
-            goto end;
+    if ( (bytes = recv(fd, info->buffer + info->offset,
+                    sizeof(info->buffer) - info->offset, 0)) <= 0 ) {
+        if ( bytes < 0 && errno == EINTR ) {
+            return;
         }
+        Log(LOG_WARNING, "Error reading names to resolve, aborting");
+        close_resolve_connection(info, 0);
+        return;
+    }
+
+    info->offset += bytes;
 
-        /* there might not be an address for this name */
-        if ( item->ai_addrlen > 0 ) {
-            if ( send(data->fd, (void*)item->ai_addr, item->ai_addrlen,
-                        MSG_NOSIGNAL) < 0 ) {
-                Log(LOG_WARNING, "Failed to send resolved address: %s",
-                        strerror(errno));
-                goto end;
+    while ( info->offset - used >= (int)sizeof(query) ) {
+        memcpy(&query, info->buffer + used, sizeof(query));
+
+        /* zero here is a marker - no more names need to be resolved */
+        if ( query.namelen == 0 ) {
+            Log(LOG_DEBUG, "Got all requests, waiting for responses");
+            info->finished = 1;
+            event_free(info->read_event);
+            info->read_event = NULL;
+            if ( info->pending == 0 ) {
+                close_resolve_connection(info, 1);
             }
+            return;
         }
 
-        namelen = strlen(item->ai_canonname) + 1;
-        assert(namelen > 1);
-        if ( send(data->fd, (void*)&namelen, sizeof(namelen), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
+        if ( info->offset - used < (int)sizeof(query) + query.namelen ) {
+            break;
         }
 
-        assert(item->ai_canonname);
-        if ( send(data->fd, (void*)item->ai_canonname, namelen, MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
-        }
+        memcpy(name, info->buffer + used + sizeof(query), query.namelen);
 
-        more = (item->ai_next) ? 1 : 0;
-        if ( send(data->fd, (void*)&more, sizeof(uint8_t), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send more flag: %s", strerror(errno));
-            goto end;
-        }
+        /* don't trust the test to have terminated the name */
+        name[query.namelen - 1] = '\0';
+
+        used += sizeof(query) + query.namelen;
+        resolve_name(info, &query, name);
+    }
+
+    /* keep any partial query at the front of the buffer for next time */
+    info->offset -= used;
+    memmove(info->buffer, info->buffer + used, info->offset);
+}
+
+
+
+/*
+ * Names are taking too long to resolve, give the test whatever results are
+ * available rather than leave it waiting.
+ */
+static void resolve_timeout_callback(
+        __attribute__((unused))evutil_socket_t fd,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_resolve_info *info = (struct amp_resolve_info*)evdata;
+
+    Log(LOG_WARNING, "Timed out waiting for %d names to resolve",
+            info->pending);
+
+    close_resolve_connection(info, info->finished);
+}
+
+
+
+/*
+ * Answers have arrived for the resolver context, run the callbacks.
+ */
+static void resolver_fd_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    if ( ub_process(resolver_ctx) != 0 ) {
+        Log(LOG_WARNING, "Failed to process DNS answers");
+    }
+}
+
+
+
+/*
+ * Start processing answers from the given unbound context on the event loop
+ * that test connections will be dealt with on.
+ */
+int start_resolver(struct event_base *base, struct ub_ctx *ctx) {
+    assert(base);
+    assert(ctx);
+
+    resolver_base = base;
+    resolver_ctx = ctx;
+    resolver_fd_event = event_new(base, ub_fd(ctx), EV_READ | EV_PERSIST,
+            resolver_fd_callback, NULL);
+
+    if ( resolver_fd_event == NULL ||
+            event_add(resolver_fd_event, NULL) != 0 ) {
+        Log(LOG_WARNING, "Failed to watch for DNS answers");
+        stop_resolver();
+        return -1;
     }
 
-    Log(LOG_DEBUG, "Name resolution thread completed, exiting");
+    return 0;
+}
+
 
-end:
-    close(data->fd);
-    amp_resolve_freeaddr(addrlist);
-    pthread_mutex_unlock(&addrlist_lock);
-    pthread_mutex_destroy(&addrlist_lock);
-    free(data);
 
-    return NULL;
+/*
+ * Stop processing answers, before the unbound context is deleted.
+ */
+void stop_resolver(void) {
+    if ( resolver_fd_event ) {
+        event_free(resolver_fd_event);
+        resolver_fd_event = NULL;
+    }
+
+    resolver_base = NULL;
+    resolver_ctx = NULL;
 }
 
 
@@ -177,14 +304,13 @@ void amp_resolver_context_delete(struct ub_ctx *ctx) {
 
 
 /*
- * Accept a new connection on the local name resolution socket and spawn
- * a new thread to deal with the queries from the test process.
+ * Accept a new connection on the local name resolution socket and start
+ * reading the queries from the test process.
  */
 void resolver_socket_event_callback(evutil_socket_t evsock,
     __attribute__((unused))short flags, void *evdata) {
 
     int fd;
-    pthread_t thread;
     struct amp_resolve_info *info;
 
     Log(LOG_DEBUG, "Accepting for new resolver connection");
@@ -197,11 +323,35 @@ void resolver_socket_event_callback(evutil_socket_t evsock,
 
     Log(LOG_DEBUG, "Accepted new resolver connection on fd %d", fd);
 
+    if ( resolver_base == NULL ) {
+        Log(LOG_WARNING, "Resolver not started, closing connection");
+        close(fd);
+        return;
+    }
+
     info = calloc(1, sizeof(struct amp_resolve_info));
     info->ctx = evdata;
     info->fd = fd;
+    pthread_mutex_init(&info->addrlist_lock, NULL);
+
+    info->read_event = event_new(resolver_base, fd, EV_READ | EV_PERSIST,
+            resolve_read_callback, info);
+    info->timeout = evtimer_new(resolver_base, resolve_timeout_callback,
+            info);
+
+    if ( info->read_event == NULL || info->timeout == NULL ||
+            event_add(info->read_event, NULL) != 0 ||
+            event_add(info->timeout, &resolve_timeout) != 0 ) {
+        Log(LOG_WARNING, "Failed to add events for resolver connection");
+        close_resolve_connection(info, 0);
+    }
+}
+
 
-    /* create the thread and detach, we don't need to look after it */
-    pthread_create(&thread, NULL, amp_resolver_worker_thread, info);
-    pthread_detach(thread);
+
+#if UNIT_TEST
+void amp_test_set_resolve_timeout(int seconds) {
+    resolve_timeout.tv_sec = seconds;
+    resolve_timeout.tv_usec = 0;
 }
+#endif
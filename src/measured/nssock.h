@@ -41,16 +41,39 @@
 #define _MEASURED_NSSOCK_H
 
 #include <unbound.h>
+#include <pthread.h>
 #include <event2/event.h>
+#include "ampresolv.h"
 
 
-/* data block given to each resolving thread */
+/* seconds to wait for names to resolve before replying with what we have */
+#define NSSOCK_RESOLVE_TIMEOUT 30
+
+/*
+ * A test connection whose names are being resolved. Queries are read and
+ * answered by the main event loop, so no thread waits on the connection.
+ */
 struct amp_resolve_info {
     int fd;                     /* file descriptor to the test process */
     struct ub_ctx *ctx;         /* shared unbound context (with the cache) */
+    struct event *read_event;   /* more queries can be read from the test */
+    struct event *timeout;      /* stop waiting for slow answers */
+    struct addrinfo *addrlist;  /* results so far */
+    pthread_mutex_t addrlist_lock;
+    int pending;                /* names that are still being resolved */
+    int finished;               /* set when the test has sent every query */
+    int replied;                /* set when the connection has been closed */
+    int offset;                 /* amount of query data in the buffer */
+    uint8_t buffer[sizeof(struct amp_resolve_query) + MAX_DNS_NAME_LEN];
 };
 
+int start_resolver(struct event_base *base, struct ub_ctx *ctx);
+void stop_resolver(void);
 void resolver_socket_event_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata);
 
+#if UNIT_TEST
+void amp_test_set_resolve_timeout(int seconds);
+#endif
+
 #endif
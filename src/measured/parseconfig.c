@@ -57,6 +57,7 @@
 #include "dscp.h"
 #include "rabbitcfg.h"
 #include "modules.h"
+#include "workerpool.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 64
@@ -116,6 +117,55 @@ static int callback_verify_packet_delay(cfg_t *cfg, cfg_opt_t *opt) {
 
 
 
+/*
+ * Ensure that the number of idle test worker processes is within limits.
+ */
+static int callback_verify_workers(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 || value > MAX_WORKER_POOL_SIZE ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Worker count must be between 0 and %d\n",
+                opt->name, value, MAX_WORKER_POOL_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Ensure that the scheduler limits aren't negative.
+ */
+static int callback_verify_scheduler(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Value must not be negative\n", opt->name, value);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Ensure that the spool size and replay rate are positive.
+ */
+static int callback_verify_spool(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value <= 0 ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Value must be greater than zero\n", opt->name, value);
+        return -1;
+    }
+    return 0;
+}
+
+
+
 /*
  * Callback to verify that the DSCP value given in the configuration is a
  * valid name of a differentiated services code point, or a numeric value
@@ -215,6 +265,164 @@ int should_wait_for_clock_sync(cfg_t *cfg) {
 
 
 
+/*
+ * Should the names used by scheduled tests be resolved ahead of time?
+ */
+int should_prefetch_names(cfg_t *cfg) {
+    assert(cfg);
+
+    return cfg_getbool(cfg, "dnsprefetch");
+}
+
+
+
+/*
+ * Get the location of the file the ASN cache should be saved to, or NULL if
+ * it shouldn't be saved. Setting it to an empty string disables saving.
+ */
+char* get_asn_cache_config(cfg_t *cfg) {
+    char *path;
+
+    assert(cfg);
+
+    if ( cfg_getstr(cfg, "asncache") != NULL ) {
+        if ( strlen(cfg_getstr(cfg, "asncache")) == 0 ) {
+            return NULL;
+        }
+        return strdup(cfg_getstr(cfg, "asncache"));
+    }
+
+    if ( asprintf(&path, "%s/%s.asn", AMP_CACHE_DIR, vars.ampname) < 0 ) {
+        Log(LOG_WARNING, "Failed to build ASN cache file path");
+        return NULL;
+    }
+
+    return path;
+}
+
+
+
+/*
+ * Get the location of a local prefix to ASN table that should be used
+ * instead of the whois server, or NULL if whois should be used.
+ */
+char* get_asn_table_config(cfg_t *cfg) {
+    assert(cfg);
+
+    if ( cfg_getstr(cfg, "asntable") != NULL &&
+            strlen(cfg_getstr(cfg, "asntable")) > 0 ) {
+        return strdup(cfg_getstr(cfg, "asntable"));
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Get the number of pre-forked worker processes that should be kept ready
+ * to run scheduled tests. Zero means fork a new process for every test.
+ */
+int get_worker_pool_config(cfg_t *cfg) {
+    assert(cfg);
+
+    return cfg_getint(cfg, "workers");
+}
+
+
+
+/*
+ * Get the limits on how many tests of each type (and in total) can run at
+ * once, and how test start times should be spread out.
+ */
+admission_config_t* get_admission_config(cfg_t *cfg) {
+    admission_config_t *config;
+    cfg_t *cfg_sub, *cfg_test;
+    unsigned int i;
+
+    assert(cfg);
+
+    config = (admission_config_t *) calloc(1, sizeof(admission_config_t));
+    config->max_delay = DEFAULT_ADMISSION_MAX_DELAY;
+
+    if ( (cfg_sub = cfg_getsec(cfg, "scheduler")) == NULL ) {
+        return config;
+    }
+
+    config->max_running = cfg_getint(cfg_sub, "maxrunning");
+    config->max_total = cfg_getint(cfg_sub, "maxtotal");
+    config->jitter = cfg_getint(cfg_sub, "jitter");
+    config->max_delay = cfg_getint(cfg_sub, "maxdelay");
+
+    for ( i = 0; i < cfg_size(cfg_sub, "test"); i++ ) {
+        admission_limit_t *limit;
+
+        cfg_test = cfg_getnsec(cfg_sub, "test", i);
+        limit = (admission_limit_t *) calloc(1, sizeof(admission_limit_t));
+        limit->name = strdup(cfg_title(cfg_test));
+        limit->max_running = cfg_getint(cfg_test, "maxrunning");
+        limit->next = config->limits;
+        config->limits = limit;
+    }
+
+    return config;
+}
+
+
+
+/*
+ * Get the limits on the total rate of traffic sent by all tests.
+ */
+rate_budget_config_t* get_rate_budget_config(cfg_t *cfg) {
+    rate_budget_config_t *config;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    config = (rate_budget_config_t *) calloc(1, sizeof(rate_budget_config_t));
+    config->burst = DEFAULT_RATE_BUDGET_BURST;
+
+    if ( (cfg_sub = cfg_getsec(cfg, "ratelimit")) == NULL ) {
+        return config;
+    }
+
+    if ( cfg_getint(cfg_sub, "pps") > 0 ) {
+        config->pps = cfg_getint(cfg_sub, "pps");
+    }
+
+    if ( cfg_getint(cfg_sub, "bps") > 0 ) {
+        config->bps = cfg_getint(cfg_sub, "bps");
+    }
+
+    config->burst = cfg_getint(cfg_sub, "burst");
+
+    return config;
+}
+
+
+
+/*
+ * Free the scheduler configuration, including any per test type limits.
+ */
+void free_admission_config(admission_config_t *config) {
+    admission_limit_t *limit;
+
+    if ( config == NULL ) {
+        return;
+    }
+
+    while ( config->limits != NULL ) {
+        limit = config->limits;
+        config->limits = limit->next;
+        free(limit->name);
+        free(limit);
+    }
+
+    free(config);
+}
+
+
+
 /*
  * Should rabbitmq be configured on start up?
  */
@@ -496,6 +704,41 @@ fetch_schedule_item_t* get_remote_schedule_config(cfg_t *cfg) {
 
 
 
+/*
+ * Get the configuration for the on-disk spool that stores results while the
+ * broker is unavailable. Returns NULL if spooling is disabled.
+ */
+spool_config_t* get_spool_config(cfg_t *cfg) {
+    spool_config_t *spool;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    cfg_sub = cfg_getsec(cfg, "spool");
+
+    if ( cfg_sub == NULL || !cfg_getbool(cfg_sub, "enabled") ) {
+        return NULL;
+    }
+
+    spool = (spool_config_t *) calloc(1, sizeof(spool_config_t));
+
+    if ( cfg_getstr(cfg_sub, "file") != NULL ) {
+        spool->path = strdup(cfg_getstr(cfg_sub, "file"));
+    } else if ( asprintf(&spool->path, "%s/%s.spool", AMP_SPOOL_DIR,
+                vars.ampname) < 0 ) {
+        Log(LOG_ALERT, "Failed to build spool file path");
+        free(spool);
+        return NULL;
+    }
+
+    spool->max_size = (uint64_t)cfg_getint(cfg_sub, "maxsize") * 1024 * 1024;
+    spool->replay_rate = cfg_getint(cfg_sub, "replayrate");
+
+    return spool;
+}
+
+
+
 /*
  * Parse the config for test interface configuration. Most of this can be
  * set via the command line, so expect a structure that may or may not already
@@ -680,6 +923,35 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
         CFG_END()
     };
 
+    cfg_opt_t opt_scheduler_test[] = {
+        CFG_INT("maxrunning", 0, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_scheduler[] = {
+        CFG_INT("maxrunning", 0, CFGF_NONE),
+        CFG_INT("maxtotal", 0, CFGF_NONE),
+        CFG_INT("jitter", 0, CFGF_NONE),
+        CFG_INT("maxdelay", DEFAULT_ADMISSION_MAX_DELAY, CFGF_NONE),
+        CFG_SEC("test", opt_scheduler_test, CFGF_TITLE | CFGF_MULTI),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_ratelimit[] = {
+        CFG_INT("pps", 0, CFGF_NONE),
+        CFG_INT("bps", 0, CFGF_NONE),
+        CFG_INT("burst", DEFAULT_RATE_BUDGET_BURST, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_spool[] = {
+        CFG_BOOL("enabled", cfg_true, CFGF_NONE),
+        CFG_STR("file", NULL, CFGF_NONE),
+        CFG_INT("maxsize", DEFAULT_SPOOL_MAX_SIZE, CFGF_NONE),
+        CFG_INT("replayrate", DEFAULT_SPOOL_REPLAY_RATE, CFGF_NONE),
+        CFG_END()
+    };
+
     cfg_opt_t measured_opts[] = {
 	CFG_STR("ampname", NULL, CFGF_NONE),
 	CFG_STR("interface", NULL, CFGF_NONE),
@@ -690,10 +962,17 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
         CFG_INT_CB("dscp", DEFAULT_DSCP_VALUE, CFGF_NONE,&callback_verify_dscp),
         CFG_STR_LIST("nameservers", NULL, CFGF_NONE),
         CFG_BOOL("waitforclocksync", cfg_false, CFGF_NONE),
+        CFG_INT("workers", 0, CFGF_NONE),
+        CFG_BOOL("dnsprefetch", cfg_true, CFGF_NONE),
+        CFG_STR("asncache", NULL, CFGF_NONE),
+        CFG_STR("asntable", NULL, CFGF_NONE),
 	CFG_SEC("ssl", opt_ssl, CFGF_NONE),
 	CFG_SEC("collector", opt_collector, CFGF_NONE),
         CFG_SEC("remotesched", opt_remotesched, CFGF_NONE),
         CFG_SEC("control", opt_control, CFGF_NONE),
+        CFG_SEC("spool", opt_spool, CFGF_NONE),
+        CFG_SEC("scheduler", opt_scheduler, CFGF_NONE),
+        CFG_SEC("ratelimit", opt_ratelimit, CFGF_NONE),
         CFG_SEC("defaults", opt_defaults, CFGF_TITLE | CFGF_MULTI),
         CFG_FUNC("include", &cfg_include),
 	CFG_END()
@@ -703,6 +982,18 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
 
     cfg = cfg_init(measured_opts, CFGF_NONE);
     cfg_set_validate_func(cfg, "packetdelay", callback_verify_packet_delay);
+    cfg_set_validate_func(cfg, "workers", callback_verify_workers);
+    cfg_set_validate_func(cfg, "spool|maxsize", callback_verify_spool);
+    cfg_set_validate_func(cfg, "spool|replayrate", callback_verify_spool);
+    cfg_set_validate_func(cfg, "scheduler|maxrunning",
+            callback_verify_scheduler);
+    cfg_set_validate_func(cfg, "scheduler|maxtotal",
+            callback_verify_scheduler);
+    cfg_set_validate_func(cfg, "scheduler|jitter", callback_verify_scheduler);
+    cfg_set_validate_func(cfg, "scheduler|maxdelay",
+            callback_verify_scheduler);
+    cfg_set_validate_func(cfg, "scheduler|test|maxrunning",
+            callback_verify_scheduler);
 
     ret = cfg_parse(cfg, filename);
 
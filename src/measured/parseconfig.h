@@ -46,13 +46,24 @@
 #include "global.h"
 #include "control.h"
 #include "schedule.h"
+#include "spool.h"
+#include "admission.h"
+#include "ratebudget.h"
 
 int get_loglevel_config(cfg_t *cfg);
 int should_config_rabbit(cfg_t *cfg);
 int should_wait_for_cert(cfg_t *cfg);
 int should_wait_for_clock_sync(cfg_t *cfg);
+int should_prefetch_names(cfg_t *cfg);
+char* get_asn_cache_config(cfg_t *cfg);
+char* get_asn_table_config(cfg_t *cfg);
+int get_worker_pool_config(cfg_t *cfg);
 amp_control_t* get_control_config(cfg_t *cfg, amp_test_meta_t *meta);
 fetch_schedule_item_t* get_remote_schedule_config(cfg_t *cfg);
+spool_config_t* get_spool_config(cfg_t *cfg);
+admission_config_t* get_admission_config(cfg_t *cfg);
+void free_admission_config(admission_config_t *config);
+rate_budget_config_t* get_rate_budget_config(cfg_t *cfg);
 amp_test_meta_t* get_interface_config(cfg_t *cfg, amp_test_meta_t *meta);
 struct ub_ctx* get_dns_context_config(cfg_t *cfg, amp_test_meta_t *meta);
 void get_default_test_args(cfg_t *cfg);
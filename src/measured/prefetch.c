@@ -0,0 +1,595 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Resolve the names used by scheduled tests shortly before the tests are due
+ * to run, so that the test process doesn't have to wait for DNS. Answers are
+ * kept until their TTL expires, and the local resolver socket will use them
+ * rather than making a new query when a test asks for the name.
+ *
+ * The prefetcher uses its own unbound context driven by the main event loop,
+ * so that it never has to wait on the queries made on behalf of tests.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unbound.h>
+#include <event2/event.h>
+
+#if _WIN32
+#include "w32-compat.h"
+#else
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "config.h"
+#include "prefetch.h"
+#include "schedule.h"
+#include "ampresolv.h"
+#include "debug.h"
+
+
+/* cached answers, indexed by a hash of the name and query type */
+static struct prefetch_entry *cache[PREFETCH_BUCKETS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prefetch_stats stats;
+
+static struct ub_ctx *prefetch_ctx = NULL;
+static struct event *prefetch_timer = NULL;
+static struct event *prefetch_fd_event = NULL;
+static time_t next_sweep = 0;
+static int prefetch_running = 0;
+
+
+
+/*
+ * FNV-1a hash of the name and query type.
+ */
+static uint32_t hash_query(char *name, uint16_t qtype) {
+    uint32_t hash = 2166136261U;
+
+    for ( ; *name != '\0'; name++ ) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619U;
+    }
+
+    hash ^= qtype;
+    hash *= 16777619U;
+
+    return hash;
+}
+
+
+
+/*
+ * Length of the addresses returned by a query of the given type.
+ */
+static int get_address_length(uint16_t qtype) {
+    return qtype == 0x1c ? 16 : 4;
+}
+
+
+
+/*
+ * Numeric addresses don't need to be resolved.
+ */
+static int is_numeric_name(char *name) {
+    struct in6_addr addr;
+
+    return inet_pton(AF_INET, name, &addr) == 1 ||
+        inet_pton(AF_INET6, name, &addr) == 1;
+}
+
+
+
+/*
+ * Find the cache entry for the name and query type. Must be called with the
+ * cache lock held.
+ */
+static struct prefetch_entry *find_entry(char *name, uint16_t qtype) {
+    struct prefetch_entry *entry;
+    uint32_t hash = hash_query(name, qtype);
+
+    for ( entry = cache[hash & (PREFETCH_BUCKETS - 1)]; entry != NULL;
+            entry = entry->next ) {
+        if ( entry->hash == hash && entry->qtype == qtype &&
+                strcmp(entry->name, name) == 0 ) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Find the cache entry for the name and query type, creating an empty one
+ * if it doesn't exist. Must be called with the cache lock held.
+ */
+static struct prefetch_entry *get_entry(char *name, uint16_t qtype) {
+    struct prefetch_entry *entry;
+
+    if ( (entry = find_entry(name, qtype)) != NULL ) {
+        return entry;
+    }
+
+    entry = calloc(1, sizeof(struct prefetch_entry));
+    entry->name = strdup(name);
+    entry->qtype = qtype;
+    entry->hash = hash_query(name, qtype);
+    entry->next = cache[entry->hash & (PREFETCH_BUCKETS - 1)];
+    cache[entry->hash & (PREFETCH_BUCKETS - 1)] = entry;
+
+    return entry;
+}
+
+
+
+static void free_entry(struct prefetch_entry *entry) {
+    free(entry->name);
+    free(entry->addresses);
+    free(entry);
+}
+
+
+
+/*
+ * Replace the addresses in a cache entry with a new answer. Must be called
+ * with the cache lock held.
+ */
+static void store_answer(struct prefetch_entry *entry, int ttl, char **data,
+        int *len) {
+    int addrlen = get_address_length(entry->qtype);
+    int i;
+
+    if ( ttl < 0 ) {
+        ttl = 0;
+    } else if ( ttl > PREFETCH_MAX_TTL ) {
+        ttl = PREFETCH_MAX_TTL;
+    }
+
+    free(entry->addresses);
+    entry->addresses = NULL;
+    entry->count = 0;
+
+    for ( i = 0; data != NULL && data[i] != NULL && i < UINT16_MAX; i++ ) {
+        if ( len[i] != addrlen ) {
+            continue;
+        }
+        entry->addresses = realloc(entry->addresses,
+                (entry->count + 1) * addrlen);
+        memcpy(entry->addresses + (entry->count * addrlen), data[i], addrlen);
+        entry->count++;
+    }
+
+    entry->expires = time(NULL) + ttl;
+    entry->retry = 0;
+}
+
+
+
+/*
+ * Deal with the answer to a prefetch query. Empty answers (the name or the
+ * address family doesn't exist) are cached too, for as long as the TTL on
+ * the negative answer allows.
+ */
+static void prefetch_callback(void *d, int err, struct ub_result *result) {
+    struct prefetch_entry *entry = (struct prefetch_entry *)d;
+
+    pthread_mutex_lock(&cache_lock);
+
+    entry->pending = 0;
+
+    if ( err != 0 || result == NULL ||
+            (!result->havedata && !result->nxdomain && result->rcode != 0) ) {
+        Log(LOG_DEBUG, "Failed to prefetch %s (%x): %s", entry->name,
+                entry->qtype, err ? ub_strerror(err) : "server failure");
+        stats.failures++;
+        entry->retry = time(NULL) + PREFETCH_LEAD_TIME;
+    } else {
+        store_answer(entry, result->ttl,
+                result->havedata ? result->data : NULL, result->len);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if ( result ) {
+        ub_resolve_free(result);
+    }
+}
+
+
+
+/*
+ * Start resolving the name if there isn't already a cached answer that will
+ * still be valid when the test runs.
+ */
+static void prefetch_name(char *name, uint16_t qtype, time_t when) {
+    struct prefetch_entry *entry;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+
+    entry = get_entry(name, qtype);
+
+    if ( entry->pending || entry->expires > when || entry->retry > now ) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    entry->pending = 1;
+    stats.queries++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if ( ub_resolve_async(prefetch_ctx, entry->name, qtype, 0x01, entry,
+                prefetch_callback, NULL) != 0 ) {
+        pthread_mutex_lock(&cache_lock);
+        entry->pending = 0;
+        entry->retry = now + PREFETCH_LEAD_TIME;
+        stats.failures++;
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
+
+
+
+/*
+ * Prefetch the names for any scheduled test that is due to run soon.
+ */
+static int prefetch_events_callback(schedule_item_t *item, void *evdata) {
+
+    time_t now = *(time_t *)evdata;
+    test_schedule_item_t *test;
+    resolve_dest_t *resolve;
+
+    test = item->data.test;
+
+    if ( test->resolve == NULL ||
+            test->abstime.tv_sec > now + PREFETCH_LEAD_TIME ) {
+        return 0;
+    }
+
+    for ( resolve = test->resolve; resolve != NULL; resolve = resolve->next ) {
+        if ( is_numeric_name(resolve->name) ) {
+            continue;
+        }
+
+        if ( resolve->family != AF_INET6 ) {
+            prefetch_name(resolve->name, 0x01, test->abstime.tv_sec);
+        }
+
+        if ( resolve->family != AF_INET ) {
+            prefetch_name(resolve->name, 0x1c, test->abstime.tv_sec);
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Remove entries that have expired and aren't waiting on a query.
+ */
+static void sweep_cache(time_t now) {
+    struct prefetch_entry **prev, *entry;
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for ( i = 0; i < PREFETCH_BUCKETS; i++ ) {
+        prev = &cache[i];
+        while ( (entry = *prev) != NULL ) {
+            if ( !entry->pending && entry->expires <= now &&
+                    entry->retry <= now ) {
+                *prev = entry->next;
+                free_entry(entry);
+                stats.expired++;
+            } else {
+                prev = &entry->next;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Check the schedule for tests that are about to run, and periodically tidy
+ * up the cache.
+ */
+static void prefetch_timer_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+
+    struct event_base *base = evdata;
+    time_t now = time(NULL);
+
+    foreach_scheduled_test(base, prefetch_events_callback, &now);
+
+    if ( now >= next_sweep ) {
+        sweep_cache(now);
+        next_sweep = now + PREFETCH_SWEEP_INTERVAL;
+
+        Log(LOG_DEBUG, "Prefetch cache: %" PRIu64 " hits, %" PRIu64
+                " misses, %" PRIu64 " queries, %" PRIu64 " failures",
+                stats.hits, stats.misses, stats.queries, stats.failures);
+    }
+}
+
+
+
+/*
+ * Answers have arrived for the prefetch context, run the callbacks.
+ */
+static void prefetch_fd_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    if ( ub_process(prefetch_ctx) != 0 ) {
+        Log(LOG_WARNING, "Failed to process prefetched DNS answers");
+    }
+}
+
+
+
+/*
+ * Start prefetching names for the tests scheduled on this event base, using
+ * the given unbound context (which will be deleted when prefetching stops).
+ */
+int start_prefetcher(struct event_base *base, struct ub_ctx *ctx) {
+    struct timeval interval = {
+        PREFETCH_INTERVAL_MS / 1000, (PREFETCH_INTERVAL_MS % 1000) * 1000
+    };
+
+    assert(base);
+    assert(ctx);
+    assert(!prefetch_running);
+
+    prefetch_ctx = ctx;
+
+    prefetch_fd_event = event_new(base, ub_fd(ctx), EV_READ | EV_PERSIST,
+            prefetch_fd_callback, NULL);
+    prefetch_timer = event_new(base, -1, EV_PERSIST, prefetch_timer_callback,
+            base);
+
+    if ( event_add(prefetch_fd_event, NULL) != 0 ||
+            event_add(prefetch_timer, &interval) != 0 ) {
+        Log(LOG_WARNING, "Failed to start DNS prefetching");
+        stop_prefetcher();
+        return -1;
+    }
+
+    next_sweep = time(NULL) + PREFETCH_SWEEP_INTERVAL;
+    prefetch_running = 1;
+
+    Log(LOG_DEBUG, "Started DNS prefetching");
+
+    return 0;
+}
+
+
+
+/*
+ * Stop prefetching and empty the cache.
+ */
+void stop_prefetcher(void) {
+    struct prefetch_entry *entry;
+    int i;
+
+    prefetch_running = 0;
+
+    if ( prefetch_timer ) {
+        event_free(prefetch_timer);
+        prefetch_timer = NULL;
+    }
+
+    if ( prefetch_fd_event ) {
+        event_free(prefetch_fd_event);
+        prefetch_fd_event = NULL;
+    }
+
+    /* outstanding queries are cancelled, their callbacks won't be called */
+    if ( prefetch_ctx ) {
+        ub_ctx_delete(prefetch_ctx);
+        prefetch_ctx = NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for ( i = 0; i < PREFETCH_BUCKETS; i++ ) {
+        while ( (entry = cache[i]) != NULL ) {
+            cache[i] = entry->next;
+            free_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Add the addresses for the name from the cache to the address list, in the
+ * same way amp_resolve_add() would if it had resolved them. Returns -1 if
+ * there isn't a valid cached answer for every address family required.
+ */
+int prefetch_lookup(char *name, int family, int max, struct addrinfo **addrlist,
+        pthread_mutex_t *addrlist_lock) {
+    struct prefetch_entry *entries[2];
+    struct addrinfo *list = NULL, *item;
+    int nentries = 0;
+    int total = 0;
+    time_t now;
+    int i, j;
+
+    assert(name);
+    assert(addrlist);
+
+    if ( !prefetch_running || is_numeric_name(name) ) {
+        return -1;
+    }
+
+    now = time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+
+    if ( family == AF_UNSPEC || family == AF_INET ) {
+        entries[nentries++] = find_entry(name, 0x01);
+    }
+
+    if ( family == AF_UNSPEC || family == AF_INET6 ) {
+        entries[nentries++] = find_entry(name, 0x1c);
+    }
+
+    for ( i = 0; i < nentries; i++ ) {
+        if ( entries[i] == NULL || entries[i]->expires <= now ) {
+            stats.misses++;
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+    }
+
+    /* the maximum number of addresses is shared between both families */
+    for ( i = 0; i < nentries; i++ ) {
+        int addrlen = get_address_length(entries[i]->qtype);
+
+        for ( j = 0; j < entries[i]->count && (max <= 0 || total < max); j++ ) {
+            item = amp_resolve_build_addrinfo(entries[i]->qtype, name,
+                    (char*)entries[i]->addresses + (j * addrlen), addrlen);
+            item->ai_next = list;
+            list = item;
+            total++;
+        }
+    }
+
+    /* names without any addresses still need an entry for each family */
+    if ( total == 0 ) {
+        for ( i = 0; i < nentries; i++ ) {
+            item = amp_resolve_build_addrinfo(entries[i]->qtype, name, NULL, 0);
+            item->ai_next = list;
+            list = item;
+        }
+    }
+
+    stats.hits++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    Log(LOG_DEBUG, "Using prefetched addresses for %s", name);
+
+    /* add the new addresses to the front of the list */
+    if ( list ) {
+        for ( item = list; item->ai_next != NULL; item = item->ai_next ) {
+            /* find the end of the list */
+        }
+
+        if ( addrlist_lock ) {
+            pthread_mutex_lock(addrlist_lock);
+        }
+
+        item->ai_next = *addrlist;
+        *addrlist = list;
+
+        if ( addrlist_lock ) {
+            pthread_mutex_unlock(addrlist_lock);
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get a copy of the current cache counters.
+ */
+void get_prefetch_stats(struct prefetch_stats *result) {
+    assert(result);
+
+    pthread_mutex_lock(&cache_lock);
+    memcpy(result, &stats, sizeof(stats));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Write the cache counters to a file for debugging.
+ */
+void dump_prefetch_stats(FILE *out) {
+    struct prefetch_stats current;
+
+    assert(out);
+
+    get_prefetch_stats(&current);
+
+    fprintf(out, "===== DNS PREFETCH =====\n");
+    fprintf(out, "hits %" PRIu64 " misses %" PRIu64 " queries %" PRIu64
+            " failures %" PRIu64 " expired %" PRIu64 "\n\n", current.hits,
+            current.misses, current.queries, current.failures,
+            current.expired);
+}
+
+
+
+#if UNIT_TEST
+void amp_test_prefetch_init(void) {
+    prefetch_running = 1;
+}
+
+void amp_test_prefetch_store(char *name, int qtype, int ttl, char **data,
+        int *len) {
+    pthread_mutex_lock(&cache_lock);
+    store_answer(get_entry(name, qtype), ttl, data, len);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void amp_test_prefetch_sweep(time_t now) {
+    sweep_cache(now);
+}
+#endif
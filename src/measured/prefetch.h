@@ -0,0 +1,108 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_PREFETCH_H
+#define _MEASURED_PREFETCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unbound.h>
+#include <event2/event.h>
+
+/* how far ahead of a scheduled test to start resolving its names (seconds) */
+#define PREFETCH_LEAD_TIME 5
+
+/* how often to check the schedule for tests that are about to run (ms) */
+#define PREFETCH_INTERVAL_MS 1000
+
+/* how often to remove expired entries from the cache (seconds) */
+#define PREFETCH_SWEEP_INTERVAL 60
+
+/* don't hold on to an answer for longer than this, whatever the TTL */
+#define PREFETCH_MAX_TTL 86400
+
+/* number of hash buckets in the cache, must be a power of two */
+#define PREFETCH_BUCKETS 4096
+
+/*
+ * A cached answer for a single name and query type (A or AAAA).
+ */
+struct prefetch_entry {
+    char *name;
+    uint16_t qtype;                 /* 0x01 for A, 0x1c for AAAA */
+    uint32_t hash;
+    time_t expires;                 /* answer can't be used after this */
+    time_t retry;                   /* don't query again before this */
+    uint8_t pending;                /* is a query outstanding */
+    uint16_t count;                 /* number of addresses in the answer */
+    uint8_t *addresses;             /* count addresses, 4 or 16 bytes each */
+    struct prefetch_entry *next;
+};
+
+/*
+ * Counters describing how useful the cache has been.
+ */
+struct prefetch_stats {
+    uint64_t hits;                  /* names answered from the cache */
+    uint64_t misses;                /* names that had to be resolved */
+    uint64_t queries;               /* prefetch queries sent */
+    uint64_t failures;              /* prefetch queries that failed */
+    uint64_t expired;               /* entries removed after expiring */
+};
+
+struct addrinfo;
+
+int start_prefetcher(struct event_base *base, struct ub_ctx *ctx);
+void stop_prefetcher(void);
+int prefetch_lookup(char *name, int family, int max, struct addrinfo **addrlist,
+        pthread_mutex_t *addrlist_lock);
+void get_prefetch_stats(struct prefetch_stats *stats);
+void dump_prefetch_stats(FILE *out);
+
+#if UNIT_TEST
+void amp_test_prefetch_init(void);
+void amp_test_prefetch_store(char *name, int qtype, int ttl, char **data,
+        int *len);
+void amp_test_prefetch_sweep(time_t now);
+#endif
+
+#endif
@@ -49,6 +49,7 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #if _WIN32
 #include <iphlpapi.h>
@@ -71,6 +72,10 @@
 #include "ssl.h"
 #include "messaging.h"
 #include "serverlib.h" /* only for send_measured_response() */
+#include "workerpool.h"
+#include "admission.h"
+#include "ratebudget.h"
+#include "waitset.h"
 
 
 
@@ -121,6 +126,14 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
         return;
     }
 
+#ifndef _WIN32
+    /* mark our admission slot as in use until this process exits */
+    admission_started(item->slot);
+
+    /* share the test traffic budget fairly with the other running tests */
+    rate_budget_attach(item->test->name);
+#endif
+
     /* update process name so we can tell what is running */
     set_proc_name(item->test->name);
 
@@ -408,6 +421,9 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
                 item->dest_count + total_resolve_count, destinations);
 
         if ( result ) {
+            /* how late the test started, so results can be judged by it */
+            result->start_delay = item->start_delay;
+
             /* report the results to the appropriate location */
             if ( ctrl ) {
                 /* SSL connection - single test run remotely, report remotely */
@@ -502,11 +518,14 @@ static long unsigned int run_test_w32(void *data) {
 
 /*
  * Test function to investigate forking, rescheduling, setting maximum
- * execution timers etc.
+ * execution timers etc. Returns 1 if the test was started (or skipped), 0 if
+ * it was triggered too early, or -1 if it should try again shortly because
+ * too many tests of the same type are already running.
  * TODO maybe just move the contents of this into run_scheduled_test()?
  */
 static int fork_test(test_schedule_item_t *item) {
     struct timeval now;
+    struct timeval late;
 
     assert(item);
     assert(item->test);
@@ -526,8 +545,14 @@ static int fork_test(test_schedule_item_t *item) {
                     item->test->name);
             return 0;
         }
+        timerclear(&late);
+    } else {
+        evutil_timersub(&now, &item->abstime, &late);
     }
 
+    /* record how late this run is starting, including any spreading */
+    item->start_delay = US_FROM_TV(late);
+
 #if _WIN32
     CreateThread(NULL,
             0,
@@ -544,8 +569,29 @@ static int fork_test(test_schedule_item_t *item) {
      * fine.
      */
     pid_t pid;
+    int64_t queued;
+
+    /* don't start if too many tests of this type are already running */
+    if ( (item->slot = admission_acquire(item->test,
+                    item->start_delay)) == ADMISSION_FULL ) {
+        Log(LOG_DEBUG, "Too many %s tests running, waiting to start",
+                item->test->name);
+        return -1;
+    } else if ( item->slot == ADMISSION_SKIP ) {
+        item->slot = 0;
+        return 1;
+    }
+
+    /* prefer handing the test to an idle worker if the pool is running */
+    if ( dispatch_to_worker_pool(item) == 0 ) {
+        return 1;
+    }
+
+    queued = monotonic_ns();
+
     if ( (pid = fork()) < 0 ) {
         perror("fork");
+        admission_cancel(item->slot);
         return 0;
     } else if ( pid == 0 ) {
         /*
@@ -559,6 +605,7 @@ static int fork_test(test_schedule_item_t *item) {
         /* unblock signals and remove handlers that the parent process added */
         if ( unblock_signals() < 0 ) {
             Log(LOG_WARNING, "Failed to unblock signals, aborting");
+            admission_cancel(item->slot);
             exit(EXIT_FAILURE);
         }
         /*
@@ -569,9 +616,14 @@ static int fork_test(test_schedule_item_t *item) {
         clear_test_schedule(item->meta->base, 1);
         event_base_free(item->meta->base);
 
+        Log(LOG_DEBUG, "Started %s test in forked process %d after %" PRId64
+                "us", item->test->name, getpid(),
+                (monotonic_ns() - queued) / 1000);
+
         run_test(item, NULL);
 
         Log(LOG_WARNING, "%s test failed to run", item->test->name);
+        admission_cancel(item->slot);
         exit(EXIT_FAILURE);
     }
 #endif
@@ -584,10 +636,7 @@ static int fork_test(test_schedule_item_t *item) {
 /*
  * Start a scheduled test running and reschedule it to run again next interval
  */
-void run_scheduled_test(
-        __attribute__((unused))evutil_socket_t evsock,
-        __attribute__((unused))short flags,
-        void *evdata) {
+void run_scheduled_test(void *evdata) {
     schedule_item_t *item = (schedule_item_t *)evdata;
     test_schedule_item_t *test_item;
     struct timeval next;
@@ -604,15 +653,19 @@ void run_scheduled_test(
      * run the test as soon as we know what it is, so it happens as close to
      * the right time as we can get it.
      */
-    run = fork_test(test_item);
+    if ( (run = fork_test(test_item)) < 0 ) {
+        /* too many running already, keep trying until one finishes */
+        next.tv_sec = 0;
+        next.tv_usec = ADMISSION_RETRY_MS * 1000;
+        wheel_timer_add(&item->timer, &next);
+        return;
+    }
 
     /* while the test runs, reschedule it again */
     next = get_next_schedule_time(item->base, test_item->period,
             test_item->start, test_item->end, US_FROM_TV(test_item->interval),
             run, &test_item->abstime);
+    evutil_timeradd(&next, &test_item->offset, &next);
 
-    if ( event_add(item->event, &next) != 0 ) {
-        /* this should never happen if we properly check the next time */
-        Log(LOG_ALERT, "Failed to reschedule %s test", test_item->test->name);
-    }
+    wheel_timer_add(&item->timer, &next);
 }
@@ -46,6 +46,6 @@
 #include "schedule.h"
 
 void run_test(const test_schedule_item_t * const item, BIO *ctrl);
-void run_scheduled_test(evutil_socket_t evsock, short flags, void *evdata);
+void run_scheduled_test(void *evdata);
 
 #endif
@@ -0,0 +1,710 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Replay a week of a schedule in virtual time to see what load it will put
+ * on an amplet before deploying it. The schedule is read with the same code
+ * that amplet2 uses, so tests are merged and spread out exactly as they
+ * would be, and the start times come from get_next_schedule_time(). Nothing
+ * is run and nothing is sent on the network.
+ *
+ * How many packets a test sends and how long it runs for aren't in the
+ * schedule, so each test has a rough profile based on its default options
+ * that can be overridden on the command line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+
+#include "config.h"
+#include "schedule.h"
+#include "modules.h"
+#include "debug.h"
+#include "testlib.h"
+
+
+/* how much virtual time to replay (seconds) */
+#define SIMULATION_LENGTH (60 * 60 * 24 * 7)
+
+/* how many of the busiest windows to report by default */
+#define DEFAULT_BUSIEST_WINDOWS 10
+
+
+/*
+ * The rough cost of a single run of a test: how many packets it sends to
+ * each target, and how long it runs for when things go well.
+ */
+struct test_profile {
+    char *name;
+    double packets;
+    uint32_t duration;
+};
+
+/*
+ * Profiles based on the default options of each test. A packet count of
+ * zero means the test doesn't send a predictable number of packets (e.g.
+ * a bulk transfer) and isn't included in packet rates. Unknown tests are
+ * assumed to send one packet per target and finish within a second.
+ */
+static struct test_profile default_profiles[] = {
+    { "icmp", 1, 1 },
+    { "tcpping", 1, 1 },
+    { "dns", 1, 1 },
+    { "trace", 16, 5 },
+    { "udpstream", 21, 2 },
+    { "fastping", 60, 60 },
+    { "throughput", 0, 10 },
+    { "http", 0, 5 },
+    { "youtube", 0, 60 },
+    { "sip", 0, 30 },
+    { NULL, 1, 1 },
+};
+
+/*
+ * Everything the simulation has seen for one type of test. The running and
+ * pps arrays have an entry for every second: they start out holding the
+ * change at that second and are summed to get the value at that second.
+ */
+struct test_load {
+    test_t *test;
+    struct test_profile profile;
+    uint64_t runs;
+    uint64_t targets;
+    int32_t *running;
+    double *pps;
+};
+
+struct simulation {
+    time_t start;
+    uint32_t length;
+    uint32_t inter_packet_delay;
+    struct test_profile *profiles;
+    int profile_count;
+    struct test_load *loads;
+    int load_count;
+    uint32_t scheduled;
+    int32_t *running;
+};
+
+/*
+ * A period of time where the number of running tests doesn't change.
+ */
+struct window {
+    uint32_t start;
+    uint32_t length;
+    int32_t running;
+};
+
+
+static struct option long_options[] = {
+    {"help", no_argument, 0, 'h'},
+    {"debug", no_argument, 0, 'x'},
+    {"start", required_argument, 0, 's'},
+    {"jitter", required_argument, 0, 'j'},
+    {"interpacketgap", required_argument, 0, 'Z'},
+    {"profile", required_argument, 0, 'p'},
+    {"output", required_argument, 0, 'o'},
+    {"windows", required_argument, 0, 'w'},
+    {"tests", required_argument, 0, 't'},
+    {0, 0, 0, 0}
+};
+
+
+
+/*
+ * Print a simple usage statement showing how to run the program.
+ */
+static void usage(void) {
+
+    fprintf(stderr, "Usage: amplet2-schedsim [-hx] [-s <time>] [-j <ms>] "
+            "[-Z <usec>] [-p <profile>]\n"
+            "                        [-o <file>] [-w <count>] [-t <dir>] "
+            "[<schedule dir> ...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -x, --debug                    Enable extra debug output\n");
+    fprintf(stderr, "  -s, --start          <time>    Unix time to start the week from\n");
+    fprintf(stderr, "  -j, --jitter         <ms>      Spread test start times over this many ms\n");
+    fprintf(stderr, "  -Z, --interpacketgap <usec>    Minimum number of microseconds between packets\n");
+    fprintf(stderr, "  -p, --profile        <profile> Cost of a test run, as test:packets:seconds\n");
+    fprintf(stderr, "  -o, --output         <file>    Write per-second load to file as CSV\n");
+    fprintf(stderr, "  -w, --windows        <count>   Number of busiest windows to report\n");
+    fprintf(stderr, "  -t, --tests          <dir>     Directory to load test modules from\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Schedules are read from %s if no directory is given.\n",
+            SCHEDULE_DIR);
+}
+
+
+
+/*
+ * Parse a test profile given on the command line as test:packets:seconds.
+ */
+static int parse_profile(char *arg, struct test_profile *profile) {
+    char *packets, *duration, *end;
+
+    if ( (packets = strchr(arg, ':')) == NULL ||
+            (duration = strchr(packets + 1, ':')) == NULL ||
+            packets == arg ) {
+        return -1;
+    }
+
+    profile->name = strndup(arg, packets - arg);
+    profile->packets = strtod(packets + 1, &end);
+    if ( end != duration || profile->packets < 0 ) {
+        free(profile->name);
+        return -1;
+    }
+
+    profile->duration = strtoul(duration + 1, &end, 10);
+    if ( *end != '\0' || *(duration + 1) == '\0' ) {
+        free(profile->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Find the profile for a test, preferring any given on the command line.
+ */
+static struct test_profile get_profile(struct simulation *sim, test_t *test) {
+    struct test_profile profile;
+    int i;
+
+    for ( i = sim->profile_count - 1; i >= 0; i-- ) {
+        if ( strcmp(sim->profiles[i].name, test->name) == 0 ) {
+            return sim->profiles[i];
+        }
+    }
+
+    for ( i = 0; default_profiles[i].name != NULL; i++ ) {
+        if ( strcmp(default_profiles[i].name, test->name) == 0 ) {
+            return default_profiles[i];
+        }
+    }
+
+    profile = default_profiles[i];
+    profile.name = test->name;
+    return profile;
+}
+
+
+
+/*
+ * Get the load for a type of test, creating it if this is the first time
+ * that type has been seen.
+ */
+static struct test_load *get_load(struct simulation *sim, test_t *test) {
+    struct test_load *load;
+    int i;
+
+    for ( i = 0; i < sim->load_count; i++ ) {
+        if ( sim->loads[i].test == test ) {
+            return &sim->loads[i];
+        }
+    }
+
+    sim->loads = realloc(sim->loads,
+            sizeof(struct test_load) * (sim->load_count + 1));
+    load = &sim->loads[sim->load_count++];
+    memset(load, 0, sizeof(struct test_load));
+    load->test = test;
+    load->profile = get_profile(sim, test);
+    /* one extra slot so a run can always end after the last second */
+    load->running = calloc(sim->length + 1, sizeof(int32_t));
+    load->pps = calloc(sim->length + 1, sizeof(double));
+
+    return load;
+}
+
+
+
+/*
+ * Estimate how many destinations a test will have once all its names have
+ * been resolved. Names that aren't limited to a single address family are
+ * assumed to have both an IPv4 and an IPv6 address.
+ */
+static uint32_t count_targets(test_schedule_item_t *test) {
+    resolve_dest_t *resolve;
+    uint32_t count = test->dest_count;
+
+    for ( resolve = test->resolve; resolve != NULL; resolve = resolve->next ) {
+        if ( resolve->count > 0 ) {
+            count += resolve->count;
+        } else if ( resolve->family == AF_UNSPEC ) {
+            count += 2;
+        } else {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Replay a single scheduled test over the simulation period, adding the
+ * start and end of every run to the load for that type of test.
+ */
+static void simulate_test(struct simulation *sim, test_schedule_item_t *test) {
+    struct test_load *load = get_load(sim, test->test);
+    struct timeval now, abstime, begin;
+    uint32_t targets = count_targets(test);
+    uint64_t duration, first, last;
+    double packets;
+    int run = 0;
+
+    /* sending to lots of targets takes longer, packets are spread out */
+    packets = load->profile.packets * targets;
+    duration = load->profile.duration +
+        ((uint64_t)(packets * sim->inter_packet_delay) + 999999) / 1000000;
+    if ( duration == 0 ) {
+        duration = 1;
+    }
+
+    /* start just before the simulation so tests due at the start are run */
+    now.tv_sec = sim->start - 1;
+    now.tv_usec = 999999;
+
+    while ( 1 ) {
+        get_next_schedule_time_at(&now, test->period, test->start, test->end,
+                US_FROM_TV(test->interval), run, &abstime);
+
+        /* the next time should always be later, but make sure we progress */
+        if ( run && !timercmp(&abstime, &now, >) ) {
+            Log(LOG_WARNING, "%s test failed to advance, skipping",
+                    test->test->name);
+            break;
+        }
+
+        evutil_timeradd(&abstime, &test->offset, &begin);
+
+        if ( begin.tv_sec >= sim->start + sim->length ) {
+            break;
+        }
+
+        first = begin.tv_sec - sim->start;
+        last = first + duration;
+        if ( last > sim->length ) {
+            last = sim->length;
+        }
+
+        load->running[first]++;
+        load->running[last]--;
+        if ( load->profile.packets > 0 ) {
+            load->pps[first] += packets / duration;
+            load->pps[last] -= packets / duration;
+        }
+
+        load->runs++;
+        load->targets += targets;
+
+        now = abstime;
+        run = 1;
+    }
+}
+
+
+
+/*
+ * Replay every scheduled test that is found in the event base.
+ */
+static int simulate_test_callback(schedule_item_t *item, void *evdata) {
+    struct simulation *sim = (struct simulation*)evdata;
+
+    simulate_test(sim, item->data.test);
+    sim->scheduled++;
+
+    return 0;
+}
+
+
+
+/*
+ * Turn the changes at each second into the actual values at each second,
+ * and total the running tests of every type.
+ */
+static void sum_loads(struct simulation *sim) {
+    struct test_load *load;
+    uint32_t second;
+    int i;
+
+    sim->running = calloc(sim->length, sizeof(int32_t));
+
+    for ( i = 0; i < sim->load_count; i++ ) {
+        load = &sim->loads[i];
+        for ( second = 0; second < sim->length; second++ ) {
+            if ( second > 0 ) {
+                load->running[second] += load->running[second - 1];
+                load->pps[second] += load->pps[second - 1];
+            }
+            /* rounding errors can leave a tiny rate when nothing is running */
+            if ( load->running[second] == 0 ) {
+                load->pps[second] = 0;
+            }
+            sim->running[second] += load->running[second];
+        }
+    }
+}
+
+
+
+static char *format_time(time_t when, char *buffer, size_t length) {
+    struct tm tm;
+
+    gmtime_r(&when, &tm);
+    strftime(buffer, length, "%a %Y-%m-%d %H:%M:%S", &tm);
+
+    return buffer;
+}
+
+
+
+/*
+ * Print the runs, targets and packet rates for each type of test.
+ */
+static void print_test_loads(struct simulation *sim) {
+    struct test_load *load;
+    char when[64];
+    uint32_t second, peak_second;
+    double total, peak, overall;
+    int32_t peak_running;
+    int i;
+
+    printf("%-12s %10s %12s %9s %10s %10s  %s\n", "test", "runs", "targets",
+            "max runs", "mean pps", "peak pps", "peak at (UTC)");
+
+    for ( i = 0; i < sim->load_count; i++ ) {
+        load = &sim->loads[i];
+        total = 0;
+        peak = 0;
+        peak_second = 0;
+        peak_running = 0;
+
+        for ( second = 0; second < sim->length; second++ ) {
+            total += load->pps[second];
+            if ( load->pps[second] > peak ) {
+                peak = load->pps[second];
+                peak_second = second;
+            }
+            if ( load->running[second] > peak_running ) {
+                peak_running = load->running[second];
+                if ( load->profile.packets == 0 ) {
+                    peak_second = second;
+                }
+            }
+        }
+
+        if ( load->profile.packets > 0 ) {
+            printf("%-12s %10" PRIu64 " %12" PRIu64 " %9d %10.2f %10.2f  %s\n",
+                    load->test->name, load->runs, load->targets, peak_running,
+                    total / sim->length, peak,
+                    format_time(sim->start + peak_second, when, sizeof(when)));
+        } else {
+            printf("%-12s %10" PRIu64 " %12" PRIu64 " %9d %10s %10s  %s\n",
+                    load->test->name, load->runs, load->targets, peak_running,
+                    "-", "-",
+                    format_time(sim->start + peak_second, when, sizeof(when)));
+        }
+    }
+
+    /* the busiest second across all the tests */
+    peak = 0;
+    peak_second = 0;
+    for ( second = 0; second < sim->length; second++ ) {
+        overall = 0;
+        for ( i = 0; i < sim->load_count; i++ ) {
+            overall += sim->loads[i].pps[second];
+        }
+        if ( overall > peak ) {
+            peak = overall;
+            peak_second = second;
+        }
+    }
+
+    printf("\nPeak packet rate: %.2f pps at %s\n", peak,
+            format_time(sim->start + peak_second, when, sizeof(when)));
+}
+
+
+
+static int compare_windows(const void *a, const void *b) {
+    const struct window *first = (const struct window*)a;
+    const struct window *second = (const struct window*)b;
+
+    if ( first->running != second->running ) {
+        return first->running > second->running ? -1 : 1;
+    }
+
+    if ( first->length != second->length ) {
+        return first->length > second->length ? -1 : 1;
+    }
+
+    return first->start < second->start ? -1 : (first->start > second->start);
+}
+
+
+
+/*
+ * Print the periods of time with the most tests running at once, along
+ * with which tests they are. Lots of tests starting together at the same
+ * point in every period is a sign the schedule needs spreading out.
+ */
+static void print_busiest_windows(struct simulation *sim, int count) {
+    struct window *windows;
+    uint32_t second, window_count = 0;
+    char when[64];
+    int i, j;
+
+    windows = malloc(sizeof(struct window) * (sim->length ? sim->length : 1));
+
+    for ( second = 0; second < sim->length; second++ ) {
+        if ( second > 0 && sim->running[second] == sim->running[second - 1] ) {
+            windows[window_count - 1].length++;
+            continue;
+        }
+        windows[window_count].start = second;
+        windows[window_count].length = 1;
+        windows[window_count].running = sim->running[second];
+        window_count++;
+    }
+
+    qsort(windows, window_count, sizeof(struct window), compare_windows);
+
+    printf("\nBusiest windows (UTC):\n");
+
+    for ( i = 0; i < count && (uint32_t)i < window_count &&
+            windows[i].running > 0; i++ ) {
+        printf("  %s %6us %6d running:",
+                format_time(sim->start + windows[i].start, when, sizeof(when)),
+                windows[i].length, windows[i].running);
+        for ( j = 0; j < sim->load_count; j++ ) {
+            if ( sim->loads[j].running[windows[i].start] > 0 ) {
+                printf(" %s %d", sim->loads[j].test->name,
+                        sim->loads[j].running[windows[i].start]);
+            }
+        }
+        printf("\n");
+    }
+
+    if ( i == 0 ) {
+        printf("  none, no tests were run\n");
+    }
+
+    free(windows);
+}
+
+
+
+/*
+ * Write the number of running tests and the packet rate for every second,
+ * in total and for each type of test.
+ */
+static int write_load_csv(struct simulation *sim, char *filename) {
+    uint32_t second;
+    double total;
+    FILE *out;
+    int i;
+
+    if ( (out = fopen(filename, "w")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open %s for writing", filename);
+        return -1;
+    }
+
+    fprintf(out, "time,running,pps");
+    for ( i = 0; i < sim->load_count; i++ ) {
+        fprintf(out, ",%s_running,%s_pps", sim->loads[i].test->name,
+                sim->loads[i].test->name);
+    }
+    fprintf(out, "\n");
+
+    for ( second = 0; second < sim->length; second++ ) {
+        total = 0;
+        for ( i = 0; i < sim->load_count; i++ ) {
+            total += sim->loads[i].pps[second];
+        }
+
+        fprintf(out, "%" PRId64 ",%d,%.2f", (int64_t)sim->start + second,
+                sim->running[second], total);
+        for ( i = 0; i < sim->load_count; i++ ) {
+            fprintf(out, ",%d,%.2f", sim->loads[i].running[second],
+                    sim->loads[i].pps[second]);
+        }
+        fprintf(out, "\n");
+    }
+
+    if ( fclose(out) != 0 ) {
+        Log(LOG_WARNING, "Failed to write %s", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * The start of the weekly schedule period (Sunday 00:00 UTC) that the
+ * given time is in.
+ */
+static time_t get_week_start(time_t now) {
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_mday -= tm.tm_wday;
+
+    return timegm(&tm);
+}
+
+
+
+int main(int argc, char *argv[]) {
+    struct simulation sim;
+    struct event_base *base;
+    amp_test_meta_t meta;
+    char *output = NULL;
+    char *test_dir = AMP_TEST_DIRECTORY;
+    char when[64];
+    int windows = DEFAULT_BUSIEST_WINDOWS;
+    int jitter = 0;
+    int opt;
+    int i;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.start = get_week_start(time(NULL));
+    sim.length = SIMULATION_LENGTH;
+    sim.inter_packet_delay = MIN_INTER_PACKET_DELAY;
+
+    /* quieten down log messages, there is one for every test scheduled */
+    log_level = LOG_WARNING;
+
+    while ( (opt = getopt_long(argc, argv, "hxs:j:Z:p:o:w:t:",
+                    long_options, NULL)) != -1 ) {
+        switch ( opt ) {
+            case 'x': log_level = LOG_DEBUG; break;
+            case 's': sim.start = strtoll(optarg, NULL, 10); break;
+            case 'j': jitter = atoi(optarg); break;
+            case 'Z': sim.inter_packet_delay = atoi(optarg); break;
+            case 'p':
+                sim.profiles = realloc(sim.profiles,
+                        sizeof(struct test_profile) * (sim.profile_count + 1));
+                if ( parse_profile(optarg,
+                            &sim.profiles[sim.profile_count]) < 0 ) {
+                    fprintf(stderr, "Invalid profile '%s', expected "
+                            "test:packets:seconds\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                sim.profile_count++;
+                break;
+            case 'o': output = optarg; break;
+            case 'w': windows = atoi(optarg); break;
+            case 't': test_dir = optarg; break;
+            case 'h': usage(); exit(EXIT_SUCCESS);
+            default: usage(); exit(EXIT_FAILURE);
+        };
+    }
+
+    if ( register_tests(test_dir) < 0 ) {
+        fprintf(stderr, "Failed to load test modules from %s\n", test_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    /* read the schedule exactly as amplet2 would, but leave it untouched */
+    set_schedule_jitter(jitter);
+    set_schedule_cache(0);
+
+    base = event_base_new();
+    memset(&meta, 0, sizeof(meta));
+    meta.base = base;
+    meta.inter_packet_delay = sim.inter_packet_delay;
+
+    if ( optind < argc ) {
+        for ( i = optind; i < argc; i++ ) {
+            read_schedule_dir(base, argv[i], &meta);
+        }
+    } else {
+        read_schedule_dir(base, SCHEDULE_DIR, &meta);
+    }
+
+    foreach_scheduled_test(base, simulate_test_callback, &sim);
+    sum_loads(&sim);
+
+    printf("Simulated %u scheduled tests for %u days from %s UTC\n\n",
+            sim.scheduled, sim.length / (60 * 60 * 24),
+            format_time(sim.start, when, sizeof(when)));
+
+    print_test_loads(&sim);
+    print_busiest_windows(&sim, windows);
+
+    if ( output && write_load_csv(&sim, output) < 0 ) {
+        exit(EXIT_FAILURE);
+    }
+
+    clear_test_schedule(base, 1);
+    event_base_free(base);
+
+    for ( i = 0; i < sim.load_count; i++ ) {
+        free(sim.loads[i].running);
+        free(sim.loads[i].pps);
+    }
+    for ( i = 0; i < sim.profile_count; i++ ) {
+        free(sim.profiles[i].name);
+    }
+    free(sim.loads);
+    free(sim.profiles);
+    free(sim.running);
+    unregister_tests();
+
+    return EXIT_SUCCESS;
+}
@@ -48,6 +48,8 @@
 #include <limits.h>
 #include <signal.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <utime.h>
 #include <curl/curl.h>
 #include <yaml.h>
 #include <stdint.h>
@@ -58,11 +60,15 @@
 #include "w32-compat.h"
 #else
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <glob.h>
 #endif
 
 #include "config.h"
 #include "schedule.h"
+#include "schedule_cache.h"
+#include "timerwheel.h"
 #include "watchdog.h"
 #include "run.h"
 #include "nametable.h"
@@ -84,6 +90,12 @@ static void timer_fetch_callback(
         __attribute__((unused))short flags,
         void *evdata);
 
+/* budget to spread out the start times of tests scheduled together (us) */
+static int64_t start_jitter = 0;
+
+/* load and save compiled schedules in the schedule directory */
+static int use_schedule_cache = 1;
+
 
 /*
  * Dump a debug information line about a scheduled test.
@@ -121,6 +133,26 @@ static void dump_event_fetch_schedule(fetch_schedule_item_t *item, FILE *out) {
 
 
 
+/*
+ * Dump a debug information line about a scheduled item and when it is due.
+ */
+static void dump_schedule_item(schedule_item_t *item, struct timeval *tv,
+        FILE *out) {
+
+    fprintf(out, "%d.%.6d ", (int)tv->tv_sec, (int)tv->tv_usec);
+    switch ( item->type ) {
+        case EVENT_RUN_TEST:
+            dump_event_run_test(item->data.test, out);
+            break;
+        case EVENT_FETCH_SCHEDULE:
+            dump_event_fetch_schedule(item->data.fetch, out);
+            break;
+        default: fprintf(out, "UNKNOWN\n");
+    };
+}
+
+
+
 /*
  *
  */
@@ -130,31 +162,29 @@ static int dump_events_callback(
         void *evdata) {
 
     struct timeval tv;
-    FILE *out = evdata;
-    event_callback_fn cb = event_get_callback(ev);
-
-    if ( cb == run_scheduled_test || cb == timer_fetch_callback ) {
-        schedule_item_t *item;
 
+    if ( event_get_callback(ev) == timer_fetch_callback ) {
         event_pending(ev, EV_TIMEOUT, &tv);
-
-        fprintf(out, "%d.%.6d ", (int)tv.tv_sec, (int)tv.tv_usec);
-        item = event_get_callback_arg(ev);
-        switch ( item->type ) {
-            case EVENT_RUN_TEST:
-                dump_event_run_test(item->data.test, out);
-                break;
-            case EVENT_FETCH_SCHEDULE:
-                dump_event_fetch_schedule(item->data.fetch, out);
-                break;
-            default: fprintf(out, "UNKNOWN\n");
-        };
+        dump_schedule_item(event_get_callback_arg(ev), &tv, (FILE*)evdata);
     }
     return 0;
 }
 
 
 
+/*
+ *
+ */
+static int dump_tests_callback(schedule_item_t *item, void *evdata) {
+    struct timeval tv;
+
+    wheel_timer_pending(&item->timer, &tv);
+    dump_schedule_item(item, &tv, (FILE*)evdata);
+    return 0;
+}
+
+
+
 /*
  * Dump the current schedule for debug purposes
  */
@@ -167,6 +197,7 @@ void dump_schedule(struct event_base *base, FILE *out) {
     fprintf(out, "===== SCHEDULE at %d.%d =====\n", (int)wall.tv_sec,
             (int)wall.tv_usec);
 
+    foreach_scheduled_test(base, dump_tests_callback, out);
     event_base_foreach_event(base, dump_events_callback, out);
 
     fprintf(out, "\n");
@@ -174,6 +205,50 @@ void dump_schedule(struct event_base *base, FILE *out) {
 
 
 
+/*
+ * Adapter between the timer wheel and a function that operates on the
+ * scheduled tests stored in it.
+ */
+struct foreach_test {
+    schedule_foreach_cb fn;
+    void *arg;
+};
+
+static int foreach_test_callback(struct wheel_timer *timer, void *evdata) {
+    struct foreach_test *foreach = (struct foreach_test*)evdata;
+    return foreach->fn((schedule_item_t*)timer->arg, foreach->arg);
+}
+
+
+
+/*
+ * Call a function on every test that is waiting to run. The function may
+ * remove the test it is given from the schedule, but no others.
+ */
+int foreach_scheduled_test(struct event_base *base, schedule_foreach_cb fn,
+        void *arg) {
+    struct foreach_test foreach = { fn, arg };
+
+    return timer_wheel_foreach(find_timer_wheel(base), foreach_test_callback,
+            &foreach);
+}
+
+
+
+/*
+ * Free a NULL terminated array of test parameters.
+ */
+static void free_test_params(char **params) {
+    int i;
+
+    for ( i=0; params[i] != NULL; i++ ) {
+        free(params[i]);
+    }
+    free(params);
+}
+
+
+
 /*
  * Free a test schedule item, as well as any parameters and pointers to
  * destinations it has.
@@ -187,11 +262,7 @@ static void free_test_schedule_item(test_schedule_item_t *item) {
 
     /* free any test parameters, NULL terminated array */
     if ( item->params != NULL ) {
-        int i;
-	for ( i=0; item->params[i] != NULL; i++ ) {
-	    free(item->params[i]);
-	}
-	free(item->params);
+        free_test_params(item->params);
     }
     /* free pointers to destinations, but not the destinations themselves */
     free(item->dests);
@@ -265,14 +336,41 @@ static int add_events_list_callback(
 
 
 /*
- * Walk the list of timers and remove all of them, or just those that are
- * scheduled tests. Refreshing the test schedule will still leave schedule
- * fetches in the list.
+ * Unschedule and free a single test.
+ */
+static int clear_test_callback(schedule_item_t *item,
+        __attribute__((unused))void *evdata) {
+
+    wheel_timer_del(&item->timer);
+    if ( item->data.test != NULL ) {
+        free_test_schedule_item(item->data.test);
+    }
+    free(item);
+
+    return 0;
+}
+
+
+
+/*
+ * Remove all the scheduled tests, and optionally the schedule fetches as
+ * well. Refreshing the test schedule will still leave schedule fetches in
+ * the list.
  */
 void clear_test_schedule(struct event_base *base, int all) {
     struct tmp_event_list *list = NULL;
     struct tmp_event_list *current;
 
+    /* the tests are all in the timer wheel, and can be removed directly */
+    foreach_scheduled_test(base, clear_test_callback, NULL);
+
+    if ( !all ) {
+        return;
+    }
+
+    /* the timer wheel has its own event that needs freeing with the base */
+    free_timer_wheel(find_timer_wheel(base));
+
     /* can't make changes during foreach(), so first get all the events */
     event_base_foreach_event(base, add_events_list_callback, &list);
 
@@ -289,36 +387,17 @@ void clear_test_schedule(struct event_base *base, int all) {
          * has some under the hood events that will also be listed here and we
          * cannot safely dereference 'item' until we know what it is
          */
-        if ( event_callback != run_scheduled_test &&
-                ( !all || event_callback != timer_fetch_callback )) {
-            tmp = current;
-            current = current->next;
-            free(tmp);
-            continue;
-        }
+        if ( event_callback == timer_fetch_callback ) {
+            /* unschedule and free the event structure */
+            event_free(curr_event);
 
-        /* unschedule and free the event structure */
-        event_free(curr_event);
-
-        /* also free our own data that was attached to the event */
-        switch ( item->type ) {
-            case EVENT_RUN_TEST:
-                if ( item->data.test != NULL ) {
-                    free_test_schedule_item(item->data.test);
-                }
-                break;
-            case EVENT_FETCH_SCHEDULE:
-                if ( item->data.fetch != NULL ) {
-                    free_fetch_schedule_item(item->data.fetch);
-                }
-                break;
-            default:
-                Log(LOG_WARNING, "Freeing unknown schedule item type %d",
-                        item->type);
-                break;
-        };
+            /* also free our own data that was attached to the event */
+            if ( item->data.fetch != NULL ) {
+                free_fetch_schedule_item(item->data.fetch);
+            }
 
-        free(item);
+            free(item);
+        }
 
         /* free each item in our temporary list as we walk it */
         tmp = current;
@@ -329,6 +408,371 @@ void clear_test_schedule(struct event_base *base, int all) {
 
 
 
+/*
+ * A scheduled test that was in place before the schedule was reloaded. The
+ * key describes everything about the test that comes from the schedule, so
+ * that it can be matched against the new schedule.
+ */
+struct saved_schedule_item {
+    schedule_item_t *sched;
+    char *key;
+    int kept;
+    struct saved_schedule_item *next;
+};
+
+struct saved_schedule {
+    struct saved_schedule_item **buckets;
+    unsigned int size;
+    unsigned int count;
+    unsigned int added;
+    struct timeval started;
+};
+
+
+
+/*
+ * Append formatted text to a string, growing it as required.
+ */
+static void append_key(char **key, size_t *length, size_t *size,
+        const char *format, ...) {
+    va_list ap;
+    int needed;
+
+    while ( 1 ) {
+        va_start(ap, format);
+        needed = vsnprintf(*key + *length, *size - *length, format, ap);
+        va_end(ap);
+
+        assert(needed >= 0);
+
+        if ( *length + needed < *size ) {
+            *length += needed;
+            return;
+        }
+
+        *size = (*size + needed) * 2;
+        *key = realloc(*key, *size);
+    }
+}
+
+
+
+/*
+ * Append the parts of a scheduled test that decide if it can be merged with
+ * another: the test, its timing and its parameters.
+ */
+static void append_test_merge_key(char **key, size_t *length, size_t *size,
+        test_schedule_item_t *test) {
+    uint32_t i;
+
+    append_key(key, length, size, "%s|%ld.%06ld|%d|%" PRIu64 "|%" PRIu64,
+            test->test->name, (long)test->interval.tv_sec,
+            (long)test->interval.tv_usec, test->period, test->start,
+            test->end);
+
+    append_key(key, length, size, "|args");
+    for ( i = 0; test->params != NULL && test->params[i] != NULL; i++ ) {
+        append_key(key, length, size, "\x1f%s", test->params[i]);
+    }
+}
+
+
+
+/*
+ * Build a string describing everything about a scheduled test except its
+ * destinations. Tests with the same key can be merged into one test.
+ */
+static char *get_test_merge_key(test_schedule_item_t *test) {
+    size_t length = 0, size = 256;
+    char *key = malloc(size);
+
+    key[0] = '\0';
+    append_test_merge_key(&key, &length, &size, test);
+
+    return key;
+}
+
+
+
+/*
+ * Build a string that uniquely describes a scheduled test: the test, its
+ * timing, parameters and destinations. Two items with the same key would
+ * run exactly the same test at exactly the same times.
+ */
+static char *get_test_schedule_key(test_schedule_item_t *test) {
+    char addrstr[INET6_ADDRSTRLEN];
+    resolve_dest_t *resolve;
+    size_t length = 0, size = 256;
+    char *key = malloc(size);
+    uint32_t i;
+
+    key[0] = '\0';
+
+    append_test_merge_key(&key, &length, &size, test);
+
+    append_key(&key, &length, &size, "|dests");
+    for ( i = 0; i < test->dest_count; i++ ) {
+        struct addrinfo *dest = test->dests[i];
+        void *addr;
+
+        if ( dest->ai_family == AF_INET ) {
+            addr = &((struct sockaddr_in*)dest->ai_addr)->sin_addr;
+        } else {
+            addr = &((struct sockaddr_in6*)dest->ai_addr)->sin6_addr;
+        }
+
+        inet_ntop(dest->ai_family, addr, addrstr, sizeof(addrstr));
+        append_key(&key, &length, &size, "\x1f%s/%s",
+                dest->ai_canonname ? dest->ai_canonname : "", addrstr);
+    }
+
+    append_key(&key, &length, &size, "|resolve");
+    for ( resolve = test->resolve; resolve != NULL; resolve = resolve->next ) {
+        append_key(&key, &length, &size, "\x1f%s/%d/%d", resolve->name,
+                resolve->count, resolve->family);
+    }
+
+    return key;
+}
+
+
+
+static uint32_t hash_test_schedule_key(char *key) {
+    uint32_t hash = 2166136261U;
+
+    for ( ; *key != '\0'; key++ ) {
+        hash ^= (uint8_t)*key;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Set the budget (in milliseconds) that test start times can be spread over.
+ */
+void set_schedule_jitter(int jitter) {
+    start_jitter = jitter > 0 ? (int64_t)jitter * 1000 : 0;
+}
+
+
+
+/*
+ * Enable or disable the compiled schedule cache. Tools that only read the
+ * schedule should leave the schedule directory untouched.
+ */
+void set_schedule_cache(int enabled) {
+    use_schedule_cache = enabled;
+}
+
+
+
+/*
+ * Pick how long after its scheduled time a test should start, so that tests
+ * aligned to the same period boundary don't all start in the same instant.
+ * The offset is based on the schedule key so a test always gets the same
+ * one (including across reloads), and is never more than half the interval.
+ */
+static struct timeval get_start_offset(test_schedule_item_t *test) {
+    struct timeval offset = {0, 0};
+    int64_t budget = start_jitter;
+    int64_t interval = US_FROM_TV(test->interval);
+    char *key;
+
+    if ( interval > 0 && budget > interval / 2 ) {
+        budget = interval / 2;
+    }
+
+    if ( budget <= 0 ) {
+        return offset;
+    }
+
+    key = get_test_schedule_key(test);
+    interval = hash_test_schedule_key(key) % budget;
+    free(key);
+
+    offset.tv_sec = interval / 1000000;
+    offset.tv_usec = interval % 1000000;
+
+    return offset;
+}
+
+
+
+/*
+ * Count the scheduled tests.
+ */
+static int count_tests_callback(
+        __attribute__((unused))schedule_item_t *sched, void *evdata) {
+    (*(unsigned int*)evdata)++;
+    return 0;
+}
+
+
+
+/*
+ * Take a scheduled test out of the timer wheel and save it, indexed by the
+ * key that describes its schedule.
+ */
+static int detach_test_callback(schedule_item_t *sched, void *evdata) {
+    struct saved_schedule *saved = (struct saved_schedule*)evdata;
+    struct saved_schedule_item *item;
+    uint32_t bucket;
+
+    item = calloc(1, sizeof(struct saved_schedule_item));
+    item->sched = sched;
+    /* the test names are about to be freed, so build the key now */
+    item->key = get_test_schedule_key(sched->data.test);
+    bucket = hash_test_schedule_key(item->key) % saved->size;
+    item->next = saved->buckets[bucket];
+    saved->buckets[bucket] = item;
+
+    wheel_timer_del(&sched->timer);
+
+    return 0;
+}
+
+
+
+/*
+ * Take all the scheduled tests out of the timer wheel (without freeing them)
+ * so that the schedule can be read again from scratch. Once the new schedule
+ * has been read, restore_test_schedule() will put back any tests that
+ * haven't changed, so they keep their existing timers.
+ */
+struct saved_schedule *detach_test_schedule(struct event_base *base) {
+    struct saved_schedule *saved;
+
+    saved = calloc(1, sizeof(struct saved_schedule));
+    gettimeofday(&saved->started, NULL);
+
+    foreach_scheduled_test(base, count_tests_callback, &saved->count);
+
+    saved->size = saved->count > 0 ? saved->count : 1;
+    saved->buckets = calloc(saved->size, sizeof(struct saved_schedule_item*));
+
+    foreach_scheduled_test(base, detach_test_callback, saved);
+
+    return saved;
+}
+
+
+
+/*
+ * Free a schedule item that belongs to a scheduled test.
+ */
+static void free_test_schedule_event(schedule_item_t *sched) {
+    wheel_timer_del(&sched->timer);
+    free_test_schedule_item(sched->data.test);
+    free(sched);
+}
+
+
+
+/*
+ * Look for a newly scheduled test in the saved schedule. If it is there then
+ * the old one is kept instead and the new one is thrown away, otherwise it
+ * is a new test.
+ */
+static int restore_test_callback(schedule_item_t *sched, void *evdata) {
+    struct saved_schedule *saved = (struct saved_schedule*)evdata;
+    struct saved_schedule_item *item;
+    char *key;
+
+    key = get_test_schedule_key(sched->data.test);
+
+    for ( item = saved->buckets[hash_test_schedule_key(key) % saved->size];
+            item != NULL; item = item->next ) {
+        if ( !item->kept && strcmp(item->key, key) == 0 ) {
+            break;
+        }
+    }
+
+    free(key);
+
+    if ( item == NULL ) {
+        saved->added++;
+        return 0;
+    }
+
+    /* the old test module has been unloaded, use the new one */
+    item->sched->data.test->test = sched->data.test->test;
+    free_test_schedule_event(sched);
+    item->kept = 1;
+
+    return 0;
+}
+
+
+
+/*
+ * Compare the newly read schedule against the one that was detached before
+ * reading it. Tests that are unchanged go back to using their old timers,
+ * so they run at the times they were already going to, and the duplicates
+ * from the new schedule are thrown away. Old tests that no longer exist are
+ * freed. Returns the number of tests that were added or removed.
+ */
+int restore_test_schedule(struct event_base *base,
+        struct saved_schedule *saved) {
+    struct saved_schedule_item *item;
+    struct timeval now, next, finished;
+    unsigned int unchanged = 0, removed = 0, changed;
+    unsigned int i;
+
+    if ( saved == NULL ) {
+        return 0;
+    }
+
+    gettimeofday(&now, NULL);
+
+    /* the old timers can't be put back while walking the new ones */
+    foreach_scheduled_test(base, restore_test_callback, saved);
+
+    for ( i = 0; i < saved->size; i++ ) {
+        while ( (item = saved->buckets[i]) != NULL ) {
+            saved->buckets[i] = item->next;
+            if ( item->kept ) {
+                test_schedule_item_t *test = item->sched->data.test;
+
+                /* carry on waiting until the next time it was due to run */
+                evutil_timeradd(&test->abstime, &test->offset, &next);
+                if ( timercmp(&next, &now, >) ) {
+                    timersub(&next, &now, &next);
+                } else {
+                    timerclear(&next);
+                }
+
+                wheel_timer_add(&item->sched->timer, &next);
+                unchanged++;
+            } else {
+                /* anything not matched has been removed from the schedule */
+                free_test_schedule_event(item->sched);
+                removed++;
+            }
+            free(item->key);
+            free(item);
+        }
+    }
+
+    gettimeofday(&finished, NULL);
+    timersub(&finished, &saved->started, &finished);
+
+    Log(LOG_INFO, "Reloaded schedule in %dms: %u unchanged, %u added, "
+            "%u removed", (int)MS_FROM_TV(finished), unchanged, saved->added,
+            removed);
+
+    changed = saved->added + removed;
+
+    free(saved->buckets);
+    free(saved);
+
+    return changed;
+}
+
+
+
 /*
  * Convert a string from the schedule file into a regular time period.
  */
@@ -738,95 +1182,140 @@ struct timeval get_next_schedule_time(struct event_base *base,
 
 
 /*
- * Compare two test schedule items to see if they are similar enough to
- * merge together to make one scheduled test with multiple destinations.
+ * Calculate the next time that a test is due to be run relative to the
+ * given time rather than the current time. Used to replay a schedule in
+ * virtual time.
+ */
+struct timeval get_next_schedule_time_at(struct timeval *now,
+        schedule_period_t period, uint64_t start, uint64_t end,
+        uint64_t frequency, int run, struct timeval *abstime) {
+
+    assert(now);
+
+    return get_next_schedule_time_internal(now, period, start, end, frequency,
+            run, abstime);
+}
+
+
+
+/*
+ * Scheduled tests that still have room for more destinations, indexed by
+ * their test, timing and parameters. New tests look up the index to find
+ * one to merge with, rather than comparing against every scheduled test.
+ */
+struct merge_item {
+    char *key;
+    uint32_t hash;
+    test_schedule_item_t *test;
+    struct merge_item *next;
+};
+
+struct merge_table {
+    struct merge_item **buckets;
+    uint32_t size;
+    uint32_t count;
+};
+
+
+
+/*
+ * Check if a scheduled test can take any more destinations.
  */
-static int compare_test_items(test_schedule_item_t *a, test_schedule_item_t *b){
-
-    if ( a->test != b->test )
-	return 0;
+static int has_room_for_targets(test_schedule_item_t *test) {
+    return test->test->max_targets == 0 ||
+        (test->dest_count + test->resolve_count) < test->test->max_targets;
+}
 
-    if ( timercmp(&(a->interval), &(b->interval), !=) )
-	return 0;
 
-    if ( a->period != b->period )
-	return 0;
 
-    if ( a->start != b->start )
-	return 0;
+/*
+ * Add a scheduled test to the index, so that later tests with the same
+ * schedule can be merged into it.
+ */
+static void add_merge_candidate(struct merge_table *table,
+        test_schedule_item_t *test) {
+    struct merge_item *item;
+    uint32_t i;
 
-    if ( a->end != b->end )
-	return 0;
+    if ( test->test->max_targets == 1 || !has_room_for_targets(test) ) {
+        return;
+    }
 
-    if ( a->params != NULL && b->params != NULL ) {
-        int i;
-	/* if both params are not null, make sure they are identical */
-	for ( i=0; a->params[i] != NULL && b->params != NULL; i++ ) {
-	    if ( strcmp(a->params[i], b->params[i]) != 0 )
-		return 0;
-	}
+    /* keep the chains short by doubling the table as it fills */
+    if ( table->count >= table->size ) {
+        uint32_t size = table->size * 2;
+        struct merge_item **buckets = calloc(size, sizeof(struct merge_item*));
 
-	/* if either isn't null by now then the params lists are different */
-	if ( a->params[i] != NULL || b->params[i] != NULL ) {
-	    return 0;
-	}
+        for ( i = 0; i < table->size; i++ ) {
+            while ( (item = table->buckets[i]) != NULL ) {
+                table->buckets[i] = item->next;
+                item->next = buckets[item->hash % size];
+                buckets[item->hash % size] = item;
+            }
+        }
 
-    } else if ( a->params != NULL || b->params != NULL ) {
-	/* if one of them is null they should both be null */
-	return 0;
+        free(table->buckets);
+        table->buckets = buckets;
+        table->size = size;
     }
 
-    return 1;
+    item = malloc(sizeof(struct merge_item));
+    item->key = get_test_merge_key(test);
+    item->hash = hash_test_schedule_key(item->key);
+    item->test = test;
+    item->next = table->buckets[item->hash % table->size];
+    table->buckets[item->hash % table->size] = item;
+    table->count++;
 }
 
 
 
 /*
- * Callback that is used to find the first matching timer event, once a valid
- * event is found the event is stored at the address pointed to by evdata
+ * Callback to add every test that is already scheduled to the index.
  */
-static int check_test_compare_callback(
-        __attribute__((unused))const struct event_base *base,
-        const struct event *ev,
+static int add_merge_candidate_callback(schedule_item_t *sched_item,
         void *evdata) {
 
-    schedule_item_t *sched_item;
-    test_schedule_item_t *sched_test;
-    test_schedule_item_t *test;
-    test_schedule_item_t **return_value = evdata;
+    assert(sched_item->data.test);
 
-    /*
-     * test if event callback matches test callback
-     * (libevent may have other events queued)
-     */
-    if ( event_get_callback(ev) != run_scheduled_test ) {
-        return 0;
-    }
+    add_merge_candidate((struct merge_table*)evdata, sched_item->data.test);
 
-    sched_item = event_get_callback_arg(ev);
+    return 0;
+}
 
-    assert(sched_item->data.test);
-    sched_test = sched_item->data.test;
 
-    assert(*return_value);
-    test = (*return_value);
 
-    /* check if these tests are the same */
-    if ( compare_test_items(sched_test, test) ) {
+/*
+ * Create the index of tests that can be merged with, starting with any
+ * tests that are already scheduled.
+ */
+static void init_merge_table(struct event_base *base,
+        struct merge_table *table) {
+    table->size = 256;
+    table->count = 0;
+    table->buckets = calloc(table->size, sizeof(struct merge_item*));
 
-        /* check if there is room for more destinations */
-        if ( test->test->max_targets == 0 ||
-                (sched_test->dest_count + sched_test->resolve_count) <
-                test->test->max_targets ) {
+    foreach_scheduled_test(base, add_merge_candidate_callback, table);
+}
 
-            /* valid matching sched_item was found */
-            *return_value = sched_test;
-            return 1;
+
+
+static void free_merge_table(struct merge_table *table) {
+    struct merge_item *item;
+    uint32_t i;
+
+    for ( i = 0; i < table->size; i++ ) {
+        while ( (item = table->buckets[i]) != NULL ) {
+            table->buckets[i] = item->next;
+            free(item->key);
+            free(item);
         }
     }
 
-    /* No match was found, move on to next item */
-    return 0;
+    free(table->buckets);
+    table->buckets = NULL;
+    table->size = 0;
+    table->count = 0;
 }
 
 
@@ -838,35 +1327,54 @@ static int check_test_compare_callback(
  * active timers and tests that need to be run.
  */
 static int merge_scheduled_tests(
-        struct event_base *base,
+        struct merge_table *table,
         test_schedule_item_t *test) {
 
-    test_schedule_item_t * sched_test = test;
+    struct merge_item **item, *match;
+    test_schedule_item_t *sched_test;
+    char *key = get_test_merge_key(test);
+    uint32_t hash = hash_test_schedule_key(key);
 
-    /* if entire events list was searched without returning then result is 0 */
-    if ( event_base_foreach_event(base,
-            check_test_compare_callback, &sched_test) ) {
+    /* everything in the index has room for more destinations */
+    for ( item = &table->buckets[hash % table->size]; *item != NULL;
+            item = &(*item)->next ) {
+        if ( (*item)->hash == hash && strcmp((*item)->key, key) == 0 ) {
+            break;
+        }
+    }
 
-        /* if status is non zero sched_test must contain a matching test */
-        assert(sched_test != test);
+    free(key);
 
-        if ( test->dest_count > 0 ) {
-            /* add a new pre-resolved address */
-            sched_test->dests = realloc(sched_test->dests,
-                    (sched_test->dest_count+1) *
-                    sizeof(struct addrinfo *));
-            sched_test->dests[sched_test->dest_count++] = test->dests[0];
-        } else {
-            /* add a new address we will need to resolve later */
-            test->resolve->next = sched_test->resolve;
-            sched_test->resolve = test->resolve;
-            sched_test->resolve_count++;
-        }
+    if ( *item == NULL ) {
+        return 0;
+    }
 
-        return 1;
+    sched_test = (*item)->test;
+    assert(sched_test != test);
+
+    if ( test->dest_count > 0 ) {
+        /* add a new pre-resolved address */
+        sched_test->dests = realloc(sched_test->dests,
+                (sched_test->dest_count+1) *
+                sizeof(struct addrinfo *));
+        sched_test->dests[sched_test->dest_count++] = test->dests[0];
+    } else {
+        /* add a new address we will need to resolve later */
+        test->resolve->next = sched_test->resolve;
+        sched_test->resolve = test->resolve;
+        sched_test->resolve_count++;
     }
 
-    return 0;
+    /* once it is full nothing else can be merged with it */
+    if ( !has_room_for_targets(sched_test) ) {
+        match = *item;
+        *item = match->next;
+        free(match->key);
+        free(match);
+        table->count--;
+    }
+
+    return 1;
 }
 
 
@@ -1004,32 +1512,54 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
 
 
 /*
- * Create a new test schedule item and fill in the test configuration.
- * All the times are given by the user in seconds, but we'll use milliseconds
- * because it makes scheduling easier.
+ * Duplicate a NULL terminated list of test parameters.
  */
-static test_schedule_item_t *create_and_schedule_test(
-        struct event_base *base, yaml_document_t *document,
-        yaml_node_item_t index, amp_test_meta_t *meta) {
+static char **copy_test_params(char **params) {
+    char **copy;
+    int count, i;
+
+    if ( params == NULL ) {
+        return NULL;
+    }
+
+    for ( count = 0; params[count] != NULL; count++ ) {
+        /* nothing */
+    }
+
+    copy = malloc(sizeof(char*) * (count + 1));
+    for ( i = 0; i < count; i++ ) {
+        copy[i] = strdup(params[i]);
+    }
+    copy[count] = NULL;
+
+    return copy;
+}
+
+
+
+/*
+ * Check the configuration of a single test from the schedule file and add
+ * it to the compiled schedule, with defaults filled in for anything that
+ * wasn't set. All the times are given by the user in seconds, but we'll use
+ * microseconds because it makes scheduling easier.
+ */
+static void compile_test(yaml_document_t *document, yaml_node_item_t index,
+        struct compiled_schedule *schedule) {
 
-    test_schedule_item_t *test = NULL;
-    schedule_item_t *sched;
     yaml_node_t *node, *key, *value;
     yaml_node_pair_t *pair;
-    test_t *test_definition;
     int64_t start = 0, end = -1, frequency = -1;
     char *period_str = NULL, *testname = NULL, **params = NULL;
     schedule_period_t period;
-    char **targets = NULL, **remaining = NULL;
+    char **targets = NULL;
     int target_len;
-    struct timeval next;
     int params_present = 0;
     int lineno = 0;
 
     /* make sure the node exists and is of the right type */
     if ( (node = yaml_document_get_node(document, index)) == NULL ||
             node->type != YAML_MAPPING_NODE ) {
-        return NULL;
+        return;
     }
 
     /*
@@ -1073,6 +1603,9 @@ static test_schedule_item_t *create_and_schedule_test(
             period_str = (char*)value->data.scalar.value;
         } else if ( strcmp((char*)key->data.scalar.value, "args") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
+            if ( params != NULL ) {
+                free_test_params(params);
+            }
             params = parse_param_string((char*)value->data.scalar.value);
             params_present = 1;
         } else if ( strcmp((char*)key->data.scalar.value, "target") == 0 ) {
@@ -1086,10 +1619,12 @@ static test_schedule_item_t *create_and_schedule_test(
         }
     }
 
-    /* confirm the test name is valid */
-    if ( testname == NULL ||
-            (test_definition = get_test_by_name(testname)) == NULL ) {
-        Log(LOG_WARNING, "Unknown test '%s' (from line %d)", testname, lineno);
+    /*
+     * The test name is checked against the loaded tests when the test is
+     * scheduled, the test modules can change without the schedule changing.
+     */
+    if ( testname == NULL ) {
+        Log(LOG_WARNING, "Missing test name (from line %d)", lineno);
         goto end;
     }
 
@@ -1126,7 +1661,8 @@ static test_schedule_item_t *create_and_schedule_test(
         frequency = get_period_default_frequency(period) * 1000000;
     } else if ( check_time_range(frequency, period) < 0 ) {
         Log(LOG_WARNING,
-                "Invalid frequency value %d for period %s (from line %d)",
+                "Invalid frequency value %" PRId64
+                " for period %s (from line %d)",
                 frequency, period_str, lineno);
         goto end;
     }
@@ -1143,8 +1679,57 @@ static test_schedule_item_t *create_and_schedule_test(
      * then checking for duplicates in the schedule can be more accurate.
      */
 
+    add_compiled_test(schedule, testname, period, start, end, frequency,
+            lineno, params, targets);
+
+end:
+    if ( params ) {
+        free_test_params(params);
+    }
+
+    if ( targets ) {
+        free(targets);
+    }
+}
+
+
+
+/*
+ * Create new test schedule items from a compiled test and schedule them,
+ * merging them with any existing tests that have the same schedule.
+ */
+static void schedule_compiled_test(struct event_base *base,
+        struct merge_table *candidates, struct schedule_cache_test *compiled,
+        amp_test_meta_t *meta) {
+
+    test_schedule_item_t *test;
+    schedule_item_t *sched;
+    test_t *test_definition;
+    char *testname, **params, **targets, **remaining;
+    struct timeval next;
+    uint32_t i;
+
+    params = malloc(sizeof(char*) * (compiled->param_count + 1));
+    targets = malloc(sizeof(char*) * (compiled->target_count + 1));
+    testname = get_compiled_test_strings(compiled, params, targets);
+
+    /* confirm the test name is valid */
+    if ( (test_definition = get_test_by_name(testname)) == NULL ) {
+        Log(LOG_WARNING, "Unknown test '%s' (from line %d)", testname,
+                compiled->lineno);
+        free(params);
+        free(targets);
+        return;
+    }
+
+    /* the targets get modified as they are parsed, so use a copy of them */
+    for ( i = 0; i < compiled->target_count; i++ ) {
+        targets[i] = strdup(targets[i]);
+    }
+
     Log(LOG_DEBUG, "start:%" PRId64 " end:%" PRId64 " freq:%" PRId64
-            " period:%" PRId64, start, end, frequency, period);
+            " period:%d", compiled->start, compiled->end,
+            compiled->frequency, compiled->period);
 
     remaining = targets;
 
@@ -1152,13 +1737,14 @@ static test_schedule_item_t *create_and_schedule_test(
         Log(LOG_DEBUG, "Creating test schedule instance for %s test", testname);
         /* if everything looks good, finally construct the test object */
         test = (test_schedule_item_t *)malloc(sizeof(test_schedule_item_t));
-        test->interval.tv_sec = frequency / 1000000;
-        test->interval.tv_usec = frequency % 1000000;
-        test->period = period;
-        test->start = start;
-        test->end = end;
+        test->interval.tv_sec = compiled->frequency / 1000000;
+        test->interval.tv_usec = compiled->frequency % 1000000;
+        test->period = compiled->period;
+        test->start = compiled->start;
+        test->end = compiled->end;
         test->test = test_definition;
-        test->params = params;
+        /* every item owns its parameters, so they can be freed separately */
+        test->params = compiled->has_params ? copy_test_params(params) : NULL;
         test->meta = meta;
         /*
          * Convert the list of targets into actual dests and ones to resolve.
@@ -1181,10 +1767,9 @@ static test_schedule_item_t *create_and_schedule_test(
          * there are still outstanding targets then the test is maxed out and
          * there is no room for more destinations.
          */
-        if ( remaining != NULL && *remaining == NULL &&
-                test_definition->max_targets != 1 ) {
+        if ( *remaining == NULL && test_definition->max_targets != 1 ) {
             /* check if this test at this time already exists */
-            if ( merge_scheduled_tests(base, test) ) {
+            if ( merge_scheduled_tests(candidates, test) ) {
                 /* remove pointer to names, merged test owns it */
                 test->resolve = NULL;
                 /* free this test, it has now merged */
@@ -1198,53 +1783,48 @@ static test_schedule_item_t *create_and_schedule_test(
         sched->data.test = test;
         sched->base = base;
 
+        /* spread out the start times of tests scheduled together */
+        test->offset = get_start_offset(test);
+        test->start_delay = 0;
+        test->slot = 0;
+
         /* create the timer event for this test */
         next = get_next_schedule_time(base, test->period, test->start,
                 test->end, US_FROM_TV(test->interval), 0, &test->abstime);
+        evutil_timeradd(&next, &test->offset, &next);
 
-        sched->event = event_new(sched->base, -1, 0, run_scheduled_test, sched);
+        wheel_timer_init(&sched->timer, get_timer_wheel(sched->base),
+                run_scheduled_test, sched);
+        wheel_timer_add(&sched->timer, &next);
 
-        if ( event_add(sched->event, &next) != 0 ) {
-            Log(LOG_ALERT, "Failed to schedule %s test", testname);
-        }
+        /* later tests with the same schedule can be merged into this one */
+        add_merge_candidate(candidates, test);
 
-    } while ( remaining != NULL && *remaining != NULL );
+    } while ( *remaining != NULL );
 
-end:
-    if ( targets ) {
-        free(targets);
+    for ( i = 0; i < compiled->target_count; i++ ) {
+        free(targets[i]);
     }
 
-    return test;
+    free(params);
+    free(targets);
 }
 
 
 
 /*
- * Read in the schedule file and create events for each test.
+ * Parse the contents of a schedule file and compile all the tests in it.
  */
-static void read_schedule_file(struct event_base *base, char *filename,
-        amp_test_meta_t *meta) {
+static void compile_schedule_file(char *filename, char *contents,
+        size_t length, struct compiled_schedule *schedule) {
 
-    FILE *in;
     yaml_parser_t parser;
     yaml_document_t document;
     yaml_node_t *root;
     yaml_node_pair_t *pair;
 
-    assert(base);
-    assert(filename);
-
-    Log(LOG_INFO, "Loading schedule from %s", filename);
-
-    if ( (in = fopen(filename, "r")) == NULL ) {
-	Log(LOG_WARNING, "Failed to open schedule file %s: %s\n",
-                filename, strerror(errno));
-        return;
-    }
-
     yaml_parser_initialize(&parser);
-    yaml_parser_set_input_file(&parser, in);
+    yaml_parser_set_input_string(&parser, (unsigned char*)contents, length);
 
     /* make sure that the schedule file is valid yaml */
     if ( !yaml_parser_load(&parser, &document) ) {
@@ -1277,39 +1857,107 @@ static void read_schedule_file(struct event_base *base, char *filename,
         if ( key->type == YAML_SCALAR_NODE &&
                 value->type == YAML_SEQUENCE_NODE &&
                 strcmp((char*)key->data.scalar.value, "tests") == 0 ) {
-            /* for each item in the tests array, create the test */
+            /* for each item in the tests array, compile the test */
             yaml_node_item_t *item;
             for ( item = value->data.sequence.items.start;
                     item != value->data.sequence.items.top; item++ ) {
-                create_and_schedule_test(base, &document, *item, meta);
+                compile_test(&document, *item, schedule);
             }
         }
      }
 
 parser_format_error:
      yaml_document_delete(&document);
-     yaml_parser_delete(&parser);
 
 parser_load_error:
-     fclose(in);
+     yaml_parser_delete(&parser);
+}
+
+
+
+/*
+ * Get the compiled tests for a schedule file, using the cached copy if the
+ * file hasn't changed since it was compiled. Returns 1 if the file had to
+ * be compiled, 0 if it was cached, or -1 if it couldn't be read.
+ */
+static int load_schedule_file(char *filename, struct schedule_cache *cache,
+        struct compiled_schedule *schedule) {
+
+    struct stat statbuf;
+    char *contents, *name;
+    FILE *in;
+
+    assert(filename);
+    assert(schedule);
+
+    if ( (in = fopen(filename, "r")) == NULL ) {
+	Log(LOG_WARNING, "Failed to open schedule file %s: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+
+    if ( fstat(fileno(in), &statbuf) < 0 ) {
+	Log(LOG_WARNING, "Failed to stat schedule file %s: %s\n",
+                filename, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+
+    /* read the whole file, it needs to be hashed before deciding to parse */
+    contents = malloc(statbuf.st_size + 1);
+    if ( statbuf.st_size > 0 &&
+            fread(contents, statbuf.st_size, 1, in) != 1 ) {
+	Log(LOG_WARNING, "Failed to read schedule file %s", filename);
+        free(contents);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    /* files are cached by name within the directory that holds the cache */
+    name = strrchr(filename, '/');
+    memset(schedule, 0, sizeof(struct compiled_schedule));
+    schedule->name = strdup(name ? name + 1 : filename);
+    hash_schedule_contents(contents, statbuf.st_size, schedule->hash);
+
+    if ( find_cached_schedule(cache, schedule) ) {
+        Log(LOG_INFO, "Loading schedule from %s (cached)", filename);
+        free(contents);
+        return 0;
+    }
+
+    Log(LOG_INFO, "Loading schedule from %s", filename);
+
+    compile_schedule_file(filename, contents, statbuf.st_size, schedule);
+    free(contents);
+
+    return 1;
 }
 
 
 
 /*
  * Read all the test schedule files in the given directory and add their
- * contents to the global test schedule.
+ * contents to the global test schedule. Files that haven't changed since
+ * they were last read are loaded from the compiled schedule cache.
  */
 void read_schedule_dir(struct event_base *base, char *directory,
         amp_test_meta_t *meta) {
 
     glob_t glob_buf;
-    unsigned int i;
+    unsigned int i, count = 0;
     char full_loc[MAX_PATH_LENGTH];
+    char cache_loc[MAX_PATH_LENGTH];
+    struct schedule_cache *cache;
+    struct compiled_schedule *schedules;
+    struct schedule_cache_test *test;
+    struct merge_table candidates;
+    int changed = 0;
 
     assert(base);
     assert(directory);
     assert(strlen(directory) < MAX_PATH_LENGTH - 8);
+    assert(strlen(directory) + strlen(SCHEDULE_CACHE_FILE) < MAX_PATH_LENGTH);
     assert(meta);
 
     /*
@@ -1324,22 +1972,205 @@ void read_schedule_dir(struct event_base *base, char *directory,
     Log(LOG_INFO, "Loading schedule from %s (found %zd candidates)",
             directory, glob_buf.gl_pathc);
 
+    strcpy(cache_loc, directory);
+    strcat(cache_loc, SCHEDULE_CACHE_FILE);
+    cache = use_schedule_cache ? load_schedule_cache(cache_loc) : NULL;
+
+    schedules = calloc(glob_buf.gl_pathc ? glob_buf.gl_pathc : 1,
+            sizeof(struct compiled_schedule));
+
     for ( i = 0; i < glob_buf.gl_pathc; i++ ) {
-        read_schedule_file(base, glob_buf.gl_pathv[i], meta);
+        switch ( load_schedule_file(glob_buf.gl_pathv[i], cache,
+                    &schedules[count]) ) {
+            case 1: changed = 1; /* fall through */
+            case 0: count++; break;
+            default: break;
+        };
+    }
+
+    /* update the cache if any schedule files were added, changed or removed */
+    if ( use_schedule_cache &&
+            (changed || count != (cache ? cache->header->file_count : 0)) ) {
+        write_schedule_cache(cache_loc, schedules, count);
+    }
+
+    init_merge_table(base, &candidates);
+
+    for ( i = 0; i < count; i++ ) {
+        for ( test = next_compiled_test(&schedules[i], NULL); test != NULL;
+                test = next_compiled_test(&schedules[i], test) ) {
+            schedule_compiled_test(base, &candidates, test, meta);
+        }
+        free_compiled_schedule(&schedules[i]);
     }
 
+    free_merge_table(&candidates);
+    free(schedules);
+    free_schedule_cache(cache);
     globfree(&glob_buf);
     return;
 }
 
 
 
+/*
+ * Header callback for the schedule fetch, used to record the ETag that the
+ * server attached to the schedule file. Redirects will pass through the
+ * headers for every response, so forget any tag we've seen when a new
+ * response starts - only the final one describes the file we received.
+ */
+static size_t fetch_header_callback(char *buffer, size_t size, size_t nitems,
+        void *data) {
+
+    char *etag = (char *)data;
+    size_t length = size * nitems;
+    size_t taglen;
+    char *start, *end;
+
+    if ( length >= strlen("HTTP/") &&
+            strncmp(buffer, "HTTP/", strlen("HTTP/")) == 0 ) {
+        etag[0] = '\0';
+        return length;
+    }
+
+    if ( length <= strlen("ETag:") ||
+            strncasecmp(buffer, "ETag:", strlen("ETag:")) != 0 ) {
+        return length;
+    }
+
+    /* header lines aren't null terminated, so be careful with the bounds */
+    start = buffer + strlen("ETag:");
+    end = buffer + length;
+
+    while ( start < end && (*start == ' ' || *start == '\t') ) {
+        start++;
+    }
+
+    while ( end > start && (end[-1] == '\r' || end[-1] == '\n' ||
+                end[-1] == ' ' || end[-1] == '\t') ) {
+        end--;
+    }
+
+    taglen = end - start;
+
+    /* ignore tags we can't store rather than sending a truncated one back */
+    if ( taglen == 0 || taglen >= MAX_SCHEDULE_ETAG_LENGTH ) {
+        etag[0] = '\0';
+        return length;
+    }
+
+    memcpy(etag, start, taglen);
+    etag[taglen] = '\0';
+
+    return length;
+}
+
+
+
+/*
+ * Read the ETag that was saved alongside the last fetched schedule file.
+ * Returns 0 if a tag was read, -1 if there isn't one.
+ */
+static int read_schedule_etag(char *filename, char *etag) {
+    FILE *in;
+    size_t length;
+
+    if ( (in = fopen(filename, "r")) == NULL ) {
+        return -1;
+    }
+
+    if ( fgets(etag, MAX_SCHEDULE_ETAG_LENGTH, in) == NULL ) {
+        fclose(in);
+        return -1;
+    }
+
+    fclose(in);
+
+    length = strcspn(etag, "\r\n");
+    etag[length] = '\0';
+
+    return length > 0 ? 0 : -1;
+}
+
+
+
+/*
+ * Save the ETag for the schedule file that was just fetched so that it can
+ * be sent to the server with the next request. If the server didn't give us
+ * one then remove any old tag, it doesn't describe the current file.
+ */
+static void write_schedule_etag(char *filename, char *etag) {
+    FILE *out;
+
+    if ( etag == NULL || etag[0] == '\0' ) {
+        if ( unlink(filename) < 0 && errno != ENOENT ) {
+            Log(LOG_WARNING, "Failed to remove schedule ETag file %s: %s",
+                    filename, strerror(errno));
+        }
+        return;
+    }
+
+    if ( (out = fopen(filename, "w")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open schedule ETag file %s: %s",
+                filename, strerror(errno));
+        return;
+    }
+
+    fprintf(out, "%s\n", etag);
+    fclose(out);
+}
+
+
+
+/*
+ * Compare two files to see if they have identical contents. Used to skip
+ * reloading the schedule when a server sends us the same schedule file again
+ * because it doesn't support conditional requests. Returns 1 if the files
+ * match, 0 if they don't or can't be compared.
+ */
+static int schedule_files_match(char *first, char *second) {
+    FILE *a, *b;
+    char bufa[4096], bufb[4096];
+    size_t lena, lenb;
+    int match = 1;
+
+    if ( (a = fopen(first, "r")) == NULL ) {
+        return 0;
+    }
+
+    if ( (b = fopen(second, "r")) == NULL ) {
+        fclose(a);
+        return 0;
+    }
+
+    do {
+        lena = fread(bufa, 1, sizeof(bufa), a);
+        lenb = fread(bufb, 1, sizeof(bufb), b);
+        if ( lena != lenb || memcmp(bufa, bufb, lena) != 0 ) {
+            match = 0;
+            break;
+        }
+    } while ( lena > 0 );
+
+    fclose(a);
+    fclose(b);
+
+    return match;
+}
+
+
+
 /*
  * Try to fetch a schedule file from a remote server if there is a fresher one
  * available, replacing any existing one that has been previously fetched.
  * Returns -1 on error, 0 if no update was needed, 1 if the file was
  * successfully fetched and updated.
  *
+ * Requests are conditional on both the ETag and the modification time of
+ * the schedule we already have (unless clobbering), so an unchanged schedule
+ * costs a single "304 Not Modified" response and never triggers a reload.
+ * The schedule is also requested compressed, if the server supports it.
+ *
  * TODO keep history of downloaded schedules? Previous 1 or 2?
  * TODO connection timeout should be short, to not delay startup?
  */
@@ -1358,11 +2189,14 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
         long code;
         long filetime;
         long cond_unmet;
-        double length;
         FILE *tmpfile;
+        struct curl_slist *headers = NULL;
         char errorbuf[CURL_ERROR_SIZE];
         char tmp_sched_file[MAX_PATH_LENGTH];
         char sched_file[MAX_PATH_LENGTH];
+        char etag_file[MAX_PATH_LENGTH];
+        char etag[MAX_SCHEDULE_ETAG_LENGTH];
+        char new_etag[MAX_SCHEDULE_ETAG_LENGTH];
 
         /*
          * TODO Can we move towards asprintf stuff rather than fixed buffers?
@@ -1376,6 +2210,12 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
                 REMOTE_SCHEDULE_FILE);
         sched_file[MAX_PATH_LENGTH-1] = '\0';
 
+        snprintf(etag_file, MAX_PATH_LENGTH-1, "%s/%s", fetch->schedule_dir,
+                REMOTE_SCHEDULE_ETAG_FILE);
+        etag_file[MAX_PATH_LENGTH-1] = '\0';
+
+        new_etag[0] = '\0';
+
         /* make sure the schedule directory exists */
         stat_result = stat(fetch->schedule_dir, &statbuf);
 
@@ -1410,6 +2250,14 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
         curl_easy_setopt(curl, CURLOPT_FILETIME, 1);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, tmpfile);
         curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, fetch_header_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, new_etag);
+        /* ask for any compression that curl supports, schedules shrink well */
+#if LIBCURL_VERSION_NUM >= 0x071506
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+#else
+        curl_easy_setopt(curl, CURLOPT_ENCODING, "");
+#endif
         /* get slightly more detailed error messages, useful with ssl */
         curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
 
@@ -1472,6 +2320,15 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
                     CURL_TIMECOND_IFMODSINCE);
             curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)statbuf.st_mtime);
             Log(LOG_DEBUG, "Local schedule Last-Modified:%d", statbuf.st_mtime);
+
+            /* and only if it doesn't match the version the server tagged */
+            if ( read_schedule_etag(etag_file, etag) == 0 ) {
+                char header[MAX_SCHEDULE_ETAG_LENGTH + 32];
+                snprintf(header, sizeof(header), "If-None-Match: %s", etag);
+                headers = curl_slist_append(headers, header);
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+                Log(LOG_DEBUG, "Local schedule ETag:%s", etag);
+            }
         }
 
         /* perform the GET */
@@ -1486,12 +2343,13 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
                     curl_easy_strerror(res));
             Log(LOG_WARNING, "%s", errorbuf);
             curl_easy_cleanup(curl);
+            curl_slist_free_all(headers);
+            unlink(tmp_sched_file);
             return -1;
         }
 
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
         curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
-        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
 #if LIBCURL_VERSION_NUM >= 0x071309
         if ( clobber == 0 ) {
             curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &cond_unmet);
@@ -1502,12 +2360,35 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
         cond_unmet = 0;
 #endif
         curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+
+        /*
+         * The content length header describes the compressed size (or is
+         * missing entirely if chunked), so look at what actually got written.
+         */
+        if ( stat(tmp_sched_file, &statbuf) < 0 ) {
+            statbuf.st_size = 0;
+        }
 
-        Log(LOG_DEBUG, "HTTP %ld Last-Modified:%d Length:%.0f",
-                code, filetime, length);
+        Log(LOG_DEBUG, "HTTP %ld Last-Modified:%d Length:%lld ETag:%s",
+                code, filetime, (long long)statbuf.st_size,
+                new_etag[0] ? new_etag : "(none)");
 
         /* if a new file was fetched then move it into position */
-        if ( code == 200 && cond_unmet == 0 && length > 0 ) {
+        if ( code == 200 && cond_unmet == 0 && statbuf.st_size > 0 ) {
+            /*
+             * Servers that ignore conditional requests will send us the
+             * same file every time, don't reload the schedule if so (unless
+             * we've been asked to clobber it anyway).
+             */
+            if ( clobber == 0 &&
+                    schedule_files_match(tmp_sched_file, sched_file) ) {
+                Log(LOG_DEBUG, "Fetched schedule file is unchanged");
+                unlink(tmp_sched_file);
+                write_schedule_etag(etag_file, new_etag);
+                return 0;
+            }
+
             Log(LOG_INFO, "New schedule file fetched from %s",
                     fetch->schedule_url);
             if ( rename(tmp_sched_file, sched_file) < 0 ) {
@@ -1516,10 +2397,33 @@ static int update_remote_schedule(fetch_schedule_item_t *fetch, int clobber) {
                         tmp_sched_file, sched_file, strerror(errno));
                 return -1;
             }
+
+            write_schedule_etag(etag_file, new_etag);
+
+            /*
+             * Use the server modification time for the local file so that
+             * the next If-Modified-Since doesn't depend on our clock.
+             */
+            if ( filetime > 0 ) {
+                struct utimbuf times;
+                times.actime = filetime;
+                times.modtime = filetime;
+                if ( utime(sched_file, &times) < 0 ) {
+                    Log(LOG_DEBUG, "Failed to set schedule file time: %s",
+                            strerror(errno));
+                }
+            }
+
             return 1;
         }
 
-        Log(LOG_DEBUG, "No new schedule file available");
+        unlink(tmp_sched_file);
+
+        if ( code == 304 || cond_unmet ) {
+            Log(LOG_DEBUG, "Remote schedule file not modified");
+        } else {
+            Log(LOG_DEBUG, "No new schedule file available");
+        }
         return 0;
     }
 
@@ -1717,4 +2621,8 @@ struct timeval amp_test_get_next_schedule_time(struct timeval *time_pass,
     return get_next_schedule_time_internal(time_pass, period, start, end, frequency,
             run, abstime);
 }
+int amp_test_update_remote_schedule(fetch_schedule_item_t *fetch,
+        int clobber) {
+    return update_remote_schedule(fetch, clobber);
+}
 #endif
@@ -47,6 +47,7 @@
 
 #include "tests.h"
 #include "ampresolv.h"
+#include "timerwheel.h"
 
 /* debug schedule output file location */
 #define DEBUG_SCHEDULE_DUMP_FILE "/tmp/amplet2.schedule.dump"
@@ -60,7 +61,9 @@
 #define SCHEDULE_DIR AMP_CONFIG_DIR "/schedules"
 #define REMOTE_SCHEDULE_FILE "/fetched.sched"
 #define TMP_REMOTE_SCHEDULE_FILE "/.fetched.sched.tmp"
-#define SCHEDULE_FETCH_FREQUENCY 3600
+#define REMOTE_SCHEDULE_ETAG_FILE "/.fetched.sched.etag"
+#define MAX_SCHEDULE_ETAG_LENGTH 256
+#define SCHEDULE_FETCH_FREQUENCY 600
 #define SCHEDULE_FETCH_TIMEOUT 30
 #define MAX_TEST_ARGS 128
 #define MAX_ARGUMENT_LENGTH 1024
@@ -102,6 +105,8 @@ typedef enum schedule_period {
 } schedule_period_t;
 
 
+struct saved_schedule;
+
 /*
  * Test meta information - interfaces, timing, addresses etc to use.
  */
@@ -132,6 +137,9 @@ typedef struct test_schedule_item {
     resolve_dest_t *resolve;	    /* list of destination names to resolve */
     amp_test_meta_t *meta;          /* which interface/addresses to use */
     char **params;		    /* test parameters in execv format */
+    struct timeval offset;          /* start this long after abstime */
+    int64_t start_delay;            /* us the current run started late */
+    int slot;                       /* admission slot of the current run */
     /* TODO chaining? */
 
 } test_schedule_item_t;
@@ -164,23 +172,36 @@ typedef enum {
 typedef struct schedule_item {
     event_type_t type;          /* type of schedule item (test, fetch) */
     struct event_base *base;    /* pointer to main event handler */
-    struct event *event;
+    struct event *event;        /* libevent timer for schedule fetches */
+    struct wheel_timer timer;   /* timer wheel entry for scheduled tests */
     union {
         test_schedule_item_t *test;
         fetch_schedule_item_t *fetch;
     } data;                     /* schedule item data based on type */
 } schedule_item_t;
 
+typedef int (*schedule_foreach_cb)(schedule_item_t *item, void *arg);
+
 
 char **parse_param_string(char *param_string);
 char **populate_target_lists(test_schedule_item_t *test, char **targets);
 void dump_schedule(struct event_base *base, FILE *out);
 void clear_test_schedule(struct event_base *base, int all);
+int foreach_scheduled_test(struct event_base *base, schedule_foreach_cb fn,
+        void *arg);
+struct saved_schedule *detach_test_schedule(struct event_base *base);
+int restore_test_schedule(struct event_base *base,
+        struct saved_schedule *saved);
 void read_schedule_dir(struct event_base *base, char *directory,
         amp_test_meta_t *meta);
 struct timeval get_next_schedule_time(struct event_base *base,
         schedule_period_t period, uint64_t start, uint64_t end,
         uint64_t frequency, int run, struct timeval *abstime);
+struct timeval get_next_schedule_time_at(struct timeval *now,
+        schedule_period_t period, uint64_t start, uint64_t end,
+        uint64_t frequency, int run, struct timeval *abstime);
+void set_schedule_jitter(int jitter);
+void set_schedule_cache(int enabled);
 void signal_fetch_callback(evutil_socket_t evsock, short flags, void * evdata);
 int enable_remote_schedule_fetch(struct event_base *base,
         fetch_schedule_item_t *fetch);
@@ -191,6 +212,8 @@ time_t amp_test_get_period_start(char repeat, time_t *now);
 struct timeval amp_test_get_next_schedule_time(struct timeval *time_pass,
         schedule_period_t period, uint64_t start, uint64_t end,
         uint64_t frequency, int run, struct timeval *abstime);
+int amp_test_update_remote_schedule(fetch_schedule_item_t *fetch,
+        int clobber);
 #endif
 
 #endif
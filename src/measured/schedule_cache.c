@@ -0,0 +1,508 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Keeps a compiled copy of the schedule files so that they don't all need to
+ * be parsed again every time measured starts or reloads its schedule. Each
+ * schedule file is compiled to a list of fixed size test records followed by
+ * their strings, with all the values checked and defaults filled in. The
+ * cache holds the compiled tests for every file in the directory along with
+ * a hash of the contents they were compiled from, so a file is only parsed
+ * again when it changes. Loading the cache is a single read, a checksum and
+ * some bounds checking, after which the tests are used in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "schedule_cache.h"
+#include "debug.h"
+
+
+/* round up to keep everything in the cache 8 byte aligned */
+#define CACHE_ALIGN(x) (((x) + 7) & ~((uint64_t)7))
+
+
+
+/*
+ * Hash the contents of a schedule file, to tell if it has changed since the
+ * cached copy was compiled.
+ */
+void hash_schedule_contents(char *contents, size_t length, uint8_t *hash) {
+    assert(contents || length == 0);
+    assert(hash);
+
+    if ( EVP_Digest(contents, length, hash, NULL, EVP_sha256(), NULL) != 1 ) {
+        /* an empty hash won't match anything that has been cached */
+        memset(hash, 0, SCHEDULE_CACHE_HASH_LENGTH);
+    }
+}
+
+
+
+/*
+ * Make sure that a block of compiled tests is well formed: every test is
+ * the right size and contains all of its strings, and the tests exactly
+ * fill the block.
+ */
+static int check_compiled_tests(char *data, uint64_t length, uint32_t count) {
+    struct schedule_cache_test *test;
+    uint64_t offset = 0;
+    uint32_t i, j;
+    char *p, *end;
+
+    for ( i = 0; i < count; i++ ) {
+        if ( length - offset < sizeof(struct schedule_cache_test) ) {
+            return -1;
+        }
+
+        test = (struct schedule_cache_test*)(data + offset);
+
+        if ( test->length < sizeof(struct schedule_cache_test) ||
+                test->length % 8 != 0 || test->length > length - offset ||
+                test->period < SCHEDULE_PERIOD_HOURLY ||
+                test->period > SCHEDULE_PERIOD_WEEKLY ) {
+            return -1;
+        }
+
+        /* test name, then all the parameters, then all the targets */
+        p = (char*)(test + 1);
+        end = data + offset + test->length;
+        for ( j = 0; j < 1 + test->param_count + test->target_count; j++ ) {
+            if ( p >= end || (p = memchr(p, '\0', end - p)) == NULL ) {
+                return -1;
+            }
+            p++;
+        }
+
+        offset += test->length;
+    }
+
+    return offset == length ? 0 : -1;
+}
+
+
+
+/*
+ * Read a cache file into memory. Returns NULL if there is no cache or it
+ * isn't valid, in which case all the schedule files will be compiled again.
+ */
+struct schedule_cache *load_schedule_cache(char *path) {
+    struct schedule_cache *cache;
+    struct schedule_cache_header *header;
+    struct schedule_cache_file *file;
+    struct stat statbuf;
+    uint8_t checksum[SCHEDULE_CACHE_HASH_LENGTH];
+    char *data;
+    FILE *in;
+    uint32_t i;
+
+    assert(path);
+
+    if ( (in = fopen(path, "r")) == NULL ) {
+        if ( errno != ENOENT ) {
+            Log(LOG_WARNING, "Failed to open schedule cache %s: %s", path,
+                    strerror(errno));
+        }
+        return NULL;
+    }
+
+    if ( fstat(fileno(in), &statbuf) < 0 ||
+            (size_t)statbuf.st_size < sizeof(struct schedule_cache_header) ) {
+        Log(LOG_WARNING, "Ignoring invalid schedule cache %s", path);
+        fclose(in);
+        return NULL;
+    }
+
+    data = malloc(statbuf.st_size);
+
+    if ( fread(data, statbuf.st_size, 1, in) != 1 ) {
+        Log(LOG_WARNING, "Failed to read schedule cache %s", path);
+        free(data);
+        fclose(in);
+        return NULL;
+    }
+
+    fclose(in);
+
+    header = (struct schedule_cache_header*)data;
+    hash_schedule_contents(data + sizeof(*header),
+            statbuf.st_size - sizeof(*header), checksum);
+
+    /* the magic number also catches files written with another byte order */
+    if ( header->magic != SCHEDULE_CACHE_MAGIC ||
+            header->version != SCHEDULE_CACHE_VERSION ||
+            memcmp(header->checksum, checksum, sizeof(checksum)) != 0 ||
+            header->file_count > (statbuf.st_size - sizeof(*header)) /
+            sizeof(struct schedule_cache_file) ) {
+        goto invalid;
+    }
+
+    /* check everything the file table points at is inside the file */
+    for ( i = 0; i < header->file_count; i++ ) {
+        file = ((struct schedule_cache_file*)(header + 1)) + i;
+
+        if ( file->name_offset >= (uint64_t)statbuf.st_size ||
+                file->name_length >= statbuf.st_size - file->name_offset ||
+                data[file->name_offset + file->name_length] != '\0' ||
+                file->offset % 8 != 0 ||
+                file->offset > (uint64_t)statbuf.st_size ||
+                file->length > statbuf.st_size - file->offset ||
+                check_compiled_tests(data + file->offset, file->length,
+                    file->test_count) < 0 ) {
+            goto invalid;
+        }
+    }
+
+    cache = calloc(1, sizeof(struct schedule_cache));
+    cache->data = data;
+    cache->length = statbuf.st_size;
+    cache->header = header;
+    cache->files = (struct schedule_cache_file*)(header + 1);
+
+    Log(LOG_DEBUG, "Loaded %u compiled schedule files from %s",
+            header->file_count, path);
+
+    return cache;
+
+invalid:
+    Log(LOG_WARNING, "Ignoring invalid schedule cache %s", path);
+    free(data);
+    return NULL;
+}
+
+
+
+void free_schedule_cache(struct schedule_cache *cache) {
+    if ( cache == NULL ) {
+        return;
+    }
+
+    free(cache->data);
+    free(cache);
+}
+
+
+
+/*
+ * Look for compiled tests matching the name and hash of the schedule file.
+ * If they are found then the schedule will point at them in the cache,
+ * which needs to stay loaded for as long as the schedule is used.
+ */
+int find_cached_schedule(struct schedule_cache *cache,
+        struct compiled_schedule *schedule) {
+    struct schedule_cache_file *file;
+    uint32_t i;
+
+    assert(schedule);
+    assert(schedule->name);
+
+    if ( cache == NULL ) {
+        return 0;
+    }
+
+    for ( i = 0; i < cache->header->file_count; i++ ) {
+        file = &cache->files[i];
+
+        if ( memcmp(file->hash, schedule->hash,
+                    SCHEDULE_CACHE_HASH_LENGTH) == 0 &&
+                strcmp(cache->data + file->name_offset, schedule->name) == 0 ) {
+            schedule->data = cache->data + file->offset;
+            schedule->length = file->length;
+            schedule->size = 0;
+            schedule->test_count = file->test_count;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Add a test to a schedule that is being compiled. The values should have
+ * already been checked and should include any defaults.
+ */
+void add_compiled_test(struct compiled_schedule *schedule, char *name,
+        schedule_period_t period, int64_t start, int64_t end,
+        int64_t frequency, int lineno, char **params, char **targets) {
+    struct schedule_cache_test test;
+    size_t length = sizeof(test);
+    char *p;
+    int i;
+
+    assert(schedule);
+    assert(schedule->size > 0 || schedule->data == NULL);
+    assert(name);
+
+    memset(&test, 0, sizeof(test));
+    test.start = start;
+    test.end = end;
+    test.frequency = frequency;
+    test.period = period;
+    test.lineno = lineno;
+    test.has_params = (params != NULL);
+
+    length += strlen(name) + 1;
+    for ( i = 0; params != NULL && params[i] != NULL; i++ ) {
+        length += strlen(params[i]) + 1;
+        test.param_count++;
+    }
+    for ( i = 0; targets != NULL && targets[i] != NULL; i++ ) {
+        length += strlen(targets[i]) + 1;
+        test.target_count++;
+    }
+
+    test.length = CACHE_ALIGN(length);
+
+    while ( schedule->length + test.length > schedule->size ) {
+        schedule->size = schedule->size ? schedule->size * 2 : 4096;
+        schedule->data = realloc(schedule->data, schedule->size);
+    }
+
+    p = schedule->data + schedule->length;
+    memset(p, 0, test.length);
+    memcpy(p, &test, sizeof(test));
+    p += sizeof(test);
+
+    p = stpcpy(p, name) + 1;
+    for ( i = 0; i < test.param_count; i++ ) {
+        p = stpcpy(p, params[i]) + 1;
+    }
+    for ( i = 0; (uint32_t)i < test.target_count; i++ ) {
+        p = stpcpy(p, targets[i]) + 1;
+    }
+
+    schedule->length += test.length;
+    schedule->test_count++;
+}
+
+
+
+/*
+ * Get the test following the given one, or the first test if it is NULL.
+ * Returns NULL once there are no more tests.
+ */
+struct schedule_cache_test *next_compiled_test(
+        struct compiled_schedule *schedule, struct schedule_cache_test *test) {
+    char *next;
+
+    assert(schedule);
+
+    if ( test == NULL ) {
+        next = schedule->data;
+    } else {
+        next = ((char*)test) + test->length;
+    }
+
+    if ( next == NULL || next >= schedule->data + schedule->length ) {
+        return NULL;
+    }
+
+    return (struct schedule_cache_test*)next;
+}
+
+
+
+/*
+ * Point the parameter and target lists at the strings in a compiled test,
+ * and return the test name. Either list can be NULL if it isn't wanted,
+ * otherwise it needs room for all the strings and a terminating NULL.
+ */
+char *get_compiled_test_strings(struct schedule_cache_test *test,
+        char **params, char **targets) {
+    char *name, *p;
+    uint32_t i;
+
+    assert(test);
+
+    name = (char*)(test + 1);
+    p = name + strlen(name) + 1;
+
+    for ( i = 0; i < test->param_count; i++ ) {
+        if ( params ) {
+            params[i] = p;
+        }
+        p += strlen(p) + 1;
+    }
+
+    for ( i = 0; i < test->target_count; i++ ) {
+        if ( targets ) {
+            targets[i] = p;
+        }
+        p += strlen(p) + 1;
+    }
+
+    if ( params ) {
+        params[test->param_count] = NULL;
+    }
+
+    if ( targets ) {
+        targets[test->target_count] = NULL;
+    }
+
+    return name;
+}
+
+
+
+void free_compiled_schedule(struct compiled_schedule *schedule) {
+    if ( schedule == NULL ) {
+        return;
+    }
+
+    /* data that came from the cache is freed along with the cache */
+    if ( schedule->size > 0 ) {
+        free(schedule->data);
+    }
+
+    free(schedule->name);
+}
+
+
+
+/*
+ * Write a new cache containing the compiled tests for all the given
+ * schedule files. The new file is written alongside the old one and renamed
+ * over it, so a partially written cache is never seen.
+ */
+int write_schedule_cache(char *path, struct compiled_schedule *schedules,
+        unsigned int count) {
+    struct schedule_cache_header *header;
+    struct schedule_cache_file *files;
+    uint64_t offset, length;
+    unsigned int i;
+    char *data, *tmp;
+    FILE *out;
+    int fd;
+
+    assert(path);
+    assert(schedules || count == 0);
+
+    /* work out how big it will be: each file has its name, then the tests */
+    length = sizeof(struct schedule_cache_header) +
+        (count * sizeof(struct schedule_cache_file));
+    for ( i = 0; i < count; i++ ) {
+        length = CACHE_ALIGN(length + strlen(schedules[i].name) + 1);
+        length += schedules[i].length;
+    }
+
+    /* build the whole thing in memory so the checksum can be calculated */
+    data = calloc(1, length);
+    header = (struct schedule_cache_header*)data;
+    header->magic = SCHEDULE_CACHE_MAGIC;
+    header->version = SCHEDULE_CACHE_VERSION;
+    header->file_count = count;
+    files = (struct schedule_cache_file*)(header + 1);
+    offset = sizeof(struct schedule_cache_header) +
+        (count * sizeof(struct schedule_cache_file));
+
+    for ( i = 0; i < count; i++ ) {
+        memcpy(files[i].hash, schedules[i].hash, SCHEDULE_CACHE_HASH_LENGTH);
+        files[i].name_offset = offset;
+        files[i].name_length = strlen(schedules[i].name);
+        strcpy(data + offset, schedules[i].name);
+        offset = CACHE_ALIGN(offset + files[i].name_length + 1);
+        files[i].offset = offset;
+        files[i].length = schedules[i].length;
+        files[i].test_count = schedules[i].test_count;
+        if ( schedules[i].length > 0 ) {
+            memcpy(data + offset, schedules[i].data, schedules[i].length);
+        }
+        offset += schedules[i].length;
+    }
+
+    assert(offset == length);
+
+    hash_schedule_contents(data + sizeof(struct schedule_cache_header),
+            length - sizeof(struct schedule_cache_header), header->checksum);
+
+    if ( asprintf(&tmp, "%s.tmp", path) < 0 ) {
+        Log(LOG_WARNING, "Failed to build temporary schedule cache path");
+        free(data);
+        return -1;
+    }
+
+    if ( (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0 ||
+            (out = fdopen(fd, "w")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open schedule cache %s: %s", tmp,
+                strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        free(data);
+        free(tmp);
+        return -1;
+    }
+
+    if ( fwrite(data, length, 1, out) != 1 || fflush(out) != 0 ||
+            fsync(fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to write schedule cache %s: %s", tmp,
+                strerror(errno));
+        fclose(out);
+        unlink(tmp);
+        free(data);
+        free(tmp);
+        return -1;
+    }
+
+    fclose(out);
+    free(data);
+
+    if ( rename(tmp, path) < 0 ) {
+        Log(LOG_WARNING, "Failed to rename schedule cache %s to %s: %s", tmp,
+                path, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    Log(LOG_DEBUG, "Wrote %u compiled schedule files to %s", count, path);
+
+    free(tmp);
+
+    return 0;
+}
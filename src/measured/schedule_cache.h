@@ -0,0 +1,144 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_SCHEDULE_CACHE_H
+#define _MEASURED_SCHEDULE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "schedule.h"
+
+/* compiled copy of the schedule files, kept in the schedule directory */
+#define SCHEDULE_CACHE_FILE "/.schedule.cache"
+
+/* identifies a file as an amplet2 compiled schedule cache */
+#define SCHEDULE_CACHE_MAGIC 0x414d5053
+#define SCHEDULE_CACHE_VERSION 1
+
+/* schedule files are identified by the SHA-256 hash of their contents */
+#define SCHEDULE_CACHE_HASH_LENGTH 32
+
+/*
+ * Header at the start of the cache file. It is followed by a table with an
+ * entry for each schedule file, then the names and compiled tests of all the
+ * files. Everything is in host byte order, offsets are from the start of the
+ * file and are 8 byte aligned, so the tests can be used in place. The
+ * checksum covers everything after the header.
+ */
+struct schedule_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t file_count;
+    uint32_t unused;
+    uint8_t checksum[SCHEDULE_CACHE_HASH_LENGTH];
+};
+
+/*
+ * The compiled tests from a single schedule file, and the hash of the file
+ * contents they were compiled from.
+ */
+struct schedule_cache_file {
+    uint8_t hash[SCHEDULE_CACHE_HASH_LENGTH];
+    uint64_t name_offset;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t name_length;
+    uint32_t test_count;
+};
+
+/*
+ * A single test from a schedule file, with all the values checked and the
+ * defaults filled in. It is followed by the NUL terminated test name, then
+ * the parameters and then the targets, padded to the next 8 byte boundary.
+ */
+struct schedule_cache_test {
+    int64_t start;
+    int64_t end;
+    int64_t frequency;
+    uint32_t length;
+    int32_t period;
+    int32_t lineno;
+    uint32_t target_count;
+    uint16_t param_count;
+    uint8_t has_params;
+    uint8_t unused[5];
+};
+
+/*
+ * The compiled tests from one schedule file. They are either built from the
+ * schedule file itself or point into a loaded cache.
+ */
+struct compiled_schedule {
+    char *name;
+    uint8_t hash[SCHEDULE_CACHE_HASH_LENGTH];
+    char *data;
+    size_t length;
+    size_t size;            /* 0 if the data belongs to a loaded cache */
+    uint32_t test_count;
+};
+
+/*
+ * A cache file that has been read into memory.
+ */
+struct schedule_cache {
+    char *data;
+    size_t length;
+    struct schedule_cache_header *header;
+    struct schedule_cache_file *files;
+};
+
+void hash_schedule_contents(char *contents, size_t length, uint8_t *hash);
+struct schedule_cache *load_schedule_cache(char *path);
+void free_schedule_cache(struct schedule_cache *cache);
+int find_cached_schedule(struct schedule_cache *cache,
+        struct compiled_schedule *schedule);
+void add_compiled_test(struct compiled_schedule *schedule, char *name,
+        schedule_period_t period, int64_t start, int64_t end,
+        int64_t frequency, int lineno, char **params, char **targets);
+struct schedule_cache_test *next_compiled_test(
+        struct compiled_schedule *schedule, struct schedule_cache_test *test);
+char *get_compiled_test_strings(struct schedule_cache_test *test,
+        char **params, char **targets);
+void free_compiled_schedule(struct compiled_schedule *schedule);
+int write_schedule_cache(char *path, struct compiled_schedule *schedules,
+        unsigned int count);
+
+#endif
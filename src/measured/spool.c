@@ -0,0 +1,578 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Durable on-disk storage for test results that can't currently be sent to
+ * the broker. Results are appended to a single file as length prefixed
+ * SpoolRecord protocol buffers and replayed in order once the broker is
+ * available again. The header at the front of the file records how far
+ * through the file replay has been confirmed, so nothing is lost (though
+ * a few results might be sent twice) if measured restarts part way through.
+ *
+ * The reporter process owns the spool, but test processes that can't reach
+ * either the reporter or the broker may also append to it, so all changes
+ * to the size of the file are made while holding an exclusive flock().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "spool.h"
+#include "debug.h"
+#include "measured.pb-c.h"
+
+
+
+/*
+ * Write the whole buffer at the given offset, retrying short writes.
+ */
+static int write_all(int fd, void *data, size_t len, off_t offset) {
+    char *ptr = data;
+    ssize_t bytes;
+
+    while ( len > 0 ) {
+        if ( (bytes = pwrite(fd, ptr, len, offset)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += bytes;
+        offset += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Read the whole buffer from the given offset. Returns -1 if the file is
+ * too short or the read fails.
+ */
+static int read_all(int fd, void *data, size_t len, off_t offset) {
+    char *ptr = data;
+    ssize_t bytes;
+
+    while ( len > 0 ) {
+        if ( (bytes = pread(fd, ptr, len, offset)) <= 0 ) {
+            if ( bytes < 0 && errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += bytes;
+        offset += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get the current size of the spool file.
+ */
+static int64_t get_spool_size(spool_t *spool) {
+    struct stat statbuf;
+
+    if ( fstat(spool->fd, &statbuf) < 0 ) {
+        return -1;
+    }
+
+    return statbuf.st_size;
+}
+
+
+
+/*
+ * Write the header containing the confirmed offset to the spool file.
+ */
+static int write_spool_header(spool_t *spool) {
+    struct spool_header header;
+
+    header.magic = SPOOL_MAGIC;
+    header.version = SPOOL_VERSION;
+    header.done = spool->done;
+
+    return write_all(spool->fd, &header, sizeof(header), 0);
+}
+
+
+
+/*
+ * Walk the records that haven't been replayed yet, making sure that they are
+ * all complete. If measured died part way through writing a record then
+ * the partial record is removed so that new records can follow it.
+ * Must be called while holding the lock.
+ */
+static int check_spool_records(spool_t *spool) {
+    uint64_t offset = spool->done;
+    int64_t size;
+    uint32_t len;
+
+    if ( (size = get_spool_size(spool)) < 0 ) {
+        return -1;
+    }
+
+    while ( offset + sizeof(len) <= (uint64_t)size ) {
+        if ( read_all(spool->fd, &len, sizeof(len), offset) < 0 ) {
+            return -1;
+        }
+
+        len = ntohl(len);
+
+        if ( len > MAX_SPOOL_RECORD_LEN ||
+                offset + sizeof(len) + len > (uint64_t)size ) {
+            break;
+        }
+
+        offset += sizeof(len) + len;
+    }
+
+    if ( offset != (uint64_t)size ) {
+        Log(LOG_WARNING, "Removing %" PRId64 " bytes of incomplete spool data",
+                size - offset);
+        if ( ftruncate(spool->fd, offset) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Open (creating if required) the spool file at the given path.
+ */
+spool_t *open_spool(char *path, uint64_t max_size) {
+    struct spool_header header;
+    spool_t *spool;
+    int64_t size;
+
+    assert(path);
+
+    spool = calloc(1, sizeof(spool_t));
+    spool->max_size = max_size;
+    spool->last_sync = time(NULL);
+
+    if ( (spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        Log(LOG_WARNING, "Failed to open spool file %s: %s", path,
+                strerror(errno));
+        free(spool);
+        return NULL;
+    }
+
+    if ( flock(spool->fd, LOCK_EX) < 0 ) {
+        Log(LOG_WARNING, "Failed to lock spool file %s: %s", path,
+                strerror(errno));
+        goto fail;
+    }
+
+    if ( (size = get_spool_size(spool)) < 0 ) {
+        goto fail_unlock;
+    }
+
+    if ( size < (int64_t)sizeof(header) ) {
+        /* new (or empty) spool file, give it a header */
+        spool->done = sizeof(header);
+        if ( ftruncate(spool->fd, sizeof(header)) < 0 ||
+                write_spool_header(spool) < 0 ) {
+            Log(LOG_WARNING, "Failed to initialise spool file %s: %s", path,
+                    strerror(errno));
+            goto fail_unlock;
+        }
+    } else {
+        if ( read_all(spool->fd, &header, sizeof(header), 0) < 0 ||
+                header.magic != SPOOL_MAGIC ||
+                header.version != SPOOL_VERSION ||
+                header.done < sizeof(header) ||
+                header.done > (uint64_t)size ) {
+            Log(LOG_WARNING, "Invalid spool file %s, not using it", path);
+            goto fail_unlock;
+        }
+
+        spool->done = header.done;
+
+        if ( check_spool_records(spool) < 0 ) {
+            Log(LOG_WARNING, "Failed to check spool file %s: %s", path,
+                    strerror(errno));
+            goto fail_unlock;
+        }
+    }
+
+    flock(spool->fd, LOCK_UN);
+
+    spool->read = spool->done;
+
+    return spool;
+
+fail_unlock:
+    flock(spool->fd, LOCK_UN);
+fail:
+    close(spool->fd);
+    free(spool);
+    return NULL;
+}
+
+
+
+/*
+ * Flush any outstanding changes and close the spool file.
+ */
+void close_spool(spool_t *spool) {
+    if ( spool == NULL ) {
+        return;
+    }
+
+    spool_sync(spool, 1);
+    close(spool->fd);
+    free(spool);
+}
+
+
+
+/*
+ * Append a single result to the end of the spool. Returns -1 if the result
+ * could not be written, including if the spool is full.
+ */
+int spool_append(spool_t *spool, char *name, uint64_t timestamp,
+        int64_t start_delay, void *data, uint32_t len) {
+    Amplet2__Measured__SpoolRecord record = AMPLET2__MEASURED__SPOOL_RECORD__INIT;
+    uint8_t *buffer;
+    uint32_t packed;
+    uint32_t prefix;
+    int64_t size;
+    int result = -1;
+
+    assert(spool);
+    assert(name);
+
+    record.test_name = name;
+    record.has_timestamp = 1;
+    record.timestamp = timestamp;
+    if ( start_delay >= 0 ) {
+        record.has_start_delay = 1;
+        record.start_delay = start_delay;
+    }
+    record.has_result = 1;
+    record.result.data = data;
+    record.result.len = len;
+
+    packed = amplet2__measured__spool_record__get_packed_size(&record);
+
+    if ( packed > MAX_SPOOL_RECORD_LEN ) {
+        Log(LOG_WARNING, "%s result too large to spool", name);
+        return -1;
+    }
+
+    buffer = malloc(sizeof(prefix) + packed);
+    prefix = htonl(packed);
+    memcpy(buffer, &prefix, sizeof(prefix));
+    amplet2__measured__spool_record__pack(&record, buffer + sizeof(prefix));
+
+    if ( flock(spool->fd, LOCK_EX) < 0 ) {
+        free(buffer);
+        return -1;
+    }
+
+    if ( (size = get_spool_size(spool)) >= 0 ) {
+        if ( size + sizeof(prefix) + packed > spool->max_size ) {
+            Log(LOG_WARNING, "Spool is full, dropping %s result", name);
+        } else if ( write_all(spool->fd, buffer, sizeof(prefix) + packed,
+                    size) < 0 ) {
+            Log(LOG_WARNING, "Failed to write %s result to spool: %s", name,
+                    strerror(errno));
+            /* don't leave a partial record behind */
+            if ( ftruncate(spool->fd, size) < 0 ) {
+                Log(LOG_WARNING, "Failed to tidy spool: %s", strerror(errno));
+            }
+        } else {
+            result = 0;
+        }
+    }
+
+    flock(spool->fd, LOCK_UN);
+    free(buffer);
+
+    if ( result == 0 ) {
+        spool->unsynced++;
+        spool_sync(spool, 0);
+    }
+
+    return result;
+}
+
+
+
+/*
+ * Flush changes to disk. Rather than syncing every record, changes are
+ * batched up and only synced every SPOOL_FSYNC_RECORDS changes or after
+ * SPOOL_FSYNC_INTERVAL seconds, unless forced.
+ */
+int spool_sync(spool_t *spool, int force) {
+    time_t now;
+
+    assert(spool);
+
+    if ( spool->unsynced == 0 ) {
+        return 0;
+    }
+
+    now = time(NULL);
+
+    if ( !force && spool->unsynced < SPOOL_FSYNC_RECORDS &&
+            now - spool->last_sync < SPOOL_FSYNC_INTERVAL ) {
+        return 0;
+    }
+
+    if ( fdatasync(spool->fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to sync spool: %s", strerror(errno));
+        return -1;
+    }
+
+    spool->unsynced = 0;
+    spool->last_sync = now;
+
+    return 0;
+}
+
+
+
+/*
+ * Are there any records in the spool that haven't been read yet?
+ */
+int spool_has_backlog(spool_t *spool) {
+    int64_t size;
+
+    assert(spool);
+
+    if ( (size = get_spool_size(spool)) < 0 ) {
+        return 0;
+    }
+
+    return (uint64_t)size > spool->read;
+}
+
+
+
+/*
+ * Read the next record from the spool. Returns 1 if a record was read,
+ * 0 if there are no more records, or -1 if the record was bad (it will be
+ * skipped over).
+ */
+int spool_read_next(spool_t *spool, spool_record_t *record) {
+    Amplet2__Measured__SpoolRecord *msg;
+    uint8_t *buffer;
+    uint32_t len;
+    int64_t size;
+    int result = -1;
+
+    assert(spool);
+    assert(record);
+
+    memset(record, 0, sizeof(spool_record_t));
+
+    /* make sure another process isn't part way through appending */
+    if ( flock(spool->fd, LOCK_SH) < 0 ) {
+        return -1;
+    }
+
+    if ( (size = get_spool_size(spool)) < 0 ||
+            spool->read + sizeof(len) > (uint64_t)size ) {
+        flock(spool->fd, LOCK_UN);
+        return 0;
+    }
+
+    if ( read_all(spool->fd, &len, sizeof(len), spool->read) < 0 ) {
+        flock(spool->fd, LOCK_UN);
+        return 0;
+    }
+
+    len = ntohl(len);
+
+    if ( len > MAX_SPOOL_RECORD_LEN ||
+            spool->read + sizeof(len) + len > (uint64_t)size ) {
+        /* shouldn't happen, records are checked on open and written whole */
+        Log(LOG_WARNING, "Corrupt spool record at offset %" PRIu64
+                ", skipping remaining records", spool->read);
+        spool->read = size;
+        flock(spool->fd, LOCK_UN);
+        return -1;
+    }
+
+    buffer = malloc(len);
+
+    if ( read_all(spool->fd, buffer, len, spool->read + sizeof(len)) < 0 ) {
+        flock(spool->fd, LOCK_UN);
+        free(buffer);
+        return 0;
+    }
+
+    flock(spool->fd, LOCK_UN);
+
+    spool->read += sizeof(len) + len;
+    record->end = spool->read;
+
+    msg = amplet2__measured__spool_record__unpack(NULL, len, buffer);
+
+    if ( msg && msg->test_name && msg->has_result ) {
+        record->name = strdup(msg->test_name);
+        record->timestamp = msg->timestamp;
+        record->start_delay = msg->has_start_delay ? msg->start_delay : -1;
+        record->len = msg->result.len;
+        record->data = malloc(msg->result.len);
+        memcpy(record->data, msg->result.data, msg->result.len);
+        result = 1;
+    } else {
+        Log(LOG_WARNING, "Failed to parse spool record, skipping");
+    }
+
+    if ( msg ) {
+        amplet2__measured__spool_record__free_unpacked(msg, NULL);
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+
+
+/*
+ * Go back to reading from the first unconfirmed record, used when records
+ * that have been read couldn't be delivered.
+ */
+void spool_rewind(spool_t *spool) {
+    assert(spool);
+    spool->read = spool->done;
+}
+
+
+
+/*
+ * Record that everything up to the given offset has been delivered.
+ */
+int spool_mark_done(spool_t *spool, uint64_t offset) {
+    assert(spool);
+
+    if ( offset <= spool->done ) {
+        return 0;
+    }
+
+    spool->done = offset;
+
+    if ( spool->read < spool->done ) {
+        spool->read = spool->done;
+    }
+
+    if ( write_spool_header(spool) < 0 ) {
+        Log(LOG_WARNING, "Failed to update spool header: %s", strerror(errno));
+        return -1;
+    }
+
+    spool->unsynced++;
+
+    return spool_sync(spool, 0);
+}
+
+
+
+/*
+ * Once every record has been delivered, empty the spool so that it doesn't
+ * keep growing. The caller must make sure that nothing it has read from the
+ * spool is still waiting to be confirmed.
+ */
+int spool_compact(spool_t *spool) {
+    int64_t size;
+    int result = 0;
+
+    assert(spool);
+
+    if ( flock(spool->fd, LOCK_EX) < 0 ) {
+        return -1;
+    }
+
+    /* only empty it if nobody has appended anything new */
+    if ( (size = get_spool_size(spool)) >= 0 &&
+            (uint64_t)size == spool->done &&
+            spool->done > sizeof(struct spool_header) ) {
+        Log(LOG_DEBUG, "Spool fully replayed, truncating");
+        spool->done = sizeof(struct spool_header);
+        spool->read = spool->done;
+
+        if ( ftruncate(spool->fd, spool->done) < 0 ||
+                write_spool_header(spool) < 0 ) {
+            Log(LOG_WARNING, "Failed to truncate spool: %s", strerror(errno));
+            result = -1;
+        } else {
+            spool->unsynced++;
+            spool_sync(spool, 1);
+        }
+    }
+
+    flock(spool->fd, LOCK_UN);
+
+    return result;
+}
+
+
+
+/*
+ * Free the memory used by a record read from the spool.
+ */
+void free_spool_record(spool_record_t *record) {
+    if ( record ) {
+        free(record->name);
+        free(record->data);
+    }
+}
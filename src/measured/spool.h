@@ -0,0 +1,123 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_SPOOL_H
+#define _MEASURED_SPOOL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* default maximum size of the spool file (MB) */
+#define DEFAULT_SPOOL_MAX_SIZE 64
+
+/* default rate at which spooled results are replayed (results per second) */
+#define DEFAULT_SPOOL_REPLAY_RATE 20
+
+/* fsync the spool after this many records have been appended... */
+#define SPOOL_FSYNC_RECORDS 32
+
+/* ...or after this many seconds, whichever comes first */
+#define SPOOL_FSYNC_INTERVAL 1
+
+/* identifies a file as an amplet2 result spool */
+#define SPOOL_MAGIC 0x414d5053
+#define SPOOL_VERSION 1
+
+/* largest single record that will be read back from the spool */
+#define MAX_SPOOL_RECORD_LEN (16 * 1024 * 1024)
+
+/*
+ * Header at the start of the spool file. Records are appended after the
+ * header, each one a 32 bit length (network byte order) followed by a
+ * SpoolRecord protocol buffer. Everything before the done offset has been
+ * replayed and confirmed by the broker.
+ */
+struct spool_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t done;
+};
+
+/*
+ * Spool configuration from the client config file.
+ */
+typedef struct spool_config {
+    char *path;                 /* location of the spool file */
+    uint64_t max_size;          /* maximum size of the spool file (bytes) */
+    uint32_t replay_rate;       /* results replayed per second */
+} spool_config_t;
+
+/*
+ * An open spool file.
+ */
+typedef struct spool {
+    int fd;
+    uint64_t max_size;
+    uint64_t done;              /* offset up to which records are confirmed */
+    uint64_t read;              /* offset of the next record to replay */
+    uint32_t unsynced;          /* changes made since the last fsync */
+    time_t last_sync;           /* time of the last fsync */
+} spool_t;
+
+/*
+ * A single result read back from the spool.
+ */
+typedef struct spool_record {
+    char *name;
+    uint64_t timestamp;
+    int64_t start_delay;        /* how late the test started, -1 unknown */
+    void *data;
+    uint32_t len;
+    uint64_t end;               /* offset just past this record in the spool */
+} spool_record_t;
+
+spool_t *open_spool(char *path, uint64_t max_size);
+void close_spool(spool_t *spool);
+int spool_append(spool_t *spool, char *name, uint64_t timestamp,
+        int64_t start_delay, void *data, uint32_t len);
+int spool_sync(spool_t *spool, int force);
+int spool_has_backlog(spool_t *spool);
+int spool_read_next(spool_t *spool, spool_record_t *record);
+void spool_rewind(spool_t *spool);
+int spool_mark_done(spool_t *spool, uint64_t offset);
+int spool_compact(spool_t *spool);
+void free_spool_record(spool_record_t *record);
+
+#endif
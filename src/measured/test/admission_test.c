@@ -0,0 +1,212 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "admission.h"
+
+
+
+static volatile sig_atomic_t finished = 0;
+
+static void finish(__attribute__((unused))int signum) {
+    finished = 1;
+}
+
+
+
+/*
+ * Fork a process that claims the given slot as if it were running a test,
+ * then waits to be told to exit normally (SIGUSR1) or to be killed.
+ */
+static pid_t start_fake_test(int slot) {
+    sigset_t mask, old;
+    int started[2];
+    char byte;
+    pid_t pid;
+
+    /* block the signal until the child is waiting for it */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    assert(pipe(started) == 0);
+
+    if ( (pid = fork()) == 0 ) {
+        signal(SIGUSR1, finish);
+        admission_started(slot);
+        assert(write(started[1], "", 1) == 1);
+        while ( !finished ) {
+            sigsuspend(&old);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    assert(pid > 0);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    /* wait until the child has marked the slot as running */
+    assert(read(started[0], &byte, 1) == 1);
+    close(started[0]);
+    close(started[1]);
+
+    return pid;
+}
+
+
+
+/*
+ * Check that only the configured number of tests of each type (and in total)
+ * are admitted at once, that slots are released when tests exit (or die),
+ * and that tests waiting too long are skipped.
+ */
+int main(void) {
+    admission_config_t config;
+    admission_limit_t limits[2];
+    struct admission_stats stats;
+    test_t icmp, dns, http;
+    int slot1, slot2, slot3;
+    pid_t pid1, pid2;
+
+    memset(&icmp, 0, sizeof(icmp));
+    memset(&dns, 0, sizeof(dns));
+    memset(&http, 0, sizeof(http));
+    icmp.id = AMP_TEST_ICMP;
+    icmp.name = "icmp";
+    dns.id = AMP_TEST_DNS;
+    dns.name = "dns";
+    http.id = AMP_TEST_HTTP;
+    http.name = "http";
+
+    /* two of each test by default, only one dns, unlimited http */
+    memset(limits, 0, sizeof(limits));
+    limits[0].name = "dns";
+    limits[0].max_running = 1;
+    limits[0].next = &limits[1];
+    limits[1].name = "http";
+    limits[1].max_running = 0;
+    memset(&config, 0, sizeof(config));
+    config.max_running = 2;
+    config.max_delay = 1000;
+    config.limits = limits;
+
+    assert(start_admission_control(&config) == 0);
+
+    slot1 = admission_acquire(&icmp, 0);
+    slot2 = admission_acquire(&icmp, 0);
+    assert(slot1 > 0 && slot2 > 0 && slot1 != slot2);
+
+    /* a third icmp test must wait, but other types are unaffected */
+    assert(admission_acquire(&icmp, 100) == ADMISSION_FULL);
+    assert(admission_acquire(&http, 0) == ADMISSION_UNLIMITED);
+
+    /* a slot that was claimed but failed to start can be given back */
+    admission_cancel(slot2);
+    slot2 = admission_acquire(&icmp, 0);
+    assert(slot2 > 0);
+
+    /* start both tests, a waiting test is skipped once past the max delay */
+    pid1 = start_fake_test(slot1);
+    pid2 = start_fake_test(slot2);
+    assert(admission_acquire(&icmp, 500 * 1000) == ADMISSION_FULL);
+    assert(admission_acquire(&icmp, 1500 * 1000) == ADMISSION_SKIP);
+
+    /* a test exiting normally releases its slot */
+    kill(pid1, SIGUSR1);
+    assert(waitpid(pid1, NULL, 0) == pid1);
+    slot1 = admission_acquire(&icmp, 0);
+    assert(slot1 > 0);
+    assert(admission_acquire(&icmp, 0) == ADMISSION_FULL);
+
+    /* a test that is killed has its slot reclaimed */
+    kill(pid2, SIGKILL);
+    assert(waitpid(pid2, NULL, 0) == pid2);
+    assert(admission_acquire(&icmp, 0) > 0);
+
+    /* per test type limits override the default */
+    assert(admission_acquire(&dns, 0) > 0);
+    assert(admission_acquire(&dns, 0) == ADMISSION_FULL);
+
+    admission_get_stats(&stats);
+    assert(stats.skipped == 1);
+    assert(stats.reclaimed == 1);
+    assert(stats.deferred == 4);
+    assert(stats.max_delay == 0);
+
+    stop_admission_control();
+
+    /* the total limit applies to every type, even those without a limit */
+    memset(&config, 0, sizeof(config));
+    config.max_total = 3;
+    config.max_delay = 1000;
+    assert(start_admission_control(&config) == 0);
+
+    slot1 = admission_acquire(&icmp, 0);
+    slot2 = admission_acquire(&dns, 0);
+    slot3 = admission_acquire(&http, 0);
+    assert(slot1 > 0 && slot2 > 0 && slot3 > 0);
+    assert(admission_acquire(&icmp, 0) == ADMISSION_FULL);
+    assert(admission_acquire(&http, 0) == ADMISSION_FULL);
+
+    /* cancelling a running test's slot has no effect, it exiting does */
+    admission_cancel(slot3);
+    slot3 = admission_acquire(&http, 0);
+    assert(slot3 > 0);
+    pid1 = start_fake_test(slot3);
+    admission_cancel(slot3);
+    assert(admission_acquire(&http, 0) == ADMISSION_FULL);
+    kill(pid1, SIGUSR1);
+    assert(waitpid(pid1, NULL, 0) == pid1);
+    assert(admission_acquire(&http, 0) > 0);
+
+    stop_admission_control();
+
+    /* with no limits everything is admitted straight away */
+    assert(admission_acquire(&icmp, 0) == ADMISSION_UNLIMITED);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "asn.h"
+#include "asnsock.h"
+#include "asnsnapshot.h"
+#include "iptrie.h"
+
+
+
+static struct sockaddr *make_address(struct sockaddr_in *addr, char *str) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    assert(inet_pton(AF_INET, str, &addr->sin_addr) == 1);
+    return (struct sockaddr*)addr;
+}
+
+
+
+/*
+ * Add a whois response to the cache, the same way the whois client does.
+ */
+static void add_response(struct amp_asn_info *info, char *response) {
+    struct iptrie result = { NULL, NULL, NULL };
+    char line[256];
+
+    strncpy(line, response, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    add_parsed_line(&result, line, info);
+    iptrie_clear(&result);
+}
+
+
+
+#define STALE_THREADS 8
+
+struct stale_check {
+    struct amp_asn_info *info;
+    pthread_barrier_t *barrier;
+    int refreshed;
+};
+
+
+
+/*
+ * Look up the same stale address as lots of other threads at once.
+ */
+static void *check_stale_thread(void *data) {
+    struct stale_check *check = (struct stale_check*)data;
+    struct iptrie result = { NULL, NULL, NULL };
+    struct iptrie stale = { NULL, NULL, NULL };
+    struct sockaddr_in addr;
+
+    pthread_barrier_wait(check->barrier);
+
+    assert(amp_test_check_asn_cache(check->info, &result, &stale,
+                make_address(&addr, "192.0.2.1")) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 64498);
+    check->refreshed = !iptrie_is_empty(&stale);
+
+    iptrie_clear(&result);
+    iptrie_clear(&stale);
+
+    return NULL;
+}
+
+
+
+/*
+ * Check that when many threads find the same stale entry at once (holding
+ * only a shared lock) exactly one of them is chosen to refresh it.
+ */
+static void check_concurrent_refresh(struct amp_asn_info *info) {
+    struct stale_check checks[STALE_THREADS];
+    pthread_t threads[STALE_THREADS];
+    pthread_barrier_t barrier;
+    struct sockaddr_in addr;
+    iptrie_node_t *node;
+    int refreshed = 0;
+    int i;
+
+    node = iptrie_lookup(info->trie, make_address(&addr, "192.0.2.1"));
+    assert(node);
+    node->expires = time(NULL) - 10;
+
+    pthread_barrier_init(&barrier, NULL, STALE_THREADS);
+
+    for ( i = 0; i < STALE_THREADS; i++ ) {
+        checks[i].info = info;
+        checks[i].barrier = &barrier;
+        checks[i].refreshed = 0;
+        pthread_create(&threads[i], NULL, check_stale_thread, &checks[i]);
+    }
+
+    for ( i = 0; i < STALE_THREADS; i++ ) {
+        pthread_join(threads[i], NULL);
+        refreshed += checks[i].refreshed;
+    }
+
+    pthread_barrier_destroy(&barrier);
+
+    assert(refreshed == 1);
+    assert(node->expires > time(NULL));
+}
+
+
+
+static void *read_lock_thread(void *data) {
+    struct amp_asn_info *info = (struct amp_asn_info*)data;
+
+    amp_asn_read_lock(info);
+    amp_asn_unlock(info);
+
+    return NULL;
+}
+
+
+
+/*
+ * Check that readers waiting behind a writer are counted.
+ */
+static void check_lock_stats(struct amp_asn_info *info) {
+    struct asn_lock_stats before, after;
+    pthread_t thread;
+
+    amp_asn_get_lock_stats(&before);
+
+    amp_asn_write_lock(info);
+    pthread_create(&thread, NULL, read_lock_thread, info);
+    usleep(50000);
+    amp_asn_unlock(info);
+    pthread_join(thread, NULL);
+
+    amp_asn_get_lock_stats(&after);
+
+    assert(after.writes == before.writes + 1);
+    assert(after.reads == before.reads + 1);
+    assert(after.read_waits == before.read_waits + 1);
+    assert(after.write_waits == before.write_waits);
+    assert(after.wait_ns > before.wait_ns);
+}
+
+
+
+/*
+ * Check that saving a snapshot moves everything out of the trie and into the
+ * snapshot, only taking the write lock to swap the new snapshot in.
+ */
+static void check_snapshot_save(void) {
+    struct amp_asn_info *info;
+    struct iptrie result = { NULL, NULL, NULL };
+    struct iptrie stale = { NULL, NULL, NULL };
+    struct asn_lock_stats before, after;
+    struct sockaddr_in addr;
+    char path[] = "/tmp/asncache_test.XXXXXX";
+    int fd;
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+
+    info = initialise_asn_info(path, NULL);
+    assert(*info->snapshot == NULL);
+
+    /* nothing to save yet */
+    assert(save_asn_snapshot(info) == 0);
+    assert(*info->snapshot == NULL);
+
+    add_response(info, "64496 | 192.0.2.5 | 192.0.2.0/24 | ZZ | test");
+    add_response(info, "64497 | 198.51.100.1 | 198.51.100.0/24 | ZZ | test");
+
+    amp_asn_get_lock_stats(&before);
+    assert(save_asn_snapshot(info) == 0);
+    amp_asn_get_lock_stats(&after);
+
+    assert(after.writes == before.writes + 1);
+    assert(after.reads == before.reads + 1);
+    assert(*info->snapshot != NULL);
+    assert(iptrie_is_empty(info->trie));
+
+    /* saved entries are answered from the snapshot */
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "192.0.2.1")) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 64496);
+
+    /* entries learnt later are merged with those already saved */
+    add_response(info, "64498 | 203.0.113.1 | 203.0.113.0/24 | ZZ | test");
+    assert(save_asn_snapshot(info) == 0);
+    assert(iptrie_is_empty(info->trie));
+    assert((*info->snapshot)->header->ipv4_count == 3);
+
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "198.51.100.7")) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 64497);
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "203.0.113.9")) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 64498);
+    assert(iptrie_is_empty(&stale));
+
+    iptrie_clear(&result);
+    amp_asn_info_delete(info);
+    unlink(path);
+}
+
+
+
+/*
+ * Check that stale cache entries are still used but marked for refreshing,
+ * that refreshed entries get a new expiry time, and that only entries that
+ * have been stale for a long time are removed from the cache.
+ */
+int main(void) {
+    struct amp_asn_info *info;
+    struct iptrie result = { NULL, NULL, NULL };
+    struct iptrie stale = { NULL, NULL, NULL };
+    struct sockaddr_in addr;
+    iptrie_node_t *node;
+    time_t now = time(NULL);
+
+    info = initialise_asn_info(NULL, NULL);
+    assert(*info->refresh > now);
+
+    add_response(info, "64496 | 192.0.2.5 | 192.0.2.0/24 | ZZ | test");
+    add_response(info, "64497 | 198.51.100.1 | 198.51.100.0/24 | ZZ | test");
+
+    /* fresh entries are used and don't need refreshing */
+    node = iptrie_lookup(info->trie, make_address(&addr, "192.0.2.1"));
+    assert(node);
+    assert(node->expires >= now + ASN_CACHE_TTL);
+    assert(node->expires < now + ASN_CACHE_TTL + ASN_CACHE_TTL_JITTER + 1);
+
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "192.0.2.1")) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 64496);
+    assert(iptrie_is_empty(&stale));
+
+    /* addresses that aren't cached need to be looked up */
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "203.0.113.1")) < 0);
+    assert(iptrie_is_empty(&stale));
+
+    /* stale entries are still used, but only refreshed by the first user */
+    node = iptrie_lookup(info->trie, make_address(&addr, "192.0.2.1"));
+    node->expires = now - 10;
+
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "192.0.2.9")) == 0);
+    assert(iptrie_lookup_as(&stale, (struct sockaddr*)&addr) == 0);
+    assert(node->expires > now);
+    iptrie_clear(&stale);
+
+    assert(amp_test_check_asn_cache(info, &result, &stale,
+                make_address(&addr, "192.0.2.9")) == 0);
+    assert(iptrie_is_empty(&stale));
+
+    /* a refreshed entry gets the new ASN and a new expiry time */
+    add_response(info, "64498 | 192.0.2.9 | 192.0.2.0/24 | ZZ | test");
+    node = iptrie_lookup(info->trie, make_address(&addr, "192.0.2.1"));
+    assert(node->as == 64498);
+    assert(node->expires >= now + ASN_CACHE_TTL);
+
+    /* nothing is removed until it's time to purge the cache */
+    node = iptrie_lookup(info->trie, make_address(&addr, "198.51.100.1"));
+    node->expires = now - MAX_ASN_CACHE_STALE - 10;
+    amp_test_purge_asn_cache(info);
+    assert(iptrie_lookup_as(info->trie, (struct sockaddr*)&addr) == 64497);
+
+    /* only the entry that hasn't been used for a long time is removed */
+    *info->refresh = now - 1;
+    amp_test_purge_asn_cache(info);
+    assert(*info->refresh > now);
+    assert(iptrie_lookup_as(info->trie, (struct sockaddr*)&addr) == -1);
+    node = iptrie_lookup(info->trie, make_address(&addr, "192.0.2.1"));
+    assert(node);
+    assert(node->as == 64498);
+    assert(node->expires >= now + ASN_CACHE_TTL);
+
+    check_concurrent_refresh(info);
+    check_lock_stats(info);
+    check_snapshot_save();
+
+    iptrie_clear(&result);
+    amp_asn_info_delete(info);
+
+    return 0;
+}
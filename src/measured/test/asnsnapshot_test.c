@@ -0,0 +1,177 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "asnsnapshot.h"
+#include "iptrie.h"
+
+
+
+static struct sockaddr *make_address(struct sockaddr_storage *addr,
+        char *str) {
+    memset(addr, 0, sizeof(*addr));
+
+    if ( inet_pton(AF_INET, str,
+                &((struct sockaddr_in*)addr)->sin_addr) == 1 ) {
+        addr->ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, str,
+                    &((struct sockaddr_in6*)addr)->sin6_addr) == 1);
+        addr->ss_family = AF_INET6;
+    }
+
+    return (struct sockaddr*)addr;
+}
+
+
+
+static void add(struct iptrie *trie, char *str, uint8_t prefix, int64_t as,
+        time_t expires) {
+    struct sockaddr_storage addr;
+    iptrie_node_t *node;
+
+    iptrie_add(trie, make_address(&addr, str), prefix, as);
+    node = iptrie_lookup(trie, (struct sockaddr*)&addr);
+    assert(node);
+    node->expires = expires;
+}
+
+
+
+static int64_t lookup(struct asn_snapshot *snapshot, char *str) {
+    struct sockaddr_storage addr;
+    struct asn_snapshot_entry *entry;
+
+    entry = asn_snapshot_lookup(snapshot, make_address(&addr, str));
+    return entry ? (int64_t)entry->asn : -1;
+}
+
+
+
+/*
+ * Check that the cache can be saved and mapped again, that new entries
+ * replace old ones when the snapshot is rewritten, and that broken files
+ * are ignored.
+ */
+int main(void) {
+    struct iptrie trie = { NULL, NULL, NULL };
+    struct asn_snapshot *snapshot, *updated;
+    char path[] = "/tmp/asnsnapshot_test.XXXXXX";
+    time_t now = time(NULL);
+    FILE *out;
+    int fd;
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+
+    /* a missing snapshot is fine, the cache just starts empty */
+    assert(open_asn_snapshot(path) == NULL);
+    assert(lookup(NULL, "192.0.2.1") == -1);
+
+    add(&trie, "192.0.2.0", 24, 64496, now + 100);
+    add(&trie, "198.51.100.0", 24, 64497, now + 100);
+    add(&trie, "203.0.113.0", 24, 64498, now - 1000);
+    add(&trie, "2001:db8:1::", 64, 64499, now + 100);
+    add(&trie, "2001:db8:2::", 64, 64500, now + 100);
+
+    /* entries that expired before the oldest time aren't saved */
+    assert(write_asn_snapshot(path, &trie, NULL, now - 500) == 0);
+    iptrie_clear(&trie);
+
+    assert((snapshot = open_asn_snapshot(path)) != NULL);
+    assert(snapshot->header->ipv4_count == 2);
+    assert(snapshot->header->ipv6_count == 2);
+
+    assert(lookup(snapshot, "192.0.2.77") == 64496);
+    assert(lookup(snapshot, "198.51.100.255") == 64497);
+    assert(lookup(snapshot, "203.0.113.1") == -1);
+    assert(lookup(snapshot, "192.0.1.255") == -1);
+    assert(lookup(snapshot, "192.0.3.0") == -1);
+    assert(lookup(snapshot, "1.1.1.1") == -1);
+    assert(lookup(snapshot, "2001:db8:1::1") == 64499);
+    assert(lookup(snapshot, "2001:db8:2:0:ffff::1") == 64500);
+    assert(lookup(snapshot, "2001:db8:3::1") == -1);
+    assert(lookup(snapshot, "::1") == -1);
+
+    /* new entries are merged with the old snapshot, replacing old values */
+    add(&trie, "192.0.2.0", 24, 64510, now + 200);
+    add(&trie, "10.0.0.0", 24, 64511, now + 200);
+    assert(write_asn_snapshot(path, &trie, snapshot, now - 500) == 0);
+    iptrie_clear(&trie);
+
+    /* the old mapping is still usable after the file is replaced */
+    assert(lookup(snapshot, "192.0.2.1") == 64496);
+
+    assert((updated = open_asn_snapshot(path)) != NULL);
+    close_asn_snapshot(snapshot);
+    assert(updated->header->ipv4_count == 3);
+    assert(updated->header->ipv6_count == 2);
+    assert(lookup(updated, "192.0.2.1") == 64510);
+    assert(lookup(updated, "10.0.0.1") == 64511);
+    assert(lookup(updated, "198.51.100.1") == 64497);
+    assert(asn_snapshot_lookup(updated, make_address(
+                    &(struct sockaddr_storage){0}, "10.0.0.1"))->expires ==
+            now + 200);
+    close_asn_snapshot(updated);
+
+    /* a truncated file is ignored */
+    assert(truncate(path, sizeof(struct asn_snapshot_header) + 10) == 0);
+    assert(open_asn_snapshot(path) == NULL);
+
+    /* as is a file that isn't a snapshot */
+    assert((out = fopen(path, "w")) != NULL);
+    fprintf(out, "this is not an ASN snapshot, but it is long enough\n");
+    fclose(out);
+    assert(open_asn_snapshot(path) == NULL);
+
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "asn.h"
+#include "asnsock.h"
+#include "asntable.h"
+#include "iptrie.h"
+
+
+
+static struct sockaddr *make_address(struct sockaddr_storage *addr,
+        char *str) {
+    memset(addr, 0, sizeof(*addr));
+
+    if ( inet_pton(AF_INET, str,
+                &((struct sockaddr_in*)addr)->sin_addr) == 1 ) {
+        addr->ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, str,
+                    &((struct sockaddr_in6*)addr)->sin6_addr) == 1);
+        addr->ss_family = AF_INET6;
+    }
+
+    return (struct sockaddr*)addr;
+}
+
+
+
+/*
+ * Check that a single line parses to the expected prefix and ASN.
+ */
+static void check_line(char *line, int expected, uint8_t prefix,
+        int64_t asn) {
+    struct sockaddr_storage addr;
+    char buffer[MAX_ASN_TABLE_LINE];
+    uint8_t found_prefix = 0;
+    int64_t found_asn = 0;
+
+    strncpy(buffer, line, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    assert(amp_test_parse_asn_table_line(buffer, &addr, &found_prefix,
+                &found_asn) == expected);
+
+    if ( expected == 1 ) {
+        assert(found_prefix == prefix);
+        assert(found_asn == asn);
+    }
+}
+
+
+
+/*
+ * Look up an address through the ASN resolver and return the ASN and
+ * prefix that would be sent back to the test.
+ */
+static int64_t lookup(struct amp_asn_info *info, char *str, uint8_t *prefix) {
+    struct iptrie result = { NULL, NULL, NULL };
+    struct sockaddr_storage addr;
+    iptrie_node_t *node;
+    int64_t asn;
+
+    make_address(&addr, str);
+
+    if ( amp_test_check_asn_table(info, &result,
+                (struct sockaddr*)&addr) < 0 ) {
+        return -1;
+    }
+
+    node = iptrie_lookup(&result, (struct sockaddr*)&addr);
+    assert(node);
+    asn = node->as;
+    *prefix = node->prefix;
+    iptrie_clear(&result);
+
+    return asn;
+}
+
+
+
+/*
+ * Check that prefix to ASN tables in both supported formats can be loaded,
+ * that the most specific prefix is used, and that addresses missing from
+ * the table are reported as AS 0 rather than falling back to whois.
+ */
+int main(void) {
+    struct amp_asn_info *info;
+    char path[] = "/tmp/asntable_test.XXXXXX";
+    uint8_t prefix;
+    FILE *out;
+    int fd;
+
+    /* both formats, with and without extra origins */
+    check_line("192.0.2.0\t24\t64496\n", 1, 24, 64496);
+    check_line("192.0.2.0/24,64496\n", 1, 24, 64496);
+    check_line("192.0.2.0/24 AS64496\n", 1, 24, 64496);
+    check_line("192.0.2.0\t24\t64496_64497\n", 1, 24, 64496);
+    check_line("192.0.2.0/24,64496,64497\n", 1, 24, 64496);
+    check_line("2001:db8::\t32\t64500\n", 1, 32, 64500);
+    check_line("2001:db8::/48,4200000000\r\n", 1, 48, 4200000000LL);
+
+    /* comments and empty lines are skipped */
+    check_line("\n", 0, 0, 0);
+    check_line("   \t\n", 0, 0, 0);
+    check_line("# prefix asn\n", 0, 0, 0);
+
+    /* broken lines are rejected */
+    check_line("192.0.2.0\n", -1, 0, 0);
+    check_line("192.0.2.0/24\n", -1, 0, 0);
+    check_line("192.0.2.0/33,64496\n", -1, 0, 0);
+    check_line("2001:db8::/129,64496\n", -1, 0, 0);
+    check_line("192.0.2/24,64496\n", -1, 0, 0);
+    check_line("192.0.2.0/24,AS\n", -1, 0, 0);
+    check_line("192.0.2.0/24,645x\n", -1, 0, 0);
+    check_line("192.0.2.0/24,{64496}\n", -1, 0, 0);
+
+    /* a missing or empty table isn't loaded */
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+    assert(load_asn_table(path) == NULL);
+    unlink(path);
+    assert(load_asn_table(path) == NULL);
+
+    assert((out = fopen(path, "w")) != NULL);
+    fprintf(out, "# test table\n");
+    fprintf(out, "10.0.0.0\t8\t64496\n");
+    fprintf(out, "10.1.0.0\t16\t64497\n");
+    fprintf(out, "10.1.2.0/24,64498\n");
+    fprintf(out, "not a prefix\n");
+    fprintf(out, "2001:db8::/32 64500\n");
+    fprintf(out, "2001:db8:1::/48 64501\n");
+    fclose(out);
+
+    info = initialise_asn_info(NULL, path);
+    assert(info->table && info->table->trie);
+
+    /* the most specific prefix wins, results are always /24 or /64 */
+    assert(lookup(info, "10.9.9.9", &prefix) == 64496 && prefix == 24);
+    assert(lookup(info, "10.1.9.9", &prefix) == 64497 && prefix == 24);
+    assert(lookup(info, "10.1.2.3", &prefix) == 64498 && prefix == 24);
+    assert(lookup(info, "2001:db8:2::1", &prefix) == 64500 && prefix == 64);
+    assert(lookup(info, "2001:db8:1:5::1", &prefix) == 64501 && prefix == 64);
+
+    /* addresses not in the table don't go to whois */
+    assert(lookup(info, "192.0.2.1", &prefix) == 0 && prefix == 24);
+    assert(lookup(info, "2001:db9::1", &prefix) == 0 && prefix == 64);
+
+    amp_asn_info_delete(info);
+
+    /* without a table everything falls through to the cache and whois */
+    info = initialise_asn_info(NULL, NULL);
+    assert(lookup(info, "10.9.9.9", &prefix) == -1);
+    amp_asn_info_delete(info);
+
+    unlink(path);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fakewhois.h"
+
+
+
+/*
+ * The ASN given to an address is a hash of the /24 or /64 network it is
+ * in, so that every address in a network gets the same answer.
+ */
+int64_t fake_whois_asn(char *address) {
+    struct in6_addr addr6;
+    struct in_addr addr4;
+    uint8_t *bytes;
+    int length;
+    uint32_t hash = 2166136261U;
+    int i;
+
+    if ( inet_pton(AF_INET, address, &addr4) == 1 ) {
+        bytes = (uint8_t*)&addr4;
+        length = 3;
+    } else if ( inet_pton(AF_INET6, address, &addr6) == 1 ) {
+        bytes = (uint8_t*)&addr6;
+        length = 8;
+    } else {
+        return -1;
+    }
+
+    for ( i = 0; i < length; i++ ) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+
+    return 64496 + (hash % 1000);
+}
+
+
+
+/*
+ * Answer a single line from the client, which is either a command or an
+ * address to look up. Returns -1 if the connection should be closed.
+ */
+static int answer_line(struct fake_whois *server, int fd, char *line) {
+    char response[128];
+    int64_t asn;
+    int drop = 0;
+
+    if ( strcmp(line, "begin") == 0 ) {
+        const char *header = "Bulk mode; whois.cymru.com [fake]\n";
+        return send(fd, header, strlen(header), MSG_NOSIGNAL) < 0 ? -1 : 0;
+    }
+
+    if ( strcmp(line, "noheader") == 0 || strcmp(line, "noasname") == 0 ||
+            strlen(line) == 0 ) {
+        return 0;
+    }
+
+    if ( strcmp(line, "end") == 0 ) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    server->queries++;
+    if ( server->drop_after > 0 && --server->drop_after == 0 ) {
+        drop = 1;
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    /* pretend the connection broke before this query was answered */
+    if ( drop ) {
+        return -1;
+    }
+
+    if ( (asn = fake_whois_asn(line)) < 0 ) {
+        snprintf(response, sizeof(response), "Error: no ASN or IP match on "
+                "line 1.\n");
+    } else if ( asn % 10 == 0 ) {
+        snprintf(response, sizeof(response), "NA      | %.64s\n", line);
+    } else {
+        snprintf(response, sizeof(response), "%-7" PRId64 " | %.64s\n", asn,
+                line);
+    }
+
+    return send(fd, response, strlen(response), MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+
+
+/*
+ * Read queries from a single client until it goes away.
+ */
+static void *fake_whois_connection(void *data) {
+    struct fake_whois *server = ((void**)data)[0];
+    int fd = (int)(intptr_t)((void**)data)[1];
+    char buffer[8192];
+    char *line, *end;
+    int offset = 0;
+    int bytes;
+
+    free(data);
+
+    while ( (bytes = recv(fd, buffer + offset,
+                    sizeof(buffer) - offset - 1, 0)) > 0 ) {
+        offset += bytes;
+        buffer[offset] = '\0';
+
+        if ( server->delay_ms > 0 ) {
+            usleep(server->delay_ms * 1000);
+        }
+
+        line = buffer;
+        while ( (end = strchr(line, '\n')) != NULL ) {
+            *end = '\0';
+            if ( answer_line(server, fd, line) < 0 ) {
+                goto done;
+            }
+            line = end + 1;
+        }
+
+        offset -= (line - buffer);
+        memmove(buffer, line, offset);
+    }
+
+done:
+    close(fd);
+
+    pthread_mutex_lock(&server->mutex);
+    server->active--;
+    pthread_mutex_unlock(&server->mutex);
+
+    return NULL;
+}
+
+
+
+/*
+ * Accept new clients, giving each one its own thread.
+ */
+static void *fake_whois_listener(void *data) {
+    struct fake_whois *server = (struct fake_whois*)data;
+    struct timeval timeout;
+    pthread_t thread;
+    fd_set readset;
+    void **args;
+    int fd;
+
+    while ( __atomic_load_n(&server->running, __ATOMIC_RELAXED) ) {
+        FD_ZERO(&readset);
+        FD_SET(server->fd, &readset);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+
+        if ( select(server->fd + 1, &readset, NULL, NULL, &timeout) <= 0 ) {
+            continue;
+        }
+
+        if ( (fd = accept(server->fd, NULL, NULL)) < 0 ) {
+            continue;
+        }
+
+        pthread_mutex_lock(&server->mutex);
+        server->connections++;
+        server->active++;
+        pthread_mutex_unlock(&server->mutex);
+
+        args = malloc(sizeof(void*) * 2);
+        args[0] = server;
+        args[1] = (void*)(intptr_t)fd;
+        pthread_create(&thread, NULL, fake_whois_connection, args);
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Start a fake whois server listening on an unused port on localhost.
+ */
+struct fake_whois *start_fake_whois(int delay_ms) {
+    struct fake_whois *server;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+
+    server = calloc(1, sizeof(struct fake_whois));
+    server->delay_ms = delay_ms;
+    server->running = 1;
+    pthread_mutex_init(&server->mutex, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    assert((server->fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    assert(bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(server->fd, 64) == 0);
+    assert(getsockname(server->fd, (struct sockaddr*)&addr, &addrlen) == 0);
+
+    snprintf(server->port, sizeof(server->port), "%d", ntohs(addr.sin_port));
+
+    assert(pthread_create(&server->thread, NULL, fake_whois_listener,
+                server) == 0);
+
+    return server;
+}
+
+
+
+/*
+ * Stop accepting new connections, and wait for the clients to close any
+ * existing connections.
+ */
+void stop_fake_whois(struct fake_whois *server) {
+    int active;
+
+    __atomic_store_n(&server->running, 0, __ATOMIC_RELAXED);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+
+    do {
+        pthread_mutex_lock(&server->mutex);
+        active = server->active;
+        pthread_mutex_unlock(&server->mutex);
+        if ( active > 0 ) {
+            usleep(10000);
+        }
+    } while ( active > 0 );
+
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_TEST_FAKEWHOIS_H
+#define _MEASURED_TEST_FAKEWHOIS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A minimal stand-in for the Team Cymru whois bulk interface, so that the
+ * whois client can be tested and benchmarked without network access. Every
+ * address is answered with an ASN derived from the address itself.
+ */
+struct fake_whois {
+    int fd;                     /* listening socket */
+    char port[8];               /* port the server is listening on */
+    int delay_ms;               /* delay before answering each read */
+    int drop_after;             /* close after this many queries (if > 0) */
+    int running;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    unsigned int connections;   /* connections accepted */
+    unsigned int active;        /* connections still open */
+    unsigned int queries;       /* addresses asked about */
+};
+
+struct fake_whois *start_fake_whois(int delay_ms);
+void stop_fake_whois(struct fake_whois *server);
+int64_t fake_whois_asn(char *address);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "messaging.h"
+#include "testlib.h"
+
+
+
+/*
+ * Create a result item, as if it had been published with the given tag.
+ */
+static struct report_item *new_item(char *name, uint64_t tag) {
+    struct report_item *item = calloc(1, sizeof(struct report_item));
+
+    assert(item);
+    item->name = strdup(name);
+    item->data = strdup("result");
+    item->len = 6;
+    item->tag = tag;
+
+    return item;
+}
+
+
+
+/*
+ * Make sure a queue holds items with exactly these tags, in this order.
+ */
+static void check_queue(struct report_queue *queue, uint64_t *tags,
+        uint32_t count) {
+    struct report_item *item;
+    uint32_t i;
+
+    assert(queue->count == count);
+
+    for ( i = 0, item = queue->head; i < count; i++, item = item->next ) {
+        assert(item);
+        assert(item->tag == tags[i]);
+        if ( i == count - 1 ) {
+            assert(queue->tail == item);
+            assert(item->next == NULL);
+        }
+    }
+
+    if ( count == 0 ) {
+        assert(queue->head == NULL);
+        assert(queue->tail == NULL);
+    }
+}
+
+
+
+static void empty_queue(struct report_queue *queue) {
+    struct report_item *item;
+
+    while ( (item = amp_test_queue_pop(queue)) != NULL ) {
+        amp_test_free_report_item(item);
+    }
+}
+
+
+
+/*
+ * Build a message the same way hand_off_result() does.
+ */
+static ssize_t build_message(char *buffer, char *name, uint64_t timestamp,
+        int64_t start_delay, char *data, uint32_t len) {
+    struct report_message_header header;
+
+    header.timestamp = timestamp;
+    header.start_delay = start_delay;
+    header.len = len;
+    header.namelen = strlen(name) + 1;
+
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), name, header.namelen);
+    memcpy(buffer + sizeof(header) + header.namelen, data, len);
+
+    return sizeof(header) + header.namelen + len;
+}
+
+
+
+/*
+ * Results from test processes should be parsed exactly, and anything that
+ * is truncated or has an inconsistent header should be refused.
+ */
+static void test_parse_report_message(void) {
+    struct report_message_header header;
+    struct report_item *item;
+    char buffer[1024];
+    ssize_t bytes;
+
+    bytes = build_message(buffer, "icmp", 1234, 56, "result", 6);
+    item = amp_test_parse_report_message(buffer, bytes);
+    assert(item);
+    assert(strcmp(item->name, "icmp") == 0);
+    assert(item->timestamp == 1234);
+    assert(item->start_delay == 56);
+    assert(item->len == 6);
+    assert(memcmp(item->data, "result", 6) == 0);
+    assert(item->tag == 0);
+    assert(item->spool_end == 0);
+    amp_test_free_report_item(item);
+
+    /* results with no data are still results */
+    bytes = build_message(buffer, "dns", 1234, -1, "", 0);
+    item = amp_test_parse_report_message(buffer, bytes);
+    assert(item);
+    assert(item->len == 0);
+    assert(item->start_delay == -1);
+    amp_test_free_report_item(item);
+
+    /* too short to even hold the header */
+    assert(amp_test_parse_report_message(buffer, sizeof(header) - 1) == NULL);
+
+    /* lengths in the header must match the message */
+    bytes = build_message(buffer, "icmp", 1234, 56, "result", 6);
+    assert(amp_test_parse_report_message(buffer, bytes - 1) == NULL);
+    assert(amp_test_parse_report_message(buffer, bytes + 1) == NULL);
+
+    /* the name must be present and null terminated */
+    buffer[sizeof(header) + 4] = 'x';
+    assert(amp_test_parse_report_message(buffer, bytes) == NULL);
+
+    memcpy(&header, buffer, sizeof(header));
+    header.namelen = 0;
+    memcpy(buffer, &header, sizeof(header));
+    assert(amp_test_parse_report_message(buffer, bytes) == NULL);
+}
+
+
+
+/*
+ * Items should come out of queues in the order they went in, and moving a
+ * whole queue to the front of another should keep both in order.
+ */
+static void test_queues(void) {
+    struct report_queue a, b, c;
+    struct report_item *item;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+
+    amp_test_queue_append(&a, new_item("icmp", 1));
+    amp_test_queue_append(&a, new_item("icmp", 2));
+    amp_test_queue_append(&a, new_item("icmp", 3));
+    check_queue(&a, (uint64_t[]){1, 2, 3}, 3);
+
+    item = amp_test_queue_pop(&a);
+    assert(item->tag == 1 && item->next == NULL);
+    amp_test_free_report_item(item);
+    check_queue(&a, (uint64_t[]){2, 3}, 2);
+
+    amp_test_queue_append(&b, new_item("dns", 10));
+    amp_test_queue_append(&b, new_item("dns", 11));
+    amp_test_queue_prepend_all(&a, &b);
+    check_queue(&a, (uint64_t[]){10, 11, 2, 3}, 4);
+    check_queue(&b, NULL, 0);
+
+    /* prepending an empty queue changes nothing */
+    amp_test_queue_prepend_all(&a, &b);
+    check_queue(&a, (uint64_t[]){10, 11, 2, 3}, 4);
+
+    /* prepending to an empty queue moves everything, including the tail */
+    amp_test_queue_prepend_all(&c, &a);
+    check_queue(&c, (uint64_t[]){10, 11, 2, 3}, 4);
+    check_queue(&a, NULL, 0);
+    amp_test_queue_append(&c, new_item("dns", 12));
+    check_queue(&c, (uint64_t[]){10, 11, 2, 3, 12}, 5);
+
+    empty_queue(&c);
+    check_queue(&c, NULL, 0);
+    assert(amp_test_queue_pop(&c) == NULL);
+}
+
+
+
+/*
+ * Confirms should only release the results they cover, and rejected results
+ * should be kept to publish again.
+ */
+static void test_process_confirm(void) {
+    struct reporter reporter;
+    uint64_t tag;
+
+    memset(&reporter, 0, sizeof(reporter));
+
+    for ( tag = 1; tag <= 5; tag++ ) {
+        amp_test_queue_append(&reporter.unconfirmed, new_item("icmp", tag));
+    }
+
+    /* a single ack only covers the one result */
+    amp_test_process_confirm(2, 0, 1, &reporter);
+    check_queue(&reporter.unconfirmed, (uint64_t[]){1, 3, 4, 5}, 4);
+
+    /* a multiple ack covers everything up to and including the tag */
+    amp_test_process_confirm(4, 1, 1, &reporter);
+    check_queue(&reporter.unconfirmed, (uint64_t[]){5}, 1);
+
+    /* confirms for results that are already gone are ignored */
+    amp_test_process_confirm(3, 0, 1, &reporter);
+    check_queue(&reporter.unconfirmed, (uint64_t[]){5}, 1);
+
+    /* with no spool, rejected results wait in memory to be published */
+    amp_test_process_confirm(5, 0, 0, &reporter);
+    check_queue(&reporter.unconfirmed, NULL, 0);
+    check_queue(&reporter.pending, (uint64_t[]){5}, 1);
+
+    empty_queue(&reporter.pending);
+}
+
+
+
+/*
+ * Move every pending item to the unconfirmed queue, as if published.
+ */
+static void publish_pending(struct reporter *reporter, uint64_t *next_tag) {
+    struct report_item *item;
+
+    while ( (item = amp_test_queue_pop(&reporter->pending)) != NULL ) {
+        item->tag = (*next_tag)++;
+        amp_test_queue_append(&reporter->unconfirmed, item);
+    }
+}
+
+
+
+/*
+ * Spooled results should be replayed at the given rate and only within the
+ * window of unconfirmed results, with the spool marked as done as they are
+ * confirmed and rejected results written back to be replayed again.
+ */
+static void test_replay_spool(void) {
+    char path[] = "/tmp/amp-messaging-test-XXXXXX";
+    struct reporter reporter;
+    struct report_item *item;
+    uint64_t last_refill;
+    uint64_t next_tag = 1;
+    uint64_t second_end;
+    double tokens = 0;
+    char name[16];
+    int fd, i;
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+
+    memset(&reporter, 0, sizeof(reporter));
+    reporter.spool = open_spool(path, 1024 * 1024);
+    assert(reporter.spool);
+
+    for ( i = 1; i <= 5; i++ ) {
+        snprintf(name, sizeof(name), "test%d", i);
+        assert(spool_append(reporter.spool, name, i, 0, "result", 6) == 0);
+    }
+
+    /* tokens build up over time, but at most a second worth at once */
+    last_refill = monotonic_ns() - 10000000000LL;
+    amp_test_replay_spool(&reporter, &tokens, &last_refill, 3);
+    assert(reporter.pending.count == 3);
+    assert(reporter.spooled == 3);
+    assert(tokens < 1);
+
+    for ( i = 1, item = reporter.pending.head; item; i++, item = item->next ) {
+        snprintf(name, sizeof(name), "test%d", i);
+        assert(strcmp(item->name, name) == 0);
+        assert(item->timestamp == (uint64_t)i);
+        assert(item->spool_end > 0);
+        if ( i == 2 ) {
+            second_end = item->spool_end;
+        }
+    }
+
+    /* no tokens left, so nothing more is read */
+    amp_test_replay_spool(&reporter, &tokens, &last_refill, 3);
+    assert(reporter.pending.count == 3);
+
+    /* confirming replayed results moves the spool past them */
+    publish_pending(&reporter, &next_tag);
+    amp_test_process_confirm(2, 1, 1, &reporter);
+    assert(reporter.spool->done == second_end);
+    assert(reporter.spooled == 1);
+
+    /* a rejected replay is written back to the end of the spool */
+    amp_test_process_confirm(3, 0, 0, &reporter);
+    assert(reporter.unconfirmed.count == 0);
+    assert(reporter.pending.count == 0);
+    assert(reporter.spooled == 0);
+
+    tokens = 10;
+    amp_test_replay_spool(&reporter, &tokens, &last_refill, 10);
+    assert(reporter.pending.count == 3);
+    assert(strcmp(reporter.pending.head->name, "test4") == 0);
+    assert(strcmp(reporter.pending.head->next->name, "test5") == 0);
+    assert(strcmp(reporter.pending.tail->name, "test3") == 0);
+
+    /* once everything is confirmed the spool is emptied */
+    publish_pending(&reporter, &next_tag);
+    amp_test_process_confirm(next_tag - 1, 1, 1, &reporter);
+    assert(reporter.spooled == 0);
+    assert(!spool_has_backlog(reporter.spool));
+    assert(reporter.spool->done == sizeof(struct spool_header));
+
+    /* results aren't read past the window of unconfirmed results */
+    for ( i = 0; i < MAX_REPORTER_UNCONFIRMED; i++ ) {
+        assert(spool_append(reporter.spool, "icmp", i, 0, "result", 6) == 0);
+    }
+    for ( i = 0; i < MAX_REPORTER_UNCONFIRMED - 2; i++ ) {
+        amp_test_queue_append(&reporter.unconfirmed, new_item("dns", i));
+    }
+    tokens = 0;
+    last_refill = monotonic_ns() - 10000000000LL;
+    amp_test_replay_spool(&reporter, &tokens, &last_refill,
+            MAX_REPORTER_UNCONFIRMED);
+    assert(reporter.pending.count == 2);
+    assert(reporter.spooled == 2);
+
+    empty_queue(&reporter.pending);
+    empty_queue(&reporter.unconfirmed);
+    close_spool(reporter.spool);
+    unlink(path);
+}
+
+
+
+int main(void) {
+    test_parse_report_message();
+    test_queues();
+    test_process_confirm();
+    test_replay_spool();
+
+    return 0;
+}
@@ -44,6 +44,9 @@
 #include <netdb.h>
 #include "nametable.h"
 
+/* enough names to make a linear search noticeably slow */
+#define MANY_NAMES 20000
+
 
 static size_t get_addr_len(int family) {
     int len;
@@ -143,6 +146,8 @@ int main(void) {
     char *name1 = "test.target.name1";
     char *name2 = "test.target.name2";
     nametable_t *name_item;
+    char name[MAX_NAMETABLE_LINE];
+    int i;
 
     addr1 = get_addr("130.217.250.13");
     addr2 = get_addr("2001:df0:4:4000:230:48ff:fe7f:5544");
@@ -181,6 +186,47 @@ int main(void) {
     /* clearing the nametable should result in an empty nametable */
     clear_nametable();
     assert(name_table == NULL);
+    assert(name_to_address(name1) == NULL);
+
+    /*
+     * Load a large number of names, enough to grow the hash index a few
+     * times, and make sure every one of them can still be found.
+     */
+    for ( i = 0; i < MANY_NAMES; i++ ) {
+        snprintf(name, sizeof(name), "many.target.name%d", i);
+        nametable_test_insert_nametable_entry(name, get_addr("192.0.2.1"));
+    }
+
+    /* give a few of them a second address */
+    for ( i = 0; i < MANY_NAMES; i += 1000 ) {
+        snprintf(name, sizeof(name), "many.target.name%d", i);
+        nametable_test_insert_nametable_entry(name, get_addr("192.0.2.2"));
+    }
+
+    nametable_test_freeze_nametable();
+
+    /* index should be a power of two with at least one bucket per name */
+    assert(nametable_test_get_bucket_count() >= MANY_NAMES);
+    assert((nametable_test_get_bucket_count() &
+                (nametable_test_get_bucket_count() - 1)) == 0);
+
+    for ( i = 0; i < MANY_NAMES; i++ ) {
+        snprintf(name, sizeof(name), "many.target.name%d", i);
+        name_item = name_to_address(name);
+        assert(name_item);
+        assert(strcmp(name_item->addr->ai_canonname, name) == 0);
+        assert(name_item->count == ((i % 1000) == 0 ? 2 : 1));
+    }
+
+    /* names that were never added, including prefixes, aren't found */
+    assert(name_to_address("many.target.name") == NULL);
+    assert(name_to_address("many.target.name0.extra") == NULL);
+    assert(name_to_address(name1) == NULL);
+
+    clear_nametable();
+    assert(name_table == NULL);
+    assert(nametable_test_get_bucket_count() == 0);
+    assert(name_to_address("many.target.name0") == NULL);
 
     return 0;
 }
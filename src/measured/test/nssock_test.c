@@ -0,0 +1,243 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unbound.h>
+#include <event2/event.h>
+
+#include "nssock.h"
+#include "ampresolv.h"
+
+/* plenty of connections waiting on names that never resolve */
+#define SLOW_CLIENTS 10
+
+struct client {
+    char *path;
+    char *name;
+    int expected;               /* number of addresses in the reply */
+    double elapsed;             /* seconds taken to get the reply */
+};
+
+static int clients_running = 0;
+
+
+
+static double now_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+
+
+/*
+ * Ask the resolver for a single name (and a numeric address, which never
+ * needs resolving) and check how many addresses come back.
+ */
+static void *client_thread(void *data) {
+    struct client *client = (struct client*)data;
+    struct addrinfo *list, *item;
+    resolve_dest_t name, numeric;
+    double start = now_seconds();
+    int count = 0;
+    int fd;
+
+    memset(&name, 0, sizeof(name));
+    name.name = client->name;
+    name.family = AF_INET;
+
+    memset(&numeric, 0, sizeof(numeric));
+    numeric.name = "192.0.2.200";
+    numeric.family = AF_INET;
+
+    assert((fd = amp_resolver_connect(client->path)) >= 0);
+    assert(amp_resolve_add_new(fd, &name) == 0);
+    assert(amp_resolve_add_new(fd, &numeric) == 0);
+    assert(amp_resolve_flag_done(fd) == 0);
+
+    list = amp_resolve_get_list(fd);
+    client->elapsed = now_seconds() - start;
+    close(fd);
+
+    for ( item = list; item != NULL; item = item->ai_next ) {
+        if ( item->ai_addr != NULL ) {
+            count++;
+        }
+    }
+    assert(count == client->expected);
+    amp_resolve_freeaddr(list);
+
+    __atomic_sub_fetch(&clients_running, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+
+
+static void start_client(pthread_t *thread, struct client *client,
+        char *path, char *name, int expected) {
+    client->path = path;
+    client->name = name;
+    client->expected = expected;
+    __atomic_add_fetch(&clients_running, 1, __ATOMIC_RELAXED);
+    assert(pthread_create(thread, NULL, client_thread, client) == 0);
+}
+
+
+
+/*
+ * Wake the event loop regularly so it notices the clients have finished.
+ */
+static void tick_callback(__attribute__((unused))evutil_socket_t fd,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *data) {
+}
+
+
+
+/*
+ * Check that names are resolved without a thread waiting on each test
+ * connection, so that lots of tests waiting on slow names don't stop other
+ * tests getting their answers, and that slow names are given up on.
+ */
+int main(void) {
+    struct client slow[SLOW_CLIENTS], fast;
+    pthread_t slow_threads[SLOW_CLIENTS], fast_thread;
+    struct timeval tick = { 0, 50000 };
+    struct sockaddr_un addr;
+    struct sockaddr_in blackhole;
+    socklen_t addrlen = sizeof(blackhole);
+    struct event_base *base;
+    struct event *listen_event, *tick_event;
+    struct ub_ctx *ctx;
+    char path[] = "/tmp/amp-nssock-test-XXXXXX";
+    char forwarder[32];
+    double start;
+    int listen_fd, udp_fd;
+    int i;
+
+    /* a nameserver that never answers, for the names that are slow */
+    memset(&blackhole, 0, sizeof(blackhole));
+    blackhole.sin_family = AF_INET;
+    blackhole.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    assert(bind(udp_fd, (struct sockaddr*)&blackhole, sizeof(blackhole)) == 0);
+    assert(getsockname(udp_fd, (struct sockaddr*)&blackhole, &addrlen) == 0);
+    snprintf(forwarder, sizeof(forwarder), "127.0.0.1@%d",
+            ntohs(blackhole.sin_port));
+
+    assert((ctx = ub_ctx_create()) != NULL);
+    assert(ub_ctx_async(ctx, 1) == 0);
+    assert(ub_ctx_set_option(ctx, "do-not-query-localhost:", "no") == 0);
+    assert(ub_ctx_set_fwd(ctx, forwarder) == 0);
+    assert(ub_ctx_data_add(ctx, "fast.example.com. 300 IN A 192.0.2.1") == 0);
+    assert(ub_ctx_data_add(ctx, "fast.example.com. 300 IN A 192.0.2.2") == 0);
+
+    assert((base = event_base_new()) != NULL);
+    amp_test_set_resolve_timeout(2);
+    assert(start_resolver(base, ctx) == 0);
+
+    /* listen on a unix socket, the same as measured does */
+    assert(mkdtemp(path) != NULL);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/nssock", path);
+    assert((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    assert(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(listen_fd, 64) == 0);
+
+    listen_event = event_new(base, listen_fd, EV_READ | EV_PERSIST,
+            resolver_socket_event_callback, ctx);
+    tick_event = event_new(base, -1, EV_PERSIST, tick_callback, NULL);
+    event_add(listen_event, NULL);
+    event_add(tick_event, &tick);
+
+    /* lots of tests waiting on names that won't resolve any time soon */
+    for ( i = 0; i < SLOW_CLIENTS; i++ ) {
+        start_client(&slow_threads[i], &slow[i], addr.sun_path,
+                "slow.example.net", 1);
+    }
+
+    /* let them all connect and send their queries */
+    start = now_seconds();
+    while ( now_seconds() - start < 0.3 ) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+
+    /* another test still gets its answers straight away */
+    start_client(&fast_thread, &fast, addr.sun_path, "fast.example.com", 3);
+
+    while ( __atomic_load_n(&clients_running, __ATOMIC_RELAXED) > 0 ) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+
+    for ( i = 0; i < SLOW_CLIENTS; i++ ) {
+        pthread_join(slow_threads[i], NULL);
+        /* slow tests get the numeric address after the timeout */
+        assert(slow[i].elapsed >= 1.5);
+    }
+    pthread_join(fast_thread, NULL);
+    assert(fast.elapsed < 1.0);
+
+    event_free(listen_event);
+    event_free(tick_event);
+    stop_resolver();
+    event_base_free(base);
+    ub_ctx_delete(ctx);
+
+    close(listen_fd);
+    close(udp_fd);
+    unlink(addr.sun_path);
+    rmdir(path);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "prefetch.h"
+#include "ampresolv.h"
+
+
+
+/*
+ * Count the addresses of each family in the list, and free it.
+ */
+static void check_list(struct addrinfo *list, int expected4, int expected6,
+        int dummies) {
+    struct addrinfo *item;
+    int count4 = 0, count6 = 0, empty = 0;
+
+    for ( item = list; item != NULL; item = item->ai_next ) {
+        if ( item->ai_addr == NULL ) {
+            empty++;
+        } else if ( item->ai_family == AF_INET ) {
+            count4++;
+        } else if ( item->ai_family == AF_INET6 ) {
+            count6++;
+        }
+    }
+
+    assert(count4 == expected4);
+    assert(count6 == expected6);
+    assert(empty == dummies);
+
+    amp_resolve_freeaddr(list);
+}
+
+
+
+/*
+ * Check that cached answers are used only while they are valid and for the
+ * address families that have been cached.
+ */
+int main(void) {
+    struct addrinfo *list;
+    struct prefetch_stats stats;
+    struct in_addr v4[3];
+    struct in6_addr v6[1];
+    char *data4[] = { (char*)&v4[0], (char*)&v4[1], (char*)&v4[2], NULL };
+    int len4[] = { 4, 4, 4 };
+    char *data6[] = { (char*)&v6[0], NULL };
+    int len6[] = { 16 };
+    char *bad[] = { (char*)&v6[0], NULL };
+    int badlen[] = { 16 };
+
+    inet_pton(AF_INET, "192.0.2.1", &v4[0]);
+    inet_pton(AF_INET, "192.0.2.2", &v4[1]);
+    inet_pton(AF_INET, "192.0.2.3", &v4[2]);
+    inet_pton(AF_INET6, "2001:db8::1", &v6[0]);
+
+    /* nothing is used until the prefetcher is running */
+    list = NULL;
+    assert(prefetch_lookup("www.example.com", AF_INET, 0, &list, NULL) < 0);
+    assert(list == NULL);
+
+    amp_test_prefetch_init();
+
+    /* names that haven't been prefetched are misses */
+    assert(prefetch_lookup("www.example.com", AF_INET, 0, &list, NULL) < 0);
+    assert(list == NULL);
+
+    amp_test_prefetch_store("www.example.com", 0x01, 300, data4, len4);
+
+    /* all the cached addresses are used, unless limited */
+    assert(prefetch_lookup("www.example.com", AF_INET, 0, &list, NULL) == 0);
+    check_list(list, 3, 0, 0);
+    list = NULL;
+    assert(prefetch_lookup("www.example.com", AF_INET, 2, &list, NULL) == 0);
+    check_list(list, 2, 0, 0);
+    list = NULL;
+
+    /* both families need to be cached before AF_UNSPEC can be answered */
+    assert(prefetch_lookup("www.example.com", AF_UNSPEC, 0, &list, NULL) < 0);
+    assert(prefetch_lookup("www.example.com", AF_INET6, 0, &list, NULL) < 0);
+    assert(list == NULL);
+
+    amp_test_prefetch_store("www.example.com", 0x1c, 300, data6, len6);
+    assert(prefetch_lookup("www.example.com", AF_UNSPEC, 0, &list, NULL) == 0);
+    check_list(list, 3, 1, 0);
+    list = NULL;
+
+    /* the limit on addresses is shared between the families */
+    assert(prefetch_lookup("www.example.com", AF_UNSPEC, 3, &list, NULL) == 0);
+    check_list(list, 3, 0, 0);
+    list = NULL;
+
+    /* addresses of the wrong length are ignored */
+    amp_test_prefetch_store("bad.example.com", 0x01, 300, bad, badlen);
+    assert(prefetch_lookup("bad.example.com", AF_INET, 0, &list, NULL) == 0);
+    check_list(list, 0, 0, 1);
+    list = NULL;
+
+    /* negative answers are cached and give one empty entry per family */
+    amp_test_prefetch_store("none.example.com", 0x01, 60, NULL, NULL);
+    amp_test_prefetch_store("none.example.com", 0x1c, 60, NULL, NULL);
+    assert(prefetch_lookup("none.example.com", AF_UNSPEC, 0, &list,
+                NULL) == 0);
+    check_list(list, 0, 0, 2);
+    list = NULL;
+
+    /* numeric addresses are never looked up in the cache */
+    assert(prefetch_lookup("192.0.2.1", AF_INET, 0, &list, NULL) < 0);
+
+    /* answers with no TTL expire immediately */
+    amp_test_prefetch_store("zero.example.com", 0x01, 0, data4, len4);
+    assert(prefetch_lookup("zero.example.com", AF_INET, 0, &list, NULL) < 0);
+    assert(list == NULL);
+
+    get_prefetch_stats(&stats);
+    assert(stats.hits == 6);
+    assert(stats.misses == 4);
+
+    /* sweeping removes only the entries that have expired */
+    amp_test_prefetch_sweep(time(NULL) + 100);
+    get_prefetch_stats(&stats);
+    assert(stats.expired == 3);
+    assert(prefetch_lookup("none.example.com", AF_INET, 0, &list, NULL) < 0);
+    assert(prefetch_lookup("www.example.com", AF_UNSPEC, 0, &list,
+                NULL) == 0);
+    check_list(list, 3, 1, 0);
+
+    stop_prefetcher();
+
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <event2/event.h>
+
+#include "schedule.h"
+#include "schedule_cache.h"
+#include "modules.h"
+#include "tests.h"
+
+extern test_t **amp_tests;
+
+struct found_tests {
+    test_schedule_item_t *items[16];
+    int count;
+};
+
+
+
+/*
+ * Write a schedule file containing the given tests.
+ */
+static void write_schedule(char *dir, char *name, char *contents) {
+    char filename[1024];
+    FILE *out;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    assert((out = fopen(filename, "w")) != NULL);
+    fprintf(out, "tests:\n%s", contents);
+    fclose(out);
+}
+
+
+
+static int find_tests_callback(schedule_item_t *item, void *evdata) {
+    struct found_tests *found = (struct found_tests*)evdata;
+
+    assert(found->count < 16);
+    found->items[found->count++] = item->data.test;
+
+    return 0;
+}
+
+
+
+/*
+ * Count the scheduled tests that run at the given frequency, and the total
+ * number of targets they have between them.
+ */
+static int count_tests(struct event_base *base, int frequency, int *targets) {
+    struct found_tests found;
+    int i, count = 0;
+
+    memset(&found, 0, sizeof(found));
+    foreach_scheduled_test(base, find_tests_callback, &found);
+
+    *targets = 0;
+    for ( i = 0; i < found.count; i++ ) {
+        if ( found.items[i]->interval.tv_sec == frequency ) {
+            *targets += found.items[i]->resolve_count;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Read the schedule directory into a new event base and check the tests
+ * at each frequency have been merged as expected.
+ */
+static void check_schedule(char *dir, amp_test_meta_t *meta, int *expected) {
+    struct event_base *base = event_base_new();
+    int targets;
+
+    meta->base = base;
+    read_schedule_dir(base, dir, meta);
+
+    /* expected holds triples of frequency, test count, target count */
+    for ( ; *expected > 0; expected += 3 ) {
+        assert(count_tests(base, expected[0], &targets) == expected[1]);
+        assert(targets == expected[2]);
+    }
+
+    clear_test_schedule(base, 1);
+    event_base_free(base);
+}
+
+
+
+/*
+ * Check that the cache holds the compiled tests for a schedule file with
+ * its current contents.
+ */
+static void check_cached(char *dir, char *file, uint32_t count) {
+    struct compiled_schedule schedule;
+    struct schedule_cache *cache;
+    struct schedule_cache_test *test;
+    char filename[1024];
+    char contents[4096];
+    char *params[8], *targets[8];
+    char *name;
+    size_t length;
+    uint32_t found = 0;
+    FILE *in;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, file);
+    assert((in = fopen(filename, "r")) != NULL);
+    length = fread(contents, 1, sizeof(contents), in);
+    fclose(in);
+
+    memset(&schedule, 0, sizeof(schedule));
+    schedule.name = file;
+    hash_schedule_contents(contents, length, schedule.hash);
+
+    snprintf(filename, sizeof(filename), "%s%s", dir, SCHEDULE_CACHE_FILE);
+    assert((cache = load_schedule_cache(filename)) != NULL);
+    assert(find_cached_schedule(cache, &schedule) == 1);
+    assert(schedule.test_count == count);
+
+    for ( test = next_compiled_test(&schedule, NULL); test != NULL;
+            test = next_compiled_test(&schedule, test) ) {
+        assert(test->param_count < 8 && test->target_count < 8);
+        /* unknown tests are still cached, the test modules may change */
+        name = get_compiled_test_strings(test, params, targets);
+        assert(strcmp(name, "fake") == 0 || strcmp(name, "pair") == 0 ||
+                strcmp(name, "unknown") == 0);
+        assert(test->period == SCHEDULE_PERIOD_DAILY);
+        assert(test->end == 86400 * INT64_C(1000000));
+        assert(targets[test->target_count] == NULL);
+        found++;
+    }
+
+    assert(found == count);
+    free_schedule_cache(cache);
+}
+
+
+
+/*
+ * Register fake test modules, as if they had just been loaded.
+ */
+static void register_fake_tests(void) {
+    amp_tests = calloc(3, sizeof(test_t*));
+    amp_tests[0] = calloc(1, sizeof(test_t));
+    amp_tests[0]->name = strdup("fake");
+    amp_tests[0]->max_targets = 0;
+    amp_tests[0]->min_targets = 1;
+    amp_tests[1] = calloc(1, sizeof(test_t));
+    amp_tests[1]->name = strdup("pair");
+    amp_tests[1]->max_targets = 2;
+    amp_tests[1]->min_targets = 1;
+}
+
+
+
+static void unregister_fake_tests(void) {
+    int i;
+
+    for ( i = 0; amp_tests[i] != NULL; i++ ) {
+        free(amp_tests[i]->name);
+        free(amp_tests[i]);
+    }
+    free(amp_tests);
+    amp_tests = NULL;
+}
+
+
+
+/*
+ * Check that schedule files are compiled into the cache, that unchanged
+ * files are loaded from it, and that tests with the same schedule are
+ * merged whether they come from the cache or not.
+ */
+int main(void) {
+    amp_test_meta_t meta;
+    struct schedule_cache *cache;
+    char dir[] = "/tmp/schedule_cache_test.XXXXXX";
+    char filename[1024];
+    FILE *out;
+    int expected[] = {
+        60, 1, 3,       /* three fake targets merged into one test */
+        120, 1, 1,      /* different arguments so not merged */
+        300, 2, 3,      /* pair tests only take two targets each */
+        0,
+    };
+    int changed[] = {
+        60, 1, 2,
+        120, 1, 1,
+        300, 2, 3,
+        600, 1, 1,
+        0,
+    };
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(filename, sizeof(filename), "%s%s", dir, SCHEDULE_CACHE_FILE);
+
+    memset(&meta, 0, sizeof(meta));
+    register_fake_tests();
+
+    write_schedule(dir, "a.sched",
+            "- test: fake\n  frequency: 60\n  target: a.example.com\n"
+            "- test: fake\n  frequency: 60\n  target: b.example.com\n"
+            "- test: fake\n  frequency: 120\n  target: c.example.com\n"
+            "  args: -x 1\n"
+            "- test: pair\n  frequency: 300\n"
+            "  target: [d.example.com, e.example.com]\n");
+    write_schedule(dir, "b.sched",
+            "- test: fake\n  frequency: 60\n  target: f.example.com\n"
+            "- test: pair\n  frequency: 300\n  target: g.example.com\n"
+            "- test: unknown\n  frequency: 60\n  target: h.example.com\n");
+
+    /* nothing cached yet, so both files are compiled and the cache written */
+    assert(access(filename, F_OK) != 0);
+    check_schedule(dir, &meta, expected);
+    check_cached(dir, "a.sched", 4);
+    check_cached(dir, "b.sched", 3);
+
+    /* the second time round everything comes from the cache */
+    check_schedule(dir, &meta, expected);
+
+    /* changing a file replaces only that file in the cache */
+    write_schedule(dir, "b.sched",
+            "- test: pair\n  frequency: 300\n  target: g.example.com\n"
+            "- test: fake\n  frequency: 600\n  target: f.example.com\n");
+    check_schedule(dir, &meta, changed);
+    check_cached(dir, "a.sched", 4);
+    check_cached(dir, "b.sched", 2);
+
+    /* removing a file removes it from the cache */
+    snprintf(filename, sizeof(filename), "%s/b.sched", dir);
+    unlink(filename);
+    expected[2] = 2;
+    expected[7] = 1;
+    expected[8] = 2;
+    check_schedule(dir, &meta, expected);
+    snprintf(filename, sizeof(filename), "%s%s", dir, SCHEDULE_CACHE_FILE);
+    assert((cache = load_schedule_cache(filename)) != NULL);
+    assert(cache->header->file_count == 1);
+    free_schedule_cache(cache);
+
+    /* a damaged cache is ignored and replaced */
+    assert((out = fopen(filename, "r+")) != NULL);
+    fseek(out, 100, SEEK_SET);
+    fwrite("\xff\xff\xff\xff\xff\xff\xff\xff", 8, 1, out);
+    fclose(out);
+    assert(load_schedule_cache(filename) == NULL);
+    check_schedule(dir, &meta, expected);
+    check_cached(dir, "a.sched", 4);
+
+    /* a truncated one too */
+    assert(truncate(filename, 40) == 0);
+    assert(load_schedule_cache(filename) == NULL);
+    check_schedule(dir, &meta, expected);
+    check_cached(dir, "a.sched", 4);
+
+    unregister_fake_tests();
+
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/a.sched", dir);
+    unlink(filename);
+    rmdir(dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "schedule.h"
+
+/*
+ * Minimal HTTP server that serves a single schedule file with an ETag, and
+ * honours If-None-Match unless told to ignore conditional requests.
+ */
+struct fake_server {
+    int sock;
+    int port;
+    char body[1024];
+    char etag[64];
+    char modified[64];
+    int ignore_conditional;
+    int requests;
+    int not_modified;
+    int saw_accept_encoding;
+    char if_none_match[64];
+    pthread_mutex_t lock;
+};
+
+
+
+static void *serve(void *data) {
+    struct fake_server *server = (struct fake_server *)data;
+    char request[4096];
+    char response[2048];
+    int client;
+
+    while ( (client = accept(server->sock, NULL, NULL)) >= 0 ) {
+        ssize_t total = 0, bytes;
+        char *header;
+
+        memset(request, 0, sizeof(request));
+        while ( strstr(request, "\r\n\r\n") == NULL &&
+                total < (ssize_t)sizeof(request) - 1 &&
+                (bytes = recv(client, request + total,
+                    sizeof(request) - 1 - total, 0)) > 0 ) {
+            total += bytes;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        server->requests++;
+        server->saw_accept_encoding =
+            strcasestr(request, "\r\nAccept-Encoding:") != NULL;
+        server->if_none_match[0] = '\0';
+        if ( (header = strcasestr(request, "\r\nIf-None-Match: ")) ) {
+            header += strlen("\r\nIf-None-Match: ");
+            sscanf(header, "%63[^\r\n]", server->if_none_match);
+        }
+
+        if ( !server->ignore_conditional &&
+                strcmp(server->if_none_match, server->etag) == 0 ) {
+            server->not_modified++;
+            snprintf(response, sizeof(response),
+                    "HTTP/1.1 304 Not Modified\r\n"
+                    "ETag: %s\r\n"
+                    "Connection: close\r\n\r\n", server->etag);
+        } else {
+            /* curl checks Last-Modified itself, so don't send it if ignoring */
+            snprintf(response, sizeof(response),
+                    "HTTP/1.1 200 OK\r\n"
+                    "ETag: %s\r\n"
+                    "%s%s%s"
+                    "Content-Length: %zu\r\n"
+                    "Connection: close\r\n\r\n%s",
+                    server->etag,
+                    server->ignore_conditional ? "" : "Last-Modified: ",
+                    server->ignore_conditional ? "" : server->modified,
+                    server->ignore_conditional ? "" : "\r\n",
+                    strlen(server->body), server->body);
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        send(client, response, strlen(response), MSG_NOSIGNAL);
+        close(client);
+    }
+
+    return NULL;
+}
+
+
+
+static void set_content(struct fake_server *server, char *body, char *etag,
+        time_t modified, int ignore_conditional) {
+    pthread_mutex_lock(&server->lock);
+    strftime(server->modified, sizeof(server->modified),
+            "%a, %d %b %Y %H:%M:%S GMT", gmtime(&modified));
+    snprintf(server->body, sizeof(server->body), "%s", body);
+    snprintf(server->etag, sizeof(server->etag), "%s", etag);
+    server->ignore_conditional = ignore_conditional;
+    pthread_mutex_unlock(&server->lock);
+}
+
+
+
+static int file_contains(char *dir, char *name, char *expected) {
+    char filename[1024];
+    char contents[1024];
+    size_t length;
+    FILE *in;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    if ( (in = fopen(filename, "r")) == NULL ) {
+        return 0;
+    }
+    length = fread(contents, 1, sizeof(contents) - 1, in);
+    contents[length] = '\0';
+    fclose(in);
+
+    return strcmp(contents, expected) == 0;
+}
+
+
+
+/*
+ * Check that remote schedule fetches are conditional on the ETag of the
+ * last schedule fetched, and that unchanged schedules don't cause a reload.
+ */
+int main(void) {
+    struct fake_server server;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    fetch_schedule_item_t fetch;
+    pthread_t thread;
+    char dir[] = "/tmp/amp-fetch-XXXXXX";
+    char url[128];
+    char filename[1024];
+
+    assert(mkdtemp(dir) != NULL);
+
+    memset(&server, 0, sizeof(server));
+    pthread_mutex_init(&server.lock, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    assert((server.sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    assert(bind(server.sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(server.sock, 8) == 0);
+    assert(getsockname(server.sock, (struct sockaddr *)&addr, &addrlen) == 0);
+    server.port = ntohs(addr.sin_port);
+
+    assert(pthread_create(&thread, NULL, serve, &server) == 0);
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/schedule", server.port);
+
+    memset(&fetch, 0, sizeof(fetch));
+    fetch.schedule_dir = dir;
+    fetch.schedule_url = url;
+    fetch.frequency = SCHEDULE_FETCH_FREQUENCY;
+
+    /* first fetch should always download the file and save the ETag */
+    set_content(&server, "tests:\n - test: first\n", "\"v1\"", 1704067200, 0);
+    assert(amp_test_update_remote_schedule(&fetch, 1) == 1);
+    assert(file_contains(dir, REMOTE_SCHEDULE_FILE,
+                "tests:\n - test: first\n"));
+    assert(file_contains(dir, REMOTE_SCHEDULE_ETAG_FILE, "\"v1\"\n"));
+    assert(server.saw_accept_encoding);
+
+    /* conditional fetch should send the ETag and get not modified */
+    assert(amp_test_update_remote_schedule(&fetch, 0) == 0);
+    assert(strcmp(server.if_none_match, "\"v1\"") == 0);
+    assert(server.not_modified == 1);
+
+    /* the temporary file shouldn't be left around */
+    snprintf(filename, sizeof(filename), "%s/%s", dir,
+            TMP_REMOTE_SCHEDULE_FILE);
+    assert(access(filename, F_OK) < 0);
+
+    /* identical content from a server ignoring conditionals is no change */
+    set_content(&server, "tests:\n - test: first\n", "\"v2\"", 1704067200, 1);
+    assert(amp_test_update_remote_schedule(&fetch, 0) == 0);
+    assert(server.not_modified == 1);
+    assert(file_contains(dir, REMOTE_SCHEDULE_ETAG_FILE, "\"v2\"\n"));
+
+    /* new content should replace the file and update the ETag */
+    set_content(&server, "tests:\n - test: second\n", "\"v3\"", 1704153600, 0);
+    assert(amp_test_update_remote_schedule(&fetch, 0) == 1);
+    assert(strcmp(server.if_none_match, "\"v2\"") == 0);
+    assert(file_contains(dir, REMOTE_SCHEDULE_FILE,
+                "tests:\n - test: second\n"));
+    assert(file_contains(dir, REMOTE_SCHEDULE_ETAG_FILE, "\"v3\"\n"));
+
+    /* clobbering should fetch regardless of the ETag */
+    assert(amp_test_update_remote_schedule(&fetch, 1) == 1);
+    assert(server.if_none_match[0] == '\0');
+    assert(server.requests == 5);
+
+    shutdown(server.sock, SHUT_RDWR);
+    close(server.sock);
+    pthread_join(thread, NULL);
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, REMOTE_SCHEDULE_FILE);
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/%s", dir,
+            REMOTE_SCHEDULE_ETAG_FILE);
+    unlink(filename);
+    rmdir(dir);
+
+    return 0;
+}
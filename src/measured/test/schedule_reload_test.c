@@ -0,0 +1,246 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <event2/event.h>
+
+#include "schedule.h"
+#include "modules.h"
+#include "tests.h"
+
+extern test_t **amp_tests;
+
+struct found_tests {
+    schedule_item_t *items[16];
+    int count;
+};
+
+
+
+/*
+ * Write a schedule file containing the given tests.
+ */
+static void write_schedule(char *dir, char *contents) {
+    char filename[1024];
+    FILE *out;
+
+    snprintf(filename, sizeof(filename), "%s/test.sched", dir);
+    assert((out = fopen(filename, "w")) != NULL);
+    fprintf(out, "tests:\n%s", contents);
+    fclose(out);
+}
+
+
+
+static int find_tests_callback(schedule_item_t *item, void *evdata) {
+    struct found_tests *found = (struct found_tests*)evdata;
+
+    assert(found->count < 16);
+    found->items[found->count++] = item;
+
+    return 0;
+}
+
+
+
+/*
+ * Find the scheduled test that runs at the given frequency.
+ */
+static schedule_item_t *find_test(struct event_base *base, int frequency,
+        int *count) {
+    struct found_tests found;
+    schedule_item_t *match = NULL;
+    int i;
+
+    memset(&found, 0, sizeof(found));
+    foreach_scheduled_test(base, find_tests_callback, &found);
+
+    for ( i = 0; i < found.count; i++ ) {
+        if ( found.items[i]->data.test->interval.tv_sec == frequency ) {
+            match = found.items[i];
+        }
+    }
+
+    if ( count ) {
+        *count = found.count;
+    }
+
+    return match;
+}
+
+
+
+/*
+ * Register a fake test module, as if it had just been loaded.
+ */
+static void register_fake_test(void) {
+    amp_tests = calloc(2, sizeof(test_t*));
+    amp_tests[0] = calloc(1, sizeof(test_t));
+    amp_tests[0]->name = strdup("fake");
+    amp_tests[0]->max_targets = 0;
+    amp_tests[0]->min_targets = 1;
+}
+
+
+
+static void unregister_fake_test(void) {
+    free(amp_tests[0]->name);
+    free(amp_tests[0]);
+    free(amp_tests);
+    amp_tests = NULL;
+}
+
+
+
+/*
+ * Check that reloading a schedule only replaces the tests that have
+ * changed, and that unchanged tests keep their existing timers.
+ */
+int main(void) {
+    struct event_base *base, *other;
+    struct saved_schedule *saved;
+    amp_test_meta_t meta;
+    schedule_item_t *unchanged, *changed, *removed, *item;
+    struct timeval abstime;
+    char dir[] = "/tmp/schedule_reload_test.XXXXXX";
+    char filename[1024];
+    test_t **old_tests;
+    int count;
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(filename, sizeof(filename), "%s/test.sched", dir);
+
+    memset(&meta, 0, sizeof(meta));
+    base = event_base_new();
+    meta.base = base;
+
+    /* spread test start times over up to 20 seconds */
+    set_schedule_jitter(20000);
+
+    register_fake_test();
+    write_schedule(dir,
+            "- test: fake\n  frequency: 60\n  target: a.example.com\n"
+            "- test: fake\n  frequency: 120\n  target: b.example.com\n"
+            "  args: -x 1\n"
+            "- test: fake\n  frequency: 300\n  target: c.example.com\n");
+    read_schedule_dir(base, dir, &meta);
+
+    unchanged = find_test(base, 60, &count);
+    changed = find_test(base, 120, NULL);
+    removed = find_test(base, 300, NULL);
+    assert(count == 3 && unchanged && changed && removed);
+    abstime = unchanged->data.test->abstime;
+
+    /* start offsets are within the jitter budget and differ between tests */
+    assert(unchanged->data.test->offset.tv_sec < 20);
+    assert(changed->data.test->offset.tv_sec < 20);
+    assert(timercmp(&unchanged->data.test->offset,
+                &changed->data.test->offset, !=));
+
+    /* reloading an identical schedule keeps everything as it was */
+    saved = detach_test_schedule(base);
+    find_test(base, 60, &count);
+    assert(count == 0);
+    old_tests = amp_tests;
+    register_fake_test();
+    read_schedule_dir(base, dir, &meta);
+    assert(restore_test_schedule(base, saved) == 0);
+    free(old_tests[0]->name);
+    free(old_tests[0]);
+    free(old_tests);
+
+    assert(find_test(base, 60, &count) == unchanged);
+    assert(count == 3);
+    assert(find_test(base, 120, NULL) == changed);
+    assert(find_test(base, 300, NULL) == removed);
+    assert(timercmp(&unchanged->data.test->abstime, &abstime, ==));
+    assert(wheel_timer_pending(&unchanged->timer, NULL));
+    /* the unchanged tests now point at the newly loaded test module */
+    assert(unchanged->data.test->test == amp_tests[0]);
+
+    /* change the arguments of one test, remove one and add another */
+    write_schedule(dir,
+            "- test: fake\n  frequency: 60\n  target: a.example.com\n"
+            "- test: fake\n  frequency: 120\n  target: b.example.com\n"
+            "  args: -x 2\n"
+            "- test: fake\n  frequency: 600\n  target: d.example.com\n");
+
+    saved = detach_test_schedule(base);
+    read_schedule_dir(base, dir, &meta);
+    assert(restore_test_schedule(base, saved) == 4);
+
+    assert(find_test(base, 60, &count) == unchanged);
+    assert(count == 3);
+    assert(timercmp(&unchanged->data.test->abstime, &abstime, ==));
+    assert(wheel_timer_pending(&unchanged->timer, NULL));
+
+    item = find_test(base, 120, NULL);
+    assert(item != NULL && item != changed);
+    assert(strcmp(item->data.test->params[1], "2") == 0);
+    assert(find_test(base, 300, NULL) == NULL);
+    assert(find_test(base, 600, NULL) != NULL);
+
+    /* the same test always gets the same start offset */
+    other = event_base_new();
+    meta.base = other;
+    read_schedule_dir(other, dir, &meta);
+    item = find_test(other, 60, NULL);
+    assert(item != NULL);
+    assert(timercmp(&item->data.test->offset,
+                &unchanged->data.test->offset, ==));
+    clear_test_schedule(other, 1);
+    event_base_free(other);
+
+    clear_test_schedule(base, 1);
+    unregister_fake_test();
+    event_base_free(base);
+
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/.schedule.cache", dir);
+    unlink(filename);
+    rmdir(dir);
+
+    return EXIT_SUCCESS;
+}
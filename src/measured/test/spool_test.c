@@ -0,0 +1,181 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+
+
+/*
+ * Get the current size of the spool file on disk.
+ */
+static off_t spool_file_size(char *path) {
+    struct stat statbuf;
+
+    assert(stat(path, &statbuf) == 0);
+    return statbuf.st_size;
+}
+
+
+
+/*
+ * Read the next record from the spool and make sure it matches.
+ */
+static void check_record(spool_t *spool, char *name, uint64_t timestamp,
+        int64_t start_delay, char *data) {
+    spool_record_t record;
+
+    assert(spool_read_next(spool, &record) == 1);
+    assert(strcmp(record.name, name) == 0);
+    assert(record.timestamp == timestamp);
+    assert(record.start_delay == start_delay);
+    assert(record.len == strlen(data));
+    assert(memcmp(record.data, data, record.len) == 0);
+    assert(record.end == spool->read);
+    free_spool_record(&record);
+}
+
+
+
+/*
+ * Check that results can be written to and replayed from the spool, that
+ * replay progress survives reopening it, and that damaged or full spools
+ * are handled sensibly.
+ */
+int main(void) {
+    char path[] = "/tmp/amp-spool-test-XXXXXX";
+    spool_record_t record;
+    spool_t *spool;
+    uint64_t first_end;
+    off_t size;
+    int fd;
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+
+    /* new, empty spool */
+    spool = open_spool(path, 1024 * 1024);
+    assert(spool);
+    assert(spool_file_size(path) == sizeof(struct spool_header));
+    assert(!spool_has_backlog(spool));
+    assert(spool_read_next(spool, &record) == 0);
+
+    /* records are read back in the order they were written, with delays */
+    assert(spool_append(spool, "icmp", 1000, 250, "result1", 7) == 0);
+    assert(spool_append(spool, "dns", 2000, -1, "result22", 8) == 0);
+    assert(spool_append(spool, "traceroute", 3000, 0, "result333", 9) == 0);
+    assert(spool_has_backlog(spool));
+
+    check_record(spool, "icmp", 1000, 250, "result1");
+    first_end = spool->read;
+    check_record(spool, "dns", 2000, -1, "result22");
+    check_record(spool, "traceroute", 3000, 0, "result333");
+    assert(!spool_has_backlog(spool));
+    assert(spool_read_next(spool, &record) == 0);
+
+    /* rewinding goes back to the first unconfirmed record */
+    spool_mark_done(spool, first_end);
+    spool_rewind(spool);
+    assert(spool->read == first_end);
+    check_record(spool, "dns", 2000, -1, "result22");
+    close_spool(spool);
+
+    /* reopening continues from the first unconfirmed record */
+    spool = open_spool(path, 1024 * 1024);
+    assert(spool);
+    assert(spool->done == first_end);
+    check_record(spool, "dns", 2000, -1, "result22");
+    check_record(spool, "traceroute", 3000, 0, "result333");
+
+    /* can't compact until everything is confirmed */
+    size = spool_file_size(path);
+    assert(spool_compact(spool) == 0);
+    assert(spool_file_size(path) == size);
+
+    /* once everything is confirmed the spool is emptied */
+    spool_mark_done(spool, spool->read);
+    assert(spool_compact(spool) == 0);
+    assert(spool_file_size(path) == sizeof(struct spool_header));
+    assert(spool->done == sizeof(struct spool_header));
+    assert(!spool_has_backlog(spool));
+
+    /* a partially written record is removed when the spool is reopened */
+    assert(spool_append(spool, "icmp", 4000, 1500, "result4", 7) == 0);
+    size = spool_file_size(path);
+    assert(spool_append(spool, "dns", 5000, 0, "result5", 7) == 0);
+    close_spool(spool);
+    assert(truncate(path, spool_file_size(path) - 3) == 0);
+
+    spool = open_spool(path, 1024 * 1024);
+    assert(spool);
+    assert(spool_file_size(path) == size);
+    check_record(spool, "icmp", 4000, 1500, "result4");
+    assert(spool_read_next(spool, &record) == 0);
+
+    /* new records can follow the recovered ones */
+    assert(spool_append(spool, "dns", 6000, 12, "result6", 7) == 0);
+    check_record(spool, "dns", 6000, 12, "result6");
+    close_spool(spool);
+
+    /* records that would make the spool too large are refused */
+    spool = open_spool(path, spool_file_size(path) + 20);
+    assert(spool);
+    size = spool_file_size(path);
+    assert(spool_append(spool, "http", 7000, 0, "a much larger result",
+                20) < 0);
+    assert(spool_file_size(path) == size);
+    close_spool(spool);
+
+    /* files that aren't spools are left alone */
+    assert((fd = open(path, O_WRONLY | O_TRUNC)) >= 0);
+    assert(write(fd, "this is not a spool file", 24) == 24);
+    close(fd);
+    assert(open_spool(path, 1024 * 1024) == NULL);
+    assert(spool_file_size(path) == 24);
+
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * Compare scheduling tests with a libevent timer each (the way the scheduler
+ * used to) against the timer wheel. Every timer re-adds itself after it
+ * fires, the same way scheduled tests do, with random intervals so that
+ * timers are spread across all the levels of the wheel. Reports the time
+ * taken to add all the timers, the CPU time used running them, and the time
+ * taken to walk the schedule and to clear it.
+ *
+ * Usage: timerwheel.bench [timers] [seconds] [max interval ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <event2/event.h>
+
+#include "config.h"
+#include "timerwheel.h"
+
+#ifndef HAVE_LIBEVENT_FOREACH
+#include "libevent_internal.h"
+#endif
+
+#define WALKS 100
+
+struct bench_timer {
+    struct event *event;
+    struct wheel_timer timer;
+    struct timeval *deadline;
+    int interval;
+    int *fired;
+};
+
+static int timers;
+static int seconds;
+static int interval;
+
+
+
+static double elapsed(struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+
+
+static double cpu_time(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+
+
+/*
+ * Pick when a timer should next fire, or return 0 if the benchmark is over.
+ */
+static int next_timeout(struct bench_timer *bench, struct timeval *timeout) {
+    struct timeval now;
+    int delay;
+
+    gettimeofday(&now, NULL);
+    if ( timercmp(&now, bench->deadline, >) ) {
+        return 0;
+    }
+
+    delay = random() % bench->interval;
+    timeout->tv_sec = delay / 1000;
+    timeout->tv_usec = (delay % 1000) * 1000;
+
+    return 1;
+}
+
+
+
+static void event_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+    struct bench_timer *bench = (struct bench_timer*)evdata;
+    struct timeval timeout;
+
+    (*bench->fired)++;
+    if ( next_timeout(bench, &timeout) ) {
+        event_add(bench->event, &timeout);
+    }
+}
+
+
+
+static void wheel_callback(void *evdata) {
+    struct bench_timer *bench = (struct bench_timer*)evdata;
+    struct timeval timeout;
+
+    (*bench->fired)++;
+    if ( next_timeout(bench, &timeout) ) {
+        wheel_timer_add(&bench->timer, &timeout);
+    }
+}
+
+
+
+/*
+ * Look at every event in the base, the same way the scheduler used to find
+ * scheduled tests.
+ */
+static int event_walk_callback(
+        __attribute__((unused))const struct event_base *base,
+        const struct event *ev, void *evdata) {
+    if ( event_get_callback(ev) == event_callback ) {
+        (*(int*)evdata)++;
+    }
+    return 0;
+}
+
+
+
+static int wheel_walk_callback(
+        __attribute__((unused))struct wheel_timer *timer, void *evdata) {
+    (*(int*)evdata)++;
+    return 0;
+}
+
+
+
+static void run(int wheel) {
+    struct event_base *base = event_base_new();
+    struct bench_timer *bench = calloc(timers, sizeof(struct bench_timer));
+    struct timeval start, deadline, timeout;
+    struct timer_wheel *timer_wheel = NULL;
+    double add, dispatch, walk, clear, cpu;
+    int i, fired = 0, found = 0;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += seconds;
+
+    if ( wheel ) {
+        timer_wheel = get_timer_wheel(base);
+    }
+
+    gettimeofday(&start, NULL);
+    for ( i = 0; i < timers; i++ ) {
+        bench[i].deadline = &deadline;
+        bench[i].interval = interval;
+        bench[i].fired = &fired;
+        next_timeout(&bench[i], &timeout);
+        if ( wheel ) {
+            wheel_timer_init(&bench[i].timer, timer_wheel, wheel_callback,
+                    &bench[i]);
+            wheel_timer_add(&bench[i].timer, &timeout);
+        } else {
+            bench[i].event = event_new(base, -1, 0, event_callback, &bench[i]);
+            event_add(bench[i].event, &timeout);
+        }
+    }
+    add = elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for ( i = 0; i < WALKS; i++ ) {
+        if ( wheel ) {
+            timer_wheel_foreach(timer_wheel, wheel_walk_callback, &found);
+        } else {
+            event_base_foreach_event(base, event_walk_callback, &found);
+        }
+    }
+    walk = elapsed(&start) / WALKS;
+    assert(found == timers * WALKS);
+
+    /* run until the deadline passes and every timer has fired one last time */
+    cpu = cpu_time();
+    event_base_dispatch(base);
+    dispatch = cpu_time() - cpu;
+
+    gettimeofday(&start, NULL);
+    for ( i = 0; i < timers; i++ ) {
+        if ( wheel ) {
+            wheel_timer_del(&bench[i].timer);
+        } else {
+            event_free(bench[i].event);
+        }
+    }
+    free_timer_wheel(timer_wheel);
+    clear = elapsed(&start);
+
+    printf("%-16s add %.3fms, walk %.3fms, clear %.3fms, "
+            "%d runs in %.3fs cpu (%.3fus each)\n",
+            wheel ? "timer wheel:" : "libevent timers:",
+            add * 1000, walk * 1000, clear * 1000, fired, dispatch,
+            dispatch * 1000000 / fired);
+
+    free(bench);
+    event_base_free(base);
+}
+
+
+
+int main(int argc, char *argv[]) {
+    timers = argc > 1 ? atoi(argv[1]) : 20000;
+    seconds = argc > 2 ? atoi(argv[2]) : 5;
+    interval = argc > 3 ? atoi(argv[3]) : 1000;
+
+    assert(timers > 0);
+    assert(seconds > 0);
+    assert(interval > 0);
+
+    srandom(1);
+    run(0);
+    srandom(1);
+    run(1);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,295 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <event2/event.h>
+
+#include "timerwheel.h"
+
+#define COUNT 5000
+#define START 1000
+
+struct fake_timer {
+    struct wheel_timer timer;
+    uint64_t expires;               /* tick the timer was meant to fire at */
+    uint64_t fired;                 /* tick the wheel was at when it fired */
+    int runs;                       /* number of times it has fired */
+    int repeat;                     /* re-add itself this long after firing */
+};
+
+static struct fake_timer timers[COUNT];
+static uint64_t now;
+static uint64_t last_fired;
+
+
+
+static void add_timer(struct fake_timer *fake, uint64_t delay) {
+    struct timeval timeout;
+
+    timeout.tv_sec = delay / 1000;
+    timeout.tv_usec = (delay % 1000) * 1000;
+    fake->expires = now + delay;
+    wheel_timer_add(&fake->timer, &timeout);
+}
+
+
+
+/*
+ * Check that timers fire once, in order, no earlier than they should and
+ * no later than the time the wheel was advanced to.
+ */
+static void fire(void *arg) {
+    struct fake_timer *fake = (struct fake_timer*)arg;
+
+    assert(fake->expires <= now);
+    assert(fake->expires >= last_fired);
+    assert(!wheel_timer_pending(&fake->timer, NULL));
+
+    last_fired = fake->expires;
+    fake->fired = now;
+    fake->runs++;
+
+    /* stay aligned to when it should have fired, like scheduled tests */
+    if ( fake->repeat ) {
+        add_timer(fake, fake->expires + fake->repeat - now);
+    }
+}
+
+
+
+static int count_callback(struct wheel_timer *timer, void *arg) {
+    assert(wheel_timer_pending(timer, NULL));
+    (*(int*)arg)++;
+    return 0;
+}
+
+
+
+static int delete_callback(struct wheel_timer *timer,
+        __attribute__((unused))void *arg) {
+    wheel_timer_del(timer);
+    return 0;
+}
+
+
+
+/*
+ * Step the wheel forward to the given time, occasionally checking that it
+ * never needs to look at anything later than the earliest pending timer.
+ */
+static void advance(struct timer_wheel *wheel, uint64_t to) {
+    uint64_t earliest = UINT64_MAX;
+    int i;
+
+    if ( random() % 64 == 0 ) {
+        for ( i = 0; i < COUNT; i++ ) {
+            if ( wheel_timer_pending(&timers[i].timer, NULL) &&
+                    timers[i].expires < earliest ) {
+                earliest = timers[i].expires;
+            }
+        }
+
+        assert(amp_test_next_timer_wheel_tick(wheel) <= earliest);
+    }
+
+    now = to;
+    amp_test_advance_timer_wheel(wheel, now);
+}
+
+
+
+/*
+ * Timers spread from now out to the given range should all fire at the
+ * right time, whatever steps the wheel is advanced in.
+ */
+static void test_expiry(uint64_t range, uint64_t step) {
+    struct timer_wheel *wheel;
+    uint64_t delay;
+    int i, pending;
+
+    now = START;
+    last_fired = 0;
+    wheel = amp_test_new_timer_wheel(now);
+    memset(timers, 0, sizeof(timers));
+
+    for ( i = 0; i < COUNT; i++ ) {
+        wheel_timer_init(&timers[i].timer, wheel, fire, &timers[i]);
+        /* a mix of short timers and ones spread across the range */
+        switch ( i % 4 ) {
+            case 0: delay = random() % 1000; break;
+            case 1: delay = random() % (range / 1000 + 1); break;
+            default: delay = ((uint64_t)random() << 16 | random()) % range;
+        };
+        add_timer(&timers[i], delay);
+    }
+
+    assert(timer_wheel_count(wheel) == COUNT);
+    pending = 0;
+    timer_wheel_foreach(wheel, count_callback, &pending);
+    assert(pending == COUNT);
+
+    while ( timer_wheel_count(wheel) > 0 ) {
+        /* big steps don't need to go through every tick in between */
+        advance(wheel, now + step + (random() % step));
+    }
+
+    for ( i = 0; i < COUNT; i++ ) {
+        assert(timers[i].runs == 1);
+        /* with small steps they should fire in the right tick */
+        if ( step == 1 ) {
+            assert(timers[i].fired - timers[i].expires <= 1);
+        }
+    }
+
+    free_timer_wheel(wheel);
+}
+
+
+
+/*
+ * Timers that add themselves back when they fire should keep firing at
+ * the right interval, and deleted timers should never fire.
+ */
+static void test_repeat(void) {
+    struct timer_wheel *wheel;
+    int i, pending;
+
+    now = START;
+    last_fired = 0;
+    wheel = amp_test_new_timer_wheel(now);
+    memset(timers, 0, sizeof(timers));
+
+    for ( i = 0; i < 100; i++ ) {
+        wheel_timer_init(&timers[i].timer, wheel, fire, &timers[i]);
+        timers[i].repeat = (i + 1) * 100;
+        add_timer(&timers[i], i);
+    }
+
+    /* adding a pending timer again moves it */
+    add_timer(&timers[0], 50);
+    assert(timer_wheel_count(wheel) == 100);
+
+    /* deleting one that is pending, or one that isn't, is fine */
+    wheel_timer_del(&timers[99].timer);
+    wheel_timer_del(&timers[99].timer);
+    assert(timer_wheel_count(wheel) == 99);
+
+    while ( now < START + 100000 ) {
+        last_fired = 0;
+        advance(wheel, now + 1 + (random() % 50));
+    }
+
+    for ( i = 0; i < 99; i++ ) {
+        uint64_t first = START + (i == 0 ? 50 : i);
+        assert(timers[i].runs == (int)(1 + (now - first) / timers[i].repeat));
+    }
+    assert(timers[99].runs == 0);
+
+    /* a timer that is due has a time, one that isn't doesn't */
+    {
+        struct timeval tv;
+        assert(wheel_timer_pending(&timers[0].timer, &tv));
+        assert(tv.tv_sec > 0);
+        assert(!wheel_timer_pending(&timers[99].timer, &tv));
+    }
+
+    /* the foreach callback is allowed to delete the timer it is given */
+    timer_wheel_foreach(wheel, delete_callback, NULL);
+    assert(timer_wheel_count(wheel) == 0);
+    pending = 0;
+    timer_wheel_foreach(wheel, count_callback, &pending);
+    assert(pending == 0);
+    assert(amp_test_next_timer_wheel_tick(wheel) == UINT64_MAX);
+
+    free_timer_wheel(wheel);
+}
+
+
+
+/*
+ * Wheels are shared by everything using the same event base, and are
+ * woken by a libevent timer.
+ */
+static void test_event_base(void) {
+    struct event_base *base = event_base_new();
+    struct timer_wheel *wheel = get_timer_wheel(base);
+    struct timeval timeout = { 0, 20000 };
+
+    assert(find_timer_wheel(base) == wheel);
+    assert(get_timer_wheel(base) == wheel);
+
+    now = 0;
+    last_fired = 0;
+    memset(timers, 0, sizeof(timers));
+    wheel_timer_init(&timers[0].timer, wheel, fire, &timers[0]);
+    wheel_timer_add(&timers[0].timer, &timeout);
+    timers[0].expires = 0;
+
+    event_base_dispatch(base);
+    assert(timers[0].runs == 1);
+    assert(timer_wheel_count(wheel) == 0);
+
+    free_timer_wheel(wheel);
+    assert(find_timer_wheel(base) == NULL);
+    event_base_free(base);
+}
+
+
+
+int main(void) {
+    srandom(1);
+
+    test_expiry(100000, 1);
+    test_expiry(100000000, 1000);
+    /* beyond the range of the top level of the wheel */
+    test_expiry(UINT64_C(1) << 36, 1000000);
+    test_repeat();
+    test_event_base();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Compare looking up ASNs with a connection per thread (the way each ASN
+ * worker used to) against the shared pipelined whois client, using the
+ * fake whois server. Each simulated traceroute looks up a mix of networks
+ * that are common to all tests (near the source) and networks that are
+ * unique to it (near the destination).
+ *
+ * Usage: whois.bench [tests] [addresses per test] [server delay ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "asn.h"
+#include "whois.h"
+#include "fakewhois.h"
+
+struct bench_thread {
+    struct whois_client *client;
+    char *port;
+    int id;
+    int count;
+    int answered;
+};
+
+
+
+static void make_addresses(int id, int count, struct sockaddr_storage *storage,
+        struct sockaddr **addrs) {
+    struct sockaddr_in *addr;
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        addr = (struct sockaddr_in*)&storage[i];
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        /* the first half of every path is shared between all the tests */
+        if ( i < count / 2 ) {
+            addr->sin_addr.s_addr = htonl(0x0a000000 | (i << 8) | 1);
+        } else {
+            addr->sin_addr.s_addr = htonl(0x0b000000 | (id << 12) | (i << 8));
+        }
+        addrs[i] = (struct sockaddr*)addr;
+    }
+}
+
+
+
+/*
+ * Connect, send every query, read every answer and disconnect.
+ */
+static void *separate_thread(void *data) {
+    struct bench_thread *args = (struct bench_thread*)data;
+    struct sockaddr_storage storage[args->count];
+    struct sockaddr *addrs[args->count];
+    char addrstr[INET6_ADDRSTRLEN];
+    char buffer[8192];
+    int fd, i, bytes, offset = 0;
+    char *line;
+
+    make_addresses(args->id, args->count, storage, addrs);
+
+    assert((fd = connect_to_whois_address("127.0.0.1", args->port)) >= 0);
+
+    for ( i = 0; i < args->count; i++ ) {
+        inet_ntop(AF_INET, &((struct sockaddr_in*)addrs[i])->sin_addr,
+                addrstr, sizeof(addrstr));
+        strcat(addrstr, "\n");
+        assert(send(fd, addrstr, strlen(addrstr), MSG_NOSIGNAL) > 0);
+    }
+
+    while ( args->answered < args->count &&
+            (bytes = recv(fd, buffer + offset,
+                          sizeof(buffer) - offset - 1, 0)) > 0 ) {
+        offset += bytes;
+        buffer[offset] = '\0';
+        while ( (line = strchr(buffer, '\n')) != NULL ) {
+            if ( strncmp(buffer, "Bulk", 4) != 0 ) {
+                args->answered++;
+            }
+            offset -= (line + 1 - buffer);
+            memmove(buffer, line + 1, offset + 1);
+        }
+    }
+
+    send(fd, "end\n", 4, MSG_NOSIGNAL);
+    close(fd);
+
+    return NULL;
+}
+
+
+
+/*
+ * Look everything up using the shared client.
+ */
+static void *shared_thread(void *data) {
+    struct bench_thread *args = (struct bench_thread*)data;
+    struct sockaddr_storage storage[args->count];
+    struct sockaddr *addrs[args->count];
+    int64_t asns[args->count];
+
+    make_addresses(args->id, args->count, storage, addrs);
+    args->answered = whois_client_lookup(args->client, addrs, args->count,
+            asns, 30);
+
+    return NULL;
+}
+
+
+
+static double run(void *(*func)(void*), struct whois_client *client,
+        char *port, int tests, int count) {
+    struct bench_thread args[tests];
+    pthread_t threads[tests];
+    struct timeval start, end;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    for ( i = 0; i < tests; i++ ) {
+        args[i].client = client;
+        args[i].port = port;
+        args[i].id = i;
+        args[i].count = count;
+        args[i].answered = 0;
+        pthread_create(&threads[i], NULL, func, &args[i]);
+    }
+
+    for ( i = 0; i < tests; i++ ) {
+        pthread_join(threads[i], NULL);
+        assert(args[i].answered == count);
+    }
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - start.tv_sec) +
+        (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+
+
+int main(int argc, char *argv[]) {
+    struct whois_client *client;
+    struct fake_whois *server;
+    int tests = argc > 1 ? atoi(argv[1]) : 50;
+    int count = argc > 2 ? atoi(argv[2]) : 30;
+    int delay = argc > 3 ? atoi(argv[3]) : 20;
+    double elapsed;
+
+    assert(tests > 0 && tests < 4096);
+    assert(count > 1 && count < 256);
+
+    server = start_fake_whois(delay);
+    elapsed = run(separate_thread, NULL, server->port, tests, count);
+    printf("connection per test: %.3fs, %u connections, %u queries\n",
+            elapsed, server->connections, server->queries);
+    stop_fake_whois(server);
+
+    server = start_fake_whois(delay);
+    client = whois_client_create("127.0.0.1", server->port);
+    elapsed = run(shared_thread, client, server->port, tests, count);
+    printf("shared client:       %.3fs, %u connections, %u queries\n",
+            elapsed, server->connections, server->queries);
+    whois_client_destroy(client);
+    stop_fake_whois(server);
+
+    return EXIT_SUCCESS;
+}
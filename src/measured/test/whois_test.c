@@ -0,0 +1,269 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "whois.h"
+#include "fakewhois.h"
+
+#define LOOKUP_THREADS 8
+#define LOOKUP_COUNT 6
+
+static char *addresses[LOOKUP_COUNT] = {
+    "192.0.2.1", "198.51.100.7", "203.0.113.200", "10.1.2.3",
+    "2001:db8::1", "2001:db8:0:1::1",
+};
+
+struct lookup_thread {
+    struct whois_client *client;
+    pthread_barrier_t *barrier;
+};
+
+
+
+static struct sockaddr *make_address(struct sockaddr_storage *addr,
+        char *str) {
+    memset(addr, 0, sizeof(*addr));
+
+    if ( inet_pton(AF_INET, str,
+                &((struct sockaddr_in*)addr)->sin_addr) == 1 ) {
+        addr->ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, str,
+                    &((struct sockaddr_in6*)addr)->sin6_addr) == 1);
+        addr->ss_family = AF_INET6;
+    }
+
+    return (struct sockaddr*)addr;
+}
+
+
+
+/*
+ * Look up all the test addresses and check they have the right ASNs.
+ * Addresses in the same /24 or /64 get the same answer, and "NA" answers
+ * are treated as AS 0.
+ */
+static void check_lookup(struct whois_client *client) {
+    struct sockaddr_storage storage[LOOKUP_COUNT];
+    struct sockaddr *addrs[LOOKUP_COUNT];
+    int64_t asns[LOOKUP_COUNT];
+    int64_t expected;
+    int i;
+
+    for ( i = 0; i < LOOKUP_COUNT; i++ ) {
+        addrs[i] = make_address(&storage[i], addresses[i]);
+    }
+
+    assert(whois_client_lookup(client, addrs, LOOKUP_COUNT, asns, 10) ==
+            LOOKUP_COUNT);
+
+    for ( i = 0; i < LOOKUP_COUNT; i++ ) {
+        expected = fake_whois_asn(addresses[i]);
+        if ( expected % 10 == 0 ) {
+            expected = 0;
+        }
+        assert(asns[i] == expected);
+    }
+}
+
+
+
+static void *lookup_thread(void *data) {
+    struct lookup_thread *args = (struct lookup_thread*)data;
+
+    pthread_barrier_wait(args->barrier);
+    check_lookup(args->client);
+
+    return NULL;
+}
+
+
+
+/*
+ * Listen on a port with a full accept queue, so connections to it hang
+ * waiting for the handshake to finish. The listening socket is put in fds[0]
+ * and the connections filling the queue in the rest of the array.
+ */
+static void start_hanging_listener(int *fds, int count, char *port,
+        int portlen) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    assert((fds[0] = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    assert(bind(fds[0], (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(fds[0], 0) == 0);
+    assert(getsockname(fds[0], (struct sockaddr*)&addr, &addrlen) == 0);
+
+    for ( i = 1; i < count; i++ ) {
+        assert((fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK,
+                        0)) >= 0);
+        connect(fds[i], (struct sockaddr*)&addr, sizeof(addr));
+    }
+
+    snprintf(port, portlen, "%d", ntohs(addr.sin_port));
+}
+
+
+
+static void *hanging_lookup_thread(void *data) {
+    struct whois_client *client = (struct whois_client*)data;
+    struct sockaddr_storage storage;
+    struct sockaddr *addr;
+    int64_t asn;
+
+    addr = make_address(&storage, "192.0.2.1");
+    assert(whois_client_lookup(client, &addr, 1, &asn, 2) == 0);
+    assert(asn == -1);
+
+    return NULL;
+}
+
+
+
+/*
+ * Check that lookups are answered over a single connection, that the same
+ * networks asked about by lots of threads at once are only sent once, that
+ * queries are sent again if the connection breaks, that lookups fail
+ * straight away if the server isn't there, and that a slow connection
+ * attempt doesn't hold up other lookups.
+ */
+int main(void) {
+    struct lookup_thread args[LOOKUP_THREADS];
+    pthread_t threads[LOOKUP_THREADS];
+    pthread_barrier_t barrier;
+    struct whois_client *client;
+    struct fake_whois *server;
+    struct whois_stats stats;
+    struct sockaddr_storage storage;
+    struct sockaddr *addr;
+    int64_t asn;
+    char port[8];
+    time_t start;
+    int fds[4];
+    int i;
+
+    /* sequential lookups share the same connection */
+    server = start_fake_whois(0);
+    client = whois_client_create("127.0.0.1", server->port);
+    check_lookup(client);
+    check_lookup(client);
+    assert(server->connections == 1);
+    assert(server->queries == 2 * LOOKUP_COUNT);
+    whois_client_destroy(client);
+    stop_fake_whois(server);
+
+    /* concurrent lookups for the same networks are only sent once */
+    server = start_fake_whois(200);
+    client = whois_client_create("127.0.0.1", server->port);
+    pthread_barrier_init(&barrier, NULL, LOOKUP_THREADS);
+    for ( i = 0; i < LOOKUP_THREADS; i++ ) {
+        args[i].client = client;
+        args[i].barrier = &barrier;
+        pthread_create(&threads[i], NULL, lookup_thread, &args[i]);
+    }
+    for ( i = 0; i < LOOKUP_THREADS; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    assert(server->connections == 1);
+    assert(server->queries == LOOKUP_COUNT);
+    whois_get_stats(&stats);
+    assert(stats.coalesced >= (LOOKUP_THREADS - 1) * LOOKUP_COUNT);
+    whois_client_destroy(client);
+    stop_fake_whois(server);
+
+    /* outstanding queries are sent again if the connection breaks */
+    server = start_fake_whois(0);
+    server->drop_after = 3;
+    client = whois_client_create("127.0.0.1", server->port);
+    check_lookup(client);
+    assert(server->connections == 2);
+    whois_client_destroy(client);
+    stop_fake_whois(server);
+
+    /* nothing listening, lookups fail without waiting for the timeout */
+    server = start_fake_whois(0);
+    strcpy(port, server->port);
+    stop_fake_whois(server);
+
+    client = whois_client_create("127.0.0.1", port);
+    addr = make_address(&storage, "192.0.2.1");
+    start = time(NULL);
+    assert(whois_client_lookup(client, &addr, 1, &asn, 10) == 0);
+    assert(asn == -1);
+    assert(whois_client_lookup(client, &addr, 1, &asn, 10) == 0);
+    assert(time(NULL) - start < 5);
+    whois_client_destroy(client);
+
+    /* other lookups give up on time while one thread is still connecting */
+    start_hanging_listener(fds, 4, port, sizeof(port));
+    client = whois_client_create("127.0.0.1", port);
+    pthread_create(&threads[0], NULL, hanging_lookup_thread, client);
+    usleep(200000);
+    addr = make_address(&storage, "198.51.100.7");
+    start = time(NULL);
+    assert(whois_client_lookup(client, &addr, 1, &asn, 1) == 0);
+    assert(asn == -1);
+    assert(time(NULL) - start < 3);
+    /* refuse the connection so the first lookup can finish */
+    for ( i = 0; i < 4; i++ ) {
+        close(fds[i]);
+    }
+    pthread_join(threads[0], NULL);
+    whois_client_destroy(client);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "workerpool.h"
+
+
+
+/*
+ * Build an addrinfo struct for a single address, like the nametable would.
+ */
+static struct addrinfo *build_dest(int family, char *address, char *name) {
+    struct addrinfo *dest = calloc(1, sizeof(struct addrinfo));
+
+    dest->ai_family = family;
+    dest->ai_socktype = SOCK_DGRAM;
+    dest->ai_canonname = name;
+
+    if ( family == AF_INET ) {
+        struct sockaddr_in *addr = calloc(1, sizeof(struct sockaddr_in));
+        addr->sin_family = AF_INET;
+        assert(inet_pton(AF_INET, address, &addr->sin_addr) == 1);
+        dest->ai_addr = (struct sockaddr*)addr;
+        dest->ai_addrlen = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6 *addr = calloc(1, sizeof(struct sockaddr_in6));
+        addr->sin6_family = AF_INET6;
+        assert(inet_pton(AF_INET6, address, &addr->sin6_addr) == 1);
+        dest->ai_addr = (struct sockaddr*)addr;
+        dest->ai_addrlen = sizeof(struct sockaddr_in6);
+    }
+
+    return dest;
+}
+
+
+
+/*
+ * Check that a schedule item serialised for the worker pool is rebuilt with
+ * all the information required to run the test.
+ */
+static void check_item(test_schedule_item_t *item) {
+    test_schedule_item_t out;
+    resolve_dest_t *a, *b;
+    uint64_t test_id;
+    int64_t queued;
+    uint32_t len;
+    uint32_t i;
+    void *data;
+
+    data = amp_test_pack_worker_item(item, 123456789, &len);
+    assert(data);
+
+    assert(amp_test_unpack_worker_item(data, len, &out, &test_id,
+                &queued) == 0);
+
+    assert(test_id == item->test->id);
+    assert(queued == 123456789);
+    assert(out.test == NULL);
+    assert(out.start_delay == item->start_delay);
+    assert(out.slot == item->slot);
+
+    /* meta information */
+    assert(out.meta);
+    assert(out.meta->inter_packet_delay == item->meta->inter_packet_delay);
+    assert(out.meta->dscp == item->meta->dscp);
+    assert((item->meta->iface == NULL && out.meta->iface == NULL) ||
+            strcmp(item->meta->iface, out.meta->iface) == 0);
+    assert((item->meta->sourcev4 == NULL && out.meta->sourcev4 == NULL) ||
+            strcmp(item->meta->sourcev4, out.meta->sourcev4) == 0);
+    assert((item->meta->sourcev6 == NULL && out.meta->sourcev6 == NULL) ||
+            strcmp(item->meta->sourcev6, out.meta->sourcev6) == 0);
+
+    /* test parameters */
+    if ( item->params == NULL ) {
+        assert(out.params == NULL);
+    } else {
+        for ( i = 0; item->params[i] != NULL; i++ ) {
+            assert(strcmp(item->params[i], out.params[i]) == 0);
+        }
+        assert(out.params[i] == NULL);
+    }
+
+    /* resolved destinations */
+    assert(out.dest_count == item->dest_count);
+    for ( i = 0; i < item->dest_count; i++ ) {
+        assert(out.dests[i]->ai_family == item->dests[i]->ai_family);
+        assert(out.dests[i]->ai_socktype == item->dests[i]->ai_socktype);
+        assert(out.dests[i]->ai_addrlen == item->dests[i]->ai_addrlen);
+        assert(memcmp(out.dests[i]->ai_addr, item->dests[i]->ai_addr,
+                    item->dests[i]->ai_addrlen) == 0);
+        assert(strcmp(out.dests[i]->ai_canonname,
+                    item->dests[i]->ai_canonname) == 0);
+    }
+
+    /* names to be resolved at test time, in the same order */
+    assert(out.resolve_count == item->resolve_count);
+    for ( a = item->resolve, b = out.resolve; a != NULL && b != NULL;
+            a = a->next, b = b->next ) {
+        assert(strcmp(a->name, b->name) == 0);
+        assert(a->count == b->count);
+        assert(a->family == b->family);
+    }
+    assert(a == NULL && b == NULL);
+
+    /* any truncated item should be rejected */
+    for ( i = 0; i < len; i++ ) {
+        assert(amp_test_unpack_worker_item(data, i, &out, &test_id,
+                    &queued) < 0);
+    }
+
+    free(data);
+}
+
+
+
+/*
+ * Test serialising schedule items to send to the worker pool.
+ */
+int main(void) {
+    test_schedule_item_t item;
+    amp_test_meta_t meta;
+    test_t test;
+    resolve_dest_t resolve[2];
+    struct addrinfo *dests[3];
+    char *params[] = { "-s", "84", "-r", "some long argument", NULL };
+
+    memset(&item, 0, sizeof(item));
+    memset(&meta, 0, sizeof(meta));
+    memset(&test, 0, sizeof(test));
+    memset(resolve, 0, sizeof(resolve));
+
+    test.id = 42;
+    test.name = "icmp";
+    meta.inter_packet_delay = 100;
+    item.test = &test;
+    item.meta = &meta;
+    item.start_delay = 2500;
+    item.slot = 7;
+
+    /* no destinations, parameters or meta strings */
+    check_item(&item);
+
+    /* meta strings and parameters */
+    meta.iface = "eth0";
+    meta.sourcev4 = "192.0.2.1";
+    meta.dscp = 46;
+    meta.inter_packet_delay = 1000;
+    item.params = params;
+    check_item(&item);
+
+    /* mixed address family destinations */
+    dests[0] = build_dest(AF_INET, "192.0.2.10", "one.example.com");
+    dests[1] = build_dest(AF_INET6, "2001:db8::10", "one.example.com");
+    dests[2] = build_dest(AF_INET, "198.51.100.1", "two.example.com");
+    item.dests = dests;
+    item.dest_count = 3;
+    check_item(&item);
+
+    /* destinations still to be resolved */
+    resolve[0].name = "three.example.com";
+    resolve[0].count = 1;
+    resolve[0].family = AF_INET6;
+    resolve[0].next = &resolve[1];
+    resolve[1].name = "four.example.com";
+    resolve[1].count = 0;
+    resolve[1].family = AF_UNSPEC;
+    item.resolve = resolve;
+    item.resolve_count = 2;
+    check_item(&item);
+
+    return 0;
+}
@@ -0,0 +1,639 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A hierarchical timer wheel for the test schedule. Every scheduled test
+ * used to have its own libevent timer, so with tens of thousands of tests
+ * the libevent heap saw a lot of churn as every test was re-added after
+ * each run, and anything that wanted to look at the schedule had to walk
+ * every event in the base.
+ *
+ * Timers are instead linked into a slot based on when they expire. The
+ * lowest level has a slot for each of the next 256 ticks (1ms), and each
+ * level above covers 256 times the range of the one below it. Adding or
+ * removing a timer is constant time, as is finding the timers that are due
+ * in a tick. When the lower levels wrap, the next slot of the level above is
+ * cascaded down into them. A single libevent timer per event base wakes the
+ * wheel up when the next slot needs attention.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+struct timer_wheel {
+    struct event_base *base;        /* event base driving the wheel */
+    struct event *event;            /* libevent timer that wakes the wheel */
+    uint64_t current;               /* first tick that hasn't been run yet */
+    uint64_t now;                   /* tick timers are being run at */
+    uint64_t scheduled;             /* tick the libevent timer is set for */
+    uint32_t count;                 /* number of pending timers */
+    int running;                    /* currently running expired timers */
+    struct wheel_timer *expired;    /* timers due in the current tick */
+    uint64_t occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64];
+    struct wheel_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct timer_wheel *next;
+};
+
+/* wheels for each event base, there is usually only one */
+static struct timer_wheel *wheels = NULL;
+
+#define TIMER_WHEEL_EXPIRED -1
+#define TIMER_WHEEL_NEVER UINT64_MAX
+
+
+
+/*
+ * Get the current time in milliseconds according to the monotonic clock.
+ */
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+
+
+/*
+ * Get the time that new timers should be relative to. While timers are
+ * being run this is the time the wheel woke up, the same as libevent uses a
+ * cached time while running callbacks. Wheels without an event base are
+ * driven manually and only know the time they were last told.
+ */
+static uint64_t get_wheel_time(struct timer_wheel *wheel) {
+    if ( wheel->running || wheel->base == NULL ) {
+        return wheel->now;
+    }
+
+    return monotonic_ms();
+}
+
+
+
+/*
+ * Find the first occupied slot in the range [from, to), or -1 if they are
+ * all empty.
+ */
+static int find_slot(const uint64_t *occupied, int from, int to) {
+    uint64_t word;
+    int slot;
+
+    while ( from < to ) {
+        word = occupied[from >> 6] >> (from & 63);
+        if ( word ) {
+            slot = from + __builtin_ctzll(word);
+            return slot < to ? slot : -1;
+        }
+        from = (from | 63) + 1;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Link a timer into the slot that it belongs in, relative to the current
+ * tick. Timers too far away for the top level go in the furthest slot and
+ * will be moved again once it is cascaded.
+ */
+static void link_timer(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    struct wheel_timer **head;
+    uint64_t expires, delta;
+    int level, slot;
+
+    if ( timer->expires < wheel->current ) {
+        timer->expires = wheel->current;
+    }
+
+    expires = timer->expires;
+    delta = expires - wheel->current;
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS - 1; level++ ) {
+        if ( delta < UINT64_C(1) << ((level + 1) * TIMER_WHEEL_BITS) ) {
+            break;
+        }
+    }
+
+    if ( delta >> (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS) ) {
+        expires = wheel->current +
+            (UINT64_C(1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+    }
+
+    slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    head = &wheel->slots[level][slot];
+
+    timer->next = *head;
+    if ( timer->next ) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    timer->slot = (level * TIMER_WHEEL_SLOTS) + slot;
+    *head = timer;
+
+    wheel->occupied[level][slot >> 6] |= UINT64_C(1) << (slot & 63);
+}
+
+
+
+/*
+ * Remove a timer from whichever slot it is in, marking the slot as empty
+ * if it was the last one there.
+ */
+static void unlink_timer(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    int level, slot;
+
+    *timer->pprev = timer->next;
+    if ( timer->next ) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    if ( timer->slot != TIMER_WHEEL_EXPIRED ) {
+        level = timer->slot / TIMER_WHEEL_SLOTS;
+        slot = timer->slot % TIMER_WHEEL_SLOTS;
+        if ( wheel->slots[level][slot] == NULL ) {
+            wheel->occupied[level][slot >> 6] &= ~(UINT64_C(1) << (slot & 63));
+        }
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+
+
+/*
+ * Find the next tick at which something needs doing: either there are
+ * timers in the lowest level that are due, or a slot in a higher level
+ * needs to be cascaded. Returns TIMER_WHEEL_NEVER if the wheel is empty.
+ */
+static uint64_t next_tick(struct timer_wheel *wheel) {
+    uint64_t best = TIMER_WHEEL_NEVER;
+    uint64_t start, tick;
+    int level, shift, digit, slot;
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS; level++ ) {
+        shift = level * TIMER_WHEEL_BITS;
+
+        /* slots in this level are only looked at on these boundaries */
+        start = ((wheel->current + (UINT64_C(1) << shift) - 1) >> shift)
+            << shift;
+        digit = (start >> shift) & TIMER_WHEEL_MASK;
+
+        if ( (slot = find_slot(wheel->occupied[level], digit,
+                        TIMER_WHEEL_SLOTS)) < 0 &&
+                (slot = find_slot(wheel->occupied[level], 0, digit)) < 0 ) {
+            continue;
+        }
+
+        tick = start + ((uint64_t)((slot - digit) & TIMER_WHEEL_MASK) << shift);
+        if ( tick < best ) {
+            best = tick;
+        }
+    }
+
+    return best;
+}
+
+
+
+/*
+ * Move all the timers in a slot down to the levels below, now that they
+ * are close enough.
+ */
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+    struct wheel_timer *timer, *next;
+
+    timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level][slot >> 6] &= ~(UINT64_C(1) << (slot & 63));
+
+    for ( /* */; timer != NULL; timer = next ) {
+        next = timer->next;
+        link_timer(wheel, timer);
+    }
+}
+
+
+
+/*
+ * Run every timer that is due at or before the given tick, in order.
+ */
+static void advance_timer_wheel(struct timer_wheel *wheel, uint64_t now) {
+    struct wheel_timer *timer;
+    uint64_t tick;
+    int level, slot;
+
+    wheel->running = 1;
+    wheel->now = now;
+
+    while ( (tick = next_tick(wheel)) <= now ) {
+        wheel->current = tick;
+
+        for ( level = TIMER_WHEEL_LEVELS - 1; level > 0; level-- ) {
+            if ( (tick & ((UINT64_C(1) << (level * TIMER_WHEEL_BITS)) - 1))
+                    == 0 ) {
+                cascade(wheel, level,
+                        (tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+            }
+        }
+
+        /*
+         * Move the due timers out of the wheel before running them, as they
+         * will most likely add themselves back and could land in this slot.
+         */
+        slot = tick & TIMER_WHEEL_MASK;
+        wheel->expired = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0][slot >> 6] &= ~(UINT64_C(1) << (slot & 63));
+
+        if ( wheel->expired ) {
+            wheel->expired->pprev = &wheel->expired;
+        }
+
+        for ( timer = wheel->expired; timer != NULL; timer = timer->next ) {
+            timer->slot = TIMER_WHEEL_EXPIRED;
+        }
+
+        wheel->current = tick + 1;
+
+        while ( (timer = wheel->expired) != NULL ) {
+            unlink_timer(wheel, timer);
+            timer->callback(timer->arg);
+        }
+    }
+
+    if ( wheel->current <= now ) {
+        wheel->current = now + 1;
+    }
+
+    wheel->running = 0;
+}
+
+
+
+/*
+ * Set the libevent timer to wake the wheel at the given tick.
+ */
+static void schedule_timer_wheel(struct timer_wheel *wheel, uint64_t tick) {
+    struct timeval timeout;
+    uint64_t now;
+
+    wheel->scheduled = tick;
+
+    if ( wheel->base == NULL ) {
+        return;
+    }
+
+    if ( tick == TIMER_WHEEL_NEVER ) {
+        event_del(wheel->event);
+        return;
+    }
+
+    now = monotonic_ms();
+    tick = tick > now ? tick - now : 0;
+    timeout.tv_sec = tick / 1000;
+    timeout.tv_usec = (tick % 1000) * 1000;
+
+    event_add(wheel->event, &timeout);
+}
+
+
+
+/*
+ * Run all the timers that are due, then go back to sleep until the next
+ * time the wheel needs looking at.
+ */
+static void timer_wheel_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+
+    struct timer_wheel *wheel = (struct timer_wheel*)evdata;
+    uint64_t now = monotonic_ms();
+
+    /*
+     * libevent might be using a coarser clock than we are and wake slightly
+     * early, but it's only ever woken when something is due.
+     */
+    if ( now < wheel->scheduled ) {
+        now = wheel->scheduled;
+    }
+
+    advance_timer_wheel(wheel, now);
+    schedule_timer_wheel(wheel, next_tick(wheel));
+}
+
+
+
+/*
+ * Create a new, empty timer wheel starting at the given tick.
+ */
+static struct timer_wheel *new_timer_wheel(struct event_base *base,
+        uint64_t now) {
+    struct timer_wheel *wheel = calloc(1, sizeof(struct timer_wheel));
+
+    wheel->base = base;
+    wheel->current = now;
+    wheel->now = now;
+    wheel->scheduled = TIMER_WHEEL_NEVER;
+
+    if ( base != NULL ) {
+        wheel->event = event_new(base, -1, 0, timer_wheel_callback, wheel);
+    }
+
+    return wheel;
+}
+
+
+
+/*
+ * Find the timer wheel belonging to an event base, or NULL if it doesn't
+ * have one.
+ */
+struct timer_wheel *find_timer_wheel(struct event_base *base) {
+    struct timer_wheel *wheel;
+
+    for ( wheel = wheels; wheel != NULL; wheel = wheel->next ) {
+        if ( wheel->base == base ) {
+            return wheel;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Get the timer wheel belonging to an event base, creating it if this is
+ * the first time it has been used.
+ */
+struct timer_wheel *get_timer_wheel(struct event_base *base) {
+    struct timer_wheel *wheel;
+
+    assert(base);
+
+    if ( (wheel = find_timer_wheel(base)) == NULL ) {
+        wheel = new_timer_wheel(base, monotonic_ms());
+        wheel->next = wheels;
+        wheels = wheel;
+    }
+
+    return wheel;
+}
+
+
+
+/*
+ * Free a timer wheel and its libevent timer. Any timers still in the wheel
+ * are left idle, but the memory they belong to is up to the caller. This
+ * needs to happen before the event base is freed.
+ */
+void free_timer_wheel(struct timer_wheel *wheel) {
+    struct timer_wheel **prev;
+    struct wheel_timer *timer;
+    int level, slot;
+
+    if ( wheel == NULL ) {
+        return;
+    }
+
+    for ( prev = &wheels; *prev != NULL; prev = &(*prev)->next ) {
+        if ( *prev == wheel ) {
+            *prev = wheel->next;
+            break;
+        }
+    }
+
+    while ( (timer = wheel->expired) != NULL ) {
+        unlink_timer(wheel, timer);
+    }
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS; level++ ) {
+        for ( slot = 0; slot < TIMER_WHEEL_SLOTS; slot++ ) {
+            while ( (timer = wheel->slots[level][slot]) != NULL ) {
+                unlink_timer(wheel, timer);
+            }
+        }
+    }
+
+    if ( wheel->event ) {
+        event_free(wheel->event);
+    }
+
+    free(wheel);
+}
+
+
+
+/*
+ * Prepare a timer to run the given function when it fires. It doesn't run
+ * until it is added.
+ */
+void wheel_timer_init(struct wheel_timer *timer, struct timer_wheel *wheel,
+        wheel_timer_cb callback, void *arg) {
+    assert(timer);
+    assert(wheel);
+
+    memset(timer, 0, sizeof(struct wheel_timer));
+    timer->wheel = wheel;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+
+
+/*
+ * Schedule a timer to fire once, after the given amount of time. A timer
+ * that is already pending is moved to the new time, like event_add().
+ * Timers have millisecond resolution and are rounded up so that they never
+ * fire early.
+ */
+void wheel_timer_add(struct wheel_timer *timer, const struct timeval *timeout) {
+    struct timer_wheel *wheel;
+    uint64_t now;
+
+    assert(timer);
+    assert(timer->wheel);
+    assert(timeout);
+
+    wheel = timer->wheel;
+
+    if ( timer->pprev ) {
+        unlink_timer(wheel, timer);
+    }
+
+    now = get_wheel_time(wheel);
+
+    /* nothing is waiting, so there is nothing to run on the way to now */
+    if ( wheel->count == 0 && !wheel->running && now > wheel->current ) {
+        wheel->current = now;
+    }
+
+    timer->expires = now + (timeout->tv_sec * 1000) +
+        ((timeout->tv_usec + 999) / 1000);
+
+    link_timer(wheel, timer);
+    wheel->count++;
+
+    if ( !wheel->running && timer->expires < wheel->scheduled ) {
+        schedule_timer_wheel(wheel, timer->expires);
+    }
+}
+
+
+
+/*
+ * Stop a timer from firing. Does nothing if the timer isn't pending.
+ */
+void wheel_timer_del(struct wheel_timer *timer) {
+    assert(timer);
+
+    if ( timer->pprev == NULL ) {
+        return;
+    }
+
+    unlink_timer(timer->wheel, timer);
+}
+
+
+
+/*
+ * Check if a timer is waiting to fire, and if so optionally get the wall
+ * clock time it will fire at, like event_pending().
+ */
+int wheel_timer_pending(const struct wheel_timer *timer, struct timeval *tv) {
+    uint64_t now, remaining;
+
+    assert(timer);
+
+    if ( timer->pprev == NULL ) {
+        return 0;
+    }
+
+    if ( tv ) {
+        now = get_wheel_time(timer->wheel);
+        remaining = timer->expires > now ? timer->expires - now : 0;
+        gettimeofday(tv, NULL);
+        tv->tv_sec += remaining / 1000;
+        tv->tv_usec += (remaining % 1000) * 1000;
+        if ( tv->tv_usec >= 1000000 ) {
+            tv->tv_sec++;
+            tv->tv_usec -= 1000000;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Call a function on every pending timer, in no particular order. The
+ * function may delete the timer it is given, but must not add or delete
+ * any others. Stops early if the function returns non-zero, and returns
+ * that value.
+ */
+int timer_wheel_foreach(struct timer_wheel *wheel, timer_wheel_foreach_cb fn,
+        void *arg) {
+    struct wheel_timer *timer, *next;
+    int level, slot, result;
+
+    if ( wheel == NULL ) {
+        return 0;
+    }
+
+    for ( timer = wheel->expired; timer != NULL; timer = next ) {
+        next = timer->next;
+        if ( (result = fn(timer, arg)) != 0 ) {
+            return result;
+        }
+    }
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS; level++ ) {
+        slot = 0;
+        while ( (slot = find_slot(wheel->occupied[level], slot,
+                        TIMER_WHEEL_SLOTS)) >= 0 ) {
+            for ( timer = wheel->slots[level][slot]; timer != NULL;
+                    timer = next ) {
+                next = timer->next;
+                if ( (result = fn(timer, arg)) != 0 ) {
+                    return result;
+                }
+            }
+            slot++;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get the number of timers that are pending.
+ */
+uint32_t timer_wheel_count(struct timer_wheel *wheel) {
+    return wheel ? wheel->count : 0;
+}
+
+
+
+#if UNIT_TEST
+struct timer_wheel *amp_test_new_timer_wheel(uint64_t now) {
+    return new_timer_wheel(NULL, now);
+}
+
+void amp_test_advance_timer_wheel(struct timer_wheel *wheel, uint64_t now) {
+    advance_timer_wheel(wheel, now);
+}
+
+uint64_t amp_test_next_timer_wheel_tick(struct timer_wheel *wheel) {
+    return next_tick(wheel);
+}
+#endif
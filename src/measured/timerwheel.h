@@ -0,0 +1,95 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_TIMERWHEEL_H
+#define _MEASURED_TIMERWHEEL_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <event2/event.h>
+
+/*
+ * Four levels of 256 slots, with a tick of 1ms, covers timers up to about
+ * 49 days away. Anything further out is parked in the top level and moved
+ * down as it gets closer.
+ */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+struct timer_wheel;
+
+typedef void (*wheel_timer_cb)(void *arg);
+
+/*
+ * A single timer, embedded in whatever it is that needs to be run. The wheel
+ * doesn't allocate or free any timers, it just links them into its slots.
+ */
+struct wheel_timer {
+    struct wheel_timer *next;       /* next timer in the same slot */
+    struct wheel_timer **pprev;     /* pointer to this timer, NULL if idle */
+    uint64_t expires;               /* tick (ms) the timer should fire at */
+    int32_t slot;                   /* level and slot the timer is in */
+    struct timer_wheel *wheel;      /* wheel the timer belongs to */
+    wheel_timer_cb callback;        /* function to run when the timer fires */
+    void *arg;                      /* argument passed to the callback */
+};
+
+typedef int (*timer_wheel_foreach_cb)(struct wheel_timer *timer, void *arg);
+
+struct timer_wheel *get_timer_wheel(struct event_base *base);
+struct timer_wheel *find_timer_wheel(struct event_base *base);
+void free_timer_wheel(struct timer_wheel *wheel);
+void wheel_timer_init(struct wheel_timer *timer, struct timer_wheel *wheel,
+        wheel_timer_cb callback, void *arg);
+void wheel_timer_add(struct wheel_timer *timer, const struct timeval *timeout);
+void wheel_timer_del(struct wheel_timer *timer);
+int wheel_timer_pending(const struct wheel_timer *timer, struct timeval *tv);
+int timer_wheel_foreach(struct timer_wheel *wheel, timer_wheel_foreach_cb fn,
+        void *arg);
+uint32_t timer_wheel_count(struct timer_wheel *wheel);
+#if UNIT_TEST
+struct timer_wheel *amp_test_new_timer_wheel(uint64_t now);
+void amp_test_advance_timer_wheel(struct timer_wheel *wheel, uint64_t now);
+uint64_t amp_test_next_timer_wheel_tick(struct timer_wheel *wheel);
+#endif
+
+#endif
@@ -0,0 +1,905 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Shared, pipelined client for the Team Cymru whois bulk interface.
+ *
+ * Every ASN resolving thread used to open its own connection to the whois
+ * server, send all its queries and then wait for the answers before closing
+ * it again. When lots of traceroute tests finish at the same time this means
+ * lots of short lived connections, often asking about the same networks.
+ *
+ * Instead a single connection is kept open while it is being used. Threads
+ * queue their queries to be written to the connection (the server answers
+ * them in bulk mode as they arrive), skipping any network that another
+ * thread is already waiting on, and a single reader thread matches the
+ * answers to the waiting threads. The lock is never held while connecting
+ * or writing, so one slow connection attempt doesn't hold up every thread.
+ * If the connection breaks, outstanding queries are sent again over a new
+ * one; if the server can't be reached then lookups fail immediately until
+ * it is time to try again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#if _WIN32
+#include "w32-compat.h"
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+#include "whois.h"
+#include "asn.h"
+#include "debug.h"
+
+
+static struct whois_stats whois_stats;
+
+
+
+/*
+ * Mask an address down to the /24 or /64 network that will be cached.
+ */
+static int get_whois_network(struct sockaddr *address,
+        struct sockaddr_storage *network) {
+
+    memset(network, 0, sizeof(struct sockaddr_storage));
+
+    switch ( address->sa_family ) {
+        case AF_INET:
+            memcpy(network, address, sizeof(struct sockaddr_in));
+            ((uint8_t*)&((struct sockaddr_in*)network)->sin_addr)[3] = 0;
+            ((struct sockaddr_in*)network)->sin_port = 0;
+            break;
+        case AF_INET6:
+            network->ss_family = AF_INET6;
+            memcpy(&((struct sockaddr_in6*)network)->sin6_addr,
+                    &((struct sockaddr_in6*)address)->sin6_addr, 8);
+            break;
+        default:
+            return -1;
+    };
+
+    return 0;
+}
+
+
+
+/*
+ * FNV-1a hash of the network address.
+ */
+static unsigned int hash_whois_network(struct sockaddr_storage *network) {
+    uint8_t *bytes;
+    unsigned int length;
+    uint32_t hash = 2166136261U;
+    unsigned int i;
+
+    if ( network->ss_family == AF_INET ) {
+        bytes = (uint8_t*)&((struct sockaddr_in*)network)->sin_addr;
+        length = 4;
+    } else {
+        bytes = (uint8_t*)&((struct sockaddr_in6*)network)->sin6_addr;
+        length = 16;
+    }
+
+    for ( i = 0; i < length; i++ ) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+
+    return hash % WHOIS_HASH_SIZE;
+}
+
+
+
+static int same_whois_network(struct sockaddr_storage *a,
+        struct sockaddr_storage *b) {
+
+    if ( a->ss_family != b->ss_family ) {
+        return 0;
+    }
+
+    if ( a->ss_family == AF_INET ) {
+        return memcmp(&((struct sockaddr_in*)a)->sin_addr,
+                &((struct sockaddr_in*)b)->sin_addr,
+                sizeof(struct in_addr)) == 0;
+    }
+
+    return memcmp(&((struct sockaddr_in6*)a)->sin6_addr,
+            &((struct sockaddr_in6*)b)->sin6_addr,
+            sizeof(struct in6_addr)) == 0;
+}
+
+
+
+/*
+ * Find an outstanding query for a network. Must hold the client mutex.
+ */
+static struct whois_query *find_whois_query(struct whois_client *client,
+        struct sockaddr_storage *network) {
+    struct whois_query *query;
+
+    for ( query = client->queries[hash_whois_network(network)];
+            query != NULL; query = query->next ) {
+        if ( same_whois_network(&query->network, network) ) {
+            return query;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+static void release_whois_request(struct whois_request *request) {
+    if ( --request->refcount > 0 ) {
+        return;
+    }
+
+    pthread_cond_destroy(&request->done);
+    free(request->asns);
+    free(request);
+}
+
+
+
+/*
+ * Give the answer to everyone waiting on a query and remove it. An ASN of
+ * -1 means the query failed. Must hold the client mutex.
+ */
+static void complete_whois_query(struct whois_client *client,
+        struct whois_query *query, int64_t asn) {
+    struct whois_query **prev;
+    struct whois_waiter *waiter;
+
+    for ( prev = &client->queries[hash_whois_network(&query->network)];
+            *prev != query; prev = &(*prev)->next ) {
+        assert(*prev);
+    }
+    *prev = query->next;
+
+    while ( (waiter = query->waiters) != NULL ) {
+        query->waiters = waiter->next;
+        waiter->request->asns[waiter->index] = asn;
+        if ( --waiter->request->remaining == 0 ) {
+            pthread_cond_signal(&waiter->request->done);
+        }
+        release_whois_request(waiter->request);
+        free(waiter);
+    }
+
+    __atomic_add_fetch(asn < 0 ? &whois_stats.failed : &whois_stats.answered,
+            1, __ATOMIC_RELAXED);
+
+    client->outstanding--;
+    free(query);
+}
+
+
+
+/*
+ * Fail every outstanding query. Must hold the client mutex.
+ */
+static void fail_whois_queries(struct whois_client *client) {
+    int i;
+
+    for ( i = 0; i < WHOIS_HASH_SIZE; i++ ) {
+        while ( client->queries[i] != NULL ) {
+            complete_whois_query(client, client->queries[i], -1);
+        }
+    }
+}
+
+
+
+/*
+ * Append a query for the network to the buffer of text being sent.
+ */
+static int format_whois_query(struct sockaddr_storage *network, char *buffer,
+        int offset, int buflen) {
+    char addrstr[INET6_ADDRSTRLEN];
+    void *addrptr;
+
+    if ( network->ss_family == AF_INET ) {
+        addrptr = &((struct sockaddr_in*)network)->sin_addr;
+    } else {
+        addrptr = &((struct sockaddr_in6*)network)->sin6_addr;
+    }
+
+    inet_ntop(network->ss_family, addrptr, addrstr, sizeof(addrstr));
+
+    return offset + snprintf(buffer + offset, buflen - offset, "%s\n",
+            addrstr);
+}
+
+
+
+/*
+ * Write the whole buffer to the server, dealing with partial sends.
+ */
+static int send_whois_buffer(int fd, char *buffer, int length) {
+    int sent = 0;
+    int bytes;
+
+    while ( sent < length ) {
+        if ( (bytes = send(fd, buffer + sent, length - sent,
+                        MSG_NOSIGNAL)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Error writing to whois socket: %s",
+                    strerror(errno));
+            return -1;
+        }
+        sent += bytes;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Add a query to the text waiting to be sent to the whois server. Must hold
+ * the client mutex.
+ */
+static void queue_whois_query(struct whois_client *client,
+        struct whois_query *query, time_t now) {
+
+    if ( client->pending_len + INET6_ADDRSTRLEN + 2 > client->pending_size ) {
+        client->pending_size = client->pending_size * 2 +
+            (INET6_ADDRSTRLEN + 2) * 64;
+        client->pending = realloc(client->pending, client->pending_size);
+    }
+
+    client->pending_len = format_whois_query(&query->network, client->pending,
+            client->pending_len, client->pending_size);
+    query->attempts++;
+    query->sent = now;
+
+    __atomic_add_fetch(&whois_stats.sent, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Write any queued queries to the whois server. The mutex is released while
+ * sending so other threads can keep adding queries, which will be sent by
+ * whichever thread is currently sending. Must hold the client mutex.
+ */
+static void flush_whois_queries(struct whois_client *client) {
+    char *buffer;
+    int length, fd, result;
+
+    while ( client->pending_len > 0 && !client->sending && client->fd >= 0 &&
+            !client->broken ) {
+        buffer = client->pending;
+        length = client->pending_len;
+        client->pending = NULL;
+        client->pending_len = 0;
+        client->pending_size = 0;
+
+        /* the reader thread won't close the connection while sending */
+        client->sending = 1;
+        fd = client->fd;
+        pthread_mutex_unlock(&client->mutex);
+
+        result = send_whois_buffer(fd, buffer, length);
+        free(buffer);
+
+        pthread_mutex_lock(&client->mutex);
+        client->sending = 0;
+
+        /* the reader thread will resend everything if this fails */
+        if ( result < 0 ) {
+            client->broken = 1;
+            pthread_cond_signal(&client->wake);
+        }
+
+        pthread_cond_broadcast(&client->changed);
+    }
+}
+
+
+
+/*
+ * Connect to the whois server, unless it failed recently and it's not yet
+ * time to try again. The mutex is released while connecting, and any other
+ * thread that wants the connection waits for the result. On success every
+ * outstanding query is queued to be sent, on failure they are all failed.
+ * Must hold the client mutex.
+ */
+static int connect_whois_client(struct whois_client *client) {
+    struct whois_query *query;
+    time_t now = time(NULL);
+    int fd;
+    int i;
+
+    if ( client->fd >= 0 ) {
+        return 0;
+    }
+
+    if ( client->connecting ) {
+        while ( client->connecting ) {
+            pthread_cond_wait(&client->changed, &client->mutex);
+        }
+        return client->fd >= 0 ? 0 : -1;
+    }
+
+    if ( now < client->retry ) {
+        return -1;
+    }
+
+    client->connecting = 1;
+    pthread_mutex_unlock(&client->mutex);
+
+    fd = connect_to_whois_address(client->server, client->port);
+
+    pthread_mutex_lock(&client->mutex);
+    client->connecting = 0;
+    pthread_cond_broadcast(&client->changed);
+
+    now = time(NULL);
+
+    if ( fd < 0 ) {
+        client->retry = now + client->backoff;
+        Log(LOG_WARNING, "Failed to connect to whois server, not trying "
+                "again for %d seconds", client->backoff);
+        client->backoff = client->backoff * 2;
+        if ( client->backoff > WHOIS_MAX_BACKOFF ) {
+            client->backoff = WHOIS_MAX_BACKOFF;
+        }
+        fail_whois_queries(client);
+        return -1;
+    }
+
+    client->fd = fd;
+    client->broken = 0;
+    client->backoff = WHOIS_MIN_BACKOFF;
+    client->last_active = now;
+    __atomic_add_fetch(&whois_stats.connects, 1, __ATOMIC_RELAXED);
+
+    for ( i = 0; i < WHOIS_HASH_SIZE; i++ ) {
+        for ( query = client->queries[i]; query != NULL; query = query->next ) {
+            queue_whois_query(client, query, now);
+        }
+    }
+
+    pthread_cond_signal(&client->wake);
+
+    return 0;
+}
+
+
+
+/*
+ * Politely close the connection to the whois server, waiting for any thread
+ * that is still writing to it. Only the reader thread closes the connection.
+ * Must hold the client mutex, which is released while closing.
+ */
+static void close_whois_client(struct whois_client *client) {
+    int fd, broken;
+
+    while ( client->sending ) {
+        pthread_cond_wait(&client->changed, &client->mutex);
+    }
+
+    if ( client->fd < 0 ) {
+        return;
+    }
+
+    fd = client->fd;
+    broken = client->broken;
+    client->fd = -1;
+    client->broken = 0;
+    client->pending_len = 0;
+
+    pthread_mutex_unlock(&client->mutex);
+
+    if ( !broken ) {
+        send(fd, "end\n", strlen("end\n"), MSG_NOSIGNAL);
+    }
+
+    close(fd);
+
+    pthread_mutex_lock(&client->mutex);
+}
+
+
+
+/*
+ * Replace a broken connection and send all the outstanding queries again,
+ * failing any that have already been sent too many times. Must hold the
+ * client mutex.
+ */
+static void reconnect_whois_client(struct whois_client *client) {
+    struct whois_query *query, *next;
+    int i;
+
+    close_whois_client(client);
+
+    for ( i = 0; i < WHOIS_HASH_SIZE; i++ ) {
+        for ( query = client->queries[i]; query != NULL; query = next ) {
+            next = query->next;
+            if ( query->attempts >= WHOIS_MAX_ATTEMPTS ) {
+                complete_whois_query(client, query, -1);
+            }
+        }
+    }
+
+    if ( client->outstanding == 0 ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "Resending %d outstanding whois queries",
+            client->outstanding);
+
+    if ( connect_whois_client(client) == 0 ) {
+        flush_whois_queries(client);
+    }
+}
+
+
+
+/*
+ * Parse a single response line and answer the matching query. Lines look
+ * like "64496   | 192.0.2.0" with unknown addresses having an ASN of "NA".
+ * Must hold the client mutex.
+ */
+static void process_whois_line(struct whois_client *client, char *line) {
+    struct sockaddr_storage addr, network;
+    struct whois_query *query;
+    char *asstr, *addrstr, *saveptr = NULL;
+    int64_t asn;
+
+    /* ignore the header or any error messages */
+    if ( strncmp(line, "Bulk", 4) == 0 || strncmp(line, "Error", 5) == 0 ) {
+        return;
+    }
+
+    if ( (asstr = strtok_r(line, "|", &saveptr)) == NULL ||
+            (addrstr = strtok_r(NULL, "| \t\r", &saveptr)) == NULL ) {
+        Log(LOG_DEBUG, "Ignoring malformed whois response");
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+
+    if ( inet_pton(AF_INET, addrstr,
+                &((struct sockaddr_in*)&addr)->sin_addr) == 1 ) {
+        addr.ss_family = AF_INET;
+    } else if ( inet_pton(AF_INET6, addrstr,
+                &((struct sockaddr_in6*)&addr)->sin6_addr) == 1 ) {
+        addr.ss_family = AF_INET6;
+    } else {
+        Log(LOG_DEBUG, "Ignoring whois response with invalid address");
+        return;
+    }
+
+    get_whois_network((struct sockaddr*)&addr, &network);
+
+    if ( (query = find_whois_query(client, &network)) == NULL ) {
+        /* probably an answer to a query that was sent twice */
+        return;
+    }
+
+    /* unknown addresses are "NA", which is treated as AS 0 */
+    asn = strtoll(asstr, NULL, 10);
+
+    complete_whois_query(client, query, asn);
+}
+
+
+
+/*
+ * Answer queries for all the complete lines in the buffer, and move any
+ * partial line to the front. Must hold the client mutex.
+ */
+static void process_whois_buffer(struct whois_client *client, char *buffer,
+        int *offset) {
+    char *line = buffer;
+    char *end;
+
+    while ( (end = strchr(line, '\n')) != NULL ) {
+        *end = '\0';
+        process_whois_line(client, line);
+        line = end + 1;
+    }
+
+    *offset -= (line - buffer);
+    memmove(buffer, line, *offset);
+    buffer[*offset] = '\0';
+
+    /* a line this long isn't a response we understand, throw it away */
+    if ( *offset >= WHOIS_BUFFER_SIZE - 1 ) {
+        Log(LOG_WARNING, "Discarding overlong whois response");
+        *offset = 0;
+        buffer[0] = '\0';
+    }
+}
+
+
+
+/*
+ * Give up on the connection if any query has been waiting too long for an
+ * answer. Must hold the client mutex.
+ */
+static int check_whois_timeouts(struct whois_client *client, time_t now) {
+    struct whois_query *query;
+    int i;
+
+    for ( i = 0; i < WHOIS_HASH_SIZE; i++ ) {
+        for ( query = client->queries[i]; query != NULL; query = query->next ) {
+            if ( query->sent + WHOIS_QUERY_TIMEOUT <= now ) {
+                Log(LOG_WARNING, "Timeout waiting for whois response");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Read responses from the whois server and pass them to the waiting
+ * threads. Also looks after replacing broken connections and closing the
+ * connection when it hasn't been used for a while.
+ */
+static void *whois_reader_thread(void *data) {
+    struct whois_client *client = (struct whois_client*)data;
+    char buffer[WHOIS_BUFFER_SIZE];
+    struct timeval timeout;
+    struct timespec wait;
+    fd_set readset;
+    int offset = 0;
+    int ready, bytes, fd;
+    time_t now;
+
+    buffer[0] = '\0';
+
+    pthread_mutex_lock(&client->mutex);
+
+    while ( client->running ) {
+        now = time(NULL);
+
+        if ( client->broken ) {
+            reconnect_whois_client(client);
+            offset = 0;
+            continue;
+        }
+
+        /* nothing to read, wait for more queries */
+        if ( client->fd < 0 || client->outstanding == 0 ) {
+            if ( client->fd >= 0 &&
+                    client->last_active + WHOIS_IDLE_TIMEOUT <= now ) {
+                Log(LOG_DEBUG, "Closing idle whois connection");
+                close_whois_client(client);
+                offset = 0;
+            }
+            wait.tv_sec = now + 1;
+            wait.tv_nsec = 0;
+            pthread_cond_timedwait(&client->wake, &client->mutex, &wait);
+            continue;
+        }
+
+        if ( check_whois_timeouts(client, now) < 0 ) {
+            client->broken = 1;
+            continue;
+        }
+
+        /* only this thread closes the connection, so fd stays valid */
+        fd = client->fd;
+        pthread_mutex_unlock(&client->mutex);
+
+        FD_ZERO(&readset);
+        FD_SET(fd, &readset);
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
+        bytes = 0;
+        if ( (ready = select(fd + 1, &readset, NULL, NULL, &timeout)) > 0 ) {
+            bytes = recv(fd, buffer + offset,
+                    WHOIS_BUFFER_SIZE - offset - 1, 0);
+        }
+
+        pthread_mutex_lock(&client->mutex);
+
+        if ( ready < 0 && errno != EINTR ) {
+            Log(LOG_WARNING, "Error waiting for whois data: %s",
+                    strerror(errno));
+            client->broken = 1;
+        } else if ( ready > 0 && bytes <= 0 ) {
+            if ( bytes == 0 ) {
+                Log(LOG_DEBUG, "whois server closed the connection");
+            } else {
+                Log(LOG_WARNING, "Error receiving from whois server: %s",
+                        strerror(errno));
+            }
+            client->broken = 1;
+        } else if ( ready > 0 ) {
+            offset += bytes;
+            buffer[offset] = '\0';
+            client->last_active = time(NULL);
+            process_whois_buffer(client, buffer, &offset);
+        }
+    }
+
+    /* let any thread that is connecting finish, so it can be closed */
+    while ( client->connecting ) {
+        pthread_cond_wait(&client->changed, &client->mutex);
+    }
+
+    close_whois_client(client);
+    fail_whois_queries(client);
+
+    pthread_mutex_unlock(&client->mutex);
+
+    return NULL;
+}
+
+
+
+/*
+ * Look up the ASNs for a list of addresses, waiting up to timeout seconds
+ * for the answers. Each answer is put in the matching position of the asns
+ * array, or -1 if it couldn't be found. Returns the number of addresses that
+ * were answered.
+ */
+int whois_client_lookup(struct whois_client *client,
+        struct sockaddr **addresses, int count, int64_t *asns, int timeout) {
+
+    struct whois_request *request;
+    struct whois_waiter *waiter;
+    struct whois_query *query;
+    struct sockaddr_storage network;
+    struct timespec deadline;
+    int answered = 0, sent = 0;
+    unsigned int bucket;
+    time_t now;
+    int i;
+
+    assert(client);
+    assert(addresses);
+    assert(asns);
+
+    for ( i = 0; i < count; i++ ) {
+        asns[i] = -1;
+    }
+
+    if ( count <= 0 ) {
+        return 0;
+    }
+
+    __atomic_add_fetch(&whois_stats.requests, count, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&client->mutex);
+
+    now = time(NULL);
+
+    if ( client->fd < 0 && !client->connecting && now < client->retry ) {
+        pthread_mutex_unlock(&client->mutex);
+        Log(LOG_DEBUG, "whois connection unavailable, ignoring");
+        return 0;
+    }
+
+    request = calloc(1, sizeof(struct whois_request));
+    request->asns = malloc(sizeof(int64_t) * count);
+    request->refcount = 1;
+    pthread_cond_init(&request->done, NULL);
+
+    for ( i = 0; i < count; i++ ) {
+        request->asns[i] = -1;
+
+        if ( get_whois_network(addresses[i], &network) < 0 ) {
+            continue;
+        }
+
+        /* only send the query if nobody else is already waiting on it */
+        if ( (query = find_whois_query(client, &network)) == NULL ) {
+            query = calloc(1, sizeof(struct whois_query));
+            memcpy(&query->network, &network, sizeof(network));
+            query->sent = now;
+            bucket = hash_whois_network(&network);
+            query->next = client->queries[bucket];
+            client->queries[bucket] = query;
+            client->outstanding++;
+            /* otherwise it gets sent once there is a working connection */
+            if ( client->fd >= 0 && !client->broken ) {
+                queue_whois_query(client, query, now);
+            }
+            sent++;
+        } else {
+            __atomic_add_fetch(&whois_stats.coalesced, 1, __ATOMIC_RELAXED);
+        }
+
+        waiter = malloc(sizeof(struct whois_waiter));
+        waiter->request = request;
+        waiter->index = i;
+        waiter->next = query->waiters;
+        query->waiters = waiter;
+        request->remaining++;
+        request->refcount++;
+    }
+
+    if ( sent > 0 ) {
+        /* failing to connect fails all the queries, including these ones */
+        if ( client->fd < 0 && !client->connecting ) {
+            connect_whois_client(client);
+        }
+        flush_whois_queries(client);
+        client->last_active = time(NULL);
+        pthread_cond_signal(&client->wake);
+    }
+
+    deadline.tv_sec = now + timeout;
+    deadline.tv_nsec = 0;
+
+    while ( request->remaining > 0 ) {
+        if ( pthread_cond_timedwait(&request->done, &client->mutex,
+                    &deadline) == ETIMEDOUT ) {
+            Log(LOG_WARNING, "Timeout waiting for %d whois responses",
+                    request->remaining);
+            break;
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        if ( (asns[i] = request->asns[i]) >= 0 ) {
+            answered++;
+        }
+    }
+
+    /* any queries still outstanding will free the request when answered */
+    release_whois_request(request);
+
+    pthread_mutex_unlock(&client->mutex);
+
+    return answered;
+}
+
+
+
+/*
+ * Create a new client for the given whois server, and start the thread
+ * that reads responses. The connection is made when it is first needed.
+ */
+struct whois_client *whois_client_create(char *server, char *port) {
+    struct whois_client *client;
+
+    assert(server);
+    assert(port);
+
+    client = calloc(1, sizeof(struct whois_client));
+    client->server = strdup(server);
+    client->port = strdup(port);
+    client->fd = -1;
+    client->backoff = WHOIS_MIN_BACKOFF;
+    client->running = 1;
+
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_cond_init(&client->wake, NULL);
+    pthread_cond_init(&client->changed, NULL);
+
+    if ( pthread_create(&client->thread, NULL, whois_reader_thread,
+                client) != 0 ) {
+        Log(LOG_WARNING, "Failed to create whois reader thread");
+        pthread_cond_destroy(&client->changed);
+        pthread_cond_destroy(&client->wake);
+        pthread_mutex_destroy(&client->mutex);
+        free(client->server);
+        free(client->port);
+        free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+
+
+/*
+ * Stop the reader thread, close the connection and fail any queries that
+ * are still outstanding.
+ */
+void whois_client_destroy(struct whois_client *client) {
+    if ( client == NULL ) {
+        return;
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    client->running = 0;
+    pthread_cond_signal(&client->wake);
+    pthread_mutex_unlock(&client->mutex);
+
+    pthread_join(client->thread, NULL);
+
+    pthread_cond_destroy(&client->changed);
+    pthread_cond_destroy(&client->wake);
+    pthread_mutex_destroy(&client->mutex);
+    free(client->pending);
+    free(client->server);
+    free(client->port);
+    free(client);
+}
+
+
+
+/*
+ * Get a copy of the current whois counters.
+ */
+void whois_get_stats(struct whois_stats *stats) {
+    assert(stats);
+
+    stats->requests = __atomic_load_n(&whois_stats.requests, __ATOMIC_RELAXED);
+    stats->coalesced = __atomic_load_n(&whois_stats.coalesced,
+            __ATOMIC_RELAXED);
+    stats->sent = __atomic_load_n(&whois_stats.sent, __ATOMIC_RELAXED);
+    stats->answered = __atomic_load_n(&whois_stats.answered, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&whois_stats.failed, __ATOMIC_RELAXED);
+    stats->connects = __atomic_load_n(&whois_stats.connects, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Write the whois counters to a file for debugging.
+ */
+void dump_whois_stats(FILE *out) {
+    struct whois_stats stats;
+
+    assert(out);
+
+    whois_get_stats(&stats);
+
+    fprintf(out, "===== WHOIS =====\n");
+    fprintf(out, "requests %" PRIu64 " coalesced %" PRIu64 " sent %" PRIu64
+            " answered %" PRIu64 " failed %" PRIu64 " connects %" PRIu64
+            "\n\n", stats.requests, stats.coalesced, stats.sent,
+            stats.answered, stats.failed, stats.connects);
+}
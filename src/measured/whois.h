@@ -0,0 +1,145 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MEASURED_WHOIS_H
+#define _MEASURED_WHOIS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#if _WIN32
+#include "w32-compat.h"
+#else
+#include <sys/socket.h>
+#endif
+
+/* number of buckets used to find outstanding queries */
+#define WHOIS_HASH_SIZE 1024
+
+/* how long a query can be outstanding before giving up on the connection */
+#define WHOIS_QUERY_TIMEOUT 30
+
+/* close the connection after this long without any queries */
+#define WHOIS_IDLE_TIMEOUT 60
+
+/* how many times to send a query, in case the connection breaks */
+#define WHOIS_MAX_ATTEMPTS 2
+
+/* wait between 1 and 300 seconds before trying to reconnect after failure */
+#define WHOIS_MIN_BACKOFF 1
+#define WHOIS_MAX_BACKOFF 300
+
+/* space for responses from the whois server that are still being read */
+#define WHOIS_BUFFER_SIZE 8192
+
+/* a thread waiting on the answers for a list of addresses */
+struct whois_request {
+    int64_t *asns;              /* answers, -1 if not (yet) known */
+    int remaining;              /* number of unanswered queries */
+    int refcount;               /* waiting thread plus unanswered queries */
+    pthread_cond_t done;        /* signalled when everything is answered */
+};
+
+/* one part of a request waiting on a particular query */
+struct whois_waiter {
+    struct whois_request *request;
+    int index;
+    struct whois_waiter *next;
+};
+
+/* a single /24 or /64 network that has been sent to the whois server */
+struct whois_query {
+    struct sockaddr_storage network;
+    time_t sent;
+    int attempts;
+    struct whois_waiter *waiters;
+    struct whois_query *next;
+};
+
+/*
+ * A long lived connection to the whois server, shared between all the ASN
+ * resolving threads. Threads queue their queries to be sent over the
+ * connection (unless an identical query is already outstanding) and then
+ * wait for the reader thread to collect the answers. Connecting and sending
+ * are done without holding the mutex, so a slow or unreachable server
+ * doesn't stop other threads from using the client.
+ */
+struct whois_client {
+    char *server;
+    char *port;
+    int fd;                     /* connection to the server, or -1 */
+    int broken;                 /* set if the connection needs replacing */
+    int connecting;             /* set while a thread is connecting */
+    int sending;                /* set while a thread is writing queries */
+    int running;                /* cleared to stop the reader thread */
+    int outstanding;            /* queries waiting for a response */
+    int backoff;                /* seconds to wait after next failure */
+    time_t retry;               /* don't try to connect before this time */
+    time_t last_active;         /* last time a query or response was seen */
+    char *pending;              /* queries waiting to be written */
+    int pending_len;
+    int pending_size;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;        /* new queries are outstanding */
+    pthread_cond_t changed;     /* connecting or sending has finished */
+    struct whois_query *queries[WHOIS_HASH_SIZE];
+};
+
+/* counters describing how well the connection is being shared */
+struct whois_stats {
+    uint64_t requests;          /* addresses asked about by threads */
+    uint64_t coalesced;         /* addresses already being looked up */
+    uint64_t sent;              /* queries sent to the whois server */
+    uint64_t answered;          /* queries answered by the whois server */
+    uint64_t failed;            /* queries given up on */
+    uint64_t connects;          /* connections made to the whois server */
+};
+
+struct whois_client *whois_client_create(char *server, char *port);
+void whois_client_destroy(struct whois_client *client);
+int whois_client_lookup(struct whois_client *client,
+        struct sockaddr **addresses, int count, int64_t *asns, int timeout);
+void whois_get_stats(struct whois_stats *stats);
+void dump_whois_stats(FILE *out);
+
+#endif
@@ -0,0 +1,748 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A pool of pre-forked processes used to run scheduled tests. Rather than
+ * forking the whole of measured (and then tearing down the event loop and
+ * schedule) every time a test is due, a single "zygote" process is forked
+ * once when the test modules are loaded. The zygote keeps a number of idle
+ * worker processes ready, all blocked reading from the same SOCK_SEQPACKET
+ * socket. Dispatching a test is then a single message send: whichever idle
+ * worker receives the item runs the test and exits, and the zygote forks a
+ * replacement from its own (small, already cleaned up) address space.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "workerpool.h"
+#include "run.h"
+#include "watchdog.h"
+#include "debug.h"
+#include "modules.h"
+#include "global.h"
+#include "testlib.h"
+#include "waitset.h"
+#include "ssl.h"
+#include "admission.h"
+
+/* largest item that will be sent to the pool, bigger ones are forked */
+#define MAX_WORKER_ITEM_LEN (64 * 1024)
+
+/* buffer used while serialising a test item */
+struct pack_buffer {
+    char *data;
+    uint32_t len;
+    uint32_t size;
+};
+
+/* number of idle workers to keep ready, 0 disables the pool */
+static int pool_size = 0;
+
+/* parent end of the socket the workers read test items from */
+static int pool_fd = -1;
+
+/* process id of the zygote that maintains the idle workers */
+static pid_t zygote_pid = 0;
+
+
+
+/*
+ * Append a block of bytes to the pack buffer, growing it if required.
+ */
+static int pack_bytes(struct pack_buffer *buf, const void *data, uint32_t len) {
+    if ( buf->len + len > buf->size ) {
+        char *tmp;
+        uint32_t size = buf->size ? buf->size : 1024;
+
+        while ( buf->len + len > size ) {
+            size *= 2;
+        }
+
+        if ( (tmp = realloc(buf->data, size)) == NULL ) {
+            return -1;
+        }
+
+        buf->data = tmp;
+        buf->size = size;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+
+
+/*
+ * Append a string to the pack buffer, prefixed by its length including the
+ * terminating null. A NULL string is written as a zero length.
+ */
+static int pack_string(struct pack_buffer *buf, const char *str) {
+    uint16_t len = 0;
+
+    if ( str != NULL ) {
+        if ( strlen(str) + 1 > UINT16_MAX ) {
+            return -1;
+        }
+        len = strlen(str) + 1;
+    }
+
+    if ( pack_bytes(buf, &len, sizeof(len)) < 0 ) {
+        return -1;
+    }
+
+    return len > 0 ? pack_bytes(buf, str, len) : 0;
+}
+
+
+
+/*
+ * Serialise all the parts of a test schedule item that are needed to run the
+ * test into a single buffer that can be sent to a worker. Pointers into the
+ * parent (test definitions, meta information) can't be used by the worker
+ * once the schedule has been reloaded, so everything is copied by value and
+ * the test is identified by its id.
+ */
+static void *pack_worker_item(test_schedule_item_t *item, int64_t queued,
+        uint32_t *len) {
+    struct pack_buffer buf;
+    struct worker_item_header header;
+    resolve_dest_t *resolve;
+    uint32_t i;
+    int failed = 0;
+
+    assert(item);
+    assert(item->test);
+    assert(item->meta);
+    assert(len);
+
+    memset(&buf, 0, sizeof(buf));
+    memset(&header, 0, sizeof(header));
+
+    header.test_id = item->test->id;
+    header.queued = queued;
+    header.start_delay = item->start_delay;
+    header.slot = item->slot;
+    header.inter_packet_delay = item->meta->inter_packet_delay;
+    header.dscp = item->meta->dscp;
+    header.dest_count = item->dest_count;
+
+    for ( resolve = item->resolve; resolve != NULL; resolve = resolve->next ) {
+        header.resolve_count++;
+    }
+
+    if ( item->params != NULL ) {
+        for ( i = 0; item->params[i] != NULL; i++ ) {
+            header.param_count++;
+        }
+    }
+
+    failed |= pack_bytes(&buf, &header, sizeof(header));
+    failed |= pack_string(&buf, item->meta->iface);
+    failed |= pack_string(&buf, item->meta->sourcev4);
+    failed |= pack_string(&buf, item->meta->sourcev6);
+
+    for ( i = 0; i < header.param_count; i++ ) {
+        failed |= pack_string(&buf, item->params[i]);
+    }
+
+    for ( i = 0; i < header.dest_count; i++ ) {
+        struct addrinfo *dest = item->dests[i];
+        int32_t family = dest->ai_family;
+        int32_t socktype = dest->ai_socktype;
+        int32_t protocol = dest->ai_protocol;
+        uint32_t addrlen = dest->ai_addrlen;
+
+        failed |= pack_bytes(&buf, &family, sizeof(family));
+        failed |= pack_bytes(&buf, &socktype, sizeof(socktype));
+        failed |= pack_bytes(&buf, &protocol, sizeof(protocol));
+        failed |= pack_bytes(&buf, &addrlen, sizeof(addrlen));
+        failed |= pack_bytes(&buf, dest->ai_addr, addrlen);
+        failed |= pack_string(&buf, dest->ai_canonname);
+    }
+
+    for ( resolve = item->resolve; resolve != NULL; resolve = resolve->next ) {
+        int32_t family = resolve->family;
+
+        failed |= pack_bytes(&buf, &resolve->count, sizeof(resolve->count));
+        failed |= pack_bytes(&buf, &family, sizeof(family));
+        failed |= pack_string(&buf, resolve->name);
+    }
+
+    if ( failed ) {
+        free(buf.data);
+        return NULL;
+    }
+
+    *len = buf.len;
+    return buf.data;
+}
+
+
+
+/*
+ * Read a block of bytes from the buffer, making sure not to run off the end.
+ */
+static int unpack_bytes(char **ptr, char *end, void *out, uint32_t len) {
+    if ( *ptr + len > end ) {
+        return -1;
+    }
+
+    memcpy(out, *ptr, len);
+    *ptr += len;
+
+    return 0;
+}
+
+
+
+/*
+ * Read a length prefixed string from the buffer into newly allocated memory.
+ * A zero length string is returned as NULL.
+ */
+static int unpack_string(char **ptr, char *end, char **out) {
+    uint16_t len;
+
+    *out = NULL;
+
+    if ( unpack_bytes(ptr, end, &len, sizeof(len)) < 0 ) {
+        return -1;
+    }
+
+    if ( len == 0 ) {
+        return 0;
+    }
+
+    /* the string must fit in the buffer and be properly terminated */
+    if ( *ptr + len > end || (*ptr)[len - 1] != '\0' ) {
+        return -1;
+    }
+
+    *out = strdup(*ptr);
+    *ptr += len;
+
+    return 0;
+}
+
+
+
+/*
+ * Free all the memory allocated while unpacking a test item.
+ */
+static void free_worker_item(test_schedule_item_t *item) {
+    resolve_dest_t *resolve;
+    uint32_t i;
+
+    if ( item->meta ) {
+        free(item->meta->iface);
+        free(item->meta->sourcev4);
+        free(item->meta->sourcev6);
+        free(item->meta);
+    }
+
+    if ( item->params ) {
+        for ( i = 0; item->params[i] != NULL; i++ ) {
+            free(item->params[i]);
+        }
+        free(item->params);
+    }
+
+    if ( item->dests ) {
+        for ( i = 0; i < item->dest_count; i++ ) {
+            if ( item->dests[i] ) {
+                free(item->dests[i]->ai_addr);
+                free(item->dests[i]->ai_canonname);
+                free(item->dests[i]);
+            }
+        }
+        free(item->dests);
+    }
+
+    while ( item->resolve != NULL ) {
+        resolve = item->resolve;
+        item->resolve = resolve->next;
+        free(resolve->name);
+        free(resolve);
+    }
+
+    memset(item, 0, sizeof(*item));
+}
+
+
+
+/*
+ * Rebuild a test schedule item from a buffer created by pack_worker_item().
+ * The test definition isn't filled in, the caller should look it up using
+ * the returned test id.
+ */
+static int unpack_worker_item(void *data, uint32_t len,
+        test_schedule_item_t *item, uint64_t *test_id, int64_t *queued) {
+    struct worker_item_header header;
+    resolve_dest_t **tail;
+    char *ptr = data;
+    char *end = ptr + len;
+    uint32_t i;
+
+    assert(data);
+    assert(item);
+    assert(test_id);
+    assert(queued);
+
+    memset(item, 0, sizeof(*item));
+
+    if ( unpack_bytes(&ptr, end, &header, sizeof(header)) < 0 ) {
+        return -1;
+    }
+
+    /* every entry takes at least a couple of bytes, sanity check counts */
+    if ( header.param_count > MAX_TEST_ARGS ||
+            header.dest_count > len || header.resolve_count > len ) {
+        return -1;
+    }
+
+    *test_id = header.test_id;
+    *queued = header.queued;
+    item->start_delay = header.start_delay;
+    item->slot = header.slot;
+
+    item->meta = calloc(1, sizeof(amp_test_meta_t));
+    item->meta->inter_packet_delay = header.inter_packet_delay;
+    item->meta->dscp = header.dscp;
+
+    if ( unpack_string(&ptr, end, &item->meta->iface) < 0 ||
+            unpack_string(&ptr, end, &item->meta->sourcev4) < 0 ||
+            unpack_string(&ptr, end, &item->meta->sourcev6) < 0 ) {
+        goto fail;
+    }
+
+    if ( header.param_count > 0 ) {
+        item->params = calloc(header.param_count + 1, sizeof(char*));
+        for ( i = 0; i < header.param_count; i++ ) {
+            if ( unpack_string(&ptr, end, &item->params[i]) < 0 ||
+                    item->params[i] == NULL ) {
+                goto fail;
+            }
+        }
+    }
+
+    if ( header.dest_count > 0 ) {
+        item->dests = calloc(header.dest_count, sizeof(struct addrinfo*));
+        item->dest_count = header.dest_count;
+        for ( i = 0; i < header.dest_count; i++ ) {
+            struct addrinfo *dest = calloc(1, sizeof(struct addrinfo));
+            int32_t family, socktype, protocol;
+            uint32_t addrlen;
+
+            item->dests[i] = dest;
+
+            if ( unpack_bytes(&ptr, end, &family, sizeof(family)) < 0 ||
+                    unpack_bytes(&ptr, end, &socktype, sizeof(socktype)) < 0 ||
+                    unpack_bytes(&ptr, end, &protocol, sizeof(protocol)) < 0 ||
+                    unpack_bytes(&ptr, end, &addrlen, sizeof(addrlen)) < 0 ||
+                    addrlen > sizeof(struct sockaddr_storage) ) {
+                goto fail;
+            }
+
+            dest->ai_family = family;
+            dest->ai_socktype = socktype;
+            dest->ai_protocol = protocol;
+            dest->ai_addrlen = addrlen;
+            dest->ai_addr = calloc(1, sizeof(struct sockaddr_storage));
+
+            if ( unpack_bytes(&ptr, end, dest->ai_addr, addrlen) < 0 ||
+                    unpack_string(&ptr, end, &dest->ai_canonname) < 0 ) {
+                goto fail;
+            }
+        }
+    }
+
+    tail = &item->resolve;
+    for ( i = 0; i < header.resolve_count; i++ ) {
+        resolve_dest_t *resolve = calloc(1, sizeof(resolve_dest_t));
+        int32_t family;
+
+        *tail = resolve;
+        tail = &resolve->next;
+
+        if ( unpack_bytes(&ptr, end, &resolve->count,
+                    sizeof(resolve->count)) < 0 ||
+                unpack_bytes(&ptr, end, &family, sizeof(family)) < 0 ||
+                unpack_string(&ptr, end, &resolve->name) < 0 ||
+                resolve->name == NULL ) {
+            goto fail;
+        }
+
+        resolve->family = family;
+        item->resolve_count++;
+    }
+
+    /* there shouldn't be anything left over */
+    if ( ptr != end ) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    free_worker_item(item);
+    return -1;
+}
+
+
+
+/*
+ * Idle worker process. Wait for a test item to arrive on the shared socket,
+ * tell the zygote that a replacement is needed, then run the test. This
+ * never returns - either the test runs and exits, or the pool is shutting
+ * down and there is nothing left to do.
+ */
+static void run_worker(int fd, int notify_fd) {
+    test_schedule_item_t item;
+    uint64_t test_id;
+    int64_t queued;
+    char *buffer;
+    ssize_t bytes;
+
+    /* tests expect to be able to wait on their own children */
+    signal(SIGCHLD, SIG_DFL);
+
+    /*
+     * Seed the random number generators now, while idle, so that each worker
+     * gets a different sequence and none of the work is done at test time.
+     */
+    srandom(time(NULL) + getpid());
+    reseed_openssl_rng();
+
+    if ( (buffer = malloc(MAX_WORKER_ITEM_LEN)) == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate worker buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    do {
+        bytes = recv(fd, buffer, MAX_WORKER_ITEM_LEN, 0);
+    } while ( bytes < 0 && errno == EINTR );
+
+    /* let the zygote know this worker is busy, even if the item is bad */
+    if ( write(notify_fd, "", 1) < 0 ) {
+        Log(LOG_WARNING, "Failed to notify worker pool: %s", strerror(errno));
+    }
+
+    close(notify_fd);
+    close(fd);
+
+    /* the parent closing the socket means the pool is being shut down */
+    if ( bytes <= 0 ) {
+        free(buffer);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* give back the admission slot on any failure before the test starts */
+    if ( unpack_worker_item(buffer, bytes, &item, &test_id, &queued) < 0 ) {
+        Log(LOG_WARNING, "Worker received malformed test item, ignoring");
+        admission_cancel(item.slot);
+        free(buffer);
+        exit(EXIT_FAILURE);
+    }
+
+    free(buffer);
+
+    if ( (item.test = get_test_by_id(test_id)) == NULL ) {
+        Log(LOG_WARNING, "Worker received unknown test id %" PRIu64, test_id);
+        admission_cancel(item.slot);
+        free_worker_item(&item);
+        exit(EXIT_FAILURE);
+    }
+
+    Log(LOG_DEBUG, "Started %s test in pool worker %d after %" PRId64 "us",
+            item.test->name, getpid(), (monotonic_ns() - queued) / 1000);
+
+    run_test(&item, NULL);
+
+    Log(LOG_WARNING, "%s test failed to run", item.test->name);
+    admission_cancel(item.slot);
+    exit(EXIT_FAILURE);
+}
+
+
+
+/*
+ * Main loop of the zygote process. Keep the pool topped up with idle
+ * workers, forking a replacement each time one of them takes a test item,
+ * and reap any workers that have finished running their tests.
+ */
+static void run_zygote(int fd) {
+    int notify[2];
+    int idle = 0;
+
+    if ( pipe(notify) < 0 ) {
+        Log(LOG_WARNING, "Failed to create worker pool pipe: %s",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while ( 1 ) {
+        struct pollfd fds[2];
+        char buf[MAX_WORKER_POOL_SIZE];
+        ssize_t bytes;
+        pid_t pid;
+
+        while ( idle < pool_size ) {
+            if ( (pid = fork()) < 0 ) {
+                Log(LOG_WARNING, "Failed to fork pool worker: %s",
+                        strerror(errno));
+                break;
+            } else if ( pid == 0 ) {
+                close(notify[0]);
+                run_worker(fd, notify[1]);
+                /* not reached */
+                exit(EXIT_FAILURE);
+            }
+
+            idle++;
+        }
+
+        /* tidy up any workers that have finished running tests */
+        child_reaper(0, 0, NULL);
+
+        /* peer shutdown shows up as POLLHUP, don't read the test items */
+        fds[0].fd = fd;
+        fds[0].events = 0;
+        fds[1].fd = notify[0];
+        fds[1].events = POLLIN;
+
+        if ( poll(fds, 2, WORKER_POOL_POLL_MS) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Worker pool poll failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if ( fds[0].revents & (POLLHUP | POLLERR | POLLNVAL) ) {
+            Log(LOG_DEBUG, "Worker pool socket closed, zygote exiting");
+            exit(EXIT_SUCCESS);
+        }
+
+        /* one byte is written by every worker that has taken a test item */
+        if ( fds[1].revents & POLLIN ) {
+            if ( (bytes = read(notify[0], buf, sizeof(buf))) > 0 ) {
+                idle -= bytes;
+                if ( idle < 0 ) {
+                    idle = 0;
+                }
+            }
+        }
+    }
+}
+
+
+
+/*
+ * Set the number of idle workers the pool should maintain. This only takes
+ * effect the next time the pool is started.
+ */
+void set_worker_pool_size(int size) {
+    if ( size < 0 ) {
+        size = 0;
+    } else if ( size > MAX_WORKER_POOL_SIZE ) {
+        size = MAX_WORKER_POOL_SIZE;
+    }
+
+    pool_size = size;
+}
+
+
+
+/*
+ * Fork the zygote process that will maintain the pool of idle workers. This
+ * should be called after the test modules are loaded (so that every worker
+ * has them) but before the schedule is read, so that tearing down the copy
+ * of the event loop in the zygote is cheap.
+ */
+int start_worker_pool(struct event_base *base) {
+    int sv[2];
+    pid_t pid;
+
+    if ( pool_size <= 0 ) {
+        return 0;
+    }
+
+    if ( pool_fd >= 0 ) {
+        stop_worker_pool();
+    }
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 ) {
+        Log(LOG_WARNING, "Failed to create worker pool socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if ( (pid = fork()) < 0 ) {
+        Log(LOG_WARNING, "Failed to fork worker pool: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if ( pid == 0 ) {
+        /* same clean up that fork_test() does for each individual test */
+        close(sv[0]);
+        close(vars.asnsock_fd);
+        close(vars.nssock_fd);
+
+        if ( unblock_signals() < 0 ) {
+            Log(LOG_WARNING, "Failed to unblock signals, aborting");
+            exit(EXIT_FAILURE);
+        }
+
+        clear_test_schedule(base, 1);
+        event_base_free(base);
+
+        set_proc_name("test worker pool");
+
+        run_zygote(sv[1]);
+        /* not reached */
+        exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    pool_fd = sv[0];
+    zygote_pid = pid;
+
+    Log(LOG_DEBUG, "Started worker pool %d with %d workers", pid, pool_size);
+
+    return 0;
+}
+
+
+
+/*
+ * Shut down the worker pool. Idle workers and the zygote will see the socket
+ * close and exit, any tests that are already running will continue until
+ * they complete.
+ */
+void stop_worker_pool(void) {
+    if ( pool_fd < 0 ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "Stopping worker pool %d", zygote_pid);
+
+    /*
+     * Shut down rather than just close, as any test processes forked from
+     * measured may still hold a copy of this descriptor.
+     */
+    shutdown(pool_fd, SHUT_RDWR);
+    close(pool_fd);
+    pool_fd = -1;
+    zygote_pid = 0;
+}
+
+
+
+/*
+ * Hand a test item to the next available worker. Returns 0 if the item was
+ * queued for a worker, or -1 if the caller should run the test itself (the
+ * pool is disabled, broken or full).
+ */
+int dispatch_to_worker_pool(test_schedule_item_t *item) {
+    void *data;
+    uint32_t len;
+
+    if ( pool_fd < 0 ) {
+        return -1;
+    }
+
+    /* if the zygote has gone away then nothing will replace busy workers */
+    if ( kill(zygote_pid, 0) < 0 ) {
+        Log(LOG_WARNING, "Worker pool %d has exited, forking tests instead",
+                zygote_pid);
+        stop_worker_pool();
+        return -1;
+    }
+
+    if ( (data = pack_worker_item(item, monotonic_ns(), &len)) == NULL ) {
+        Log(LOG_WARNING, "Failed to serialise %s test for worker pool",
+                item->test->name);
+        return -1;
+    }
+
+    if ( len > MAX_WORKER_ITEM_LEN ) {
+        Log(LOG_DEBUG, "%s test item too large for worker pool",
+                item->test->name);
+        free(data);
+        return -1;
+    }
+
+    if ( send(pool_fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+        Log(LOG_WARNING, "Failed to dispatch %s test to worker pool: %s",
+                item->test->name, strerror(errno));
+        free(data);
+        return -1;
+    }
+
+    free(data);
+
+    return 0;
+}
+
+
+
+#if UNIT_TEST
+void *amp_test_pack_worker_item(test_schedule_item_t *item, int64_t queued,
+        uint32_t *len) {
+    return pack_worker_item(item, queued, len);
+}
+
+int amp_test_unpack_worker_item(void *data, uint32_t len,
+        test_schedule_item_t *item, uint64_t *test_id, int64_t *queued) {
+    return unpack_worker_item(data, len, item, test_id, queued);
+}
+#endif
@@ -0,0 +1,83 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_WORKERPOOL_H
+#define _MEASURED_WORKERPOOL_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "schedule.h"
+
+/* don't let the pool grow to an unreasonable number of idle processes */
+#define MAX_WORKER_POOL_SIZE 256
+
+/* how often the zygote reaps finished workers and retries forks (ms) */
+#define WORKER_POOL_POLL_MS 1000
+
+/*
+ * Fixed size header at the front of every test item sent to the pool. It is
+ * followed by the variable length strings and addresses that make up the
+ * test meta information, parameters and destinations.
+ */
+struct worker_item_header {
+    uint64_t test_id;               /* id of the test module to run */
+    int64_t queued;                 /* monotonic time item was sent (ns) */
+    int64_t start_delay;            /* us the test started after abstime */
+    int32_t slot;                   /* admission slot claimed for the test */
+    uint32_t inter_packet_delay;    /* meta->inter_packet_delay */
+    uint32_t param_count;           /* number of test parameters */
+    uint32_t dest_count;            /* number of resolved destinations */
+    uint32_t resolve_count;         /* number of names left to resolve */
+    uint8_t dscp;                   /* meta->dscp */
+};
+
+void set_worker_pool_size(int size);
+int start_worker_pool(struct event_base *base);
+void stop_worker_pool(void);
+int dispatch_to_worker_pool(test_schedule_item_t *item);
+
+#if UNIT_TEST
+void *amp_test_pack_worker_item(test_schedule_item_t *item, int64_t queued,
+        uint32_t *len);
+int amp_test_unpack_worker_item(void *data, uint32_t len,
+        test_schedule_item_t *item, uint64_t *test_id, int64_t *queued);
+#endif
+
+#endif
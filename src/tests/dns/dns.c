@@ -66,6 +66,7 @@
 #include "tests.h"
 #include "debug.h"
 #include "testlib.h"
+#include "probe.h"
 #include "dns.h"
 #include "dns.pb-c.h"
 #include "dscp.h"
@@ -73,6 +74,7 @@
 
 
 static struct option long_options[] = {
+    {"batch", required_argument, 0, 'B'},
     {"class", required_argument, 0, 'c'},
     {"nsid", no_argument, 0, 'n'},
     {"perturbate", required_argument, 0, 'p'},
@@ -112,26 +114,6 @@ static void interrupt_test(
 #endif
 
 
-/*
- * Force the event loop to halt, so we can end the test and report the
- * results that we do have.
- */
-static void halt_test(
-    __attribute__((unused))evutil_socket_t evsock,
-    __attribute__((unused))short flags,
-    void *evdata) {
-    struct dnsglobals_t *globals = (struct dnsglobals_t *)evdata;
-
-    Log(LOG_DEBUG, "Halting DNS test due to timeout");
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-        globals->losstimer = NULL;
-    }
-    event_base_loopbreak(globals->base);
-}
-
-
-
 /*
  * Decode a compressed name/label. Each portion of the name is preceeded by a
  * byte containing its length. The final portion of any name can be
@@ -280,17 +262,47 @@ static void process_opt_rr(void *rr, uint16_t rrlen, struct info_t *info) {
 
 
 /*
- * Process a received DNS packet to make sure it is a proper response to our
- * query, and if so, record details on the response.
+ * Check that a received DNS packet is a response to one of our queries, and
+ * find the sequence number of the query from the id field.
+ */
+static int match_response(void *data, struct recv_packet_t *packet,
+        uint32_t *key) {
+
+    struct dnsglobals_t *globals = (struct dnsglobals_t*)data;
+    struct dns_t *header;
+    uint16_t index;
+
+    if ( packet->bytes < (int)sizeof(struct dns_t) ) {
+        return -1;
+    }
+
+    header = (struct dns_t *)packet->data;
+    index = ntohs(header->id) - globals->ident;
+
+    /* make sure the id field in this packet matches our request */
+    if ( index >= globals->count ) {
+	Log(LOG_DEBUG, "Incoming DNS packet with invalid ID number");
+	return -1;
+    }
+
+    *key = index;
+
+    return 0;
+}
+
+
+
+/*
+ * Record details of the response to one of our queries.
  *
  * TODO what if the packet isn't long enough for the amount of data that it
  * claims to have?
  */
-static void process_packet(struct dnsglobals_t *globals, char *packet,
-        __attribute__((unused))uint32_t bytes, struct timeval *now) {
+static int report_response(void *data, struct probe_t *probe,
+        struct recv_packet_t *packet) {
 
+    struct dnsglobals_t *globals = (struct dnsglobals_t*)data;
     struct dns_t *header;
-    uint16_t recv_ident;
     int index;
     char *rr_start = NULL;
     struct dns_opt_rr_t *rr_data;
@@ -302,17 +314,8 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
 
     info = globals->info;
 
-    header = (struct dns_t *)packet;
-    recv_ident = ntohs(header->id);
-
-    /* make sure the id field in this packet matches our request */
-    if ( recv_ident < globals->ident ||
-            (recv_ident - globals->ident) > globals->count ) {
-	Log(LOG_DEBUG, "Incoming DNS packet with invalid ID number");
-	return;
-    }
-
-    index = recv_ident - globals->ident;
+    header = (struct dns_t *)packet->data;
+    index = probe->index;
     info[index].reply = 1;
     info[index].flags.bytes = header->flags.bytes;
     info[index].total_answer = ntohs(header->an_count);
@@ -343,13 +346,13 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
     if ( info[index].response_code == RESPONSEOK ||
             info[index].response_code == NOTFOUND ) {
 
-	rr_start = packet + sizeof(struct dns_t);
+	rr_start = packet->data + sizeof(struct dns_t);
 
 	/* skip over all the question RRs, we aren't really interested */
 	for ( i=0; i<ntohs(header->qd_count); i++ ) {
 	    Log(LOG_DEBUG, "Skipping question RR %d/%d\n", i+1,
 		    ntohs(header->qd_count));
-	    rr_start = decode(NULL, packet, rr_start);
+	    rr_start = decode(NULL, packet->data, rr_start);
 	    rr_start += sizeof(struct dns_query_t);
 	}
 
@@ -358,7 +361,7 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
 	    name = malloc(MAX_DNS_NAME_LEN * sizeof(char));
 
 	    /* decode will update rr_start to the next byte after the name */
-	    rr_start = decode(name, packet, rr_start);
+	    rr_start = decode(name, packet->data, rr_start);
 	    rr_data = (struct dns_opt_rr_t *)rr_start;
 
 	    Log(LOG_DEBUG, "RR: '%s' type=0x%.2x class=0x%.2x rdlen=%d\n",
@@ -405,61 +408,17 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
     if ( rr_start == NULL ) {
         info[index].bytes = 0;
     } else {
-        info[index].bytes = rr_start - packet;
+        info[index].bytes = rr_start - packet->data;
     }
 
-    delay = DIFF_TV_US(*now, info[index].time_sent);
+    delay = DIFF_TS_NS(packet->time, info[index].time_sent);
     if ( delay > 0 ) {
-        info[index].delay = (uint32_t)delay;
+        info[index].delay = (uint64_t)delay;
     } else {
         info[index].delay = 0;
     }
-    globals->outstanding--;
-}
-
-
-
-/*
- * Callback used when a packet is received that might be a response to one
- * of our probes.
- */
-static void receive_probe_callback(evutil_socket_t evsock,
-        short flags, void *evdata) {
-
-    char *packet;
-    int buflen;
-    ssize_t bytes;
-    int wait;
-    struct timeval now;
-    struct socket_t sockets;
-    struct dnsglobals_t *globals = (struct dnsglobals_t*)evdata;
-
-    assert(evsock > 0);
-    assert(flags == EV_READ);
-
-    if ( globals->options.udp_payload_size > 0 ) {
-        buflen = globals->options.udp_payload_size;
-    } else {
-        buflen = DEFAULT_UDP_PAYLOAD_SIZE;
-    }
-
-    wait = 0;
-    sockets.socket = evsock;
-    sockets.socket6 = -1;
-
-    packet = calloc(1, buflen);
 
-    if ( (bytes=get_packet(&sockets, packet, buflen, NULL, &wait, &now)) > 0 ) {
-        process_packet(globals, packet, bytes, &now);
-    }
-
-    if ( globals->outstanding == 0 && globals->index == globals->count ) {
-        /* not waiting on any more packets, exit the event loop */
-        Log(LOG_DEBUG, "All expected DNS responses received");
-        event_base_loopbreak(globals->base);
-    }
-
-    free(packet);
+    return 1;
 }
 
 
@@ -556,31 +515,15 @@ static char *create_dns_query(uint16_t ident, uint32_t *len, struct opt_t *opt){
 
 
 /*
- * Send a DNS packet and record information about when it was sent.
+ * Record the information about the query to the next destination so that we
+ * can track the response, and copy the query to send into the packet buffer.
  */
-static void send_packet(
-        __attribute__((unused))evutil_socket_t evsock,
-        __attribute__((unused))short flags,
-        void *evdata) {
-
-    int sock;
-    int delay;
-    char *qbuf;
-    int seq;
-    uint16_t ident;
-    struct addrinfo *dest;
-    struct opt_t *opt;
-    struct dnsglobals_t *globals;
-    struct info_t *info;
-    struct timeval timeout;
+static int build_query(void *data, struct probe_t *probe, char *packet,
+        int size) {
 
-    globals = (struct dnsglobals_t *)evdata;
-    info = globals->info;
-    seq = globals->index;
-    ident = globals->ident;
-    dest = globals->dests[seq];
-    opt = &globals->options;
-    qbuf = NULL;
+    struct dnsglobals_t *globals = (struct dnsglobals_t*)data;
+    struct addrinfo *dest = globals->dests[probe->index];
+    struct info_t *info = &globals->info[probe->index];
 
     /*
      * Set initial values for the info block for this test - it has already
@@ -588,79 +531,38 @@ static void send_packet(
      * this before any return statements, so we have a little bit of info
      * in case we abort early.
      */
-    info[seq].addr = dest;
+    info->addr = dest;
 
     if ( !dest->ai_addr ) {
         Log(LOG_INFO, "No address for target %s, skipping", dest->ai_canonname);
-        goto next;
+        return -1;
     }
 
-    /* determine the appropriate socket to use and port field to set */
+    /* set the appropriate port field */
     switch ( dest->ai_family ) {
 	case AF_INET:
-	    sock = globals->sockets.socket;
 	    ((struct sockaddr_in*)dest->ai_addr)->sin_port = htons(53);
 	    break;
 	case AF_INET6:
-	    sock = globals->sockets.socket6;
 	    ((struct sockaddr_in6*)dest->ai_addr)->sin6_port = htons(53);
 	    break;
 	default:
 	    Log(LOG_WARNING, "Unknown address family: %d", dest->ai_family);
-	    goto next;
+	    return -1;
     };
 
-    if ( sock < 0 ) {
-	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
-                dest->ai_canonname);
-	goto next;
-    }
-
-    //XXX pass in buffer, return useful length like icmp test?
-    qbuf = create_dns_query(seq + ident, &(info[seq].query_length), opt);
+    assert((uint32_t)size >= globals->query_length);
 
-    while ( (delay = delay_send_packet(sock, qbuf, info[seq].query_length,
-                    dest, opt->inter_packet_delay,
-                    &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
-    }
+    /* the query is the same every time, except for the query id */
+    memcpy(packet, globals->query, globals->query_length);
+    ((struct dns_t *)packet)->id = htons(globals->ident + probe->index);
+    info->query_length = globals->query_length;
 
-    if ( delay < 0 ) {
-        /* mark this as done if the packet failed to send properly */
-        info[seq].reply = 1;
-        memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
-    } else {
-        globals->outstanding++;
-    }
+    probe->dest = dest;
+    probe->key = probe->index;
+    probe->sent = &info->time_sent;
 
-next:
-    globals->index++;
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-        globals->nextpackettimer = NULL;
-    }
-    /* create timer for sending the next packet if there are still more to go */
-    if ( globals->index == globals->count ) {
-        Log(LOG_DEBUG, "Reached final target: %d", globals->index);
-        if ( globals->outstanding == 0 ) {
-            event_base_loopbreak(globals->base);
-        } else {
-            globals->losstimer = event_new(globals->base, -1, 0,
-                    halt_test, globals);
-            timeout.tv_sec = LOSS_TIMEOUT;
-            timeout.tv_usec = 0;
-            event_add(globals->losstimer, &timeout);
-        }
-    } else {
-        globals->nextpackettimer = event_new(globals->base, -1, 0,
-                send_packet, globals);
-        timeout.tv_sec = (int)(globals->options.inter_packet_delay / 1000000);
-        timeout.tv_usec = globals->options.inter_packet_delay % 1000000;
-        event_add(globals->nextpackettimer, &timeout);
-    }
-    if ( qbuf ) {
-        free(qbuf);
-    }
+    return globals->query_length;
 }
 
 
@@ -748,7 +650,9 @@ static Amplet2__Dns__Item* report_destination(struct info_t *info) {
     /* TODO check response code too? */
     if ( info->reply && info->time_sent.tv_sec > 0 ) {
         item->has_rtt = 1;
-        item->rtt = info->delay;
+        item->rtt = (uint32_t)(info->delay / 1000);
+        item->has_rtt_ns = 1;
+        item->rtt_ns = info->delay;
         item->has_ttl = 1;
         item->ttl = info->ttl;
         item->has_response_size = 1;
@@ -774,6 +678,7 @@ static Amplet2__Dns__Item* report_destination(struct info_t *info) {
     } else {
         /* don't report any of these fields without a response to our query */
         item->has_rtt = 0;
+        item->has_rtt_ns = 0;
         item->has_ttl = 0;
         item->has_response_size = 0;
         item->has_total_answer = 0;
@@ -1097,14 +1002,16 @@ static struct addrinfo **get_system_resolvers(int *count) {
  */
 static void usage(void) {
     fprintf(stderr,
-            "Usage: amp-dns [-hrnsvx] [-c class] [-p perturbate] [-q query]\n"
-            "               [-t type] [-z size]\n"
+            "Usage: amp-dns [-hrnsvx] [-B batchsize] [-c class]\n"
+            "               [-p perturbate] [-q query] [-t type] [-z size]\n"
             "               [-Q codepoint] [-Z interpacketgap]\n"
             "               [-I interface] [-4 [sourcev4]] [-6 [sourcev6]]\n"
             "               [-- destination1 [ destination2 ... destinationN]]"
             "\n\n");
 
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -B, --batch          <count>   "
+            "Number of queries to send with each system call\n");
     fprintf(stderr, "  -c, --class          <class>   "
             "Class type to search for (default: IN)\n");
     fprintf(stderr, "  -n, --nsid                     "
@@ -1144,8 +1051,10 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     int local_resolv;
     struct dnsglobals_t *globals;
     struct event *signal_int;
-    struct event *socket;
-    struct event *socket6;
+    struct probe_opt_t probe_options;
+    struct probe_ops_t probe_ops = {
+        build_query, match_response, report_response
+    };
     amp_test_result_t *result;
 
     Log(LOG_DEBUG, "Starting DNS test");
@@ -1166,12 +1075,13 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     options->perturbate = 0;
     options->inter_packet_delay = MIN_INTER_PACKET_DELAY;
     options->dscp = DEFAULT_DSCP_VALUE;
+    options->batch = 1;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
     local_resolv = 0;
 
-    while ( (opt = getopt_long(argc, argv, "c:np:q:rst:z:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "B:c:np:q:rst:z:I:Q:Z:4::6::hvx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': address_string = parse_optional_argument(argv);
@@ -1193,6 +1103,7 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': options->inter_packet_delay = atoi(optarg); break;
+            case 'B': options->batch = atoi(optarg); break;
             case 'c': options->query_class = get_query_class(optarg); break;
             case 'n': options->nsid = 1; break;
             case 'p': options->perturbate = atoi(optarg); break;
@@ -1231,6 +1142,17 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
         options->udp_payload_size = MIN_UDP_PAYLOAD_SIZE;
     }
 
+    /* make sure the batch size is something we can actually send */
+    if ( options->batch < 1 ) {
+        Log(LOG_WARNING, "Batch size %d too small, raising to 1",
+                options->batch);
+        options->batch = 1;
+    } else if ( options->batch > MAX_SEND_BATCH ) {
+        Log(LOG_WARNING, "Batch size %d too large, lowering to %d",
+                options->batch, MAX_SEND_BATCH);
+        options->batch = MAX_SEND_BATCH;
+    }
+
     /* if no destinations have been set then try to use /etc/resolv.conf */
     if ( count == 0 && dests == NULL ) {
         Log(LOG_DEBUG, "No destinations set, checking /etc/resolve.conf");
@@ -1297,11 +1219,25 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
     memset(globals->info, 0, sizeof(struct info_t) * count);
 
-    globals->index = 0;
-    globals->outstanding = 0;
     globals->count = count;
     globals->dests = dests;
-    globals->losstimer = NULL;
+
+    /* every query is the same apart from the id, so only build it once */
+    globals->query = create_dns_query(0, &globals->query_length, options);
+
+    /*
+     * The probe engine takes care of sending queries and matching responses.
+     * Responses can be as large as the payload size we advertise.
+     */
+    probe_options.count = count;
+    probe_options.batch = options->batch;
+    probe_options.packet_size = globals->query_length;
+    probe_options.response_size = options->udp_payload_size > 0 ?
+            options->udp_payload_size : DEFAULT_UDP_PAYLOAD_SIZE;
+    probe_options.inter_packet_delay = options->inter_packet_delay;
+    probe_options.loss_timeout = LOSS_TIMEOUT;
+    globals->engine = new_probe_engine(globals->base, &globals->sockets,
+            &probe_options, &probe_ops, globals);
 
 #if _WIN32
     signal_int = NULL;
@@ -1312,39 +1248,14 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     event_add(signal_int, NULL);
 #endif
 
-    /* set up callbacks for receiving packets */
-    socket = event_new(globals->base, globals->sockets.socket,
-            EV_READ|EV_PERSIST, receive_probe_callback, globals);
-    event_add(socket, NULL);
-
-    socket6 = event_new(globals->base, globals->sockets.socket6,
-            EV_READ|EV_PERSIST, receive_probe_callback, globals);
-    event_add(socket6, NULL);
-
     /* schedule the first probe packet to be sent immediately */
-    globals->nextpackettimer = event_new(globals->base, -1,
-            EV_PERSIST, send_packet, globals);
-    event_active(globals->nextpackettimer, 0, 0);
+    start_probe_engine(globals->engine);
 
     /* run the event loop till told to stop or all tests performed */
     event_base_dispatch(globals->base);
 
     /* tidy up after ourselves */
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-    }
-
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-    }
-
-    if ( socket ) {
-        event_free(socket);
-    }
-
-    if ( socket6 ) {
-        event_free(socket6);
-    }
+    free_probe_engine(globals->engine);
 
     if ( signal_int ) {
         event_free(signal_int);
@@ -1353,11 +1264,11 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     event_base_free(globals->base);
 
     if ( globals->sockets.socket > 0 ) {
-	close(globals->sockets.socket);
+	close_socket(globals->sockets.socket);
     }
 
     if ( globals->sockets.socket6 > 0 ) {
-	close(globals->sockets.socket6);
+	close_socket(globals->sockets.socket6);
     }
 
     if ( sourcev4 ) {
@@ -1372,6 +1283,7 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     result = report_results(&start_time, count, globals->info, options);
 
     free(options->query_string);
+    free(globals->query);
     free(globals->info);
     free(globals);
 
@@ -1456,7 +1368,11 @@ void print_dns(amp_test_result_t *result) {
             continue;
         }
 
-        printf(" %dus\n", item->rtt);
+        if ( item->has_rtt_ns ) {
+            printf(" %.3fus\n", item->rtt_ns / 1000.0);
+        } else {
+            printf(" %dus\n", item->rtt);
+        }
 
         /* if present, print instance name / nsid payload like dig does */
         if ( item->instance.len > 0 ) {
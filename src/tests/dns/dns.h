@@ -48,6 +48,7 @@
 #endif
 
 #include "testlib.h"
+#include "probe.h"
 
 /* Minimum requestors UDP payload size in bytes (RFC 6891) */
 #define MIN_UDP_PAYLOAD_SIZE 512
@@ -170,8 +171,8 @@ struct dns_opt_rdata_t {
 struct info_t {
     void *nsid_payload;                 /* server instance (NSID) */
     struct addrinfo *addr;		/* address probe was sent to */
-    struct timeval time_sent;		/* when the probe was sent */
-    uint32_t delay;			/* delay in receiving response, usec */
+    struct timespec time_sent;		/* when the probe was sent */
+    uint64_t delay;			/* delay in receiving response, nsec */
     uint32_t query_length;		/* number of bytes in query */
     uint32_t bytes;			/* number of bytes in response */
     //uint16_t receive_flags;		/* flags set by responding server */
@@ -203,6 +204,7 @@ struct opt_t {
     int perturbate;
     uint32_t inter_packet_delay;
     uint8_t dscp;
+    int batch;
 };
 
 
@@ -212,14 +214,13 @@ struct dnsglobals_t {
     struct socket_t sockets;
     struct addrinfo **dests;
     struct info_t *info;
+    char *query;
+    uint32_t query_length;
     uint16_t ident;
-    int index;
     int count;
-    int outstanding;
 
     struct event_base *base;
-    struct event *nextpackettimer;
-    struct event *losstimer;
+    struct probe_engine_t *engine;
 };
 
 
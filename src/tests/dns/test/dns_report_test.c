@@ -132,7 +132,9 @@ static void verify_response(struct info_t *a, Amplet2__Dns__Item *b) {
     /* ensure rtt, flags etc are only set if there was a valid response */
     if ( a->reply && a->time_sent.tv_sec > 0 ) {
         assert(b->has_rtt);
-        assert(a->delay == b->rtt);
+        assert(a->delay / 1000 == b->rtt);
+        assert(b->has_rtt_ns);
+        assert(a->delay == b->rtt_ns);
         assert(b->has_ttl);
         assert(a->ttl == b->ttl);
         assert(b->has_response_size);
@@ -178,6 +180,7 @@ static void verify_response(struct info_t *a, Amplet2__Dns__Item *b) {
 
     } else {
         assert(!b->has_rtt);
+        assert(!b->has_rtt_ns);
         assert(!b->has_ttl);
         assert(!b->has_response_size);
         assert(!b->has_total_answer);
@@ -252,7 +255,7 @@ static void build_info(struct info_t *item, struct addrinfo *addr,
         item->nsid_length = 0;
     }
     item->time_sent.tv_sec = seconds;
-    item->time_sent.tv_usec = 0;
+    item->time_sent.tv_nsec = 0;
 }
 
 
@@ -265,26 +268,27 @@ int main(void) {
     struct timeval start_time;
     struct addrinfo *addr = get_numeric_address("192.168.0.254", NULL);
     struct opt_t full_options[] = {
-        /* query, type, class, size, recurse, dnssec, nsid, pert, inter, dscp */
-        {"www.example.com", 0x0, 0x0, 0, 0, 0, 0, 0, 0, 0},
-        {"www.example.com", 0x1, 0x1, 512, 0, 0, 0, 1, 0, 8},
-        {"www.example.com", 0x1c, 0x1, 1280, 0, 0, 1, 0, 0, 10},
-        {"www.example.com", 0xff, 0xff, 4096, 0, 0, 1, 1, 0, 12},
-        {"www.example.com", 0x8001, 0xffff, 8192, 0, 1, 0, 0, 0, 16},
-
-        {"www.example.org", 0x0, 0x0, 0, 0, 1, 0, 1, 0, 20},
-        {"www.example.org", 0x1, 0x1, 511, 0, 1, 1, 0, 0, 24},
-        {"www.example.org", 0x1c, 0x1, 1279, 0, 1, 1, 1, 0, 26},
-        {"www.example.org", 0xff, 0xff, 4095, 1, 0, 0, 0, 0, 28},
-        {"www.example.org", 0x8001, 0xffff, 8191, 1, 0, 0, 1, 0, 30},
-
-        {"example.com", 0x0, 0x1, 0, 1, 0, 1, 0, 0, 34},
-        {"example.com", 0x1, 0x1, 513, 1, 0, 1, 1, 0, 36},
-        {"example.com", 0x1c, 0x1, 1281, 1, 1, 0, 0, 0, 46},
-        {"example.com", 0xff, 0xff, 4097, 1, 1, 0, 1, 0, 48},
-        {"example.com", 0x8001, 0xffff, 8193, 1, 1, 1, 0, 0, 56},
-
-        {"www.example.com", 0xffff, 0x1, 8192, 1, 1, 1, 1, 0, 63},
+        /* query, type, class, size, recurse, dnssec, nsid, pert, inter, dscp,
+         * batch */
+        {"www.example.com", 0x0, 0x0, 0, 0, 0, 0, 0, 0, 0, 1},
+        {"www.example.com", 0x1, 0x1, 512, 0, 0, 0, 1, 0, 8, 1},
+        {"www.example.com", 0x1c, 0x1, 1280, 0, 0, 1, 0, 0, 10, 1},
+        {"www.example.com", 0xff, 0xff, 4096, 0, 0, 1, 1, 0, 12, 1},
+        {"www.example.com", 0x8001, 0xffff, 8192, 0, 1, 0, 0, 0, 16, 1},
+
+        {"www.example.org", 0x0, 0x0, 0, 0, 1, 0, 1, 0, 20, 1},
+        {"www.example.org", 0x1, 0x1, 511, 0, 1, 1, 0, 0, 24, 1},
+        {"www.example.org", 0x1c, 0x1, 1279, 0, 1, 1, 1, 0, 26, 1},
+        {"www.example.org", 0xff, 0xff, 4095, 1, 0, 0, 0, 0, 28, 1},
+        {"www.example.org", 0x8001, 0xffff, 8191, 1, 0, 0, 1, 0, 30, 1},
+
+        {"example.com", 0x0, 0x1, 0, 1, 0, 1, 0, 0, 34, 1},
+        {"example.com", 0x1, 0x1, 513, 1, 0, 1, 1, 0, 36, 1},
+        {"example.com", 0x1c, 0x1, 1281, 1, 1, 0, 0, 0, 46, 1},
+        {"example.com", 0xff, 0xff, 4097, 1, 1, 0, 1, 0, 48, 1},
+        {"example.com", 0x8001, 0xffff, 8193, 1, 1, 1, 0, 0, 56, 1},
+
+        {"www.example.com", 0xffff, 0x1, 8192, 1, 1, 1, 1, 0, 63, 1},
     };
 
     addr->ai_canonname = strdup("foo.bar.baz");
@@ -63,6 +63,7 @@
 #include "tests.h"
 #include "debug.h"
 #include "testlib.h"
+#include "waitset.h"
 #include "fastping.pb-c.h"
 #include "fastping.h"
 #include "usage.h"
@@ -70,8 +71,8 @@
 #include "checksum.h"
 
 
-/* time till next packet after which select will sleep rather than spin */
-const struct timeval THRESHOLD = {0, 1000};
+/* time till next packet (ns) after which select will sleep rather than spin */
+const int64_t THRESHOLD = 1000000;
 /* percentile values of interest */
 const float PERCENTILES[] = {0.0, 0.1, 1.0, 5.0, 10.0, 20.0, 30.0, 40.0, 50.0,
     60.0, 70.0, 80.0, 90.0, 95.0, 99.0, 99.9, 100};
@@ -122,17 +123,33 @@ static void usage(void) {
  * Sort function used to order packets for percentile calculations
  */
 static int cmp (const void *a, const void *b) {
-    return ( *(int32_t*)a - *(int32_t*)b );
+    int64_t x = *(int64_t*)a;
+    int64_t y = *(int64_t*)b;
+
+    return ( x > y ) - ( x < y );
+}
+
+
+
+/*
+ * Find the position of the given percentile within the sorted samples.
+ */
+static uint32_t percentile_index(int percentile, uint32_t samples) {
+    uint32_t index = PERCENTILES[percentile] / 100 * samples;
+    if ( index >= samples ) {
+        index--;
+    }
+    return index;
 }
 
 
 
 /*
  * Construct a protocol buffer message containing the summary statistics for
- * the RTT or jitter measurements.
+ * the RTT or jitter measurements, converted to microseconds.
  */
 static Amplet2__Fastping__SummaryStats* report_summary(
-        struct summary_t *summary, int32_t *ipv) {
+        struct summary_t *summary, int64_t *ipv) {
     Amplet2__Fastping__SummaryStats *stats;
     int i;
 
@@ -143,27 +160,64 @@ static Amplet2__Fastping__SummaryStats* report_summary(
     stats = calloc(1, sizeof(Amplet2__Fastping__SummaryStats));
     amplet2__fastping__summary_stats__init(stats);
 
+    stats->has_maximum = 1;
+    stats->maximum = summary->maximum / 1000;
+    stats->has_minimum = 1;
+    stats->minimum = summary->minimum / 1000;
+    stats->has_mean = 1;
+    stats->mean = (uint32_t)round(summary->mean / 1000);
+    stats->has_sd = 1;
+    stats->sd = summary->sd / 1000;
+    stats->has_samples = 1;
+    stats->samples = summary->samples;
+
+    stats->n_percentiles = PERCENTILE_COUNT;
+    stats->percentiles = calloc(stats->n_percentiles, sizeof(int32_t));
+
+    for ( i = 0; i < PERCENTILE_COUNT; i++ ) {
+        stats->percentiles[i] =
+            ipv[percentile_index(i, summary->samples)] / 1000;
+    }
+
+    return stats;
+}
+
+
+
+/*
+ * Construct a protocol buffer message containing the summary statistics for
+ * the RTT or jitter measurements, at the full nanosecond resolution.
+ */
+static Amplet2__Fastping__SummaryStats64* report_summary_ns(
+        struct summary_t *summary, int64_t *ipv) {
+    Amplet2__Fastping__SummaryStats64 *stats;
+    int i;
+
+    if ( !summary || !ipv ) {
+        return NULL;
+    }
+
+    stats = calloc(1, sizeof(Amplet2__Fastping__SummaryStats64));
+    amplet2__fastping__summary_stats64__init(stats);
+
     stats->has_maximum = 1;
     stats->maximum = summary->maximum;
     stats->has_minimum = 1;
     stats->minimum = summary->minimum;
     stats->has_mean = 1;
-    stats->mean = (uint32_t)round(summary->mean);
+    stats->mean = (int64_t)round(summary->mean);
     stats->has_sd = 1;
     stats->sd = summary->sd;
     stats->has_samples = 1;
     stats->samples = summary->samples;
 
     stats->n_percentiles = PERCENTILE_COUNT;
-    stats->percentiles = calloc(stats->n_percentiles, sizeof(int32_t));
+    stats->percentiles = calloc(stats->n_percentiles, sizeof(int64_t));
 
     for ( i = 0; i < PERCENTILE_COUNT; i++ ) {
-        uint32_t index = PERCENTILES[i] / 100 * summary->samples;
-        if ( index >= summary->samples ) {
-            index--;
-        }
-        stats->percentiles[i] = ipv[index];
-        Log(LOG_DEBUG, "Percentile %.02f: %d\n", PERCENTILES[i], ipv[index]);
+        stats->percentiles[i] = ipv[percentile_index(i, summary->samples)];
+        Log(LOG_DEBUG, "Percentile %.02f: %" PRId64 "ns\n", PERCENTILES[i],
+                stats->percentiles[i]);
     }
 
     return stats;
@@ -177,17 +231,16 @@ static Amplet2__Fastping__SummaryStats* report_summary(
  * etc.
  */
 static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
-        struct opt_t *options, struct timeval *runtime) {
+        struct opt_t *options, int64_t *runtime) {
 
     Amplet2__Fastping__Item *item =
         (Amplet2__Fastping__Item*)malloc(sizeof(Amplet2__Fastping__Item));
     uint64_t i;
-    uint64_t current = 0, prev = 0;
-    struct timeval latency;
+    int64_t current = 0, prev = 0;
     double delta, delta2;
     double rtt_squares, jitter_squares;
-    int32_t *ipv;
-    int32_t *ipdv;
+    int64_t *ipv;
+    int64_t *ipdv;
     struct summary_t rtt, jitter;
 
     amplet2__fastping__item__init(item);
@@ -199,19 +252,22 @@ static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
     memset(&rtt, 0, sizeof(rtt));
     memset(&jitter, 0, sizeof(jitter));
 
-    ipv = calloc(options->count, sizeof(int32_t));
-    ipdv = calloc(options->count, sizeof(int32_t));
+    ipv = calloc(options->count, sizeof(int64_t));
+    ipdv = calloc(options->count, sizeof(int64_t));
 
     rtt_squares = 0;
     jitter_squares = 0;
 
     for ( i = 0; i < options->count; i++ ) {
-        if ( !timerisset(&timing[i].time_received) ) {
+        if ( timing[i].time_received.tv_sec == 0 ) {
             continue;
         }
 
-        timersub(&timing[i].time_received, &timing[i].time_sent, &latency);
-        current = (latency.tv_sec * 1000000) + latency.tv_usec;
+        /* ignore the sample if the clock was stepped backwards mid-flight */
+        if ( (current = DIFF_TS_NS(timing[i].time_received,
+                        timing[i].time_sent)) < 0 ) {
+            continue;
+        }
 
         ipv[rtt.samples] = current;
         delta = (double)current - rtt.mean;
@@ -233,24 +289,27 @@ static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
     }
 
     if ( rtt.samples > 0 ) {
-        qsort(ipv, rtt.samples, sizeof(int32_t), cmp);
+        qsort(ipv, rtt.samples, sizeof(int64_t), cmp);
         rtt.maximum = ipv[rtt.samples - 1];
         rtt.minimum = ipv[0];
         rtt.sd = sqrt(rtt_squares / rtt.samples);
         item->rtt = report_summary(&rtt, ipv);
+        item->rtt_ns = report_summary_ns(&rtt, ipv);
     }
 
     if ( jitter.samples > 0 ) {
-        qsort(ipdv, jitter.samples, sizeof(int32_t), cmp);
+        qsort(ipdv, jitter.samples, sizeof(int64_t), cmp);
         jitter.maximum = ipdv[jitter.samples - 1];
         jitter.minimum = ipdv[0];
         jitter.sd = sqrt(jitter_squares / jitter.samples);
         item->jitter = report_summary(&jitter, ipdv);
+        item->jitter_ns = report_summary_ns(&jitter, ipdv);
     }
 
     if ( runtime ) {
+        /* runtime is reported in microseconds */
         item->has_runtime = 1;
-        item->runtime = runtime->tv_sec * 1000000 + runtime->tv_usec;
+        item->runtime = *runtime / 1000;
     }
 
     free(ipv);
@@ -266,7 +325,7 @@ static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
  */
 static amp_test_result_t* report_result(struct timeval *start_time,
         struct addrinfo *dest, struct opt_t *options, struct info_t *timing,
-        struct timeval *runtime) {
+        int64_t *runtime) {
 
     int count = 1;
 
@@ -320,6 +379,20 @@ static amp_test_result_t* report_result(struct timeval *start_time,
         free(reports[0]->jitter);
     }
 
+    if ( reports[0]->rtt_ns ) {
+        if ( reports[0]->rtt_ns->percentiles ) {
+            free(reports[0]->rtt_ns->percentiles);
+        }
+        free(reports[0]->rtt_ns);
+    }
+
+    if ( reports[0]->jitter_ns ) {
+        if ( reports[0]->jitter_ns->percentiles ) {
+            free(reports[0]->jitter_ns->percentiles);
+        }
+        free(reports[0]->jitter_ns);
+    }
+
     free(reports[0]);
     free(reports);
 
@@ -589,17 +662,18 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
 
     char *packet;
     int length;
-    char response[RESPONSE_BUFFER_LEN];
+    struct recv_batch_t *responses;
     struct info_t *timing;
 
-    struct timeval run_time;
+    /* start_time is wall clock time, all others are monotonic nanoseconds */
     struct timeval start_time;
-    struct timeval stop_time;
-    struct timeval next_packet;
-    struct timeval interpacket_gap;
-    struct timeval loss_timeout;
+    int64_t run_time;
+    int64_t start;
+    int64_t stop_time;
+    int64_t next_packet;
+    int64_t interpacket_gap;
+    int64_t loss_timeout;
 
-    struct sockaddr from;
     amp_test_result_t *results;
 
     uint64_t sent = 0;
@@ -607,8 +681,8 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
     uint16_t pid = getpid();
     int sock;
 
-    memset(&stop_time, 0, sizeof(struct timeval));
-    memset(&loss_timeout, 0, sizeof(struct timeval));
+    stop_time = 0;
+    loss_timeout = 0;
 
     /* get the current time to use when reporting initial errors */
     if ( gettimeofday(&start_time, NULL) != 0 ) {
@@ -636,11 +710,11 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
     }
 
     /* packet rate is an integer above zero, so longest gap is only 1 second */
-    interpacket_gap.tv_sec = options->rate <= 1 ? 1 : 0;
-    interpacket_gap.tv_usec = options->rate > 1 ? (1000000 / options->rate) : 0;
+    interpacket_gap = 1000000000 / (options->rate > 1 ? options->rate : 1);
 
     timing = calloc(options->count, sizeof(struct info_t));
     packet = calloc(1, options->size);
+    responses = new_recv_batch(MAX_RECV_BATCH, RESPONSE_BUFFER_LEN);
 
     /* try to prime any stateful devices that might be in the path */
     if ( options->preemptive ) {
@@ -667,15 +741,16 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
 	exit(EXIT_FAILURE);
     }
 
-    timeradd(&start_time, &interpacket_gap, &next_packet);
+    start = monotonic_ns();
+    next_packet = start + interpacket_gap;
 
     while ( sent < options->count || received < options->count ) {
         struct timeval timeout = {0, 0};
-        struct timeval now;
+        int64_t now;
         fd_set readfds, writefds;
 
         if ( sent < options->count ) {
-            struct timeval towait;
+            int64_t towait;
             /*
              * Still sending data, but it seems wasteful to spin on this loop
              * if we know there is a long time to wait till the next packet.
@@ -684,10 +759,10 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
              * we won't send the next packet on time, or we won't service this
              * loop often enough and incoming packets could fill up buffers.
              */
-            gettimeofday(&now, NULL);
-            timersub(&next_packet, &now, &towait);
-            if ( timercmp(&towait, &THRESHOLD, >) ) {
-                usleep(towait.tv_usec * 0.30);
+            now = monotonic_ns();
+            towait = next_packet - now;
+            if ( towait > THRESHOLD ) {
+                usleep((towait / 1000) * 0.30);
             }
         } else {
             /* otherwise we'll wait for a bit after the last packet we saw */
@@ -706,18 +781,25 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
                 continue;
             }
             Log(LOG_ERR, "Select failed");
+            free_recv_batch(responses);
             return NULL;
         }
 
         /* get the current time to use to see if a packet should be sent */
-        gettimeofday(&now, NULL);
+        now = monotonic_ns();
 
-        if ( sent < options->count && !timercmp(&now, &next_packet, <) ) {
+        if ( sent < options->count && now >= next_packet ) {
             if ( FD_ISSET(sock, &writefds) ) {
-                delay_send_packet(sock, packet, length, dest, 0,
-                        &(timing[sent].time_sent));
+                int delay;
+
+                if ( (delay = delay_send_packet(sock, packet, length, dest, 0,
+                                &(timing[sent].time_sent))) > 0 ) {
+                    /* the shared rate budget is full, wait until it isn't */
+                    next_packet = now + ((int64_t)delay * 1000);
+                    continue;
+                }
 
-                timeradd(&next_packet, &interpacket_gap, &next_packet);
+                next_packet += interpacket_gap;
                 sent++;
 
                 /* generate the next packet so it is ready when the socket is */
@@ -731,16 +813,14 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
 
         /* if all the packets have been sent, start the timer to wait */
         if ( sent >= options->count ) {
-            if ( stop_time.tv_sec == 0 && stop_time.tv_usec == 0 ) {
-                struct timeval temp;
-                gettimeofday(&stop_time, NULL);
-                temp.tv_sec = FASTPING_PACKET_LOSS_TIMEOUT;
-                temp.tv_usec = 0;
-                timeradd(&stop_time, &temp, &loss_timeout);
+            if ( stop_time == 0 ) {
+                stop_time = monotonic_ns();
+                loss_timeout = stop_time +
+                    (int64_t)FASTPING_PACKET_LOSS_TIMEOUT * 1000000000;
                 Log(LOG_DEBUG, "Finished packet stream");
             } else {
                 /* check if its time to timeout and declare packets lost */
-                if ( !timercmp(&now, &loss_timeout, <) ) {
+                if ( now >= loss_timeout ) {
                     Log(LOG_DEBUG, "Timed out waiting for responses");
                     break;
                 }
@@ -750,27 +830,27 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
         /* check to see if there is data in the socket waiting to be read */
         if ( FD_ISSET(sock, &readfds) ) {
             int wait = 0;
-            int bytes;
-            struct timeval receive_time;
+            int i;
 
             /*
-             * Only one packet is read here to try to limit any delay to
-             * sending the next packet. If lots of packets arrive all at
-             * once then they won't get processed quickly, which could fill
-             * buffers. Filtering as many unwanted packets as possible helps,
-             * as does making sure we hit this loop regularly.
+             * Read everything that is currently waiting in the socket (up to
+             * the size of the batch) with a single system call, so that a
+             * burst of responses doesn't sit in the socket buffer while we
+             * loop around sending more packets. Filtering as many unwanted
+             * packets as possible helps, as does making sure we hit this
+             * loop regularly.
              */
-            bytes = get_packet(sockets, response, RESPONSE_BUFFER_LEN, &from,
-                    &wait, &receive_time);
+            get_packets(sockets, responses, &wait);
 
-            if ( bytes > 0 ) {
+            for ( i = 0; i < responses->count; i++ ) {
+                struct recv_packet_t *response = &responses->packets[i];
                 /* extract the sequence number from the icmp packet */
                 int64_t sequence;
-                sequence = extract_data(dest, response, bytes, pid, &from);
+                sequence = extract_data(dest, response->data, response->bytes,
+                        pid, (struct sockaddr*)&response->from);
                 if ( sequence >= 0 && sequence < (int64_t)sent ) {
-                    if ( !timerisset(&timing[sequence].time_received) ) {
-                        memcpy(&(timing[sequence].time_received),
-                                &receive_time, sizeof(struct timeval));
+                    if ( timing[sequence].time_received.tv_sec == 0 ) {
+                        timing[sequence].time_received = response->time;
                         received++;
                         if ( received >= options->count ) {
                             Log(LOG_DEBUG, "Received all responses");
@@ -790,10 +870,11 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
 
     Log(LOG_DEBUG, "Calculating fastping results");
 
-    timersub(&stop_time, &start_time, &run_time);
+    run_time = stop_time - start;
 
     results = report_result(&start_time, dest, options, timing, &run_time);
 
+    free_recv_batch(responses);
     free(timing);
     free(packet);
 
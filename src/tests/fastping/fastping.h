@@ -68,13 +68,14 @@
  * the outgoing packet and only keeping the RTT value once it returns
  */
 struct info_t {
-    struct timeval time_sent;
-    struct timeval time_received;
+    struct timespec time_sent;
+    struct timespec time_received;
 };
 
+/* all values are in nanoseconds */
 struct summary_t {
-    uint32_t maximum;
-    uint32_t minimum;
+    int64_t maximum;
+    int64_t minimum;
     double mean;
     double sd;
     uint32_t samples;
@@ -65,6 +65,7 @@
 #include "config.h"
 #include "tests.h"
 #include "testlib.h"
+#include "probe.h"
 #include "icmp.h"
 #include "icmp.pb-c.h"
 #include "debug.h"
@@ -80,6 +81,7 @@
  */
 
 static struct option long_options[] = {
+    {"batch", required_argument, 0, 'B'},
     {"perturbate", required_argument, 0, 'p'},
     {"random", no_argument, 0, 'r'},
     {"size", required_argument, 0, 's'},
@@ -116,43 +118,20 @@ static void interrupt_test(
 
 
 /*
- * Force the event loop to halt, so we can end the test and report the
- * results that we do have.
+ * Find the sequence number of the echo request embedded in an icmp error,
+ * if it is in response to a packet we have sent.
  */
-static void halt_test(
-    __attribute__((unused))evutil_socket_t evsock,
-    __attribute__((unused))short flags,
-    void *evdata) {
-    struct icmpglobals_t *globals = (struct icmpglobals_t *)evdata;
-
-    Log(LOG_DEBUG, "Halting ICMP test due to timeout");
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-        globals->losstimer = NULL;
-    }
-    event_base_loopbreak(globals->base);
-}
-
-
-
-/*
- * Check an icmp error to determine if it is in response to a packet we have
- * sent. If it is then the error needs to be recorded.
- */
-static int icmp_error(char *packet, int bytes, uint16_t ident,
-        struct info_t info[]) {
+static int match_icmp_error(char *packet, uint32_t bytes, uint16_t ident,
+        uint16_t *seq) {
     struct iphdr *ip, *embed_ip;
-    struct icmphdr *icmp, *embed_icmp;
-    uint16_t seq;
-    int required_bytes;
+    struct icmphdr *embed_icmp;
+    uint32_t required_bytes;
 
     ip = (struct iphdr *)packet;
 
     assert(ip->version == 4);
     assert(ip->ihl >= 5);
 
-    icmp = (struct icmphdr *)(packet + (ip->ihl << 2));
-
     /*
      * make sure there is enough room in this packet to entertain the
      * possibility of having embedded data - at least enough space for
@@ -188,23 +167,7 @@ static int icmp_error(char *packet, int bytes, uint16_t ident,
 	return -1;
     }
 
-    seq = ntohs(embed_icmp->un.echo.sequence);
-    /*
-     * TODO it's possible for this to be clobbered by the most recent error
-     * (though unlikely except in the case of redirects). Do we care?
-     */
-    info[seq].err_type = icmp->type;
-    info[seq].err_code = icmp->code;
-
-    /*
-     * Don't count a redirect as a response, we are still expecting a real
-     * reply from the destination host.
-     */
-    if ( icmp->type != ICMP_REDIRECT ) {
-        info[seq].reply = 1;
-    }
-    /* TODO get ttl */
-    /*info[seq].ttl = */
+    *seq = ntohs(embed_icmp->un.echo.sequence);
 
     return 0;
 }
@@ -212,16 +175,16 @@ static int icmp_error(char *packet, int bytes, uint16_t ident,
 
 
 /*
- * Process an ICMPv4 packet to check if it is an ICMP ECHO REPLY in response to
- * a request we have sent. If so then record the time it took to get the reply.
+ * Check an ICMPv4 packet to see if it is an ICMP ECHO REPLY in response to a
+ * request we have sent, or an error caused by one. If so then get the
+ * sequence number of the request it belongs to.
  */
-static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now) {
+static int match_ipv4_packet(struct icmpglobals_t *globals, char *packet,
+        uint32_t bytes, uint32_t *key) {
 
     struct iphdr *ip;
     struct icmphdr *icmp;
     uint16_t seq;
-    int64_t delay;
 
     /* make sure that we read enough data to have a valid response */
     if ( bytes < sizeof(struct iphdr) + sizeof(struct icmphdr) +
@@ -244,45 +207,88 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
 
     icmp = (struct icmphdr *)(packet + (ip->ihl << 2));
 
-    /* if it isn't an echo reply it could still be an error for us */
     if ( icmp->type != ICMP_ECHOREPLY ) {
-	return icmp_error(packet, bytes, globals->ident, globals->info);
-    }
-
-    /* if it is an echo reply but the id doesn't match then it's not ours */
-    if ( ntohs(icmp->un.echo.id ) != globals->ident ) {
+        /* if it isn't an echo reply it could still be an error for us */
+        if ( match_icmp_error(packet, bytes, globals->ident, &seq) < 0 ) {
+            return -1;
+        }
+    } else if ( ntohs(icmp->un.echo.id ) != globals->ident ) {
+        /* if it is an echo reply but the id doesn't match then not ours */
         Log(LOG_DEBUG, "Bad ident (got %d, expected %d)",
                 ntohs(icmp->un.echo.id), globals->ident);
 	return -1;
+    } else {
+        seq = ntohs(icmp->un.echo.sequence);
     }
 
     /* check the sequence number is less than the maximum number of requests */
-    seq = ntohs(icmp->un.echo.sequence);
-    if ( seq > globals->count ) {
+    if ( seq >= globals->count ) {
         Log(LOG_DEBUG, "Bad sequence number\n");
 	return -1;
     }
 
+    *key = seq;
+
+    return 0;
+}
+
+
+
+/*
+ * Record the response to a probe, either the round trip time of an echo
+ * reply or the type and code of an error.
+ */
+static int report_ipv4_packet(struct info_t *info, char *packet,
+        struct timespec *now) {
+
+    struct iphdr *ip;
+    struct icmphdr *icmp;
+    int64_t delay;
+
+    ip = (struct iphdr *)packet;
+    icmp = (struct icmphdr *)(packet + (ip->ihl << 2));
+
+    if ( icmp->type != ICMP_ECHOREPLY ) {
+        /*
+         * TODO it's possible for this to be clobbered by the most recent
+         * error (though unlikely except in the case of redirects). Do we care?
+         */
+        info->err_type = icmp->type;
+        info->err_code = icmp->code;
+
+        /*
+         * Don't count a redirect as a response, we are still expecting a real
+         * reply from the destination host.
+         */
+        if ( icmp->type == ICMP_REDIRECT ) {
+            return 0;
+        }
+
+        info->reply = 1;
+        /* TODO get ttl */
+        /*info->ttl = */
+        return 1;
+    }
+
     /* check that the magic value in the reply matches what we expected */
     if ( *(uint16_t*)(((char *)packet)+(ip->ihl<< 2)+sizeof(struct icmphdr)) !=
-	    globals->info[seq].magic ) {
+	    info->magic ) {
         Log(LOG_DEBUG, "Bad magic value");
 	return -1;
     }
 
     /* reply is good, record the round trip time */
-    globals->info[seq].reply = 1;
-    globals->outstanding--;
+    info->reply = 1;
 
-    delay = DIFF_TV_US(*now, globals->info[seq].time_sent);
+    delay = DIFF_TS_NS(*now, info->time_sent);
     if ( delay > 0 ) {
-        globals->info[seq].delay = (uint32_t)delay;
+        info->delay = (uint64_t)delay;
     } else {
-        globals->info[seq].delay = 0;
+        info->delay = 0;
     }
 
     Log(LOG_DEBUG, "Good ICMP ECHOREPLY");
-    return 0;
+    return 1;
 }
 
 
@@ -292,14 +298,13 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
  * is the same behaviour as the original icmp test, but is it really what we
  * want? Should record errors for both protocols, or neither?
  */
-static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now) {
+static int match_ipv6_packet(struct icmpglobals_t *globals, char *packet,
+        uint32_t bytes, uint32_t *key) {
 
     struct icmp6_hdr *icmp;
     uint16_t seq;
-    int64_t delay;
 
-    if ( bytes < sizeof(struct icmp6_hdr) ) {
+    if ( bytes < sizeof(struct icmp6_hdr) + sizeof(uint16_t) ) {
         return -1;
     }
 
@@ -310,79 +315,85 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
     /* sanity check the various fields of the icmp header */
     if ( icmp->icmp6_type != ICMP6_ECHO_REPLY ||
 	    ntohs(icmp->icmp6_id) != globals->ident ||
-	    seq > globals->count ) {
+	    seq >= globals->count ) {
 	return -1;
     }
 
+    *key = seq;
+
+    return 0;
+}
+
+
+
+/*
+ * Record the round trip time of an ICMPv6 echo reply.
+ */
+static int report_ipv6_packet(struct info_t *info, char *packet,
+        struct timespec *now) {
+
+    int64_t delay;
+
     /* check that the magic value in the reply matches what we expected */
     if ( *(uint16_t*)(((char*)packet) + sizeof(struct icmp6_hdr)) !=
-	    globals->info[seq].magic ) {
+	    info->magic ) {
 	return -1;
     }
 
     /* reply is good, record the round trip time */
-    globals->info[seq].reply = 1;
-    globals->outstanding--;
+    info->reply = 1;
 
-    delay = DIFF_TV_US(*now, globals->info[seq].time_sent);
+    delay = DIFF_TS_NS(*now, info->time_sent);
     if ( delay > 0 ) {
-        globals->info[seq].delay = (uint32_t)delay;
+        info->delay = (uint64_t)delay;
     } else {
-        globals->info[seq].delay = 0;
+        info->delay = 0;
     }
 
     Log(LOG_DEBUG, "Good ICMP6 ECHOREPLY");
-    return 0;
+    return 1;
 }
 
 
 
 /*
- * Callback used when a packet is received that might be a response to one
- * of our probes.
+ * Check if a received packet might be a response to one of our probes, and
+ * find the sequence number of the probe.
  */
-static void receive_probe_callback(evutil_socket_t evsock,
-        short flags, void *evdata) {
+static int match_response(void *data, struct recv_packet_t *packet,
+        uint32_t *key) {
 
-    char packet[RESPONSE_BUFFER_LEN];
-    struct timeval now;
-    struct iphdr *ip;
-    ssize_t bytes;
-    int wait;
-    struct socket_t sockets;
-    struct icmpglobals_t *globals = (struct icmpglobals_t*)evdata;
-
-    assert(evsock > 0);
-    assert(flags == EV_READ);
-
-    wait = 0;
-
-    /* the socket used here doesn't matter as the family isn't used anywhere */
-    sockets.socket = evsock;
-    sockets.socket6 = -1;
-
-    if ( (bytes=get_packet(&sockets, packet, RESPONSE_BUFFER_LEN, NULL, &wait,
-                    &now)) > 0 ) {
-	/*
-	 * this check isn't as nice as it could be - should we explicitly ask
-	 * for the icmp6 header to be returned so we can be sure we are
-	 * checking the right things?
-	 */
-        ip = (struct iphdr*)packet;
-        switch ( ip->version ) {
-	    case 4: process_ipv4_packet(globals, packet, bytes, &now);
-		    break;
-	    default: /* unless we ask we don't have an ipv6 header here */
-		    process_ipv6_packet(globals, packet, bytes, &now);
-		    break;
-	};
-    }
+    struct icmpglobals_t *globals = (struct icmpglobals_t*)data;
 
-    if ( globals->outstanding == 0 && globals->index == globals->count ) {
-        /* not waiting on any more packets, exit the event loop */
-        Log(LOG_DEBUG, "All expected ICMP responses received");
-        event_base_loopbreak(globals->base);
-    }
+    /*
+     * this check isn't as nice as it could be - should we explicitly ask
+     * for the icmp6 header to be returned so we can be sure we are
+     * checking the right things?
+     */
+    switch ( ((struct iphdr*)packet->data)->version ) {
+        case 4: return match_ipv4_packet(globals, packet->data,
+                        packet->bytes, key);
+        default: /* unless we ask we don't have an ipv6 header here */
+                return match_ipv6_packet(globals, packet->data,
+                        packet->bytes, key);
+    };
+}
+
+
+
+/*
+ * Record the response to a probe that is waiting for one.
+ */
+static int report_response(void *data, struct probe_t *probe,
+        struct recv_packet_t *packet) {
+
+    struct icmpglobals_t *globals = (struct icmpglobals_t*)data;
+    struct info_t *info = &globals->info[probe->index];
+
+    switch ( ((struct iphdr*)packet->data)->version ) {
+        case 4: return report_ipv4_packet(info, packet->data, &packet->time);
+        default: return report_ipv6_packet(info, packet->data, &packet->time);
+    };
 }
 
 
@@ -424,107 +435,32 @@ static int build_probe(uint8_t family, void *packet, uint16_t packet_size,
 
 
 /*
- * Construct and send an icmp echo request packet.
+ * Record the information about the probe to the next destination so that we
+ * can track the response, and build the echo request to send to it.
  */
-static void send_packet(
-        __attribute__((unused))evutil_socket_t evsock,
-        __attribute__((unused))short flags,
-        void *evdata) {
-
-    char *packet;
-    int sock;
-    int length;
-    int delay;
-    int seq;
-    uint16_t ident;
-    struct addrinfo *dest;
-    struct opt_t *opt;
-    struct icmpglobals_t *globals;
-    struct info_t *info;
-    struct timeval timeout;
+static int build_request(void *data, struct probe_t *probe, char *packet,
+        int size) {
 
-    globals = (struct icmpglobals_t *)evdata;
-    info = globals->info;
-    seq = globals->index;
-    ident = globals->ident;
-    dest = globals->dests[seq];
-    opt = &globals->options;
-    packet = NULL;
+    struct icmpglobals_t *globals = (struct icmpglobals_t*)data;
+    struct addrinfo *dest = globals->dests[probe->index];
+    struct info_t *info = &globals->info[probe->index];
 
     /* save information about this packet so we can track the response */
-    memset(&info[seq], 0, sizeof(info[seq]));
-    info[seq].addr = dest;
-    info[seq].magic = rand();
+    memset(info, 0, sizeof(*info));
+    info->addr = dest;
+    info->magic = rand();
 
-    /* TODO should we try to send the next packet in this time slot? */
     if ( !dest->ai_addr ) {
         Log(LOG_INFO, "No address for target %s, skipping", dest->ai_canonname);
-        goto next;
-    }
-
-    /* determine which socket we should use, ipv4 or ipv6 */
-    switch ( dest->ai_family ) {
-	case AF_INET: sock = globals->sockets.socket; break;
-	case AF_INET6: sock = globals->sockets.socket6; break;
-	default: Log(LOG_WARNING, "Unknown address family: %d",dest->ai_family);
-                 goto next;
-    };
-
-    if ( sock < 0 ) {
-	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
-                dest->ai_canonname);
-        goto next;
-    }
-
-    /* build the probe packet */
-    packet = calloc(1, opt->packet_size);
-    length = build_probe(dest->ai_family, packet, opt->packet_size, seq, ident,
-            info[seq].magic);
-
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, dest,
-                    opt->inter_packet_delay, &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
-    }
-
-    if ( delay < 0 ) {
-        /* mark this as done if the packet failed to send properly */
-        info[seq].reply = 1;
-        memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
-    } else {
-        globals->outstanding++;
+        return -1;
     }
 
-next:
-    globals->index++;
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-        globals->nextpackettimer = NULL;
-    }
-    /* create timer for sending the next packet if there are still more to go */
-    if ( globals->index == globals->count ) {
-        Log(LOG_DEBUG, "Reached final target: %d", globals->index);
-        if ( globals->outstanding == 0 ) {
-            /* avoid waiting for LOSS_TIMEOUT if no packets are outstanding */
-            event_base_loopbreak(globals->base);
-        } else {
-            globals->losstimer = event_new(globals->base, -1, 0,
-                    halt_test, globals);
-            timeout.tv_sec = LOSS_TIMEOUT;
-            timeout.tv_usec = 0;
-            event_add(globals->losstimer, &timeout);
-        }
-    } else {
-        globals->nextpackettimer = event_new(globals->base, -1, 0,
-                send_packet, globals);
-        timeout.tv_sec = (int)(globals->options.inter_packet_delay / 1000000);
-        timeout.tv_usec = globals->options.inter_packet_delay % 1000000;
-        event_add(globals->nextpackettimer, &timeout);
-    }
+    probe->dest = dest;
+    probe->key = probe->index;
+    probe->sent = &info->time_sent;
 
-    if ( packet ) {
-        free(packet);
-    }
+    return build_probe(dest->ai_family, packet, size, probe->index,
+            globals->ident, info->magic);
 }
 
 
@@ -584,12 +520,15 @@ static Amplet2__Icmp__Item* report_destination(struct info_t *info) {
              (info->err_type == 0 && info->err_code == 0)) ) {
         /* report the rtt if we got a valid reply */
         item->has_rtt = 1;
-        item->rtt = info->delay;
+        item->rtt = (uint32_t)(info->delay / 1000);
+        item->has_rtt_ns = 1;
+        item->rtt_ns = info->delay;
         item->has_ttl = 1;
         item->ttl = info->ttl;
     } else {
         /* don't send an rtt if there wasn't a valid one recorded */
         item->has_rtt = 0;
+        item->has_rtt_ns = 0;
         item->has_ttl = 0;
     }
 
@@ -672,7 +611,8 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
  */
 static void usage(void) {
     fprintf(stderr,
-            "Usage: amp-icmp [-hrvx] [-p perturbate] [-s packetsize]\n"
+            "Usage: amp-icmp [-hrvx] [-B batchsize] [-p perturbate]\n"
+            "                [-s packetsize]\n"
             "                [-Q codepoint] [-Z interpacketgap]\n"
             "                [-I interface] [-4 [sourcev4]] [-6 [sourcev6]]\n"
             "                -- destination1 [destination2 ... destinationN]"
@@ -680,6 +620,8 @@ static void usage(void) {
 
     /* test specific options */
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -B, --batch          <count>   "
+            "Number of probes to send with each system call\n");
     fprintf(stderr, "  -p, --perturbate     <msec>    "
             "Maximum number of milliseconds to delay test\n");
     fprintf(stderr, "  -r, --random                   "
@@ -707,8 +649,10 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     char *address_string;
     struct icmpglobals_t *globals;
     struct event *signal_int;
-    struct event *socket;
-    struct event *socket6;
+    struct probe_opt_t probe_options;
+    struct probe_ops_t probe_ops = {
+        build_request, match_response, report_response
+    };
     amp_test_result_t *result;
 
     Log(LOG_DEBUG, "Starting ICMP test");
@@ -723,11 +667,12 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     globals->options.packet_size = DEFAULT_ICMP_ECHO_REQUEST_LEN;
     globals->options.random = 0;
     globals->options.perturbate = 0;
+    globals->options.batch = 1;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "p:rs:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "B:p:rs:I:Q:Z:4::6::hvx",
                     long_options, NULL)) != -1 ) {
 	switch ( opt ) {
             case '4': address_string = parse_optional_argument(argv);
@@ -742,6 +687,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
                           sourcev6 = get_numeric_address(address_string, NULL);
                       };
                       break;
+            case 'B': globals->options.batch = atoi(optarg); break;
             case 'I': device = optarg; break;
             case 'Q': if ( parse_dscp_value(optarg,
                                   &globals->options.dscp) < 0 ) {
@@ -782,6 +728,17 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
 	globals->options.packet_size = MIN_PACKET_LEN;
     }
 
+    /* make sure the batch size is something we can actually send */
+    if ( globals->options.batch < 1 ) {
+        Log(LOG_WARNING, "Batch size %d too small, raising to 1",
+                globals->options.batch);
+        globals->options.batch = 1;
+    } else if ( globals->options.batch > MAX_SEND_BATCH ) {
+        Log(LOG_WARNING, "Batch size %d too large, lowering to %d",
+                globals->options.batch, MAX_SEND_BATCH);
+        globals->options.batch = MAX_SEND_BATCH;
+    }
+
     /* delay the start by a random amount if perturbate is set */
     if ( globals->options.perturbate ) {
 	int delay;
@@ -831,11 +788,18 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     /* allocate space to store information about each request sent */
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
 
-    globals->index = 0;
-    globals->outstanding = 0;
     globals->count = count;
     globals->dests = dests;
-    globals->losstimer = NULL;
+
+    /* the probe engine takes care of sending probes and matching responses */
+    probe_options.count = count;
+    probe_options.batch = globals->options.batch;
+    probe_options.packet_size = globals->options.packet_size;
+    probe_options.response_size = RESPONSE_BUFFER_LEN;
+    probe_options.inter_packet_delay = globals->options.inter_packet_delay;
+    probe_options.loss_timeout = LOSS_TIMEOUT;
+    globals->engine = new_probe_engine(globals->base, &globals->sockets,
+            &probe_options, &probe_ops, globals);
 
 #if _WIN32
     signal_int = NULL;
@@ -846,39 +810,14 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     event_add(signal_int, NULL);
 #endif
 
-    /* set up callbacks for receiving packets */
-    socket = event_new(globals->base, globals->sockets.socket,
-            EV_READ|EV_PERSIST, receive_probe_callback, globals);
-    event_add(socket, NULL);
-
-    socket6 = event_new(globals->base, globals->sockets.socket6,
-            EV_READ|EV_PERSIST, receive_probe_callback, globals);
-    event_add(socket6, NULL);
-
     /* schedule the first probe packet to be sent immediately */
-    globals->nextpackettimer = event_new(globals->base, -1,
-            EV_PERSIST, send_packet, globals);
-    event_active(globals->nextpackettimer, 0, 0);
+    start_probe_engine(globals->engine);
 
     /* run the event loop till told to stop or all tests performed */
     event_base_dispatch(globals->base);
 
     /* tidy up after ourselves */
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-    }
-
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-    }
-
-    if ( socket ) {
-        event_free(socket);
-    }
-
-    if ( socket6 ) {
-        event_free(socket6);
-    }
+    free_probe_engine(globals->engine);
 
     if ( signal_int ) {
         event_free(signal_int);
@@ -887,11 +826,11 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     event_base_free(globals->base);
 
     if ( globals->sockets.socket > 0 ) {
-	close(globals->sockets.socket);
+	close_socket(globals->sockets.socket);
     }
 
     if ( globals->sockets.socket6 > 0 ) {
-	close(globals->sockets.socket6);
+	close_socket(globals->sockets.socket6);
     }
 
     if ( sourcev4 ) {
@@ -962,7 +901,9 @@ void print_icmp(amp_test_result_t *result) {
         inet_ntop(item->family, item->address.data, addrstr, INET6_ADDRSTRLEN);
         printf(" (%s)", addrstr);
 
-        if ( item->has_rtt ) {
+        if ( item->has_rtt_ns ) {
+            printf(" %.3fus", item->rtt_ns / 1000.0);
+        } else if ( item->has_rtt ) {
             printf(" %dus", item->rtt);
         } else {
             if ( item->err_type == 0 ) {
@@ -1023,8 +964,14 @@ test_t *register_test() {
 
 #if UNIT_TEST
 int amp_test_process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now) {
-    return process_ipv4_packet(globals, packet, bytes, now);
+        uint32_t bytes, struct timespec *now) {
+    uint32_t seq;
+
+    if ( match_ipv4_packet(globals, packet, bytes, &seq) < 0 ) {
+        return -1;
+    }
+
+    return report_ipv4_packet(&globals->info[seq], packet, now) < 0 ? -1 : 0;
 }
 
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
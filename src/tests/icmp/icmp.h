@@ -55,6 +55,7 @@
 #endif
 
 #include "testlib.h"
+#include "probe.h"
 
 
 
@@ -87,6 +88,7 @@
 struct opt_t {
     int random;			/* use random packet sizes (bytes) */
     int perturbate;		/* delay sending by up to this time (usec) */
+    int batch;                  /* number of probes to send at once */
     uint8_t dscp;               /* diffserv codepoint to set */
     uint16_t packet_size;	/* use this packet size (bytes) */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
@@ -100,8 +102,8 @@ struct opt_t {
  */
 struct info_t {
     struct addrinfo *addr;	/* address probe was sent to */
-    struct timeval time_sent;	/* when the probe was sent */
-    uint32_t delay;		/* delay in receiving response, microseconds */
+    struct timespec time_sent;	/* when the probe was sent */
+    uint64_t delay;		/* delay in receiving response, nanoseconds */
     uint16_t magic;		/* a random number to confirm response */
     uint8_t reply;		/* set to 1 once we have a reply */
     uint8_t err_type;		/* type of ICMP error reply or 0 if no error */
@@ -120,13 +122,10 @@ struct icmpglobals_t {
     struct addrinfo **dests;
     struct info_t *info;
     uint16_t ident;
-    int index;
     int count;
-    int outstanding;
 
     struct event_base *base;
-    struct event *nextpackettimer;
-    struct event *losstimer;
+    struct probe_engine_t *engine;
 };
 
 
@@ -138,7 +137,7 @@ test_t *register_test(void);
 
 #if UNIT_TEST
 int amp_test_process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now);
+        uint32_t bytes, struct timespec *now);
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
         int count, struct info_t info[], struct opt_t *opt);
 #endif
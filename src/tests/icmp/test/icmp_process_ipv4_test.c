@@ -59,8 +59,9 @@
 int main(void) {
     char packet[MAX_PACKET_LEN];
     struct icmpglobals_t globals;
-    struct timeval now = {0, 0};
+    struct timespec now = {0, 0};
     struct iphdr *ip;
+    int i;
     struct icmphdr icmps[] = {
         /* good response */
         { ICMP_ECHOREPLY, 0, 0, { .echo = {htons(1), 0}} },
@@ -116,34 +117,34 @@ int main(void) {
 
     srand(time(NULL));
 
-    for ( globals.index = 0; globals.index < globals.count; globals.index++ ) {
-        globals.info[globals.index].magic = rand();
-        ip->tot_len = length[globals.index];
-        globals.ident = ntohs(icmps[globals.index].un.echo.id);
+    for ( i = 0; i < globals.count; i++ ) {
+        globals.info[i].magic = rand();
+        ip->tot_len = length[i];
+        globals.ident = ntohs(icmps[i].un.echo.id);
 
         /* fill the packet with each icmp header and magic in turn */
         memcpy(packet + sizeof(struct iphdr),
-                &icmps[globals.index], sizeof(struct icmphdr));
+                &icmps[i], sizeof(struct icmphdr));
         memcpy(packet + sizeof(struct iphdr) + sizeof(struct icmphdr),
-                &globals.info[globals.index].magic,
-                sizeof(globals.info[globals.index].magic));
+                &globals.info[i].magic,
+                sizeof(globals.info[i].magic));
 
         /* check that it passed or failed appropriately */
         assert(amp_test_process_ipv4_packet(&globals, packet,
-                    length[globals.index], &now) == results[globals.index]);
+                    length[i], &now) == results[i]);
 
         /*
          * The error type/code will only be set if it can be determined to be a
          * response to a probe packet that we sent. If it's too short or too
          * wrong, then this won't be set.
          */
-        if ( icmps[globals.index].type < NR_ICMP_TYPES &&
-                icmps[globals.index].type != ICMP_ECHO &&
-                length[globals.index] >= MIN_VALID_LEN ) {
-            assert(globals.info[globals.index].err_type ==
-                    icmps[globals.index].type);
-            assert(globals.info[globals.index].err_code ==
-                    icmps[globals.index].code);
+        if ( icmps[i].type < NR_ICMP_TYPES &&
+                icmps[i].type != ICMP_ECHO &&
+                length[i] >= MIN_VALID_LEN ) {
+            assert(globals.info[i].err_type ==
+                    icmps[i].type);
+            assert(globals.info[i].err_code ==
+                    icmps[i].code);
         }
     }
 
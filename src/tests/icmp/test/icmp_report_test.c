@@ -116,11 +116,14 @@ static void verify_response(struct info_t *a, Amplet2__Icmp__Item *b) {
                 (a->err_type == ICMP_REDIRECT ||
                  (a->err_type == 0 && a->err_code == 0)) ) {
         assert(b->has_rtt);
-        assert(a->delay == b->rtt);
+        assert(a->delay / 1000 == b->rtt);
+        assert(b->has_rtt_ns);
+        assert(a->delay == b->rtt_ns);
         assert(b->has_ttl);
         assert(a->ttl == b->ttl);
     } else {
         assert(!b->has_rtt);
+        assert(!b->has_rtt_ns);
         assert(!b->has_ttl);
     }
 }
@@ -190,7 +193,7 @@ static void build_info(struct info_t *item, struct addrinfo *addr,
     item->err_code = code;
     item->ttl = ttl;
     item->time_sent.tv_sec = seconds;
-    item->time_sent.tv_usec = 0;
+    item->time_sent.tv_nsec = 0;
 }
 
 
@@ -71,6 +71,8 @@ def get_data(data):
                 "runtime": i.runtime if i.HasField("runtime") else None,
                 "rtt": _build_summary(i.rtt) if i.HasField("rtt") else None,
                 "jitter": _build_summary(i.jitter) if i.HasField("jitter") else None,
+                "rtt_ns": _build_summary(i.rtt_ns) if i.HasField("rtt_ns") else None,
+                "jitter_ns": _build_summary(i.jitter_ns) if i.HasField("jitter_ns") else None,
             }
         )
 
@@ -65,6 +65,21 @@ def build_summary(data):
         "samples": data.samples,
     }
 
+def build_summary_ns(data):
+    """
+    Build the nanosecond summary dictionary if the appropriate data was reported
+    """
+    if not data:
+        return None
+    return {
+        "maximum": data.maximum,
+        "minimum": data.minimum,
+        "mean": data.mean,
+        "sd": data.sd if data.HasField("sd") else None,
+        "samples": data.samples,
+        "percentiles": list(data.percentiles),
+    }
+
 def build_voip(data):
     """
     Build the VoIP result dictionary if the appropriate data was reported
@@ -104,6 +119,8 @@ def get_data(data):
                 "direction": direction_to_string(i.direction),
                 "rtt": build_summary(i.rtt) if i.HasField("rtt") else None,
                 "jitter": build_summary(i.jitter) if i.HasField("jitter") else None,
+                "rtt_ns": build_summary_ns(i.rtt_ns) if i.HasField("rtt_ns") else None,
+                "jitter_ns": build_summary_ns(i.jitter_ns) if i.HasField("jitter_ns") else None,
                 "percentiles": i.percentiles,
                 "packets_received": i.packets_received if i.HasField("packets_received") else None,
                 "loss_periods": build_loss_periods(i.loss_periods),
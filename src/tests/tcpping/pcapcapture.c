@@ -186,6 +186,13 @@ static int create_pcap_filter(struct pcapdevice *p, uint16_t srcportv4,
         return 0;
     }
 
+#if HAVE_PCAP_TSTAMP_PRECISION
+    /* not fatal, we can still use microsecond timestamps if we have to */
+    if ( pcap_set_tstamp_precision(p->pcap, PCAP_TSTAMP_PRECISION_NANO) != 0 ) {
+        Log(LOG_DEBUG, "No nanosecond pcap timestamps, using microseconds");
+    }
+#endif
+
     if ( pcap_activate(p->pcap) != 0 ) {
         Log(LOG_ERR, "Failed to activate pcap handle:%s", pcap_geterr(p->pcap));
         return 0;
@@ -388,7 +395,7 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
     transport.protocol = 0;
     transport.remaining = 0;
     transport.ts.tv_sec = 0;
-    transport.ts.tv_usec = 0;
+    transport.ts.tv_nsec = 0;
 
     packet = (char *)pcap_next(p->pcap, &header);
     if ( packet == NULL ) {
@@ -397,7 +404,15 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
         return transport;
     }
 
-    transport.ts = header.ts;
+    /* with nanosecond precision the tv_usec field is actually nanoseconds */
+    transport.ts.tv_sec = header.ts.tv_sec;
+#if HAVE_PCAP_TSTAMP_PRECISION
+    if ( pcap_get_tstamp_precision(p->pcap) == PCAP_TSTAMP_PRECISION_NANO ) {
+        transport.ts.tv_nsec = header.ts.tv_usec;
+    } else
+#endif
+    transport.ts.tv_nsec = header.ts.tv_usec * 1000;
+
     remaining = header.len;
 
     datalink = pcap_datalink(p->pcap);
@@ -68,7 +68,7 @@ struct pcaptransport {
     char *header;
     uint8_t protocol;
     int remaining;
-    struct timeval ts;
+    struct timespec ts;
 };
 
 void pcap_cleanup(void);
@@ -61,6 +61,7 @@
 
 #include "config.h"
 #include "testlib.h"
+#include "probe.h"
 #include "tcpping.h"
 #include "pcapcapture.h"
 #include "tcpping.pb-c.h"
@@ -72,6 +73,7 @@
 
 
 static struct option long_options[] = {
+    {"batch", required_argument, 0, 'B'},
     {"port", required_argument, 0, 'P'},
     {"perturbate", required_argument, 0, 'p'},
     {"random", no_argument, 0, 'r'},
@@ -106,26 +108,6 @@ static void interrupt_test(
 
 
 
-/*
- * Force the event loop to halt, so we can end the test and report the
- * results that we do have.
- */
-static void halt_test(
-    __attribute__((unused))evutil_socket_t evsock,
-    __attribute__((unused))short flags,
-    void *evdata) {
-    struct tcppingglobals *tp = (struct tcppingglobals *)evdata;
-
-    Log(LOG_DEBUG, "Halting TCPPing test due to timeout");
-    if (tp->losstimer){
-        event_free(tp->losstimer);
-    }
-    tp->losstimer = NULL;
-    event_base_loopbreak(tp->base);
-}
-
-
-
 /*
  * Open the raw TCP sockets needed for this test and bind them to
  * the requested device or addresses.
@@ -322,6 +304,17 @@ static void process_options(struct tcppingglobals *tcpping) {
         tcpping->options.packet_size = MAX_TCPPING_PROBE_LEN;
     }
 
+    /* make sure the batch size is something we can actually send */
+    if ( tcpping->options.batch < 1 ) {
+        Log(LOG_WARNING, "Batch size %d too small, raising to 1",
+                tcpping->options.batch);
+        tcpping->options.batch = 1;
+    } else if ( tcpping->options.batch > MAX_SEND_BATCH ) {
+        Log(LOG_WARNING, "Batch size %d too large, lowering to %d",
+                tcpping->options.batch, MAX_SEND_BATCH);
+        tcpping->options.batch = MAX_SEND_BATCH;
+    }
+
     /* delay the start by a random amount of perturbate is set */
     if ( tcpping->options.perturbate ) {
         int delay;
@@ -411,7 +404,7 @@ static int set_tcp_checksum(struct tcphdr *tcp, int packet_size,
  */
 static int craft_tcp_syn(struct tcppingglobals *tp, char *packet,
         uint16_t srcport, int packet_size, struct sockaddr *srcaddr,
-        struct addrinfo *destaddr) {
+        struct addrinfo *destaddr, uint32_t seqno) {
 
     struct tcphdr *tcp;
     struct tcpmssoption *mss;
@@ -421,7 +414,7 @@ static int craft_tcp_syn(struct tcppingglobals *tp, char *packet,
     tcp = (struct tcphdr *)packet;
     tcp->source = htons(srcport);
     tcp->dest = htons(tp->options.port);
-    tcp->seq = htonl(tp->seqindex + (tp->destindex * 100));
+    tcp->seq = htonl(seqno);
     tcp->ack_seq = 0;
 
     /* Pad IPv4 packets out to match the length of a IPv6 packet with
@@ -479,10 +472,10 @@ static int unpack_destid(int destid, int max) {
 
 
 /*
- * Given a TCP header from a response packet, find the index of the
- * test target that generated the response.
+ * Given a TCP header from a response packet, find the probe to the test
+ * target that generated the response.
  */
-static inline int match_response(struct tcppingglobals *tp,
+static inline struct probe_t *match_response(struct tcppingglobals *tp,
         struct tcphdr *tcp, uint8_t istcp) {
     /*
      * TODO: should we be checking if the response came from our intended
@@ -517,15 +510,11 @@ static inline int match_response(struct tcppingglobals *tp,
 
     if ( destid < 0 || destid >= tp->destcount ) {
         Log(LOG_DEBUG, "Invalid destid %d, ignoring", destid);
-        return -1;
-    }
-
-    if ( tp->info[destid].reply != NO_REPLY ) {
-        /* Already got a reply for this SYN */
-        return -1;
+        return NULL;
     }
 
-    return destid;
+    /* only probes that haven't already had a reply are still waiting */
+    return find_probe(tp->engine, destid);
 }
 
 
@@ -535,8 +524,9 @@ static inline int match_response(struct tcppingglobals *tp,
  * is actually one of ours, and then extract timing information etc.
  */
 static void process_tcp_response(struct tcppingglobals *tp, struct tcphdr *tcp,
-        int remaining, struct timeval ts) {
+        int remaining, struct timespec ts) {
 
+    struct probe_t *probe;
     int destid;
 
     if ( tcp == NULL || remaining < (int)sizeof(struct tcphdr) ) {
@@ -544,15 +534,17 @@ static void process_tcp_response(struct tcppingglobals *tp, struct tcphdr *tcp,
         return;
     }
 
-    if ((destid = match_response(tp, tcp, 1)) >= 0) {
+    if ( (probe = match_response(tp, tcp, 1)) != NULL ) {
         int64_t delay;
 
+        destid = probe->index;
+
         tp->info[destid].reply = TCP_REPLY;
         tp->info[destid].replyflags = 0;
 
-        delay = DIFF_TV_US(ts, tp->info[destid].time_sent);
+        delay = DIFF_TS_NS(ts, tp->info[destid].time_sent);
         if ( delay > 0 ) {
-            tp->info[destid].delay = (uint32_t)delay;
+            tp->info[destid].delay = (uint64_t)delay;
         } else {
             tp->info[destid].delay = 0;
         }
@@ -570,7 +562,7 @@ static void process_tcp_response(struct tcppingglobals *tp, struct tcphdr *tcp,
         if ( tcp->fin )
             tp->info[destid].replyflags += 0x01;
 
-        tp->outstanding --;
+        finish_probe(tp->engine, probe);
     }
 }
 
@@ -586,9 +578,10 @@ static void process_tcp_response(struct tcppingglobals *tp, struct tcphdr *tcp,
  * that our amp monitor is doing.
  */
 static void process_icmp4_response(struct tcppingglobals *tp,
-        struct icmphdr *icmp, int remaining, struct timeval ts) {
+        struct icmphdr *icmp, int remaining, struct timespec ts) {
 
     char *packet = (char *)icmp;
+    struct probe_t *probe;
     int destid;
     struct iphdr *ip;
 
@@ -619,20 +612,23 @@ static void process_icmp4_response(struct tcppingglobals *tp,
         return;
     }
 
-    if ((destid = match_response(tp, (struct tcphdr *)packet, 0)) >= 0) {
+    if ( (probe = match_response(tp, (struct tcphdr *)packet, 0)) != NULL ) {
         int64_t delay;
 
+        destid = probe->index;
+
         tp->info[destid].icmptype = icmp->type;
         tp->info[destid].icmpcode = icmp->code;
         tp->info[destid].reply = ICMP_REPLY;
-        tp->outstanding --;
 
-        delay = DIFF_TV_US(ts, tp->info[destid].time_sent);
+        delay = DIFF_TS_NS(ts, tp->info[destid].time_sent);
         if ( delay > 0 ) {
-            tp->info[destid].delay = (uint32_t)delay;
+            tp->info[destid].delay = (uint64_t)delay;
         } else {
             tp->info[destid].delay = 0;
         }
+
+        finish_probe(tp->engine, probe);
     }
 }
 
@@ -648,9 +644,10 @@ static void process_icmp4_response(struct tcppingglobals *tp,
  * that our amp monitor is doing.
  */
 static void process_icmp6_response(struct tcppingglobals *tp,
-        struct icmp6_hdr *icmp, int remaining, struct timeval ts) {
+        struct icmp6_hdr *icmp, int remaining, struct timespec ts) {
 
     char *packet = (char *)icmp;
+    struct probe_t *probe;
     int destid;
 
     /*
@@ -675,20 +672,23 @@ static void process_icmp6_response(struct tcppingglobals *tp,
         return;
     }
 
-    if ((destid = match_response(tp, (struct tcphdr *)packet, 0)) >= 0) {
+    if ( (probe = match_response(tp, (struct tcphdr *)packet, 0)) != NULL ) {
         int64_t delay;
 
+        destid = probe->index;
+
         tp->info[destid].icmptype = icmp->icmp6_type;
         tp->info[destid].icmpcode = icmp->icmp6_code;
         tp->info[destid].reply = ICMP_REPLY;
-        tp->outstanding --;
 
-        delay = DIFF_TV_US(ts, tp->info[destid].time_sent);
+        delay = DIFF_TS_NS(ts, tp->info[destid].time_sent);
         if ( delay > 0 ) {
-            tp->info[destid].delay = (uint32_t)delay;
+            tp->info[destid].delay = (uint64_t)delay;
         } else {
             tp->info[destid].delay = 0;
         }
+
+        finish_probe(tp->engine, probe);
     }
 }
 
@@ -728,69 +728,49 @@ static void receive_packet(evutil_socket_t evsock, short flags, void *evdata) {
         process_icmp6_response(tp, (struct icmp6_hdr *)transport.header,
                 transport.remaining, transport.ts);
     }
-
-    if ( tp->outstanding == 0 && tp->destindex == tp->destcount ) {
-        /* All packets have been sent and we are not waiting on any more
-         * responses -- exit the event loop so we can report.
-         */
-        Log(LOG_DEBUG, "All expected TCPPing responses received");
-        event_base_loopbreak(tp->base);
-    }
 }
 
 
 
 /*
- * Callback used when the timer fires indicating that a packet should be sent.
- * It will determine the next destination to be tested, create an appropriate
- * SYN packet and send it to the destination.
+ * Build the SYN packet for the next destination to be tested, creating a
+ * pcap listener for the responses if one doesn't already exist.
  */
-static void send_packet(
-        __attribute__((unused))evutil_socket_t evsock,
-        __attribute__((unused))short flags,
-        void *evdata) {
+static int build_syn(void *data, struct probe_t *probe, char *packet,
+        int size) {
 
-    struct tcppingglobals *tp = (struct tcppingglobals *)evdata;
-    struct addrinfo *dest = NULL;
+    struct tcppingglobals *tp = (struct tcppingglobals *)data;
+    struct addrinfo *dest = tp->dests[probe->index];
+    struct info_t *info = &tp->info[probe->index];
     uint16_t srcport;
     int packet_size;
-    char *packet = NULL;
-    int sock;
     struct sockaddr *srcaddr;
-    int delay;
-    struct timeval timeout;
-
-    /* Grab the next available destination */
-    assert(tp->destindex < tp->destcount);
-    dest = tp->dests[tp->destindex];
-    srcaddr = (struct sockaddr *)&(tp->info[tp->destindex].source);
-
-    tp->info[tp->destindex].addr = dest;
-    tp->info[tp->destindex].seqno = tp->seqindex + (tp->destindex * 100);
-    tp->info[tp->destindex].delay = 0;
-    tp->info[tp->destindex].reply = NO_REPLY;
-    tp->info[tp->destindex].replyflags = 0;
-    tp->info[tp->destindex].icmptype = 0;
-    tp->info[tp->destindex].icmpcode = 0;
+
+    srcaddr = (struct sockaddr *)&(info->source);
+
+    memset(info, 0, sizeof(*info));
+    info->addr = dest;
+    info->seqno = tp->seqindex + (probe->index * 100);
+    info->reply = NO_REPLY;
 
     if ( !dest->ai_addr ) {
         Log(LOG_INFO, "No address for target %s, skipping", dest->ai_canonname);
-        goto nextdest;
+        return -1;
     }
 
     if ( dest->ai_family == AF_INET ) {
         srcport = tp->sourceportv4;
-        sock = tp->raw_sockets.socket;
         packet_size = tp->options.packet_size - sizeof(struct iphdr);
     } else if ( dest->ai_family == AF_INET6 ) {
         srcport = tp->sourceportv6;
-        sock = tp->raw_sockets.socket6;
         packet_size = tp->options.packet_size - sizeof(struct ip6_hdr);
     } else {
         Log(LOG_WARNING, "Unknown address family: %d", dest->ai_family);
-        goto nextdest;
+        return -1;
     }
 
+    assert(packet_size <= size);
+
     /* we already know the source address if it has been manually configured */
     if ( dest->ai_family == AF_INET && tp->sourcev4 ) {
         memcpy(srcaddr, tp->sourcev4->ai_addr, sizeof(struct sockaddr_in));
@@ -798,7 +778,7 @@ static void send_packet(
         memcpy(srcaddr, tp->sourcev6->ai_addr, sizeof(struct sockaddr_in6));
     } else if ( find_source_address(tp->device, dest, srcaddr) == 0 ) {
         Log(LOG_DEBUG, "Failed to find source address for TCPPing test");
-        goto nextdest;
+        return -1;
     }
 
     /* Create a listening pcap fd for the interface */
@@ -807,59 +787,22 @@ static void send_packet(
             tp->base, tp, receive_packet) == -1 ) {
         Log(LOG_WARNING, "Failed to create pcap device for dest %s:%d",
                 dest->ai_canonname, tp->options.port);
-
-        goto nextdest;
+        return -1;
     }
 
-    packet = calloc(1, packet_size);
-
-    /* Form a TCP SYN packet */
-    if ( craft_tcp_syn(tp, packet, srcport, packet_size, srcaddr, dest) < 0 ) {
+    /* Form a TCP SYN packet, the buffer is reused so clear the payload */
+    memset(packet, 0, packet_size);
+    if ( craft_tcp_syn(tp, packet, srcport, packet_size, srcaddr, dest,
+                info->seqno) < 0 ) {
         Log(LOG_WARNING, "Error while crafting TCP packet for TCPPing test");
-        goto nextdest;
-    }
-
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, packet_size, dest,
-                    tp->options.inter_packet_delay,
-                    &(tp->info[tp->destindex].time_sent))) > 0 ) {
-        usleep(delay);
+        return -1;
     }
 
-    if ( delay < 0 ) {
-        /* zero the timestamp if the packet failed to send properly */
-        memset(&(tp->info[tp->destindex].time_sent), 0, sizeof(struct timeval));
-    } else {
-        tp->outstanding++;
-    }
+    probe->dest = dest;
+    probe->key = probe->index;
+    probe->sent = &info->time_sent;
 
-nextdest:
-    /* Create a timer for sending the next packet */
-    tp->destindex ++;
-    if ( tp->nextpackettimer ) {
-        event_free(tp->nextpackettimer);
-        tp->nextpackettimer = NULL;
-    }
-    if ( tp->destindex == tp->destcount ) {
-        Log(LOG_DEBUG, "Reached final target: %d", tp->destindex);
-        if ( tp->outstanding == 0 ) {
-            event_base_loopbreak(tp->base);
-        } else {
-            tp->losstimer = event_new(tp->base, -1, 0, halt_test, tp);
-            timeout.tv_sec = LOSS_TIMEOUT;
-            timeout.tv_usec = 0;
-            event_add(tp->losstimer, &timeout);
-        }
-    } else {
-        tp->nextpackettimer = event_new(tp->base, -1, 0, send_packet, tp);
-        timeout.tv_sec = (int)(tp->options.inter_packet_delay / 1000000);
-        timeout.tv_usec = tp->options.inter_packet_delay % 1000000;
-        event_add(tp->nextpackettimer, &timeout);
-    }
-
-    if ( packet ) {
-        free(packet);
-    }
+    return packet_size;
 }
 
 
@@ -883,6 +826,7 @@ static Amplet2__Tcpping__Item* report_destination(struct info_t *info) {
     switch ( info->reply ) {
         case NO_REPLY:
             item->has_rtt = 0;
+            item->has_rtt_ns = 0;
             item->has_icmptype = 0;
             item->has_icmpcode = 0;
             item->flags = NULL;
@@ -893,7 +837,9 @@ static Amplet2__Tcpping__Item* report_destination(struct info_t *info) {
                     sizeof(Amplet2__Tcpping__TcpFlags));
 
             item->has_rtt = 1;
-            item->rtt = info->delay;
+            item->rtt = (uint32_t)(info->delay / 1000);
+            item->has_rtt_ns = 1;
+            item->rtt_ns = info->delay;
 
             amplet2__tcpping__tcp_flags__init(item->flags);
 
@@ -931,6 +877,7 @@ static Amplet2__Tcpping__Item* report_destination(struct info_t *info) {
              * using it to generate an RTT?
              */
             item->has_rtt = 0;
+            item->has_rtt_ns = 0;
             item->has_icmptype = 1;
             item->icmptype = info->icmptype;
             item->has_icmpcode = 1;
@@ -1009,14 +956,17 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
  */
 static void usage(void) {
     fprintf(stderr,
-            "Usage: amp-tcpping [-hrvx] [-p perturbate] [-s packetsize]\n"
-            "                   [-P port] [-Q codepoint] [-Z interpacketgap]\n"
+            "Usage: amp-tcpping [-hrvx] [-B batchsize] [-p perturbate]\n"
+            "                   [-s packetsize] [-P port]\n"
+            "                   [-Q codepoint] [-Z interpacketgap]\n"
             "                   [-I interface] [-4 [sourcev4]] [-6 [sourcev6]]\n"
             "                   -- destination1 [destination2 ... destinationN]"
             "\n\n");
 
     /* test specific options */
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -B, --batch          <count>   "
+            "Number of probes to send with each system call\n");
     fprintf(stderr, "  -P, --port                     "
             "The port number to probe on the target host\n");
     fprintf(stderr, "  -p, --perturbate     <ms>      "
@@ -1044,6 +994,8 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     struct tcppingglobals *globals;
     struct event_base *base = NULL;
     struct event *signal_int;
+    struct probe_opt_t probe_options;
+    struct probe_ops_t probe_ops = { build_syn, NULL, NULL };
     amp_test_result_t *result;
     char *address_string;
 
@@ -1059,12 +1011,13 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     globals->options.random = 0;
     globals->options.perturbate = 0;
     globals->options.port = DEFAULT_TCPPING_PORT;
+    globals->options.batch = 1;
     globals->sourcev4 = NULL;
     globals->sourcev6 = NULL;
     globals->device = NULL;
     globals->base = base;
 
-    while ( (opt = getopt_long(argc, argv, "P:p:rs:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "B:P:p:rs:I:Q:Z:4::6::hvx",
                 long_options, NULL)) != -1 ) {
         switch (opt) {
             case '4': address_string = parse_optional_argument(argv);
@@ -1089,6 +1042,7 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': globals->options.inter_packet_delay = atoi(optarg); break;
+            case 'B': globals->options.batch = atoi(optarg); break;
             case 'P': globals->options.port = atoi(optarg); break;
             case 'p': globals->options.perturbate = atoi(optarg); break;
             case 'r': globals->options.random = 1; break;
@@ -1128,12 +1082,21 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     /* Start our sequence numbers from a random value and increment */
     globals->seqindex = rand();
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
-    globals->destindex = 0;
     globals->destcount = count;
-    globals->outstanding = 0;
     globals->dests = dests;
-    globals->nextpackettimer = NULL;
-    globals->losstimer = NULL;
+
+    /*
+     * The probe engine takes care of sending the SYNs, responses are captured
+     * with pcap and matched back to their probes in receive_packet().
+     */
+    probe_options.count = count;
+    probe_options.batch = globals->options.batch;
+    probe_options.packet_size = globals->options.packet_size;
+    probe_options.response_size = 0;
+    probe_options.inter_packet_delay = globals->options.inter_packet_delay;
+    probe_options.loss_timeout = LOSS_TIMEOUT;
+    globals->engine = new_probe_engine(base, &globals->raw_sockets,
+            &probe_options, &probe_ops, globals);
 
     /* catch a SIGINT and end the test early */
     signal_int = event_new(base, SIGINT,
@@ -1141,27 +1104,19 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     event_add(signal_int, NULL);
 
     /*
-     * Send a SYN to our first destination at time zero (immediately). This
-     * will setup a timer callback for sending the next packet and a fd
-     * callback for any response.
+     * Send a SYN to our first destination at time zero (immediately). The
+     * pcap callback for any response is created along with the first SYN.
      */
-    globals->nextpackettimer = event_new(base, -1, 0, send_packet, globals);
-    event_active(globals->nextpackettimer, 0, 0);
+    start_probe_engine(globals->engine);
 
     event_base_dispatch(base);
 
+    free_probe_engine(globals->engine);
+
     if ( signal_int ) {
         event_free(signal_int);
     }
 
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-    }
-
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-    }
-
     pcap_cleanup();
 
     close_sockets(globals);
@@ -1232,7 +1187,11 @@ void print_tcpping(amp_test_result_t *result) {
 
         if ( item->has_rtt ) {
             /* anything with an rtt is currently TCP only, should have flags */
-            printf(" %dus ", item->rtt);
+            if ( item->has_rtt_ns ) {
+                printf(" %.3fus ", item->rtt_ns / 1000.0);
+            } else {
+                printf(" %dus ", item->rtt);
+            }
 
             if ( item->flags->has_syn && item->flags->syn )
                 printf("SYN ");
@@ -52,6 +52,7 @@
 
 #include "tests.h"
 #include "testlib.h"
+#include "probe.h"
 
 
 /* The extra 4 bytes allows us to at least include an MSS option in the SYN */
@@ -88,6 +89,7 @@ struct opt_t {
     uint16_t port;              /* Target port number */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
     uint8_t dscp;
+    int batch;                  /* number of probes to send at once */
 };
 
 struct tcppingglobals {
@@ -101,14 +103,11 @@ struct tcppingglobals {
     struct socket_t raw_sockets;
     struct socket_t tcp_sockets;
     struct info_t *info;
-    int destindex;
     int destcount;
     char *device;
-    int outstanding;
 
     struct event_base *base;
-    struct event *nextpackettimer;
-    struct event *losstimer;
+    struct probe_engine_t *engine;
 };
 
 
@@ -144,9 +143,9 @@ struct tcpmssoption {
 struct info_t {
     struct sockaddr_storage source; /* Source IP address for the probe */
     struct addrinfo *addr;      /* Address that was probed */
-    struct timeval time_sent;   /* Time when the SYN was sent */
+    struct timespec time_sent;  /* Time when the SYN was sent */
     uint32_t seqno;             /* Sequence number of the sent SYN */
-    uint32_t delay;             /* Delay in receiving response */
+    uint64_t delay;             /* Delay in receiving response, nanoseconds */
     enum reply_type reply;      /* Protocol of reply (TCP/ICMP) */
     uint8_t replyflags;         /* TCP control bits set in the reply */
     uint8_t icmptype;           /* ICMP type of the reply */
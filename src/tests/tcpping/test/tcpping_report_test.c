@@ -168,6 +168,7 @@ static void verify_response(struct info_t *a, Amplet2__Tcpping__Item *b) {
     switch ( a->reply ) {
         case NO_REPLY:
             assert(!b->has_rtt);
+            assert(!b->has_rtt_ns);
             assert(!b->has_icmptype);
             assert(!b->has_icmpcode);
             assert(b->flags == NULL);
@@ -175,7 +176,9 @@ static void verify_response(struct info_t *a, Amplet2__Tcpping__Item *b) {
 
         case TCP_REPLY:
             assert(b->has_rtt);
-            assert(a->delay == b->rtt);
+            assert(a->delay / 1000 == b->rtt);
+            assert(b->has_rtt_ns);
+            assert(a->delay == b->rtt_ns);
             assert(!b->has_icmptype);
             assert(!b->has_icmpcode);
             assert(b->flags);
@@ -184,6 +187,7 @@ static void verify_response(struct info_t *a, Amplet2__Tcpping__Item *b) {
 
         case ICMP_REPLY:
             assert(!b->has_rtt);
+            assert(!b->has_rtt_ns);
             assert(b->has_icmptype);
             assert(b->has_icmpcode);
             assert(a->icmptype == b->icmptype);
@@ -62,6 +62,7 @@
 #include "serverlib.h"
 #include "debug.h"
 #include "tcpinfo.h"
+#include "waitset.h"
 
 
 
@@ -433,9 +434,10 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
     void *packet_out;
     int32_t bytes_sent = 0;
     uint32_t bytes_to_send;
-    struct timeval timeout;
+    int64_t timeout;
     int result;
-    fd_set write_set;
+    struct wait_set_t *set;
+    struct wait_event_t ready;
 
     /* Make sure the test is valid */
     if ( test_opts->bytes == 0 && test_opts->duration == 0 ) {
@@ -458,6 +460,15 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
         return -1;
     }
 
+    /* create the wait set once, rather than rebuilding it for every write */
+    if ( (set = new_wait_set()) == NULL ||
+            wait_set_add(set, sock_fd, WAIT_WRITE) < 0 ) {
+        Log(LOG_ERR, "sendStream() could not wait on test socket\n");
+        free_wait_set(set);
+        free(packet_out);
+        return -1;
+    }
+
     /* Note starting time */
     run_time_ms = 0;
     res->start_ns = timeNanoseconds();
@@ -473,11 +484,9 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
                 break;
             }
             /* run time is being measured in ms, so measure timeout the same */
-            timeout.tv_sec = (test_opts->duration - run_time_ms) / 1000;
-            timeout.tv_usec = (test_opts->duration - run_time_ms) % 1000 * 1000;
+            timeout = (int64_t)(test_opts->duration - run_time_ms) * 1000000;
         } else {
-            timeout.tv_sec = 10;
-            timeout.tv_usec = 0;
+            timeout = 10000000000LL;
         }
 
         /* amount of data to send should be remaining data (if set) */
@@ -489,10 +498,7 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
             bytes_to_send = test_opts->write_size;
         }
 
-        FD_ZERO(&write_set);
-        FD_SET(sock_fd, &write_set);
-
-        result = select(sock_fd + 1, NULL, &write_set, NULL, &timeout);
+        result = wait_set_wait(set, &timeout, &ready, 1);
 
         /* timeout has fired, stop the test */
         if ( result == 0 ) {
@@ -501,17 +507,13 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
 
         /* error, check if we can carry on or need to stop the test */
         if ( result < 0 ) {
-            if ( errno == EINTR ) {
-                continue;
-            } else {
-                Log(LOG_WARNING, "Error sending TCP throughput data: %s\n",
-                        strerror(errno));
-                break;
-            }
+            Log(LOG_WARNING, "Error sending TCP throughput data: %s\n",
+                    strerror(errno));
+            break;
         }
 
         /* we can write to the test socket, do so */
-        if ( FD_ISSET(sock_fd, &write_set) ) {
+        if ( ready.events & WAIT_WRITE ) {
             if ( test_opts->protocol == AMPLET2__THROUGHPUT__PROTOCOL__HTTP_POST ) {
                 if ( res->bytes == 0 ) {
                     /* start with an HTTP header to get proxies interested */
@@ -537,6 +539,7 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
     } while ( more );
 
     res->end_ns = timeNanoseconds();
+    free_wait_set(set);
     free(packet_out);
 
     res->tcpinfo = get_tcp_info(sock_fd);
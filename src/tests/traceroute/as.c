@@ -104,7 +104,7 @@ static int is_private_address(struct sockaddr *addr) {
  *
  */
 int set_as_numbers(struct dest_info_t *donelist) {
-    struct iptrie trie = { NULL, NULL };
+    struct iptrie trie = { NULL, NULL, NULL };
     struct dest_info_t *item;
     int masklen;
     int asn_fd;
@@ -71,6 +71,7 @@
 
 static struct option long_options[] = {
     {"asn", no_argument, 0, 'a'},
+    {"batch", required_argument, 0, 'B'},
     {"noip", no_argument, 0, 'b'},
     {"probeall", no_argument, 0, 'f'}, /* deprecated and ignored */
     {"perturbate", required_argument, 0, 'p'},
@@ -145,17 +146,38 @@ static int build_ipv6_probe(void *packet, uint16_t packet_size, int id,
 
 
 /*
- * Send the next probe packet towards a given destination.
+ * Mark a destination as done if the probe packet failed to send properly, we
+ * don't want to wait for a response that will never arrive. We also fill in
+ * 5 null hops in the path to make it appear the same as other failed
+ * traceroutes, but without having to send a heap of packets.
+ */
+static void set_probe_failed(struct dest_info_t *info) {
+    int i;
+
+    info->done_forward = 1;
+    info->path_length = TRACEROUTE_NO_REPLY_LIMIT;
+    for ( i = 0; i < info->path_length; i++ ) {
+        info->hop[i].addr = NULL;
+    }
+}
+
+
+
+/*
+ * Send the next probe packet towards a given destination. If a batch is
+ * given then the probe is queued in it rather than sent immediately, and
+ * the caller is responsible for flushing the batch and checking the result.
  */
 static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
         uint16_t packet_size, uint32_t inter_packet_delay, uint8_t dscp,
-        struct dest_info_t *info) {
+        struct send_batch_t *batch, struct dest_info_t *info) {
 
     char packet[packet_size];
     long int delay;
     uint16_t id;
     int sock;
     int length;
+    int ttl;
 
     assert(ip_sockets);
     assert(info);
@@ -168,6 +190,7 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
 
     memset(packet, 0, sizeof(packet));
     id = (info->ttl << 10) + info->id;
+    ttl = 0;
 
     switch ( info->addr->ai_family ) {
         case AF_INET: {
@@ -177,10 +200,11 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
         } break;
 
         case AF_INET6: {
-            int ttl = info->ttl;
             sock = ip_sockets->socket6;
-            if ( setsockopt(sock, SOL_IPV6, IPV6_UNICAST_HOPS, &ttl,
-                    sizeof(ttl)) < 0 ) {
+            ttl = info->ttl;
+            /* batched probes carry their own hop limit as ancillary data */
+            if ( batch == NULL && setsockopt(sock, SOL_IPV6,
+                        IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)) < 0 ) {
                 Log(LOG_WARNING, "Failed to set IPv6_UNICAST_HOPS: %s",
                         strerror(errno));
                 return -1;
@@ -195,12 +219,19 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
 	    return -1;
     };
 
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, info->addr,
-                    inter_packet_delay,
-                    &(info->hop[info->ttl - 1].time_sent))) > 0 ) {
-        Log(LOG_DEBUG, "Sleeping for %ldus - send event triggered early",delay);
-        usleep(delay);
+    if ( batch ) {
+        /* queue packet, it will be sent when the batch is flushed */
+        delay = queue_send_packet(batch, packet, length, info->addr, ttl,
+                &(info->hop[info->ttl - 1].time_sent)) < 0 ? -1 : 0;
+    } else {
+        /* send packet with appropriate inter packet delay */
+        while ( (delay = delay_send_packet(sock, packet, length, info->addr,
+                        inter_packet_delay,
+                        &(info->hop[info->ttl - 1].time_sent))) > 0 ) {
+            Log(LOG_DEBUG, "Sleeping for %ldus - send event triggered early",
+                    delay);
+            usleep(delay);
+        }
     }
 
     info->probes++;
@@ -208,19 +239,7 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
             info->id, info->ttl, info->attempts);
 
     if ( delay < 0 ) {
-        /*
-         * Mark this as done if the packet failed to send properly, we
-         * don't want to wait for a response that will never arrive. We
-         * also fill in 5 null hops in the path to make it appear the
-         * same as other failed traceroutes, but without having to send
-         * a heap of packets.
-         */
-        int i;
-        info->done_forward = 1;
-        info->path_length = TRACEROUTE_NO_REPLY_LIMIT;
-        for ( i = 0; i < info->path_length; i++ ) {
-            info->hop[i].addr = NULL;
-        }
+        set_probe_failed(info);
         return -1;
     }
 
@@ -726,7 +745,7 @@ static void set_done_item(struct probe_list_t *probelist,
  * Deal with an incoming packet that may be a response to one of our probes.
  */
 static int process_packet(struct sockaddr *addr, char *packet,
-        struct timeval now, struct probe_list_t *probelist ) {
+        struct timespec now, struct probe_list_t *probelist ) {
 
     struct dest_info_t *item;
     int ttl, index, type, code;
@@ -783,7 +802,7 @@ static int process_packet(struct sockaddr *addr, char *packet,
 
     /* record the delay between sending this probe and getting a response */
     if ( item->hop[ttl - 1].delay == 0 ) {
-        int64_t delay = DIFF_TV_US(now, item->hop[ttl - 1].time_sent);
+        int64_t delay = DIFF_TS_NS(now, item->hop[ttl - 1].time_sent) / 1000;
         /* don't allow a negative delay */
         if ( delay > 0 ) {
             item->hop[ttl - 1].delay = (uint32_t)delay;
@@ -1144,7 +1163,7 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
 static void usage(void) {
     fprintf(stderr,
             "Usage: amp-trace [-abhfrvx] [-p perturbate] [-s packetsize]\n"
-            "                 [-w windowsize]\n"
+            "                 [-w windowsize] [-B batchsize]\n"
             "                 [-Q codepoint] [-Z interpacketgap]\n"
             "                 [-I interface] [-4 [sourcev4]] [-6 [sourcev6]]\n"
             "                 -- destination1 [destination2 ... destinationN]"
@@ -1153,6 +1172,8 @@ static void usage(void) {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -a, --asn                      "
             "Lookup AS numbers for all addresses\n");
+    fprintf(stderr, "  -B, --batch          <count>   "
+            "Number of probes to send with each system call\n");
     fprintf(stderr, "  -b, --no-ip                    "
             "Suppress IP addresses in output\n");
     fprintf(stderr, "  -r, --random                   "
@@ -1175,21 +1196,22 @@ static void usage(void) {
  * Determine the time until we are allowed to send the next probe onto the
  * network - must always wait at least the inter packet delay.
  */
-static struct timeval get_next_send_time(struct timeval *last, uint32_t delay) {
+static struct timeval get_next_send_time(struct timespec *last,
+        uint32_t delay) {
     struct timeval tmp = {0, 0};
-    struct timeval now;
+    struct timespec now;
 
     /*
-     * Use gettimeofday so that we are using the same clock that set the last
-     * sent time for the probe. It's different to the clock used by
+     * Use get_realtime() so that we are using the same clock that set the
+     * last sent time for the probe. It's different to the clock used by
      * libevent but we are only interested in the difference between values
      * so that's ok.
      */
-    gettimeofday(&now, NULL);
+    get_realtime(&now);
 
     if ( last ) {
         /* determine how long it was since we sent a probe */
-        int64_t diff = DIFF_TV_US(now, *last);
+        int64_t diff = DIFF_TS_NS(now, *last) / 1000;
 
         /* if it hasn't been long enough then wait the remaining time */
         if ( diff < delay ) {
@@ -1208,17 +1230,17 @@ static struct timeval get_next_send_time(struct timeval *last, uint32_t delay) {
  * Do this by adding the delay to the longest outstanding packet and comparing
  * that to the current time.
  */
-static struct timeval get_next_timeout_time(struct timeval *next,
+static struct timeval get_next_timeout_time(struct timespec *next,
         uint32_t delay) {
     struct timeval tmp;
-    struct timeval now;
+    struct timespec now;
 
     /* again, we need to use the same clock packet sent times used */
-    gettimeofday(&now, NULL);
+    get_realtime(&now);
 
     if ( next ) {
         /* determine how far in the future the next timeout should be */
-        int64_t diff = DIFF_TV_US(*next, now) + delay;
+        int64_t diff = (DIFF_TS_NS(*next, now) / 1000) + delay;
 
         if ( diff < 0 ) {
             /* deal with it immediately if it has already been */
@@ -1249,7 +1271,10 @@ static void send_probe_callback(
         void *evdata) {
     struct probe_list_t *probelist = (struct probe_list_t*)evdata;
     struct dest_info_t *item;
+    struct dest_info_t *items[MAX_SEND_BATCH];
+    int status[MAX_SEND_BATCH];
     struct timeval timeout;
+    int count, i;
 
     Log(LOG_DEBUG, "send_probe_callback");
 
@@ -1261,27 +1286,54 @@ static void send_probe_callback(
         return;
     }
 
-    /* remove probe info from the ready list */
-    item = probelist->ready;
-    probelist->ready = probelist->ready->next;
-    if ( probelist->ready == NULL ) {
-        probelist->ready_end = NULL;
-    }
-    item->next = NULL;
+    /* send probes to as many ready destinations as fit in a single batch */
+    for ( count = 0; probelist->ready != NULL &&
+            count < probelist->opts->batch; count++ ) {
+        /* remove probe info from the ready list */
+        item = probelist->ready;
+        probelist->ready = probelist->ready->next;
+        if ( probelist->ready == NULL ) {
+            probelist->ready_end = NULL;
+        }
+        item->next = NULL;
 
-    /* send probe to the destination at the appropriate TTL */
-    if ( send_probe(probelist->sockets, probelist->ident,
+        /* send probe to the destination at the appropriate TTL */
+        items[count] = item;
+        status[count] = send_probe(probelist->sockets, probelist->ident,
                 probelist->opts->packet_size,
                 probelist->opts->inter_packet_delay,
-                probelist->opts->dscp, item) < 0 ) {
-        /* failed to send probe, mark the whole path as done */
-        set_done_item(probelist, item);
-        enqueue_next_pending(probelist);
-        if ( probelist->outstanding == NULL && probelist->ready == NULL ) {
-            event_base_loopbreak(probelist->base);
-            return;
+                probelist->opts->dscp, probelist->batch, item);
+    }
+
+    if ( probelist->batch ) {
+        int delay;
+
+        /* send the whole batch with appropriate inter packet delay */
+        while ( (delay = flush_send_batch(probelist->batch)) > 0 ) {
+            usleep(delay);
         }
-    } else {
+
+        /* any probe without a sent time failed to send */
+        for ( i = 0; i < count; i++ ) {
+            item = items[i];
+            if ( status[i] == 0 &&
+                    item->hop[item->ttl-1].time_sent.tv_sec == 0 ) {
+                set_probe_failed(item);
+                status[i] = -1;
+            }
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        item = items[i];
+
+        if ( status[i] < 0 ) {
+            /* failed to send probe, mark the whole path as done */
+            set_done_item(probelist, item);
+            enqueue_next_pending(probelist);
+            continue;
+        }
+
         /* probe sent ok, keep track of when the most recent probe was sent */
         probelist->last_probe = &item->hop[item->ttl-1].time_sent;
         probelist->total_probes++;
@@ -1300,13 +1352,19 @@ static void send_probe_callback(
         }
     }
 
+    /* nothing left waiting for a response or to be sent, we are done */
+    if ( probelist->outstanding == NULL && probelist->ready == NULL ) {
+        event_base_loopbreak(probelist->base);
+        return;
+    }
+
     /* schedule the next probe to be sent if there are any ready to go */
     if ( probelist->ready != NULL ) {
         struct timeval delay;
         assert(probelist->sendtimer == NULL);
 
         delay = get_next_send_time(probelist->last_probe,
-                probelist->opts->inter_packet_delay);
+                probelist->opts->inter_packet_delay * count);
 
         probelist->sendtimer = event_new(probelist->base, -1, 0,
                     send_probe_callback, evdata);
@@ -1322,20 +1380,21 @@ static void send_probe_callback(
 static void recv_probe_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata) {
 
-    char packet[2048];
-    struct timeval now;
     struct probe_list_t *probelist = (struct probe_list_t*)evdata;
     struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
     struct dest_info_t *item;
+    struct recv_packet_t *packet;
     struct socket_t sockets;
     int wait;
+    int ready;
+    int i;
 
     Log(LOG_DEBUG, "Got a packet");
 
     /*
      * determine the address family of the socket, so we can properly get
-     * the source address from the get_packet() call
+     * the source address from the get_packets() call
      */
     if ( getsockname(evsock, (struct sockaddr*)&addr, &socklen) < 0 ) {
         Log(LOG_WARNING, "getsockname() failed in receive callback: %s",
@@ -1347,15 +1406,25 @@ static void recv_probe_callback(evutil_socket_t evsock,
     sockets.socket = (addr.ss_family == AF_INET) ? evsock : -1;
     sockets.socket6 = (addr.ss_family == AF_INET6) ? evsock : -1;
 
-    if ( get_packet(&sockets, packet, sizeof(packet), (struct sockaddr*)&addr,
-                &wait, &now) < 1 ) {
+    /* read every response that is currently waiting on the socket */
+    if ( get_packets(&sockets, probelist->responses, &wait) < 1 ) {
         Log(LOG_WARNING, "Failed to get packet data");
         return;
     }
 
     item = probelist->outstanding;
+    ready = 0;
 
-    if ( process_packet((struct sockaddr*)&addr, packet, now, evdata) > 0 ) {
+    for ( i = 0; i < probelist->responses->count; i++ ) {
+        packet = &probelist->responses->packets[i];
+        if ( process_packet((struct sockaddr*)&packet->from, packet->data,
+                    packet->time, evdata) > 0 ) {
+            ready = 1;
+        }
+    }
+
+    /* if the ready list was empty but now isn't, schedule the next send */
+    if ( ready ) {
         struct timeval delay;
         assert(probelist->sendtimer == NULL);
 
@@ -1558,12 +1627,13 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     options.perturbate = 0;
     options.ip = 1;
     options.as = 0;
+    options.batch = 1;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
     window = INITIAL_WINDOW;
 
-    while ( (opt = getopt_long(argc, argv, "abfp:rs:w:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "aB:bfp:rs:w:I:Q:Z:4::6::hvx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': address_string = parse_optional_argument(argv);
@@ -1586,6 +1656,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
                       break;
             case 'Z': options.inter_packet_delay = atoi(optarg); break;
             case 'a': options.as = 1; break;
+            case 'B': options.batch = atoi(optarg); break;
             case 'b': options.ip = 0; break;
             case 'f': /* deprecated probeall option */; break;
             case 'p': options.perturbate = atoi(optarg); break;
@@ -1622,6 +1693,17 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
 	options.packet_size = MIN_TRACEROUTE_PROBE_LEN;
     }
 
+    /* make sure the batch size is something we can actually send */
+    if ( options.batch < 1 ) {
+        Log(LOG_WARNING, "Batch size %d too small, raising to 1",
+                options.batch);
+        options.batch = 1;
+    } else if ( options.batch > MAX_SEND_BATCH ) {
+        Log(LOG_WARNING, "Batch size %d too large, lowering to %d",
+                options.batch, MAX_SEND_BATCH);
+        options.batch = MAX_SEND_BATCH;
+    }
+
     /* delay the start by a random amount of perturbate is set */
     if ( options.perturbate ) {
 	int delay;
@@ -1691,6 +1773,14 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     probelist.done_count = 0;
     probelist.last_probe = NULL;
     probelist.base = event_base_new();
+    probelist.batch = NULL;
+    probelist.responses = new_recv_batch(MAX_RECV_BATCH, RESPONSE_BUFFER_LEN);
+
+    /* only use the batch send path if more than one probe is sent at once */
+    if ( options.batch > 1 ) {
+        probelist.batch = new_send_batch(&ip_sockets, options.batch,
+                options.packet_size, options.inter_packet_delay);
+    }
 
     /* create all info blocks and place them in the send queue */
     for ( i = 0; i < count; i++ ) {
@@ -1758,14 +1848,17 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
 
     event_base_free(probelist.base);
 
+    free_send_batch(probelist.batch);
+    free_recv_batch(probelist.responses);
+
     /* sockets aren't needed any longer */
     if ( icmp_sockets.socket > 0 ) {
-	close(icmp_sockets.socket);
+	close_socket(icmp_sockets.socket);
 	close(ip_sockets.socket);
     }
 
     if ( icmp_sockets.socket6 > 0 ) {
-	close(icmp_sockets.socket6);
+	close_socket(icmp_sockets.socket6);
 	close(ip_sockets.socket6);
     }
 
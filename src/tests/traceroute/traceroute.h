@@ -79,6 +79,9 @@
 /* number of consecutive timeouts required before giving up on a path */
 #define TRACEROUTE_NO_REPLY_LIMIT 5
 
+/* maximum size of an ICMP response that we will read */
+#define RESPONSE_BUFFER_LEN 2048
+
 #define HOP_ADDR(ttl) (item->hop[ttl - 1].addr)
 #define HOP_REPLY(ttl) (item->hop[ttl - 1].reply)
 
@@ -119,6 +122,7 @@ struct opt_t {
     int perturbate;		/* delay sending by up to this time (usec) */
     int ip;                     /* report the IP address of each hop */
     int as;                     /* lookup the AS number of each address */
+    int batch;                  /* number of probes to send at once */
     uint16_t packet_size;	/* use this packet size (bytes) */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
     uint8_t dscp;
@@ -128,7 +132,7 @@ struct opt_t {
  * Information block for the probe sent to a particular TTL.
  */
 struct hop_info_t {
-    struct timeval time_sent;	/* when the probe was sent */
+    struct timespec time_sent;	/* when the probe was sent */
     int64_t as;                 /* AS that the address belongs to */
     uint32_t delay;		/* delay in receiving response, microseconds */
     reply_t reply;              /* Has a reply been received */
@@ -164,6 +168,8 @@ struct dest_info_t {
  */
 struct probe_list_t {
     struct socket_t *sockets;
+    struct send_batch_t *batch;         /* queue for batched probes, if used */
+    struct recv_batch_t *responses;     /* storage for received responses */
     struct dest_info_t *pending;        /* targets yet to be probed */
     struct dest_info_t *ready;          /* targets ready to be probed */
     struct dest_info_t *ready_end;
@@ -178,7 +184,7 @@ struct probe_list_t {
     uint16_t ident;
     struct opt_t *opts;
     int total_probes;
-    struct timeval *last_probe;	        /* when most recent probe was sent */
+    struct timespec *last_probe;	/* when most recent probe was sent */
 };
 
 #endif
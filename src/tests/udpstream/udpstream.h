@@ -41,6 +41,7 @@
 #define _TESTS_UDPSTREAM_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <netinet/ip6.h>
 #include <netinet/udp.h>
@@ -61,7 +62,7 @@
 #define MINIMUM_UDPSTREAM_PACKET_COUNT 2
 #define MINIMUM_UDPSTREAM_PACKET_LENGTH ( \
         sizeof(struct ip6_hdr) + sizeof(struct udphdr) + \
-        sizeof(struct payload_t))
+        offsetof(struct payload_t, nsec))
 #define MAXIMUM_UDPSTREAM_PACKET_LENGTH 1500
 #define DEFAULT_UDPSTREAM_PACKET_LENGTH 100
 #define DEFAULT_UDPSTREAM_PACKET_COUNT 21
@@ -122,23 +123,26 @@ struct info_t {
 
 
 /*
- * Payload sent inside the UDP probe packets.
+ * Payload sent inside the UDP probe packets. The sub-microsecond part of the
+ * send time is optional, as the smallest packets don't have room for it and
+ * older versions don't send it. It is zero when not present.
  */
 struct payload_t {
     uint64_t sec;
     uint64_t usec;
     uint32_t index;
+    uint16_t nsec;
 } __attribute__((__packed__));
 
 
 
 /*
- *
+ * Summary statistics, all values are in nanoseconds.
  */
 struct summary_t {
-    uint32_t maximum;
-    uint32_t minimum;
-    uint32_t mean;
+    int64_t maximum;
+    int64_t minimum;
+    int64_t mean;
     uint32_t samples;
 };
 
@@ -153,12 +157,13 @@ void print_udpstream(amp_test_result_t *result);
 void usage(void);
 struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
         struct opt_t *options);
-int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times);
+int receive_udp_stream(int sock, struct opt_t *options, int64_t *times);
 Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *rtt);
+Amplet2__Udpstream__SummaryStats64* report_summary_ns(struct summary_t *rtt);
 Amplet2__Udpstream__Voip* report_voip(Amplet2__Udpstream__Item *item);
 Amplet2__Udpstream__Item* report_stream(
         Amplet2__Udpstream__Item__Direction direction,
-        struct summary_t *rtt, struct timeval *times, struct opt_t *options);
+        struct summary_t *rtt, int64_t *times, struct opt_t *options);
 
 ProtobufCBinaryData* build_hello(struct opt_t *options);
 void* parse_hello(ProtobufCBinaryData *data);
@@ -152,6 +152,7 @@ static Amplet2__Udpstream__Item* merge_results(ProtobufCBinaryData *data,
 
     if ( rtt ) {
         results->rtt = report_summary(rtt);
+        results->rtt_ns = report_summary_ns(rtt);
         results->voip = report_voip(results);
     }
 
@@ -170,11 +171,18 @@ static struct summary_t *extract_summary(ProtobufCBinaryData *data) {
 
     Log(LOG_DEBUG, "Extracting rtt information from results");
 
-    if ( item->rtt ) {
+    /* older servers will only report the rtt in microseconds */
+    if ( item->rtt_ns ) {
         stats = malloc(sizeof(struct summary_t));
-        stats->maximum = item->rtt->maximum;
-        stats->minimum = item->rtt->minimum;
-        stats->mean = item->rtt->mean;
+        stats->maximum = item->rtt_ns->maximum;
+        stats->minimum = item->rtt_ns->minimum;
+        stats->mean = item->rtt_ns->mean;
+        stats->samples = item->rtt_ns->samples;
+    } else if ( item->rtt ) {
+        stats = malloc(sizeof(struct summary_t));
+        stats->maximum = (int64_t)item->rtt->maximum * 1000;
+        stats->minimum = (int64_t)item->rtt->minimum * 1000;
+        stats->mean = (int64_t)item->rtt->mean * 1000;
         stats->samples = item->rtt->samples;
     }
 
@@ -242,7 +250,7 @@ static amp_test_result_t* run_test(struct addrinfo *server,
     int test_socket;
     struct sockaddr_storage ss;
     socklen_t socklen = sizeof(ss);
-    struct timeval *in_times = NULL;
+    int64_t *in_times = NULL;
     struct test_request_t *schedule = NULL, *current;
     ProtobufCBinaryData data;
     Amplet2__Udpstream__Item *remote_results = NULL, *local_results = NULL;
@@ -300,7 +308,7 @@ static amp_test_result_t* run_test(struct addrinfo *server,
                 break;
 
             case AMPLET2__UDPSTREAM__ITEM__DIRECTION__SERVER_TO_CLIENT:
-                in_times = calloc(options->packet_count,sizeof(struct timeval));
+                in_times = calloc(options->packet_count, sizeof(int64_t));
                 /* bind test socket to same address as the control socket */
                 getsockname(BIO_get_fd(ctrl, NULL), (struct sockaddr *)&ss,
                         &socklen);
@@ -632,7 +640,13 @@ static void print_item(Amplet2__Udpstream__Item *item, uint32_t packet_count) {
             packet_count, item->packets_received,
             100 - ((double)item->packets_received / (double)packet_count*100));
 
-    if ( item->rtt && item->rtt->samples > 0 ) {
+    /* prefer the nanosecond values, older reports only have microseconds */
+    if ( item->rtt_ns && item->rtt_ns->samples > 0 ) {
+        printf("      %" PRIu64 " rtt samples min/mean/max = "
+                "%.03f/%.03f/%.03f ms\n",
+                item->rtt_ns->samples, item->rtt_ns->minimum/1000000.0,
+                item->rtt_ns->mean/1000000.0, item->rtt_ns->maximum/1000000.0);
+    } else if ( item->rtt && item->rtt->samples > 0 ) {
         printf("      %d rtt samples min/mean/max = %.03f/%.03f/%.03f ms\n",
                 item->rtt->samples, item->rtt->minimum/1000.0,
                 item->rtt->mean/1000.0, item->rtt->maximum/1000.0);
@@ -640,7 +654,13 @@ static void print_item(Amplet2__Udpstream__Item *item, uint32_t packet_count) {
         printf("      no rtt information available\n");
     }
 
-    if ( item->jitter && item->jitter->samples > 0 ) {
+    if ( item->jitter_ns && item->jitter_ns->samples > 0 ) {
+        printf("      %" PRIu64 " jitter samples min/mean/max = "
+                "%.03f/%.03f/%.03f ms\n",
+                item->jitter_ns->samples, item->jitter_ns->minimum/1000000.0,
+                item->jitter_ns->mean/1000000.0,
+                item->jitter_ns->maximum/1000000.0);
+    } else if ( item->jitter && item->jitter->samples > 0 ) {
         printf("      %d jitter samples min/mean/max = %.03f/%.03f/%.03f ms\n",
                 item->jitter->samples, item->jitter->minimum/1000.0,
                 item->jitter->mean/1000.0, item->jitter->maximum/1000.0);
@@ -649,9 +669,17 @@ static void print_item(Amplet2__Udpstream__Item *item, uint32_t packet_count) {
     }
 
     printf("      percentiles:\n");
-    for ( i = 0; i < item->n_percentiles; i++ ) {
-        printf("        %3d: %+.03f ms\n", (i+1) * 10,
-                item->percentiles[i]/1000.0);
+    if ( item->jitter_ns &&
+            item->jitter_ns->n_percentiles == item->n_percentiles ) {
+        for ( i = 0; i < item->jitter_ns->n_percentiles; i++ ) {
+            printf("        %3d: %+.03f ms\n", (i+1) * 10,
+                    item->jitter_ns->percentiles[i]/1000000.0);
+        }
+    } else {
+        for ( i = 0; i < item->n_percentiles; i++ ) {
+            printf("        %3d: %+.03f ms\n", (i+1) * 10,
+                    item->percentiles[i]/1000.0);
+        }
     }
 
     printf("      arrival patterns:");
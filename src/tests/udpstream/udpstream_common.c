@@ -46,6 +46,7 @@
 #include <endian.h>
 #include <netdb.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <errno.h>
 
@@ -53,6 +54,8 @@
 #include "udpstream.h"
 #include "debug.h"
 #include "mos.h"
+#include "waitset.h"
+#include "ratebudget.h"
 
 
 
@@ -153,6 +156,25 @@ void* parse_send(ProtobufCBinaryData *data) {
 
 
 
+/*
+ * Extract the time that a probe was sent from the payload, including the
+ * sub-microsecond part if the packet was large enough to carry it.
+ */
+static void get_payload_time(char *packet, ssize_t bytes,
+        struct timespec *sent_time) {
+    struct payload_t *payload = (struct payload_t*)packet;
+
+    /* this should cast appropriately whether 32 or 64 bit */
+    sent_time->tv_sec = (time_t)be64toh(payload->sec);
+    sent_time->tv_nsec = (long)be64toh(payload->usec) * 1000;
+
+    if ( bytes >= (ssize_t)sizeof(struct payload_t) ) {
+        sent_time->tv_nsec += ntohs(payload->nsec);
+    }
+}
+
+
+
 /*
  * Receive and process any reflected packets that have been sent back to us
  * as a response to our probes. Compare the arrival timestamp with the sending
@@ -161,7 +183,7 @@ void* parse_send(ProtobufCBinaryData *data) {
 static void receive_reflected_packets(struct socket_t *sockets, int wait,
         uint32_t expected, struct summary_t *rtt) {
     ssize_t bytes;
-    struct timeval now;
+    struct timespec now;
     char response[MAXIMUM_UDPSTREAM_PACKET_LENGTH];
     static double mean = 0;
 
@@ -174,18 +196,19 @@ static void receive_reflected_packets(struct socket_t *sockets, int wait,
             (bytes = get_packet(sockets, response,
                                 MAXIMUM_UDPSTREAM_PACKET_LENGTH,
                                 NULL, &wait, &now)) > 0 ) {
-        struct payload_t *recv_payload;
-        struct timeval sent_time;
-        uint32_t value;
+        struct timespec sent_time;
+        int64_t value;
         double delta;
 
         //XXX check that this is actually a related packet
 
-        recv_payload = (struct payload_t*)&response;
-        /* this should cast appropriately whether 32 or 64 bit */
-        sent_time.tv_sec = (time_t)be64toh(recv_payload->sec);
-        sent_time.tv_usec = (time_t)be64toh(recv_payload->usec);
-        value = DIFF_TV_US(now, sent_time);
+        get_payload_time(response, bytes, &sent_time);
+
+        /* ignore the sample if the clock was stepped backwards mid-flight */
+        if ( (value = DIFF_TS_NS(now, sent_time)) < 0 ) {
+            continue;
+        }
+
         if ( value > rtt->maximum ) {
             rtt->maximum = value;
         }
@@ -197,7 +220,7 @@ static void receive_reflected_packets(struct socket_t *sockets, int wait,
         mean += delta / rtt->samples;
     }
 
-    rtt->mean = (uint32_t)round(mean);
+    rtt->mean = (int64_t)round(mean);
 }
 
 
@@ -207,7 +230,7 @@ static void receive_reflected_packets(struct socket_t *sockets, int wait,
  */
 struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
         struct opt_t *options) {
-    struct timeval now;
+    struct timespec now;
     struct payload_t *payload;
     size_t payload_len;
     uint32_t i;
@@ -243,20 +266,27 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
 
     if ( options->rtt_samples > 0 ) {
         rtt = calloc(1, sizeof(struct summary_t));
-        rtt->minimum = UINT32_MAX;
+        rtt->minimum = INT64_MAX;
     }
 
     //XXX put a pattern in the payload?
     /* the packet size option includes headers, so subtract them */
     payload_len -= sizeof(struct udphdr);
-    payload = (struct payload_t *)calloc(1, payload_len);
+    /* small packets only send the start of the payload, but fill it all */
+    payload = (struct payload_t *)calloc(1,
+            payload_len > sizeof(struct payload_t) ?
+            payload_len : sizeof(struct payload_t));
 
     for ( i = 0; i < options->packet_count; i++ ) {
-        gettimeofday(&now, NULL);
+        /* wait for room in the rate budget shared with all other tests */
+        rate_budget_wait(1, payload_len);
+
+        get_realtime(&now);
         payload->index = htonl(i);
         /* this should cast appropriately whether 32 or 64 bit*/
         payload->sec = htobe64(now.tv_sec);
-        payload->usec = htobe64(now.tv_usec);
+        payload->usec = htobe64(now.tv_nsec / 1000);
+        payload->nsec = htons(now.tv_nsec % 1000);
 
         if ( sendto(sock, payload, payload_len, 0,
                     remote->ai_addr, remote->ai_addrlen) < 0 ) {
@@ -298,12 +328,13 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
 /*
  * Receive a stream of UDP packets, expecting the specified number of packets.
  */
-int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
+int receive_udp_stream(int sock, struct opt_t *options, int64_t *times) {
     char buffer[MAXIMUM_UDPSTREAM_PACKET_LENGTH];
-    int timeout;
+    int64_t timeout;
     uint32_t i;
-    struct timeval sent_time, recv_time;
-    struct socket_t sockets;
+    struct timespec sent_time, recv_time;
+    struct wait_set_t *set;
+    struct wait_event_t ready;
     struct payload_t *payload;
     struct sockaddr_storage ss;
     socklen_t socklen;
@@ -313,17 +344,28 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
     socklen = sizeof(ss);
     getsockname(sock, (struct sockaddr *)&ss, &socklen);
 
-    sockets.socket = sock;
-    sockets.socket6 = -1;
+    /* create the wait set once, rather than rebuilding it for every packet */
+    if ( (set = new_wait_set()) == NULL ||
+            wait_set_add(set, sock, WAIT_READ) < 0 ) {
+        Log(LOG_WARNING, "Failed to wait on UDP stream socket");
+        free_wait_set(set);
+        return -1;
+    }
 
     Log(LOG_DEBUG, "Receiving UDP stream, packets:%d", options->packet_count);
 
     for ( i = 0; i < options->packet_count; i++ ) {
         /* reset timeout per packet, consider some global timer also? */
-        timeout = UDPSTREAM_LOSS_TIMEOUT;
+        timeout = (int64_t)UDPSTREAM_LOSS_TIMEOUT * 1000;
+        bytes = -1;
 
-        if ( (bytes = get_packet(&sockets, buffer, sizeof(buffer),
-                        (struct sockaddr*)&ss, &timeout, &recv_time)) > 0 ) {
+        /* keep waiting if woken by something other than a packet arriving */
+        while ( bytes < 0 && wait_set_wait(set, &timeout, &ready, 1) > 0 ) {
+            bytes = read_packet(sock, buffer, sizeof(buffer),
+                    (struct sockaddr*)&ss, socklen, &recv_time);
+        }
+
+        if ( bytes > 0 ) {
 
             payload = (struct payload_t*)&buffer;
 
@@ -343,10 +385,8 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
                     }
                 }
 
-                /* this should cast appropriately whether 32 or 64 bit */
-                sent_time.tv_sec = (time_t)be64toh(payload->sec);
-                sent_time.tv_usec = (time_t)be64toh(payload->usec);
-                timersub(&recv_time, &sent_time, &times[index]);
+                get_payload_time(buffer, bytes, &sent_time);
+                times[index] = DIFF_TS_NS(recv_time, sent_time);
                 Log(LOG_DEBUG, "Got UDP stream packet %d (id:%d)", i, index);
             }
         } else {
@@ -354,6 +394,8 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
         }
     }
 
+    free_wait_set(set);
+
     return 0;
 }
 
@@ -363,7 +405,10 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
  * Compare two unsigned 32bit integers, used to quicksort the ipdv array.
  */
 static int cmp(const void *a, const void *b) {
-    return ( *(uint32_t*)a - *(uint32_t*)b );
+    int64_t x = *(int64_t*)a;
+    int64_t y = *(int64_t*)b;
+
+    return ( x > y ) - ( x < y );
 }
 
 
@@ -443,7 +488,7 @@ Amplet2__Udpstream__Voip* report_voip(Amplet2__Udpstream__Item *item) {
 
 /*
  * Construct a protocol buffer message containing the summary statistics for
- * the RTT measurements in a single test flow.
+ * the RTT measurements in a single test flow, converted to microseconds.
  */
 Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *summary) {
     Amplet2__Udpstream__SummaryStats *stats;
@@ -457,6 +502,35 @@ Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *summary) {
     stats = calloc(1, sizeof(Amplet2__Udpstream__SummaryStats));
     amplet2__udpstream__summary_stats__init(stats);
 
+    stats->has_maximum = 1;
+    stats->maximum = summary->maximum / 1000;
+    stats->has_minimum = 1;
+    stats->minimum = summary->minimum / 1000;
+    stats->has_mean = 1;
+    stats->mean = summary->mean / 1000;
+    stats->has_samples = 1;
+    stats->samples = summary->samples;
+
+    return stats;
+}
+
+
+
+/*
+ * Construct a protocol buffer message containing the summary statistics for
+ * the RTT measurements in a single test flow, in nanoseconds.
+ */
+Amplet2__Udpstream__SummaryStats64* report_summary_ns(
+        struct summary_t *summary) {
+    Amplet2__Udpstream__SummaryStats64 *stats;
+
+    if ( !summary || summary->samples == 0 ) {
+        return NULL;
+    }
+
+    stats = calloc(1, sizeof(Amplet2__Udpstream__SummaryStats64));
+    amplet2__udpstream__summary_stats64__init(stats);
+
     stats->has_maximum = 1;
     stats->maximum = summary->maximum;
     stats->has_minimum = 1;
@@ -478,14 +552,14 @@ Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *summary) {
  */
 Amplet2__Udpstream__Item* report_stream(
         Amplet2__Udpstream__Item__Direction direction,
-        struct summary_t *rtt, struct timeval *times, struct opt_t *options) {
+        struct summary_t *rtt, int64_t *times, struct opt_t *options) {
 
     Amplet2__Udpstream__Item *item =
         (Amplet2__Udpstream__Item*)malloc(sizeof(Amplet2__Udpstream__Item));
     uint32_t i;
     uint32_t received = 0;
-    int32_t current = 0, prev = 0;
-    int32_t ipdv[options->packet_count];
+    int64_t current = 0, prev = 0;
+    int64_t ipdv[options->packet_count];
     int loss_runs = 0;
     Amplet2__Udpstream__Period *period = NULL;
     struct summary_t jitter;
@@ -508,8 +582,8 @@ Amplet2__Udpstream__Item* report_stream(
     }
 
     for ( i = 0; i < options->packet_count; i++ ) {
-        //XXX this check doesn't properly work to prevent unset timevals?
-        if ( !timerisset(&times[i]) ) {
+        //XXX this check doesn't properly work to prevent unset times?
+        if ( times[i] == 0 ) {
             if ( period &&
                  period->status == AMPLET2__UDPSTREAM__PERIOD__STATUS__LOST ) {
                 period->length++;
@@ -547,11 +621,11 @@ Amplet2__Udpstream__Item* report_stream(
         }
 
         if ( received == 1 ) {
-            prev = (times[i].tv_sec * 1000000) + times[i].tv_usec;
+            prev = times[i];
             continue;
         }
 
-        current = (times[i].tv_sec * 1000000) + times[i].tv_usec;
+        current = times[i];
 
         ipdv[jitter.samples] = current - prev;
         prev = current;
@@ -578,11 +652,12 @@ Amplet2__Udpstream__Item* report_stream(
     }
 
     /* at least two packets arrived - we have one delay variance measurement */
-    qsort(&ipdv, jitter.samples, sizeof(int32_t), cmp);
+    qsort(&ipdv, jitter.samples, sizeof(int64_t), cmp);
     jitter.maximum = ipdv[jitter.samples - 1];
     jitter.minimum = ipdv[0];
-    jitter.mean = mean;
+    jitter.mean = (int64_t)round(mean);
     item->jitter = report_summary(&jitter);
+    item->jitter_ns = report_summary_ns(&jitter);
 
     /*
      * Base the number of percentiles around the minimum of what the user
@@ -592,14 +667,25 @@ Amplet2__Udpstream__Item* report_stream(
     item->n_percentiles = MIN(options->percentile_count, jitter.samples);
     item->percentiles = calloc(item->n_percentiles, sizeof(int32_t));
 
+    /* the nanosecond summary carries the same percentiles at full precision */
+    if ( item->jitter_ns ) {
+        item->jitter_ns->n_percentiles = item->n_percentiles;
+        item->jitter_ns->percentiles =
+            calloc(item->n_percentiles, sizeof(int64_t));
+    }
+
     Log(LOG_DEBUG, "Reporting %d percentiles", item->n_percentiles);
 
     for ( i = 0; i < item->n_percentiles; i++ ) {
-        Log(LOG_DEBUG, "Percentile %d (%d): %d\n", (i+1) * 10,
+        int64_t value =
+            ipdv[(int)(jitter.samples / item->n_percentiles * (i+1)) - 1];
+        Log(LOG_DEBUG, "Percentile %d (%d): %" PRId64 "ns\n", (i+1) * 10,
                 (int)(jitter.samples / item->n_percentiles * (i+1)) - 1,
-                ipdv[(int)(jitter.samples / item->n_percentiles * (i+1)) - 1]);
-        item->percentiles[i] = ipdv[(int)
-            (jitter.samples / item->n_percentiles * (i+1)) - 1];
+                value);
+        item->percentiles[i] = value / 1000;
+        if ( item->jitter_ns ) {
+            item->jitter_ns->percentiles[i] = value;
+        }
     }
 
     /*
@@ -609,6 +695,7 @@ Amplet2__Udpstream__Item* report_stream(
      */
     if ( rtt ) {
         item->rtt = report_summary(rtt);
+        item->rtt_ns = report_summary_ns(rtt);
         item->voip = report_voip(item);
     }
 
@@ -69,12 +69,12 @@ static void do_receive(BIO *ctrl, int test_sock, struct opt_t *options) {
 
     Amplet2__Udpstream__Item *result;
     ProtobufCBinaryData packed;
-    struct timeval *times = NULL;
+    int64_t *times = NULL;
 
     Log(LOG_DEBUG, "got RECEIVE command");
 
-    /* we are going to track a timeval for every expected packet */
-    times = calloc(options->packet_count, sizeof(struct timeval));
+    /* we are going to track a one-way delay for every expected packet */
+    times = calloc(options->packet_count, sizeof(int64_t));
 
     /* tell the client what port the test server is running on */
     send_control_ready(AMP_TEST_UDPSTREAM, ctrl, options->tport);
@@ -144,6 +144,7 @@ static void do_send(BIO *ctrl, int test_sock, struct sockaddr_storage *remote,
     item = (Amplet2__Udpstream__Item*)malloc(sizeof(Amplet2__Udpstream__Item));
     amplet2__udpstream__item__init(item);
     item->rtt = report_summary(rtt);
+    item->rtt_ns = report_summary_ns(rtt);
 
     /* pack the result for sending to the client */
     packed.len = amplet2__udpstream__item__get_packed_size(item);
@@ -155,6 +156,7 @@ static void do_send(BIO *ctrl, int test_sock, struct sockaddr_storage *remote,
 
     free(rtt);
     free(item->rtt);
+    free(item->rtt_ns);
     free(item);
     free(packed.data);
 }